@@ -0,0 +1,564 @@
+/*++
+
+Module Name:
+
+    ToasterExtMof.h
+
+Abstract:
+
+    Data block layouts and GUIDs for the WMI classes declared in
+    toasterext.mof, in the same shape wmimofck generates for toaster.mof.
+    Keep the two files in sync.
+
+--*/
+
+#ifndef _toasterext_h_
+#define _toasterext_h_
+
+// ToasterCrispiness - ToasterCrispiness
+// Toaster crispiness, served through the bus direct-call interface
+#define ToasterCrispinessGuid \
+    { 0xc0ee8da9,0x6637,0x4e7b, { 0x98,0xfd,0x7d,0x8c,0x1f,0x5c,0x72,0x1f } }
+
+#if ! (defined(MIDL_PASS))
+DEFINE_GUID(ToasterCrispiness_GUID, \
+            0xc0ee8da9,0x6637,0x4e7b,0x98,0xfd,0x7d,0x8c,0x1f,0x5c,0x72,0x1f);
+#endif
+
+
+typedef struct _ToasterCrispiness
+{
+    // Crispiness level of the toaster
+    ULONG CrispinessLevel;
+    #define ToasterCrispiness_CrispinessLevel_SIZE sizeof(ULONG)
+    #define ToasterCrispiness_CrispinessLevel_ID 1
+
+    // TRUE if the child safety lock is engaged
+    ULONG SafetyLockEnabled;
+    #define ToasterCrispiness_SafetyLockEnabled_SIZE sizeof(ULONG)
+    #define ToasterCrispiness_SafetyLockEnabled_ID 2
+
+} ToasterCrispiness, *PToasterCrispiness;
+
+#define ToasterCrispiness_SIZE (FIELD_OFFSET(ToasterCrispiness, SafetyLockEnabled) + ToasterCrispiness_SafetyLockEnabled_SIZE)
+
+// ToasterPerfStatistics - ToasterPerfStatistics
+// Toaster I/O statistics since the device was added
+#define ToasterPerfStatisticsGuid \
+    { 0xab36209f,0x02f9,0x4223, { 0xbe,0xde,0x4a,0x66,0xa9,0x8b,0xd5,0xa9 } }
+
+#if ! (defined(MIDL_PASS))
+DEFINE_GUID(ToasterPerfStatistics_GUID, \
+            0xab36209f,0x02f9,0x4223,0xbe,0xde,0x4a,0x66,0xa9,0x8b,0xd5,0xa9);
+#endif
+
+
+typedef struct _ToasterPerfStatistics
+{
+    // Read requests completed
+    ULONGLONG ReadRequests;
+    #define ToasterPerfStatistics_ReadRequests_SIZE sizeof(ULONGLONG)
+    #define ToasterPerfStatistics_ReadRequests_ID 1
+
+    // Bytes returned by reads
+    ULONGLONG ReadBytes;
+    #define ToasterPerfStatistics_ReadBytes_SIZE sizeof(ULONGLONG)
+    #define ToasterPerfStatistics_ReadBytes_ID 2
+
+    // Read requests completed with an error
+    ULONGLONG ReadErrors;
+    #define ToasterPerfStatistics_ReadErrors_SIZE sizeof(ULONGLONG)
+    #define ToasterPerfStatistics_ReadErrors_ID 3
+
+    // Read service time histogram
+    ULONGLONG ReadLatencyHistogram[16];
+    #define ToasterPerfStatistics_ReadLatencyHistogram_SIZE sizeof(ULONGLONG[16])
+    #define ToasterPerfStatistics_ReadLatencyHistogram_ID 4
+
+    // Write requests completed
+    ULONGLONG WriteRequests;
+    #define ToasterPerfStatistics_WriteRequests_SIZE sizeof(ULONGLONG)
+    #define ToasterPerfStatistics_WriteRequests_ID 5
+
+    // Bytes accepted by writes
+    ULONGLONG WriteBytes;
+    #define ToasterPerfStatistics_WriteBytes_SIZE sizeof(ULONGLONG)
+    #define ToasterPerfStatistics_WriteBytes_ID 6
+
+    // Write requests completed with an error
+    ULONGLONG WriteErrors;
+    #define ToasterPerfStatistics_WriteErrors_SIZE sizeof(ULONGLONG)
+    #define ToasterPerfStatistics_WriteErrors_ID 7
+
+    // Write service time histogram
+    ULONGLONG WriteLatencyHistogram[16];
+    #define ToasterPerfStatistics_WriteLatencyHistogram_SIZE sizeof(ULONGLONG[16])
+    #define ToasterPerfStatistics_WriteLatencyHistogram_ID 8
+
+    // Device control requests completed
+    ULONGLONG IoctlRequests;
+    #define ToasterPerfStatistics_IoctlRequests_SIZE sizeof(ULONGLONG)
+    #define ToasterPerfStatistics_IoctlRequests_ID 9
+
+    // Bytes returned by device control requests
+    ULONGLONG IoctlBytes;
+    #define ToasterPerfStatistics_IoctlBytes_SIZE sizeof(ULONGLONG)
+    #define ToasterPerfStatistics_IoctlBytes_ID 10
+
+    // Device control requests completed with an error
+    ULONGLONG IoctlErrors;
+    #define ToasterPerfStatistics_IoctlErrors_SIZE sizeof(ULONGLONG)
+    #define ToasterPerfStatistics_IoctlErrors_ID 11
+
+    // Device control service time histogram
+    ULONGLONG IoctlLatencyHistogram[16];
+    #define ToasterPerfStatistics_IoctlLatencyHistogram_SIZE sizeof(ULONGLONG[16])
+    #define ToasterPerfStatistics_IoctlLatencyHistogram_ID 12
+
+    // Number of per-processor counter sets aggregated
+    ULONG ProcessorCount;
+    #define ToasterPerfStatistics_ProcessorCount_SIZE sizeof(ULONG)
+    #define ToasterPerfStatistics_ProcessorCount_ID 13
+
+} ToasterPerfStatistics, *PToasterPerfStatistics;
+
+#define ToasterPerfStatistics_SIZE (FIELD_OFFSET(ToasterPerfStatistics, ProcessorCount) + ToasterPerfStatistics_ProcessorCount_SIZE)
+
+// ToasterIdlePolicy - ToasterIdlePolicy
+// Adaptive S0 idle timeout
+#define ToasterIdlePolicyGuid \
+    { 0xd1774fde,0x33e9,0x4409, { 0x8c,0x7d,0x78,0x79,0x35,0xa9,0x59,0xb1 } }
+
+#if ! (defined(MIDL_PASS))
+DEFINE_GUID(ToasterIdlePolicy_GUID, \
+            0xd1774fde,0x33e9,0x4409,0x8c,0x7d,0x78,0x79,0x35,0xa9,0x59,0xb1);
+#endif
+
+
+typedef struct _ToasterIdlePolicy
+{
+    // Non-zero to adapt the idle timeout; zero to use MaximumIdleTimeout
+    ULONG Enabled;
+    #define ToasterIdlePolicy_Enabled_SIZE sizeof(ULONG)
+    #define ToasterIdlePolicy_Enabled_ID 1
+
+    // Lower bound of the idle timeout, in milliseconds
+    ULONG MinimumIdleTimeout;
+    #define ToasterIdlePolicy_MinimumIdleTimeout_SIZE sizeof(ULONG)
+    #define ToasterIdlePolicy_MinimumIdleTimeout_ID 2
+
+    // Upper bound of the idle timeout, in milliseconds
+    ULONG MaximumIdleTimeout;
+    #define ToasterIdlePolicy_MaximumIdleTimeout_SIZE sizeof(ULONG)
+    #define ToasterIdlePolicy_MaximumIdleTimeout_ID 3
+
+    // Share of short gaps, 1 - 99 percent, that must not cause a power transition
+    ULONG Percentile;
+    #define ToasterIdlePolicy_Percentile_SIZE sizeof(ULONG)
+    #define ToasterIdlePolicy_Percentile_ID 4
+
+    // Idle timeout in effect, in milliseconds
+    ULONG CurrentIdleTimeout;
+    #define ToasterIdlePolicy_CurrentIdleTimeout_SIZE sizeof(ULONG)
+    #define ToasterIdlePolicy_CurrentIdleTimeout_ID 5
+
+    // Number of times the idle timeout was changed
+    ULONG Retunes;
+    #define ToasterIdlePolicy_Retunes_SIZE sizeof(ULONG)
+    #define ToasterIdlePolicy_Retunes_ID 6
+
+    // Number of returns to D0 from a low-power state
+    ULONG Resumes;
+    #define ToasterIdlePolicy_Resumes_SIZE sizeof(ULONG)
+    #define ToasterIdlePolicy_Resumes_ID 7
+
+    // Recent gaps between requests
+    ULONG GapHistogram[17];
+    #define ToasterIdlePolicy_GapHistogram_SIZE sizeof(ULONG[17])
+    #define ToasterIdlePolicy_GapHistogram_ID 8
+
+} ToasterIdlePolicy, *PToasterIdlePolicy;
+
+#define ToasterIdlePolicy_SIZE (FIELD_OFFSET(ToasterIdlePolicy, GapHistogram) + ToasterIdlePolicy_GapHistogram_SIZE)
+
+// ToasterPowerState - ToasterPowerState
+// Toaster device state save/restore across low-power states
+#define ToasterPowerStateGuid \
+    { 0x24f37ed1,0xd992,0x457a, { 0x99,0x7b,0x38,0x63,0xff,0xf9,0xd3,0xe2 } }
+
+#if ! (defined(MIDL_PASS))
+DEFINE_GUID(ToasterPowerState_GUID, \
+            0x24f37ed1,0xd992,0x457a,0x99,0x7b,0x38,0x63,0xff,0xf9,0xd3,0xe2);
+#endif
+
+
+typedef struct _ToasterPowerState
+{
+    // Non-zero if the data ring survives low-power states
+    ULONG RetainRing;
+    #define ToasterPowerState_RetainRing_SIZE sizeof(ULONG)
+    #define ToasterPowerState_RetainRing_ID 1
+
+    // Number of transitions to a low-power state that saved state
+    ULONG Saves;
+    #define ToasterPowerState_Saves_SIZE sizeof(ULONG)
+    #define ToasterPowerState_Saves_ID 2
+
+    // Number of lazy restores completed
+    ULONG Restores;
+    #define ToasterPowerState_Restores_SIZE sizeof(ULONG)
+    #define ToasterPowerState_Restores_ID 3
+
+    // Data ring bytes saved by the last D0Exit
+    ULONG LastSavedBytes;
+    #define ToasterPowerState_LastSavedBytes_SIZE sizeof(ULONG)
+    #define ToasterPowerState_LastSavedBytes_ID 4
+
+    // Duration of the last D0Exit, in microseconds
+    ULONG LastD0ExitTime;
+    #define ToasterPowerState_LastD0ExitTime_SIZE sizeof(ULONG)
+    #define ToasterPowerState_LastD0ExitTime_ID 5
+
+    // Longest D0Exit, in microseconds
+    ULONG MaxD0ExitTime;
+    #define ToasterPowerState_MaxD0ExitTime_SIZE sizeof(ULONG)
+    #define ToasterPowerState_MaxD0ExitTime_ID 6
+
+    // Duration of the last D0Entry, in microseconds
+    ULONG LastD0EntryTime;
+    #define ToasterPowerState_LastD0EntryTime_SIZE sizeof(ULONG)
+    #define ToasterPowerState_LastD0EntryTime_ID 7
+
+    // Longest D0Entry, in microseconds
+    ULONG MaxD0EntryTime;
+    #define ToasterPowerState_MaxD0EntryTime_SIZE sizeof(ULONG)
+    #define ToasterPowerState_MaxD0EntryTime_ID 8
+
+    // Time the last lazy restore took, in microseconds
+    ULONG LastRestoreTime;
+    #define ToasterPowerState_LastRestoreTime_SIZE sizeof(ULONG)
+    #define ToasterPowerState_LastRestoreTime_ID 9
+
+    // Longest lazy restore, in microseconds
+    ULONG MaxRestoreTime;
+    #define ToasterPowerState_MaxRestoreTime_SIZE sizeof(ULONG)
+    #define ToasterPowerState_MaxRestoreTime_ID 10
+
+    // Time from the last D0Entry until all saved state was back, in microseconds
+    ULONG LastResumeLatency;
+    #define ToasterPowerState_LastResumeLatency_SIZE sizeof(ULONG)
+    #define ToasterPowerState_LastResumeLatency_ID 11
+
+    // Longest time from D0Entry until all saved state was back, in microseconds
+    ULONG MaxResumeLatency;
+    #define ToasterPowerState_MaxResumeLatency_SIZE sizeof(ULONG)
+    #define ToasterPowerState_MaxResumeLatency_ID 12
+
+    // Duration of EvtDeviceAdd, in microseconds
+    ULONG DeviceAddTime;
+    #define ToasterPowerState_DeviceAddTime_SIZE sizeof(ULONG)
+    #define ToasterPowerState_DeviceAddTime_ID 13
+
+    // Duration of the last PrepareHardware, in microseconds
+    ULONG LastPrepareHardwareTime;
+    #define ToasterPowerState_LastPrepareHardwareTime_SIZE sizeof(ULONG)
+    #define ToasterPowerState_LastPrepareHardwareTime_ID 14
+
+    // Time the deferred start-up work of the last start took, in microseconds
+    ULONG LastDeferredStartTime;
+    #define ToasterPowerState_LastDeferredStartTime_SIZE sizeof(ULONG)
+    #define ToasterPowerState_LastDeferredStartTime_ID 15
+
+    // Time from the last PrepareHardware until the deferred start-up work was done, in microseconds
+    ULONG LastStartLatency;
+    #define ToasterPowerState_LastStartLatency_SIZE sizeof(ULONG)
+    #define ToasterPowerState_LastStartLatency_ID 16
+
+} ToasterPowerState, *PToasterPowerState;
+
+#define ToasterPowerState_SIZE (FIELD_OFFSET(ToasterPowerState, LastStartLatency) + ToasterPowerState_LastStartLatency_SIZE)
+
+// ToasterPowerLog - ToasterPowerLog
+// Most recent toaster power callbacks
+#define ToasterPowerLogGuid \
+    { 0x501c45b3,0xd2ca,0x478d, { 0x87,0xbb,0xab,0x80,0x6e,0x57,0xd4,0x8c } }
+
+#if ! (defined(MIDL_PASS))
+DEFINE_GUID(ToasterPowerLog_GUID, \
+            0x501c45b3,0xd2ca,0x478d,0x87,0xbb,0xab,0x80,0x6e,0x57,0xd4,0x8c);
+#endif
+
+
+typedef struct _ToasterPowerLog
+{
+    // Events recorded since the device was added
+    ULONG TotalEvents;
+    #define ToasterPowerLog_TotalEvents_SIZE sizeof(ULONG)
+    #define ToasterPowerLog_TotalEvents_ID 1
+
+    // Number of valid entries in the arrays below
+    ULONG Count;
+    #define ToasterPowerLog_Count_SIZE sizeof(ULONG)
+    #define ToasterPowerLog_Count_ID 2
+
+    // System time the callback started, 100ns units since 1601 (UTC)
+    ULONGLONG Timestamp[64];
+    #define ToasterPowerLog_Timestamp_SIZE sizeof(ULONGLONG[64])
+    #define ToasterPowerLog_Timestamp_ID 3
+
+    // Callback, see TOASTER_POWER_EVENT_TYPE in ToasterIoctl.h
+    ULONG Type[64];
+    #define ToasterPowerLog_Type_SIZE sizeof(ULONG[64])
+    #define ToasterPowerLog_Type_ID 4
+
+    // Device power state before the transition, 0 for the wake callbacks
+    ULONG FromState[64];
+    #define ToasterPowerLog_FromState_SIZE sizeof(ULONG[64])
+    #define ToasterPowerLog_FromState_ID 5
+
+    // Device power state after the transition, 0 for the wake callbacks
+    ULONG ToState[64];
+    #define ToasterPowerLog_ToState_SIZE sizeof(ULONG[64])
+    #define ToasterPowerLog_ToState_ID 6
+
+    // Time spent in the callback, in microseconds
+    ULONG Duration[64];
+    #define ToasterPowerLog_Duration_SIZE sizeof(ULONG[64])
+    #define ToasterPowerLog_Duration_ID 7
+
+    // Requests queued or owned by the driver at the time
+    ULONG QueueDepth[64];
+    #define ToasterPowerLog_QueueDepth_SIZE sizeof(ULONG[64])
+    #define ToasterPowerLog_QueueDepth_ID 8
+
+} ToasterPowerLog, *PToasterPowerLog;
+
+#define ToasterPowerLog_SIZE (FIELD_OFFSET(ToasterPowerLog, QueueDepth) + ToasterPowerLog_QueueDepth_SIZE)
+
+// ToasterDeviceSnapshot - ToasterDeviceSnapshot
+// Toaster device snapshot
+#define ToasterDeviceSnapshotGuid \
+    { 0x4813e2fd,0xc831,0x4541, { 0xa7,0x3f,0xd5,0x02,0x72,0xcf,0x19,0x23 } }
+
+#if ! (defined(MIDL_PASS))
+DEFINE_GUID(ToasterDeviceSnapshot_GUID, \
+            0x4813e2fd,0xc831,0x4541,0xa7,0x3f,0xd5,0x02,0x72,0xcf,0x19,0x23);
+#endif
+
+
+typedef struct _ToasterDeviceSnapshot
+{
+    // Layout version, 1. Later versions only append fields
+    ULONG Version;
+    #define ToasterDeviceSnapshot_Version_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_Version_ID 1
+
+    // Bytes of the record the driver filled in
+    ULONG Size;
+    #define ToasterDeviceSnapshot_Size_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_Size_ID 2
+
+    // ToasterDeviceInformation.ConnectorType
+    ULONG ConnectorType;
+    #define ToasterDeviceSnapshot_ConnectorType_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_ConnectorType_ID 3
+
+    // ToasterDeviceInformation.Capacity
+    ULONG Capacity;
+    #define ToasterDeviceSnapshot_Capacity_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_Capacity_ID 4
+
+    // ToasterDeviceInformation.ErrorCount
+    ULONG ErrorCount;
+    #define ToasterDeviceSnapshot_ErrorCount_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_ErrorCount_ID 5
+
+    // ToasterDeviceInformation.Controls
+    ULONG Controls;
+    #define ToasterDeviceSnapshot_Controls_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_Controls_ID 6
+
+    // ToasterDeviceInformation.DebugPrintLevel
+    ULONG DebugPrintLevel;
+    #define ToasterDeviceSnapshot_DebugPrintLevel_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_DebugPrintLevel_ID 7
+
+    // ToasterControl.ControlValue
+    ULONG ControlValue;
+    #define ToasterDeviceSnapshot_ControlValue_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_ControlValue_ID 8
+
+    // Crispiness level, 0 when the device is not on the toaster bus
+    ULONG CrispinessLevel;
+    #define ToasterDeviceSnapshot_CrispinessLevel_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_CrispinessLevel_ID 9
+
+    // Non-zero if the safety lock is engaged
+    ULONG SafetyLockEnabled;
+    #define ToasterDeviceSnapshot_SafetyLockEnabled_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_SafetyLockEnabled_ID 10
+
+    // Number of per-processor counter sets aggregated
+    ULONG ProcessorCount;
+    #define ToasterDeviceSnapshot_ProcessorCount_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_ProcessorCount_ID 11
+
+    // Reserved, zero
+    ULONG Reserved;
+    #define ToasterDeviceSnapshot_Reserved_SIZE sizeof(ULONG)
+    #define ToasterDeviceSnapshot_Reserved_ID 12
+
+    // Read requests completed
+    ULONGLONG ReadRequests;
+    #define ToasterDeviceSnapshot_ReadRequests_SIZE sizeof(ULONGLONG)
+    #define ToasterDeviceSnapshot_ReadRequests_ID 13
+
+    // Bytes returned by reads
+    ULONGLONG ReadBytes;
+    #define ToasterDeviceSnapshot_ReadBytes_SIZE sizeof(ULONGLONG)
+    #define ToasterDeviceSnapshot_ReadBytes_ID 14
+
+    // Read requests completed with an error
+    ULONGLONG ReadErrors;
+    #define ToasterDeviceSnapshot_ReadErrors_SIZE sizeof(ULONGLONG)
+    #define ToasterDeviceSnapshot_ReadErrors_ID 15
+
+    // Write requests completed
+    ULONGLONG WriteRequests;
+    #define ToasterDeviceSnapshot_WriteRequests_SIZE sizeof(ULONGLONG)
+    #define ToasterDeviceSnapshot_WriteRequests_ID 16
+
+    // Bytes accepted by writes
+    ULONGLONG WriteBytes;
+    #define ToasterDeviceSnapshot_WriteBytes_SIZE sizeof(ULONGLONG)
+    #define ToasterDeviceSnapshot_WriteBytes_ID 17
+
+    // Write requests completed with an error
+    ULONGLONG WriteErrors;
+    #define ToasterDeviceSnapshot_WriteErrors_SIZE sizeof(ULONGLONG)
+    #define ToasterDeviceSnapshot_WriteErrors_ID 18
+
+    // Device control requests completed
+    ULONGLONG IoctlRequests;
+    #define ToasterDeviceSnapshot_IoctlRequests_SIZE sizeof(ULONGLONG)
+    #define ToasterDeviceSnapshot_IoctlRequests_ID 19
+
+    // Bytes returned by device control requests
+    ULONGLONG IoctlBytes;
+    #define ToasterDeviceSnapshot_IoctlBytes_SIZE sizeof(ULONGLONG)
+    #define ToasterDeviceSnapshot_IoctlBytes_ID 20
+
+    // Device control requests completed with an error
+    ULONGLONG IoctlErrors;
+    #define ToasterDeviceSnapshot_IoctlErrors_SIZE sizeof(ULONGLONG)
+    #define ToasterDeviceSnapshot_IoctlErrors_ID 21
+
+} ToasterDeviceSnapshot, *PToasterDeviceSnapshot;
+
+#define ToasterDeviceSnapshot_SIZE (FIELD_OFFSET(ToasterDeviceSnapshot, IoctlErrors) + ToasterDeviceSnapshot_IoctlErrors_SIZE)
+
+// ToasterSlot - ToasterSlot
+// One slot of a multi-slot toaster
+typedef struct _ToasterSlot
+{
+    // Slot number, 0-based
+    ULONG SlotNumber;
+    #define ToasterSlot_SlotNumber_SIZE sizeof(ULONG)
+    #define ToasterSlot_SlotNumber_ID 1
+
+    // Capacity of the slot
+    ULONG Capacity;
+    #define ToasterSlot_Capacity_SIZE sizeof(ULONG)
+    #define ToasterSlot_Capacity_ID 2
+
+    // Control value of the slot
+    ULONG ControlValue;
+    #define ToasterSlot_ControlValue_SIZE sizeof(ULONG)
+    #define ToasterSlot_ControlValue_ID 3
+
+    // Errors reported by the slot
+    ULONG ErrorCount;
+    #define ToasterSlot_ErrorCount_SIZE sizeof(ULONG)
+    #define ToasterSlot_ErrorCount_ID 4
+
+} ToasterSlot, *PToasterSlot;
+
+#define ToasterSlot_SIZE (FIELD_OFFSET(ToasterSlot, ErrorCount) + ToasterSlot_ErrorCount_SIZE)
+
+// ToasterSlots - ToasterSlots
+// All slots of a multi-slot toaster in one instance
+#define ToasterSlotsGuid \
+    { 0x8f82941f,0x8d2d,0x41ad, { 0x80,0x1a,0x3a,0xaa,0x1c,0x55,0xd4,0xc7 } }
+
+#if ! (defined(MIDL_PASS))
+DEFINE_GUID(ToasterSlots_GUID, \
+            0x8f82941f,0x8d2d,0x41ad,0x80,0x1a,0x3a,0xaa,0x1c,0x55,0xd4,0xc7);
+#endif
+
+
+typedef struct _ToasterSlots
+{
+    // Number of slots
+    ULONG SlotCount;
+    #define ToasterSlots_SlotCount_SIZE sizeof(ULONG)
+    #define ToasterSlots_SlotCount_ID 1
+
+    // The slots, in slot number order
+    ToasterSlot Slots[1];
+    #define ToasterSlots_Slots_ID 2
+
+} ToasterSlots, *PToasterSlots;
+
+// ToasterInterruptModeration - ToasterInterruptModeration
+// Interrupt moderation of the hardware-backed toaster
+#define ToasterInterruptModerationGuid \
+    { 0x2599ed0e,0xa22f,0x4785, { 0x84,0xb3,0xc2,0x06,0xdb,0xd7,0xc2,0x6a } }
+
+#if ! (defined(MIDL_PASS))
+DEFINE_GUID(ToasterInterruptModeration_GUID, \
+            0x2599ed0e,0xa22f,0x4785,0x84,0xb3,0xc2,0x06,0xdb,0xd7,0xc2,0x6a);
+#endif
+
+
+typedef struct _ToasterInterruptModeration
+{
+    // Completions per interrupt, 0 - 256; 0 and 1 signal every completion
+    ULONG CoalesceCount;
+    #define ToasterInterruptModeration_CoalesceCount_SIZE sizeof(ULONG)
+    #define ToasterInterruptModeration_CoalesceCount_ID 1
+
+    // Longest a completion waits for its interrupt, 0 - 10000 microseconds; 0 waits for CoalesceCount
+    ULONG CoalesceTimer;
+    #define ToasterInterruptModeration_CoalesceTimer_SIZE sizeof(ULONG)
+    #define ToasterInterruptModeration_CoalesceTimer_ID 2
+
+    // Non-zero while the device completes requests through its interrupt
+    ULONG Connected;
+    #define ToasterInterruptModeration_Connected_SIZE sizeof(ULONG)
+    #define ToasterInterruptModeration_Connected_ID 3
+
+    // Most requests completed by one DPC
+    ULONG MaxBatch;
+    #define ToasterInterruptModeration_MaxBatch_SIZE sizeof(ULONG)
+    #define ToasterInterruptModeration_MaxBatch_ID 4
+
+    // Interrupts taken
+    ULONGLONG Interrupts;
+    #define ToasterInterruptModeration_Interrupts_SIZE sizeof(ULONGLONG)
+    #define ToasterInterruptModeration_Interrupts_ID 5
+
+    // DPCs run
+    ULONGLONG Dpcs;
+    #define ToasterInterruptModeration_Dpcs_SIZE sizeof(ULONGLONG)
+    #define ToasterInterruptModeration_Dpcs_ID 6
+
+    // Requests completed from the DPC
+    ULONGLONG Requests;
+    #define ToasterInterruptModeration_Requests_SIZE sizeof(ULONGLONG)
+    #define ToasterInterruptModeration_Requests_ID 7
+
+} ToasterInterruptModeration, *PToasterInterruptModeration;
+
+#define ToasterInterruptModeration_SIZE (FIELD_OFFSET(ToasterInterruptModeration, Requests) + ToasterInterruptModeration_Requests_SIZE)
+
+#endif
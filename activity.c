@@ -0,0 +1,129 @@
+/*++
+
+Module Name:
+
+    Activity.c
+
+Abstract:
+
+    TraceLogging provider of the featured toaster function driver, see
+    ToasterTl.h.
+
+    Reads, writes and IOCTLs log a RequestStart event when they arrive
+    (Toaster.c) and a RequestStop event where they are completed and
+    accounted, next to each ToasterStatsRecord. Both carry the activity ID
+    of the IRP, so a request that came through the generic filter is
+    logged under the ID the filter gave it. A request that arrived while no
+    session was listening logs no stop either.
+
+    The power callbacks log through ToasterPowerLogRecord (Power.c).
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "activity.tmh"
+
+// {8A53ECEA-A240-4D16-BCB8-887A3824DFF3}
+TRACELOGGING_DEFINE_PROVIDER(ToasterTlProvider,
+                             "Toaster.Function",
+                             (0x8a53ecea, 0xa240, 0x4d16, 0xbc, 0xb8, 0x88, 0x7a, 0x38, 0x24, 0xdf, 0xf3));
+
+
+//被ToasterEvtIoRead, ToasterEvtIoWrite和ToasterEvtIoDeviceControl调用
+VOID
+ToasterTlRequestStart(
+    _In_ WDFREQUEST         Request,
+    _In_ TOASTER_STAT_CLASS Class,
+    _In_ SIZE_T             Length,
+    _In_ ULONG              IoControlCode
+    )
+/*++
+
+Routine Description:
+
+    Logs the arrival of a request and remembers its activity ID for
+    ToasterTlRequestStop.
+
+Arguments:
+
+    Class - read, write or IOCTL.
+
+    Length - the read or write length, the output buffer length of an
+        IOCTL.
+
+    IoControlCode - 0 for a read or write.
+
+--*/
+{
+    PTOASTER_REQUEST_CONTEXT context = ToasterRequestGetContext(Request);
+
+    if (!ToasterTlEnabled(TOASTER_TL_KEYWORD_REQUEST)) {
+        context->Traced = FALSE;
+        return;
+    }
+
+    ToasterTlGetActivityId(WdfRequestWdmGetIrp(Request), &context->ActivityId);
+    context->Traced = TRUE;
+
+    TraceLoggingWriteActivity(ToasterTlProvider,
+                              "RequestStart",
+                              &context->ActivityId,
+                              NULL,
+                              TraceLoggingOpcode(WINEVENT_OPCODE_START),
+                              TraceLoggingLevel(TOASTER_TL_LEVEL),
+                              TraceLoggingKeyword(TOASTER_TL_KEYWORD_REQUEST),
+                              TraceLoggingPointer(Request, "Request"),
+                              TraceLoggingUInt32((ULONG) Class, "Class"),
+                              TraceLoggingUInt64((ULONG64) Length, "Length"),
+                              TraceLoggingHexUInt32(IoControlCode, "IoControlCode"));
+}
+
+//在每个ToasterStatsRecord旁被调用
+VOID
+ToasterTlRequestStop(
+    _In_ WDFREQUEST         Request,
+    _In_ NTSTATUS           Status,
+    _In_ ULONG_PTR          Information
+    )
+/*++
+
+Routine Description:
+
+    Logs the completion of a request under the activity ID its start was
+    logged with. Called right before the request is completed.
+
+--*/
+{
+    PTOASTER_REQUEST_CONTEXT context;
+
+    if (!ToasterTlEnabled(TOASTER_TL_KEYWORD_REQUEST)) {
+        return;
+    }
+
+    context = ToasterRequestGetContext(Request);
+
+    if (!context->Traced) {
+        return;
+    }
+
+    TraceLoggingWriteActivity(ToasterTlProvider,
+                              "RequestStop",
+                              &context->ActivityId,
+                              NULL,
+                              TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+                              TraceLoggingLevel(TOASTER_TL_LEVEL),
+                              TraceLoggingKeyword(TOASTER_TL_KEYWORD_REQUEST),
+                              TraceLoggingPointer(Request, "Request"),
+                              TraceLoggingNTStatus(Status, "Status"),
+                              TraceLoggingUInt64((ULONG64) Information, "Information"));
+}
@@ -0,0 +1,246 @@
+/*++
+
+Module Name:
+
+    Batch.c
+
+Abstract:
+
+    Implements IOCTL_TOASTER_SUBMIT_BATCH, which runs an array of toaster
+    operations (data ring reads and writes, crispiness get/set through the
+    bus interface) in a single dispatch and reports a status per entry.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "batch.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterSubmitBatch)
+#endif
+
+
+VOID
+ToasterExecuteOp(
+    _In_ WDFDEVICE Device,
+    _In_ PTOASTER_OP Op,
+    _In_reads_bytes_(SourceLength) PUCHAR SourceData,
+    _In_ SIZE_T SourceLength,
+    _Out_writes_bytes_(DestinationLength) PUCHAR DestinationData,
+    _In_ SIZE_T DestinationLength,
+    _Out_ PTOASTER_OP_RESULT Result
+    )
+/*++
+
+Routine Description:
+
+    Runs one batch operation. The caller must have captured Op into memory
+    the user cannot modify; the data areas may be user-visible.
+
+Arguments:
+
+    Device - Handle to the framework device object.
+
+    Op - operation to run.
+
+    SourceData, SourceLength - data area that ToasterOpWrite copies from.
+
+    DestinationData, DestinationLength - data area that ToasterOpRead
+        copies into.
+
+    Result - receives the outcome.
+
+--*/
+{
+    PFDO_IO_DATA    ioData = ToasterFdoGetIoData(Device);
+    UCHAR           level;
+
+    Result->Status = STATUS_SUCCESS;
+    Result->Information = 0;
+
+    switch (Op->OpCode) {
+
+    case ToasterOpNop:
+        break;
+
+    case ToasterOpRead:
+        if (Op->DataOffset > DestinationLength ||
+            Op->Length > DestinationLength - Op->DataOffset) {
+            Result->Status = STATUS_INVALID_USER_BUFFER;
+            break;
+        }
+
+        ToasterStateRestore(Device, ioData, TOASTER_STATE_RING);
+
+        Result->Information = (ULONG) ToasterRingRead(&ioData->DataRing,
+                                                      DestinationData + Op->DataOffset,
+                                                      Op->Length,
+                                                      FALSE);
+
+        if (Result->Information != 0) {
+            ToasterStateSetDirty(ioData, TOASTER_STATE_RING);
+        }
+        break;
+
+    case ToasterOpWrite:
+        if (Op->DataOffset > SourceLength ||
+            Op->Length > SourceLength - Op->DataOffset) {
+            Result->Status = STATUS_INVALID_USER_BUFFER;
+            break;
+        }
+
+        ToasterStateRestore(Device, ioData, TOASTER_STATE_RING);
+
+        Result->Information = (ULONG) ToasterRingWrite(&ioData->DataRing,
+                                                       SourceData + Op->DataOffset,
+                                                       Op->Length);
+
+        if (Result->Information != 0) {
+            ToasterStateSetDirty(ioData, TOASTER_STATE_RING);
+            ToasterServicePendingReads(ioData);
+        }
+        break;
+
+    case ToasterOpGetCrispiness:
+        Result->Status = ToasterGetCrispiness(Device, &level);
+        Result->Information = level;
+        break;
+
+    case ToasterOpSetCrispiness:
+        if (Op->Value > MAXUCHAR) {
+            Result->Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        Result->Status = ToasterSetCrispiness(Device, (UCHAR) Op->Value);
+        break;
+
+    default:
+        Result->Status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
+}
+
+//被ToasterEvtIoDeviceControl调用
+NTSTATUS
+ToasterSubmitBatch(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_TOASTER_SUBMIT_BATCH. See ToasterIoctl.h for the layout of
+    the input and output buffers.
+
+Arguments:
+
+    Device - Handle to the framework device object.
+
+    Request - The batch request.
+
+    Information - Receives the number of output bytes used: the result
+        array plus the furthest byte written by any read operation.
+
+Return Value:
+
+    NTSTATUS of the request as a whole. Per-operation failures are reported
+    in the result array and do not fail the request.
+
+--*/
+{
+    NTSTATUS                    status;
+    PTOASTER_BATCH_HEADER       header;
+    PTOASTER_OP                 ops;
+    PTOASTER_OP_RESULT          results;
+    TOASTER_OP_RESULT           result;
+    PUCHAR                      inputBuffer;
+    PUCHAR                      outputBuffer;
+    size_t                      inputLength;
+    size_t                      outputLength;
+    size_t                      opsLength;
+    size_t                      resultsLength;
+    size_t                      readEnd = 0;
+    ULONG                       i;
+
+    PAGED_CODE();
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(TOASTER_BATCH_HEADER),
+                                           &inputBuffer,
+                                           &inputLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    header = (PTOASTER_BATCH_HEADER) inputBuffer;
+
+    if (header->Version != TOASTER_BATCH_VERSION ||
+        header->Count == 0 ||
+        header->Count > TOASTER_BATCH_MAX_OPS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // Count is bounded above, so neither product can overflow.
+    //
+    opsLength = (size_t) header->Count * sizeof(TOASTER_OP);
+    resultsLength = (size_t) header->Count * sizeof(TOASTER_OP_RESULT);
+
+    if (inputLength - sizeof(TOASTER_BATCH_HEADER) < opsLength) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            resultsLength,
+                                            &outputBuffer,
+                                            &outputLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    //
+    // The input buffer is the I/O manager's copy of the caller's data, so
+    // the descriptors cannot change underneath us while we walk them.
+    //
+    ops = (PTOASTER_OP) (inputBuffer + sizeof(TOASTER_BATCH_HEADER));
+    results = (PTOASTER_OP_RESULT) outputBuffer;
+
+    for (i = 0; i < header->Count; i++) {
+
+        ToasterExecuteOp(Device,
+                         &ops[i],
+                         inputBuffer + sizeof(TOASTER_BATCH_HEADER) + opsLength,
+                         inputLength - sizeof(TOASTER_BATCH_HEADER) - opsLength,
+                         outputBuffer + resultsLength,
+                         outputLength - resultsLength,
+                         &result);
+
+        //
+        // The output buffer is mapped user memory; never read back from it.
+        //
+        results[i] = result;
+
+        if (ops[i].OpCode == ToasterOpRead && NT_SUCCESS(result.Status)) {
+            readEnd = max(readEnd, (size_t) ops[i].DataOffset + result.Information);
+        }
+    }
+
+    *Information = resultsLength + readEnd;
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,1073 @@
+/*++
+
+Module Name:
+
+    ToastBench.c
+
+Abstract:
+
+    Load generator and benchmark for the toaster stack.
+
+    Opens a toaster through GUID_DEVINTERFACE_TOASTER and drives it from N
+    threads, each keeping Depth overlapped requests outstanding on its own
+    handle and completion port. Every request is drawn from a weighted mix
+    of reads, writes, IOCTL_TOASTER_SUBMIT_BATCH and the ToasterControl1..3
+    WMI methods, and timed from issue to completion. At the end it reports
+    per-operation throughput and p50/p99/p999 latency.
+
+    WMI methods have no overlapped form; a thread that draws one runs it
+    synchronously, and its other requests wait for it like they would for
+    any other caller of the method. Completions are stamped as soon as
+    they are dequeued, and the requests that replace them, WMI methods
+    included, are only issued once the whole batch is recorded, so a WMI
+    method never adds to the latency of a request that had already
+    completed. It still delays the next dequeue.
+
+    Whether filter_generic.c is in the stack is detected, not chosen: the
+    generic filter answers IOCTL_FILTER_GET_LATENCY on its way down, the
+    function driver does not. Run once with the filter installed and once
+    without, with -label to tell the two apart in -csv output. \\.\ToasterFilter,
+    the sideband filter's control device, is reported when it exists. With
+    -filtertrace the generic filter's own IOCTL latency histograms are reset
+    before the run and printed after it, as a cross-check of what the
+    filter adds.
+
+    Reads on a device with PendingReads park until a write comes in; keep
+    writes in the mix there, or reads are only counted once the run is
+    over and they are cancelled.
+
+    Built as a console application with the driver directory on the
+    include path; links with setupapi.lib and advapi32.lib.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <winioctl.h>
+#include <setupapi.h>
+#include <initguid.h>
+#include <wmistr.h>
+#include <wmium.h>
+#include <intrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include "public.h"
+#include "ToasterMof.h"
+#include "toasterioctl.h"
+#include "filterioctl.h"
+
+#define BENCH_MAX_THREADS           64
+#define BENCH_MAX_DEPTH             256
+#define BENCH_COMPLETIONS           64
+
+//
+// Latencies are kept in nanoseconds in a log-linear histogram: 16
+// buckets per power of two, so a percentile is off by at most 1/16.
+//
+#define BENCH_HIST_SUB_BITS         4
+#define BENCH_HIST_SUB              (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS          (64 * BENCH_HIST_SUB)
+
+typedef enum _BENCH_OP {
+    BenchOpRead = 0,
+    BenchOpWrite,
+    BenchOpBatch,
+    BenchOpWmi,
+    BenchOpMaximum
+} BENCH_OP;
+
+static const PCWSTR BenchOpNames[BenchOpMaximum] = {
+    L"read",
+    L"write",
+    L"batch",
+    L"wmi",
+};
+
+typedef struct _BENCH_CONFIG {
+    ULONG   Threads;
+    ULONG   Depth;
+    ULONG   Seconds;
+    ULONG   Warmup;
+    ULONG   Length;
+    ULONG   BatchOps;
+    ULONG   Weights[BenchOpMaximum];
+    ULONG   TotalWeight;
+    ULONG   Device;
+    BOOL    FilterTrace;
+    BOOL    Csv;
+    PCWSTR  Label;
+} BENCH_CONFIG, *PBENCH_CONFIG;
+
+typedef struct _BENCH_STATS {
+    ULONG64 Ops;
+    ULONG64 Errors;
+    ULONG64 Bytes;
+    ULONG64 MaxNs;
+    ULONG64 Histogram[BENCH_HIST_BUCKETS];
+} BENCH_STATS, *PBENCH_STATS;
+
+//
+// One outstanding request. Overlapped comes first so that a completion
+// entry leads straight back to its slot.
+//
+typedef struct _BENCH_SLOT {
+    OVERLAPPED  Overlapped;
+    BENCH_OP    Op;
+    LONGLONG    Start;
+    PUCHAR      Input;
+    ULONG       InputLength;
+    PUCHAR      Output;
+    ULONG       OutputLength;
+} BENCH_SLOT, *PBENCH_SLOT;
+
+typedef struct _BENCH_THREAD {
+    HANDLE      Thread;
+    HANDLE      Device;
+    HANDLE      Port;
+    WMIHANDLE   Wmi;
+    WCHAR       WmiInstance[MAX_PATH];
+    ULONG       WmiMethod;
+    ULONG       Random;
+    ULONG       Outstanding;
+    BENCH_SLOT  Slots[BENCH_MAX_DEPTH];
+    BENCH_STATS Stats[BenchOpMaximum];
+} BENCH_THREAD, *PBENCH_THREAD;
+
+static BENCH_CONFIG     Config;
+static WCHAR            DevicePath[MAX_PATH];
+static LARGE_INTEGER    Frequency;
+static volatile LONG    Recording;
+static volatile LONG    Stop;
+
+static
+ULONG
+BenchBucket(
+    _In_ ULONG64 Ns
+    )
+{
+    ULONG   exponent;
+
+    if (Ns < BENCH_HIST_SUB) {
+        return (ULONG) Ns;
+    }
+
+    _BitScanReverse64(&exponent, Ns);
+
+    return (exponent - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB +
+           (ULONG) ((Ns >> (exponent - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+static
+ULONG64
+BenchBucketValue(
+    _In_ ULONG Bucket
+    )
+/*++
+
+Routine Description:
+
+    Returns the smallest latency that falls into Bucket.
+
+--*/
+{
+    ULONG   exponent;
+
+    if (Bucket < BENCH_HIST_SUB) {
+        return Bucket;
+    }
+
+    exponent = Bucket / BENCH_HIST_SUB + BENCH_HIST_SUB_BITS - 1;
+
+    return ((ULONG64) (BENCH_HIST_SUB + Bucket % BENCH_HIST_SUB)) << (exponent - BENCH_HIST_SUB_BITS);
+}
+
+static
+VOID
+BenchRecord(
+    _Inout_ PBENCH_STATS    Stats,
+    _In_    LONGLONG        Start,
+    _In_    LONGLONG        End,
+    _In_    BOOL            Success,
+    _In_    ULONG64         Bytes
+    )
+{
+    ULONG64 ns;
+
+    if (!Recording) {
+        return;
+    }
+
+    ns = (ULONG64) (End - Start) * 1000000000 / (ULONG64) Frequency.QuadPart;
+
+    Stats->Ops++;
+    Stats->Bytes += Bytes;
+    if (!Success) {
+        Stats->Errors++;
+    }
+    if (ns > Stats->MaxNs) {
+        Stats->MaxNs = ns;
+    }
+
+    Stats->Histogram[BenchBucket(ns)]++;
+}
+
+static
+ULONG64
+BenchPercentile(
+    _In_ PBENCH_STATS   Stats,
+    _In_ double         Fraction
+    )
+{
+    ULONG64 target;
+    ULONG64 seen = 0;
+    ULONG   i;
+
+    if (Stats->Ops == 0) {
+        return 0;
+    }
+
+    target = (ULONG64) (Stats->Ops * Fraction);
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += Stats->Histogram[i];
+        if (seen >= target) {
+            return BenchBucketValue(i);
+        }
+    }
+
+    return Stats->MaxNs;
+}
+
+static
+BENCH_OP
+BenchPickOp(
+    _Inout_ PBENCH_THREAD Context
+    )
+{
+    ULONG   value;
+    ULONG   op;
+
+    //
+    // xorshift32; the mix only has to be right on average.
+    //
+    Context->Random ^= Context->Random << 13;
+    Context->Random ^= Context->Random >> 17;
+    Context->Random ^= Context->Random << 5;
+
+    value = Context->Random % Config.TotalWeight;
+
+    for (op = 0; op < BenchOpMaximum - 1; op++) {
+        if (value < Config.Weights[op]) {
+            break;
+        }
+        value -= Config.Weights[op];
+    }
+
+    return (BENCH_OP) op;
+}
+
+static
+BOOL
+BenchRunWmi(
+    _Inout_ PBENCH_THREAD Context
+    )
+/*++
+
+Routine Description:
+
+    Runs ToasterControl1, 2 and 3 in turn. They take and return at most
+    two ULONGs, so one pair of buffers fits all three.
+
+--*/
+{
+    static const ULONG  inSizes[3] = {
+        ToasterControl1_IN_SIZE, ToasterControl2_IN_SIZE, ToasterControl3_IN_SIZE
+    };
+    static const ULONG  outSizes[3] = {
+        ToasterControl1_OUT_SIZE, ToasterControl2_OUT_SIZE, ToasterControl3_OUT_SIZE
+    };
+    ULONG               input[2] = { 1, 2 };
+    ULONG               output[2];
+    ULONG               outSize;
+    ULONG               method = Context->WmiMethod;
+    LARGE_INTEGER       start;
+    LARGE_INTEGER       end;
+    ULONG               error;
+
+    Context->WmiMethod = (method + 1) % 3;
+
+    QueryPerformanceCounter(&start);
+
+    outSize = outSizes[method];
+
+    error = WmiExecuteMethodW(Context->Wmi,
+                              Context->WmiInstance,
+                              method + 1,
+                              inSizes[method],
+                              input,
+                              &outSize,
+                              output);
+
+    QueryPerformanceCounter(&end);
+
+    BenchRecord(&Context->Stats[BenchOpWmi], start.QuadPart, end.QuadPart, error == ERROR_SUCCESS, 0);
+
+    return error == ERROR_SUCCESS;
+}
+
+static
+BOOL
+BenchIssue(
+    _Inout_ PBENCH_THREAD   Context,
+    _Inout_ PBENCH_SLOT     Slot
+    )
+/*++
+
+Routine Description:
+
+    Starts the next request of a slot. WMI methods drawn on the way run
+    synchronously, see the module header.
+
+Return Value:
+
+    FALSE if the slot is idle: the run is over or the request failed to
+    start.
+
+--*/
+{
+    LARGE_INTEGER   start;
+    BOOL            result;
+
+    for (;;) {
+
+        if (Stop) {
+            return FALSE;
+        }
+
+        Slot->Op = BenchPickOp(Context);
+        if (Slot->Op != BenchOpWmi) {
+            break;
+        }
+
+        (VOID) BenchRunWmi(Context);
+    }
+
+    ZeroMemory(&Slot->Overlapped, sizeof(OVERLAPPED));
+
+    QueryPerformanceCounter(&start);
+    Slot->Start = start.QuadPart;
+
+    switch (Slot->Op) {
+
+    case BenchOpRead:
+        result = ReadFile(Context->Device,
+                          Slot->Output,
+                          Config.Length,
+                          NULL,
+                          &Slot->Overlapped);
+        break;
+
+    case BenchOpWrite:
+        result = WriteFile(Context->Device,
+                           Slot->Input + sizeof(TOASTER_BATCH_HEADER) + Config.BatchOps * sizeof(TOASTER_OP),
+                           Config.Length,
+                           NULL,
+                           &Slot->Overlapped);
+        break;
+
+    default:
+        result = DeviceIoControl(Context->Device,
+                                 IOCTL_TOASTER_SUBMIT_BATCH,
+                                 Slot->Input,
+                                 Slot->InputLength,
+                                 Slot->Output,
+                                 Slot->OutputLength,
+                                 NULL,
+                                 &Slot->Overlapped);
+        break;
+    }
+
+    if (!result && GetLastError() != ERROR_IO_PENDING) {
+        QueryPerformanceCounter(&start);
+        BenchRecord(&Context->Stats[Slot->Op], Slot->Start, start.QuadPart, FALSE, 0);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static
+ULONG64
+BenchBatchBytes(
+    _In_ PBENCH_SLOT Slot
+    )
+{
+    PTOASTER_OP_RESULT  results = (PTOASTER_OP_RESULT) Slot->Output;
+    ULONG64             bytes = 0;
+    ULONG               i;
+
+    for (i = 0; i < Config.BatchOps; i++) {
+        if (results[i].Status >= 0) {
+            bytes += results[i].Information;
+        }
+    }
+
+    return bytes;
+}
+
+static
+BOOL
+BenchPrepareSlot(
+    _Inout_ PBENCH_SLOT Slot
+    )
+/*++
+
+Routine Description:
+
+    Allocates a slot's buffers and fills in its batch: alternating writes
+    and reads of Length bytes. Plain writes send the start of the batch's
+    write payload; plain reads land at the start of the output buffer,
+    which always holds at least Length bytes.
+
+--*/
+{
+    PTOASTER_BATCH_HEADER   header;
+    PTOASTER_OP             ops;
+    ULONG                   writes = (Config.BatchOps + 1) / 2;
+    ULONG                   reads = Config.BatchOps / 2;
+    ULONG                   i;
+
+    Slot->InputLength = sizeof(TOASTER_BATCH_HEADER) +
+                        Config.BatchOps * sizeof(TOASTER_OP) +
+                        max(writes, 1) * Config.Length;
+    Slot->OutputLength = Config.BatchOps * sizeof(TOASTER_OP_RESULT) +
+                         max(reads, 1) * Config.Length;
+
+    Slot->Input = (PUCHAR) VirtualAlloc(NULL, Slot->InputLength, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    Slot->Output = (PUCHAR) VirtualAlloc(NULL, Slot->OutputLength, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (Slot->Input == NULL || Slot->Output == NULL) {
+        return FALSE;
+    }
+
+    header = (PTOASTER_BATCH_HEADER) Slot->Input;
+    header->Version = TOASTER_BATCH_VERSION;
+    header->Count = Config.BatchOps;
+
+    ops = (PTOASTER_OP) (header + 1);
+
+    for (i = 0; i < Config.BatchOps; i++) {
+        ops[i].OpCode = (i % 2 == 0) ? ToasterOpWrite : ToasterOpRead;
+        ops[i].Length = Config.Length;
+        ops[i].DataOffset = (i / 2) * Config.Length;
+        ops[i].Value = 0;
+    }
+
+    FillMemory((PUCHAR) (ops + Config.BatchOps), max(writes, 1) * Config.Length, 0x5A);
+
+    return TRUE;
+}
+
+static
+DWORD
+WINAPI
+BenchThread(
+    _In_ LPVOID Parameter
+    )
+{
+    PBENCH_THREAD           context = (PBENCH_THREAD) Parameter;
+    OVERLAPPED_ENTRY        entries[BENCH_COMPLETIONS];
+    LARGE_INTEGER           now;
+    PBENCH_SLOT             slot;
+    ULONG                   count;
+    ULONG                   i;
+    ULONG64                 bytes;
+    BOOL                    success;
+
+    for (i = 0; i < Config.Depth; i++) {
+        if (BenchIssue(context, &context->Slots[i])) {
+            context->Outstanding++;
+        }
+    }
+
+    while (context->Outstanding != 0) {
+
+        if (Stop) {
+            //
+            // Parked reads would otherwise wait for a write that is not
+            // coming.
+            //
+            CancelIoEx(context->Device, NULL);
+        }
+
+        if (!GetQueuedCompletionStatusEx(context->Port,
+                                         entries,
+                                         BENCH_COMPLETIONS,
+                                         &count,
+                                         Stop ? INFINITE : 100,
+                                         FALSE)) {
+            continue;
+        }
+
+        //
+        // Every entry of the batch completed by now; stamp them all here
+        // rather than as the loop gets to them.
+        //
+        QueryPerformanceCounter(&now);
+
+        for (i = 0; i < count; i++) {
+
+            slot = CONTAINING_RECORD(entries[i].lpOverlapped, BENCH_SLOT, Overlapped);
+
+            //
+            // The OVERLAPPED's Internal is the NTSTATUS the request
+            // completed with; the entry's own Internal is reserved.
+            //
+            success = ((LONG) slot->Overlapped.Internal >= 0);
+
+            if (slot->Op == BenchOpBatch) {
+                bytes = success ? BenchBatchBytes(slot) : 0;
+            } else {
+                bytes = entries[i].dwNumberOfBytesTransferred;
+            }
+
+            BenchRecord(&context->Stats[slot->Op], slot->Start, now.QuadPart, success, bytes);
+        }
+
+        //
+        // Only now reissue: a WMI method drawn here runs synchronously and
+        // must not delay the recording of the rest of the batch.
+        //
+        for (i = 0; i < count; i++) {
+
+            slot = CONTAINING_RECORD(entries[i].lpOverlapped, BENCH_SLOT, Overlapped);
+
+            if (!BenchIssue(context, slot)) {
+                context->Outstanding--;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static
+BOOL
+BenchFindDevice(
+    VOID
+    )
+{
+    HDEVINFO                            devInfo;
+    SP_DEVICE_INTERFACE_DATA            interfaceData;
+    PSP_DEVICE_INTERFACE_DETAIL_DATA_W  detail;
+    DWORD                               size = 0;
+    BOOL                                found = FALSE;
+
+    devInfo = SetupDiGetClassDevsW(&GUID_DEVINTERFACE_TOASTER,
+                                   NULL,
+                                   NULL,
+                                   DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+    if (devInfo == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    interfaceData.cbSize = sizeof(interfaceData);
+
+    if (SetupDiEnumDeviceInterfaces(devInfo,
+                                    NULL,
+                                    &GUID_DEVINTERFACE_TOASTER,
+                                    Config.Device,
+                                    &interfaceData)) {
+
+        (VOID) SetupDiGetDeviceInterfaceDetailW(devInfo, &interfaceData, NULL, 0, &size, NULL);
+
+        detail = (PSP_DEVICE_INTERFACE_DETAIL_DATA_W) malloc(size);
+        if (detail != NULL) {
+
+            detail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W);
+
+            if (SetupDiGetDeviceInterfaceDetailW(devInfo, &interfaceData, detail, size, NULL, NULL)) {
+                wcsncpy_s(DevicePath, MAX_PATH, detail->DevicePath, _TRUNCATE);
+                found = TRUE;
+            }
+
+            free(detail);
+        }
+    }
+
+    SetupDiDestroyDeviceInfoList(devInfo);
+
+    return found;
+}
+
+static
+BOOL
+BenchOpenThread(
+    _Inout_ PBENCH_THREAD Context,
+    _In_    ULONG         Index
+    )
+{
+    ULONG   size;
+    ULONG   error;
+    ULONG   i;
+
+    Context->Random = 0x9E3779B9 ^ (Index * 0x85EBCA6B) ^ GetTickCount();
+    if (Context->Random == 0) {
+        Context->Random = 1;
+    }
+
+    Context->Device = CreateFileW(DevicePath,
+                                  GENERIC_READ | GENERIC_WRITE,
+                                  FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                  NULL,
+                                  OPEN_EXISTING,
+                                  FILE_FLAG_OVERLAPPED,
+                                  NULL);
+    if (Context->Device == INVALID_HANDLE_VALUE) {
+        fwprintf(stderr, L"Cannot open %s: %u\n", DevicePath, GetLastError());
+        return FALSE;
+    }
+
+    Context->Port = CreateIoCompletionPort(Context->Device, NULL, 0, 1);
+    if (Context->Port == NULL) {
+        fwprintf(stderr, L"CreateIoCompletionPort failed: %u\n", GetLastError());
+        return FALSE;
+    }
+
+    for (i = 0; i < Config.Depth; i++) {
+        if (!BenchPrepareSlot(&Context->Slots[i])) {
+            fwprintf(stderr, L"Out of memory\n");
+            return FALSE;
+        }
+    }
+
+    if (Config.Weights[BenchOpWmi] == 0) {
+        return TRUE;
+    }
+
+    error = WmiOpenBlock((LPGUID) &ToasterControl_GUID, WMIGUID_EXECUTE, &Context->Wmi);
+    if (error == ERROR_SUCCESS) {
+        size = MAX_PATH;
+        error = WmiFileHandleToInstanceNameW(Context->Wmi,
+                                             Context->Device,
+                                             &size,
+                                             Context->WmiInstance);
+    }
+
+    if (error != ERROR_SUCCESS) {
+        fwprintf(stderr, L"No ToasterControl instance for the device: %u\n", error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static
+VOID
+BenchProbeFilters(
+    _Out_ PBOOL     Generic,
+    _Out_ PBOOL     Sideband,
+    _Out_ PULONG    Instances
+    )
+{
+    HANDLE                  device;
+    HANDLE                  control;
+    FILTER_LATENCY_OUTPUT   latency;
+    FILTER_ENUM_OUTPUT      instances;
+    FILTER_LATENCY_TRACE    trace;
+    DWORD                   returned;
+
+    *Generic = FALSE;
+    *Sideband = FALSE;
+    *Instances = 0;
+
+    device = CreateFileW(DevicePath, GENERIC_READ | GENERIC_WRITE,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         NULL, OPEN_EXISTING, 0, NULL);
+    if (device != INVALID_HANDLE_VALUE) {
+
+        if (DeviceIoControl(device, IOCTL_FILTER_GET_LATENCY, NULL, 0,
+                            &latency, sizeof(latency), &returned, NULL) ||
+            GetLastError() == ERROR_MORE_DATA) {
+            *Generic = TRUE;
+        }
+
+        if (*Generic && Config.FilterTrace) {
+            trace.Enable = 1;
+            trace.Reset = 1;
+            (VOID) DeviceIoControl(device, IOCTL_FILTER_SET_LATENCY_TRACE,
+                                   &trace, sizeof(trace), NULL, 0, &returned, NULL);
+        }
+
+        CloseHandle(device);
+    }
+
+    control = CreateFileW(L"\\\\.\\ToasterFilter", GENERIC_READ | GENERIC_WRITE,
+                          0, NULL, OPEN_EXISTING, 0, NULL);
+    if (control != INVALID_HANDLE_VALUE) {
+
+        *Sideband = TRUE;
+
+        if (DeviceIoControl(control, IOCTL_FILTER_ENUM_INSTANCES, NULL, 0,
+                            &instances, sizeof(instances), &returned, NULL) ||
+            GetLastError() == ERROR_MORE_DATA) {
+            *Instances = instances.Total;
+        }
+
+        CloseHandle(control);
+    }
+}
+
+static
+VOID
+BenchPrintFilterLatency(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Prints what the generic filter measured while -filtertrace had it
+    tracing, and turns the tracer off again. Its buckets are powers of two
+    in microseconds, so the percentiles are upper bounds.
+
+--*/
+{
+    HANDLE                  device;
+    PFILTER_LATENCY_OUTPUT  output;
+    FILTER_LATENCY_TRACE    trace;
+    DWORD                   size;
+    DWORD                   returned;
+    ULONG64                 seen;
+    ULONG                   i;
+    ULONG                   j;
+    ULONG                   p50;
+    ULONG                   p99;
+
+    device = CreateFileW(DevicePath, GENERIC_READ | GENERIC_WRITE,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         NULL, OPEN_EXISTING, 0, NULL);
+    if (device == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    size = FIELD_OFFSET(FILTER_LATENCY_OUTPUT, Entries) + 64 * sizeof(FILTER_LATENCY_ENTRY);
+    output = (PFILTER_LATENCY_OUTPUT) malloc(size);
+
+    if (output != NULL &&
+        DeviceIoControl(device, IOCTL_FILTER_GET_LATENCY, NULL, 0,
+                        output, size, &returned, NULL)) {
+
+        wprintf(L"\ngeneric filter, forward to completion:\n");
+        wprintf(L"%-10s %12s %8s %10s %10s\n", L"ioctl", L"requests", L"errors", L"p50(us)<", L"p99(us)<");
+
+        for (i = 0; i < output->Returned; i++) {
+
+            PFILTER_LATENCY_ENTRY entry = &output->Entries[i];
+
+            if (entry->Requests == 0) {
+                continue;
+            }
+
+            seen = 0;
+            p50 = p99 = FILTER_LATENCY_BUCKETS - 1;
+
+            for (j = 0; j < FILTER_LATENCY_BUCKETS; j++) {
+                seen += entry->Histogram[j];
+                if (p50 == FILTER_LATENCY_BUCKETS - 1 && seen * 2 >= entry->Requests) {
+                    p50 = j;
+                }
+                if (seen * 100 >= entry->Requests * 99) {
+                    p99 = j;
+                    break;
+                }
+            }
+
+            wprintf(L"0x%08x %12llu %8llu %10u %10u\n",
+                    entry->IoControlCode,
+                    entry->Requests,
+                    entry->Errors,
+                    1u << p50,
+                    1u << p99);
+        }
+
+        if (output->Untracked != 0) {
+            wprintf(L"(%llu requests of codes without a slot)\n", output->Untracked);
+        }
+    }
+
+    free(output);
+
+    trace.Enable = 0;
+    trace.Reset = 0;
+    (VOID) DeviceIoControl(device, IOCTL_FILTER_SET_LATENCY_TRACE,
+                           &trace, sizeof(trace), NULL, 0, &returned, NULL);
+
+    CloseHandle(device);
+}
+
+static
+VOID
+BenchUsage(
+    VOID
+    )
+{
+    fwprintf(stderr,
+             L"usage: toastbench [options]\n"
+             L"  -threads N      worker threads (1)\n"
+             L"  -depth N        overlapped requests per thread (8)\n"
+             L"  -seconds N      measured run time (10)\n"
+             L"  -warmup N       seconds before measuring starts (2)\n"
+             L"  -length N       bytes per read, write and batch op (4096)\n"
+             L"  -batchops N     ops per IOCTL_TOASTER_SUBMIT_BATCH (16)\n"
+             L"  -read N -write N -batch N -wmi N\n"
+             L"                  weights of the mix (50/50/0/0)\n"
+             L"  -device N       index of the toaster interface (0)\n"
+             L"  -filtertrace    print the generic filter's IOCTL latency\n"
+             L"  -csv            one comma-separated line per operation\n"
+             L"  -label TEXT     first column of -csv output\n");
+}
+
+static
+BOOL
+BenchParse(
+    _In_ int        Argc,
+    _In_ wchar_t**  Argv
+    )
+{
+    static const struct {
+        PCWSTR  Name;
+        PULONG  Value;
+    } options[] = {
+        { L"-threads",  &Config.Threads },
+        { L"-depth",    &Config.Depth },
+        { L"-seconds",  &Config.Seconds },
+        { L"-warmup",   &Config.Warmup },
+        { L"-length",   &Config.Length },
+        { L"-batchops", &Config.BatchOps },
+        { L"-read",     &Config.Weights[BenchOpRead] },
+        { L"-write",    &Config.Weights[BenchOpWrite] },
+        { L"-batch",    &Config.Weights[BenchOpBatch] },
+        { L"-wmi",      &Config.Weights[BenchOpWmi] },
+        { L"-device",   &Config.Device },
+    };
+    int     i;
+    ULONG   j;
+    ULONG   op;
+
+    Config.Threads = 1;
+    Config.Depth = 8;
+    Config.Seconds = 10;
+    Config.Warmup = 2;
+    Config.Length = 4096;
+    Config.BatchOps = 16;
+    Config.Weights[BenchOpRead] = 50;
+    Config.Weights[BenchOpWrite] = 50;
+    Config.Label = L"toaster";
+
+    for (i = 1; i < Argc; i++) {
+
+        if (_wcsicmp(Argv[i], L"-filtertrace") == 0) {
+            Config.FilterTrace = TRUE;
+            continue;
+        }
+
+        if (_wcsicmp(Argv[i], L"-csv") == 0) {
+            Config.Csv = TRUE;
+            continue;
+        }
+
+        if (_wcsicmp(Argv[i], L"-label") == 0 && i + 1 < Argc) {
+            Config.Label = Argv[++i];
+            continue;
+        }
+
+        for (j = 0; j < ARRAYSIZE(options); j++) {
+            if (_wcsicmp(Argv[i], options[j].Name) == 0 && i + 1 < Argc) {
+                *options[j].Value = wcstoul(Argv[++i], NULL, 0);
+                break;
+            }
+        }
+
+        if (j == ARRAYSIZE(options)) {
+            return FALSE;
+        }
+    }
+
+    Config.TotalWeight = 0;
+    for (op = 0; op < BenchOpMaximum; op++) {
+        Config.TotalWeight += Config.Weights[op];
+    }
+
+    return Config.Threads >= 1 && Config.Threads <= BENCH_MAX_THREADS &&
+           Config.Depth >= 1 && Config.Depth <= BENCH_MAX_DEPTH &&
+           Config.Seconds >= 1 &&
+           Config.Length >= 1 &&
+           Config.BatchOps <= TOASTER_BATCH_MAX_OPS &&
+           (Config.BatchOps != 0 || Config.Weights[BenchOpBatch] == 0) &&
+           Config.TotalWeight != 0;
+}
+
+int
+__cdecl
+wmain(
+    _In_ int        Argc,
+    _In_ wchar_t**  Argv
+    )
+{
+    PBENCH_THREAD   threads;
+    BENCH_STATS     total[BenchOpMaximum];
+    LARGE_INTEGER   start;
+    LARGE_INTEGER   end;
+    double          seconds;
+    BOOL            generic;
+    BOOL            sideband;
+    ULONG           instances;
+    ULONG           i;
+    ULONG           op;
+    ULONG           bucket;
+
+    if (!BenchParse(Argc, Argv)) {
+        BenchUsage();
+        return 1;
+    }
+
+    if (!BenchFindDevice()) {
+        fwprintf(stderr, L"No toaster interface %u\n", Config.Device);
+        return 1;
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+
+    BenchProbeFilters(&generic, &sideband, &instances);
+
+    threads = (PBENCH_THREAD) calloc(Config.Threads, sizeof(BENCH_THREAD));
+    if (threads == NULL) {
+        fwprintf(stderr, L"Out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < Config.Threads; i++) {
+        if (!BenchOpenThread(&threads[i], i)) {
+            return 1;
+        }
+    }
+
+    if (!Config.Csv) {
+        wprintf(L"%s\n", DevicePath);
+        wprintf(L"%u threads x %u deep, %u s (+%u s warmup), %u bytes, %u ops per batch\n",
+                Config.Threads, Config.Depth, Config.Seconds, Config.Warmup,
+                Config.Length, Config.BatchOps);
+        wprintf(L"mix read %u write %u batch %u wmi %u\n",
+                Config.Weights[BenchOpRead], Config.Weights[BenchOpWrite],
+                Config.Weights[BenchOpBatch], Config.Weights[BenchOpWmi]);
+        wprintf(L"generic filter %s, sideband filter %s (%u instances)\n",
+                generic ? L"in the stack" : L"not in the stack",
+                sideband ? L"present" : L"absent",
+                instances);
+    }
+
+    for (i = 0; i < Config.Threads; i++) {
+        threads[i].Thread = CreateThread(NULL, 0, BenchThread, &threads[i], 0, NULL);
+        if (threads[i].Thread == NULL) {
+            fwprintf(stderr, L"CreateThread failed: %u\n", GetLastError());
+            InterlockedExchange(&Stop, 1);
+            Config.Threads = i;
+            break;
+        }
+    }
+
+    Sleep(Config.Warmup * 1000);
+
+    QueryPerformanceCounter(&start);
+    InterlockedExchange(&Recording, 1);
+
+    Sleep(Config.Seconds * 1000);
+
+    InterlockedExchange(&Recording, 0);
+    QueryPerformanceCounter(&end);
+    InterlockedExchange(&Stop, 1);
+
+    for (i = 0; i < Config.Threads; i++) {
+        WaitForSingleObject(threads[i].Thread, INFINITE);
+        CloseHandle(threads[i].Thread);
+    }
+
+    seconds = (double) (end.QuadPart - start.QuadPart) / (double) Frequency.QuadPart;
+
+    ZeroMemory(total, sizeof(total));
+
+    for (i = 0; i < Config.Threads; i++) {
+        for (op = 0; op < BenchOpMaximum; op++) {
+
+            PBENCH_STATS stats = &threads[i].Stats[op];
+
+            total[op].Ops += stats->Ops;
+            total[op].Errors += stats->Errors;
+            total[op].Bytes += stats->Bytes;
+            total[op].MaxNs = max(total[op].MaxNs, stats->MaxNs);
+
+            for (bucket = 0; bucket < BENCH_HIST_BUCKETS; bucket++) {
+                total[op].Histogram[bucket] += stats->Histogram[bucket];
+            }
+        }
+    }
+
+    if (!Config.Csv) {
+        wprintf(L"\n%-6s %12s %12s %10s %8s %10s %10s %10s %10s\n",
+                L"op", L"ops", L"ops/s", L"MB/s", L"errors",
+                L"p50(us)", L"p99(us)", L"p999(us)", L"max(us)");
+    }
+
+    for (op = 0; op < BenchOpMaximum; op++) {
+
+        if (Config.Weights[op] == 0) {
+            continue;
+        }
+
+        if (Config.Csv) {
+            wprintf(L"%s,%s,%u,%u,%u,%s,",
+                    Config.Label,
+                    BenchOpNames[op],
+                    Config.Threads,
+                    Config.Depth,
+                    Config.Length,
+                    generic ? L"filter" : L"nofilter");
+        } else {
+            wprintf(L"%-6s ", BenchOpNames[op]);
+        }
+
+        wprintf(Config.Csv ?
+                    L"%llu,%.0f,%.2f,%llu,%.1f,%.1f,%.1f,%.1f\n" :
+                    L"%12llu %12.0f %10.2f %8llu %10.1f %10.1f %10.1f %10.1f\n",
+                total[op].Ops,
+                total[op].Ops / seconds,
+                total[op].Bytes / seconds / (1024.0 * 1024.0),
+                total[op].Errors,
+                BenchPercentile(&total[op], 0.50) / 1000.0,
+                BenchPercentile(&total[op], 0.99) / 1000.0,
+                BenchPercentile(&total[op], 0.999) / 1000.0,
+                total[op].MaxNs / 1000.0);
+    }
+
+    if (generic && Config.FilterTrace) {
+        BenchPrintFilterLatency();
+    }
+
+    for (i = 0; i < Config.Threads; i++) {
+        if (threads[i].Wmi != NULL) {
+            WmiCloseBlock(threads[i].Wmi);
+        }
+        CloseHandle(threads[i].Port);
+        CloseHandle(threads[i].Device);
+    }
+
+    return 0;
+}
@@ -0,0 +1,359 @@
+/*++
+
+Module Name:
+
+    Bus.c
+
+Abstract:
+
+    Keeps the toaster bus direct-call interface (GUID_TOASTER_INTERFACE_STANDARD)
+    referenced for as long as the device owns its hardware, so that the I/O
+    and WMI paths can call the bus driver directly instead of querying the
+    interface every time.
+
+    The crispiness level and the safety lock state are cached in
+    FDO_IO_DATA. Reading them never leaves this driver; only a set goes to
+    the bus driver, and it refreshes the cache on success.
+
+    The bus driver forgets the crispiness level while the device is in a
+    low-power state. State.c puts it back before the first get or set after
+    a resume.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "bus.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterBusInterfaceAcquire)
+#pragma alloc_text(PAGE, ToasterBusInterfaceRelease)
+#pragma alloc_text(PAGE, ToasterIoctlGetCrispiness)
+#pragma alloc_text(PAGE, ToasterIoctlSetCrispiness)
+#endif
+
+
+//被ToasterEvtDevicePrepareHardware调用
+VOID
+ToasterBusInterfaceAcquire(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Queries the bus interface into FDO_DATA and keeps the reference until
+    ToasterBusInterfaceRelease. Failure is not fatal: off the toaster bus
+    the interface simply does not exist and crispiness requests fail with
+    STATUS_NOT_SUPPORTED.
+
+--*/
+{
+    NTSTATUS        status;
+    PFDO_DATA       fdoData;
+    PFDO_IO_DATA    ioData;
+    UCHAR           level = 0;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
+
+    status = WdfFdoQueryForInterface(Device,
+                                   &GUID_TOASTER_INTERFACE_STANDARD,
+                                   (PINTERFACE) &fdoData->BusInterface,//输出
+                                   sizeof(TOASTER_INTERFACE_STANDARD), //大小
+                                   1, //Version
+                                   NULL);// InterfaceSpecific Data
+    if (!NT_SUCCESS(status)) {
+        WppPrintDevice(fdoData->WppRecorderLog,
+                      "Bus interface not available 0x%x\n",
+                      status);
+        return;
+    }
+
+    //
+    // Prime the cache. These are the only reads that go to the bus driver.
+    //
+    (*fdoData->BusInterface.GetCrispinessLevel)(fdoData->BusInterface.InterfaceHeader.Context,
+                                                &level);
+    WriteNoFence(&ioData->CrispinessLevel, level);
+
+    WriteNoFence(&ioData->SafetyLockEnabled,
+                 (*fdoData->BusInterface.IsSafetyLockEnabled)(fdoData->BusInterface.InterfaceHeader.Context));
+
+    //
+    // A restart after a stop reuses the run-down reference that the
+    // previous ToasterBusInterfaceRelease completed.
+    //
+    if (ioData->BusInterfaceRunDown) {
+        ExReInitializeRundownProtection(&ioData->BusInterfaceRundown);
+        ioData->BusInterfaceRunDown = FALSE;
+    }
+
+    WriteBooleanRelease(&ioData->BusInterfaceReferenced, TRUE);
+}
+
+//被ToasterEvtDeviceReleaseHardware调用
+VOID
+ToasterBusInterfaceRelease(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Waits for in-flight direct calls to drain and drops the interface
+    reference taken by ToasterBusInterfaceAcquire.
+
+--*/
+{
+    PFDO_DATA       fdoData;
+    PFDO_IO_DATA    ioData;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
+
+    if (!ioData->BusInterfaceReferenced) {
+        return;
+    }
+
+    WriteBooleanRelease(&ioData->BusInterfaceReferenced, FALSE);
+
+    ExWaitForRundownProtectionRelease(&ioData->BusInterfaceRundown);
+    ioData->BusInterfaceRunDown = TRUE;
+
+    //
+    // Provider of this interface may have taken a reference on it.
+    // So we must release the interface once we are done using it.
+    //
+    (*fdoData->BusInterface.InterfaceHeader.InterfaceDereference)
+                        ((PVOID)fdoData->BusInterface.InterfaceHeader.Context);
+}
+
+NTSTATUS
+ToasterGetCrispiness(
+    _In_  WDFDEVICE Device,
+    _Out_ PUCHAR    Level
+    )
+/*++
+
+Routine Description:
+
+    Returns the cached crispiness level. Callable at any IRQL up to
+    DISPATCH_LEVEL. At PASSIVE_LEVEL a level still waiting to be restored
+    after a resume is put back first, through the bus interface and under
+    SavedState.CrispinessLock. Above it the restore is left to the next
+    caller at PASSIVE_LEVEL; the cached level, which is the one the
+    restore puts back, is returned all the same, without a lock.
+
+--*/
+{
+    PFDO_IO_DATA    ioData = ToasterFdoGetIoData(Device);
+
+    if (!ReadBooleanAcquire(&ioData->BusInterfaceReferenced)) {
+        *Level = 0;
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    ToasterStateRestore(Device, ioData, TOASTER_STATE_CRISPINESS);
+
+    *Level = (UCHAR) ReadNoFence(&ioData->CrispinessLevel);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ToasterSetCrispiness(
+    _In_ WDFDEVICE  Device,
+    _In_ UCHAR      Level
+    )
+/*++
+
+Routine Description:
+
+    Sets the crispiness level through the direct-call interface and updates
+    the cached copy. A level still waiting to be restored after a resume is
+    superseded, not restored first. Called at PASSIVE_LEVEL.
+
+--*/
+{
+    NTSTATUS        status;
+    PFDO_IO_DATA    ioData = ToasterFdoGetIoData(Device);
+
+    //
+    // Under CrispinessLock, so that a restore that already started cannot
+    // put the saved level back over this one.
+    //
+    WdfWaitLockAcquire(ioData->SavedState.CrispinessLock, NULL);
+
+    if (ReadNoFence(&ioData->SavedState.RestorePending) & TOASTER_STATE_CRISPINESS) {
+        InterlockedAnd(&ioData->SavedState.RestorePending, ~TOASTER_STATE_CRISPINESS);
+    }
+
+    status = ToasterSetCrispinessLocked(Device, Level);
+
+    WdfWaitLockRelease(ioData->SavedState.CrispinessLock);
+
+    return status;
+}
+
+NTSTATUS
+ToasterSetCrispinessLocked(
+    _In_ WDFDEVICE  Device,
+    _In_ UCHAR      Level
+    )
+/*++
+
+Routine Description:
+
+    Body of ToasterSetCrispiness, also used by the restore after a resume.
+    Called at PASSIVE_LEVEL with SavedState.CrispinessLock held; leaves
+    RestorePending alone.
+
+--*/
+{
+    NTSTATUS        status = STATUS_SUCCESS;
+    PFDO_DATA       fdoData = ToasterFdoGetData(Device);
+    PFDO_IO_DATA    ioData = ToasterFdoGetIoData(Device);
+    LONG            previous;
+
+    if (!ExAcquireRundownProtection(&ioData->BusInterfaceRundown)) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (!ReadBooleanAcquire(&ioData->BusInterfaceReferenced)) {
+        status = STATUS_NOT_SUPPORTED;
+    } else if ((*fdoData->BusInterface.SetCrispinessLevel)(fdoData->BusInterface.InterfaceHeader.Context,
+                                                           Level)) {
+        previous = InterlockedExchangeNoFence(&ioData->CrispinessLevel, Level);
+        ToasterStateSetDirty(ioData, TOASTER_STATE_CRISPINESS);
+
+        if (previous != Level) {
+            ToasterNotify(ioData, ToasterEventCrispiness);
+        }
+    } else {
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    ExReleaseRundownProtection(&ioData->BusInterfaceRundown);
+
+    return status;
+}
+
+NTSTATUS
+ToasterGetSafetyLock(
+    _In_  WDFDEVICE Device,
+    _Out_ PBOOLEAN  Enabled
+    )
+/*++
+
+Routine Description:
+
+    Returns the safety lock state sampled when the interface was acquired.
+
+--*/
+{
+    PFDO_IO_DATA    ioData = ToasterFdoGetIoData(Device);
+
+    if (!ReadBooleanAcquire(&ioData->BusInterfaceReferenced)) {
+        *Enabled = FALSE;
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    *Enabled = (BOOLEAN) ReadNoFence(&ioData->SafetyLockEnabled);
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtIoDeviceControl调用
+NTSTATUS
+ToasterIoctlGetCrispiness(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_TOASTER_GET_CRISPINESS.
+
+--*/
+{
+    NTSTATUS            status;
+    PTOASTER_CRISPINESS crispiness;
+    UCHAR               level;
+    BOOLEAN             safetyLock;
+
+    PAGED_CODE();
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(TOASTER_CRISPINESS),
+                                            (PVOID*) &crispiness,
+                                            NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = ToasterGetCrispiness(Device, &level);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    (VOID) ToasterGetSafetyLock(Device, &safetyLock);
+
+    crispiness->Level = level;
+    crispiness->SafetyLockEnabled = safetyLock;
+
+    *Information = sizeof(TOASTER_CRISPINESS);
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtIoDeviceControl调用
+NTSTATUS
+ToasterIoctlSetCrispiness(
+    _In_ WDFDEVICE      Device,
+    _In_ WDFREQUEST     Request
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_TOASTER_SET_CRISPINESS.
+
+--*/
+{
+    NTSTATUS            status;
+    PTOASTER_CRISPINESS crispiness;
+
+    PAGED_CODE();
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(TOASTER_CRISPINESS),
+                                           (PVOID*) &crispiness,
+                                           NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (crispiness->Level > MAXUCHAR) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return ToasterSetCrispiness(Device, (UCHAR) crispiness->Level);
+}
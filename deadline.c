@@ -0,0 +1,356 @@
+/*++
+
+Module Name:
+
+    Deadline.c
+
+Abstract:
+
+    Timeouts of parked requests for the featured toaster function driver,
+    see IOCTL_TOASTER_SET_FILE_TIMEOUTS.
+
+    Reads that wait for data and IOCTL_TOASTER_WAIT_EVENTS requests sit in
+    manual queues (PendingReadQueue, Notify.WaitQueue); the queues already
+    complete them when they are canceled. A request whose handle has a
+    timeout is stamped with a deadline before it goes into its queue.
+
+    There is one timer per device, not one per request. It is set for the
+    earliest deadline not yet covered, and when it fires it walks the
+    queues, completes every request that is due with STATUS_IO_TIMEOUT and
+    sets itself for the earliest deadline left. A deadline that falls
+    within TOASTER_FILE_TIMEOUT_SLACK of the one the timer is already set
+    for does not move it, so requests that time out close together are
+    completed by the same sweep. Without parked deadlines the timer is not
+    set at all.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "deadline.tmh"
+
+EVT_WDF_TIMER ToasterDeadlineEvtTimer;
+
+static
+LONGLONG
+ToasterDeadlineSweep(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFQUEUE       Queue,
+    _In_ LONGLONG       Now,
+    _In_ BOOLEAN        IsWait
+    );
+
+static
+VOID
+ToasterDeadlineExpire(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request,
+    _In_ BOOLEAN        IsWait
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterDeadlineInitialize)
+#endif
+
+
+//被ToasterEvtDeviceAdd调用
+NTSTATUS
+ToasterDeadlineInitialize(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Creates the sweep timer. Must run after ToasterStatsAllocate, whose
+    counter frequency deadlines are kept in.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_DATA               fdoData;
+    PTOASTER_DEADLINE       deadline;
+    WDF_TIMER_CONFIG        timerConfig;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    deadline = &ToasterFdoGetIoData(Device)->Deadline;
+
+    KeInitializeSpinLock(&deadline->Lock);
+
+    deadline->NextDue = MAXLONGLONG;
+    deadline->TicksPerMs = ToasterFdoGetIoData(Device)->Stats.Frequency / 1000;
+    deadline->SlackTicks = TOASTER_FILE_TIMEOUT_SLACK * deadline->TicksPerMs;
+
+    //
+    // The slack is lateness the caller agreed to; let the system fold the
+    // timer into another one's expiry within it.
+    //
+    WDF_TIMER_CONFIG_INIT(&timerConfig, ToasterDeadlineEvtTimer);
+    timerConfig.AutomaticSerialization = FALSE;
+    timerConfig.TolerableDelay = TOASTER_FILE_TIMEOUT_SLACK;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfTimerCreate(&timerConfig, &attributes, &deadline->Timer);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfTimerCreate failed 0x%x\n",
+                           status);
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtIoRead和ToasterNotifyWait调用
+LONGLONG
+ToasterDeadlineSet(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request,
+    _In_ ULONG          Timeout
+    )
+/*++
+
+Routine Description:
+
+    Stamps a request about to be parked with its deadline, Timeout
+    milliseconds after its arrival.
+
+Arguments:
+
+    Timeout - the handle's timeout for this kind of request, 0 for none.
+
+Return Value:
+
+    The deadline, 0 for none. Pass it to ToasterDeadlineArm once the
+    request is in its queue: by then the request may already be completed,
+    and must not be touched again.
+
+--*/
+{
+    PTOASTER_REQUEST_CONTEXT context = ToasterRequestGetContext(Request);
+
+    if (Timeout == 0) {
+        context->Deadline = 0;
+    } else {
+        context->Deadline = context->StartTicks +
+                            (LONGLONG) Timeout * IoData->Deadline.TicksPerMs;
+    }
+
+    return context->Deadline;
+}
+
+VOID
+ToasterDeadlineArm(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ LONGLONG       Deadline
+    )
+/*++
+
+Routine Description:
+
+    Makes sure the timer fires no later than TOASTER_FILE_TIMEOUT_SLACK
+    after Deadline. Callable at DISPATCH_LEVEL and below.
+
+    The request must be in its queue before this is called. A sweep clears
+    NextDue before it walks the queues, so either it sees the request or
+    this call sees the timer unset.
+
+--*/
+{
+    PTOASTER_DEADLINE   deadline = &IoData->Deadline;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    LONGLONG            delta;
+    LONGLONG            ms;
+
+    if (Deadline == 0) {
+        return;
+    }
+
+    KeAcquireInStackQueuedSpinLock(&deadline->Lock, &lockHandle);
+
+    if (deadline->NextDue > Deadline + deadline->SlackTicks) {
+
+        deadline->NextDue = Deadline;
+
+        delta = Deadline - ToasterStatsStart();
+        ms = (delta > 0) ? (delta + deadline->TicksPerMs - 1) / deadline->TicksPerMs : 0;
+
+        //
+        // Starting a timer that is already set moves it.
+        //
+        (VOID) WdfTimerStart(deadline->Timer, WDF_REL_TIMEOUT_IN_MS(max(ms, 1)));
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+}
+
+//通过WdfTimerCreate设置的回调
+VOID
+ToasterDeadlineEvtTimer(
+    _In_ WDFTIMER Timer
+    )
+/*++
+
+Routine Description:
+
+    Times out every parked request that is due and sets the timer for the
+    earliest deadline left.
+
+--*/
+{
+    PFDO_IO_DATA        ioData;
+    PTOASTER_DEADLINE   deadline;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    LONGLONG            now;
+    LONGLONG            next;
+    ULONG               priority;
+
+    ioData = ToasterFdoGetIoData(WdfTimerGetParentObject(Timer));
+    deadline = &ioData->Deadline;
+
+    KeAcquireInStackQueuedSpinLock(&deadline->Lock, &lockHandle);
+    deadline->NextDue = MAXLONGLONG;
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    now = ToasterStatsStart();
+
+    next = ToasterDeadlineSweep(ioData, ioData->Notify.WaitQueue, now, TRUE);
+
+    for (priority = 0; priority < ToasterPriorityMaximum; priority++) {
+        next = min(next,
+                   ToasterDeadlineSweep(ioData, ioData->PendingReadQueue[priority], now, FALSE));
+    }
+
+    if (next != MAXLONGLONG) {
+        ToasterDeadlineArm(ioData, next);
+    }
+}
+
+LONGLONG
+ToasterDeadlineSweep(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFQUEUE       Queue,
+    _In_ LONGLONG       Now,
+    _In_ BOOLEAN        IsWait
+    )
+/*++
+
+Routine Description:
+
+    Times out the requests of one queue that are due at Now. The walk works
+    like the one of ToasterNotifyEvtDpc.
+
+Return Value:
+
+    The earliest deadline of the requests left in the queue, MAXLONGLONG
+    if none has one.
+
+--*/
+{
+    NTSTATUS    status;
+    WDFREQUEST  previous = NULL;
+    WDFREQUEST  found;
+    WDFREQUEST  request;
+    LONGLONG    due;
+    LONGLONG    next = MAXLONGLONG;
+
+    for (;;) {
+
+        status = WdfIoQueueFindRequest(Queue, previous, NULL, NULL, &found);
+
+        if (status == STATUS_NOT_FOUND && previous != NULL) {
+            //
+            // The request the walk was positioned on left the queue; start
+            // over.
+            //
+            WdfObjectDereference(previous);
+            previous = NULL;
+            continue;
+        }
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        due = ToasterRequestGetContext(found)->Deadline;
+
+        if (due == 0 || due > Now) {
+            if (due != 0) {
+                next = min(next, due);
+            }
+            if (previous != NULL) {
+                WdfObjectDereference(previous);
+            }
+            previous = found;
+            continue;
+        }
+
+        status = WdfIoQueueRetrieveFoundRequest(Queue, found, &request);
+        WdfObjectDereference(found);
+
+        if (NT_SUCCESS(status)) {
+            ToasterDeadlineExpire(IoData, request, IsWait);
+        }
+    }
+
+    if (previous != NULL) {
+        WdfObjectDereference(previous);
+    }
+
+    return next;
+}
+
+VOID
+ToasterDeadlineExpire(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request,
+    _In_ BOOLEAN        IsWait
+    )
+/*++
+
+Routine Description:
+
+    Completes a parked request that timed out, undoing what parking it did
+    the same way its queue's EvtIoCanceledOnQueue does.
+
+--*/
+{
+    PTOASTER_FILE_CONTEXT   file = ToasterRequestGetFile(Request);
+    TOASTER_STAT_CLASS      statClass;
+
+    if (IsWait) {
+        InterlockedDecrement(&IoData->Notify.Waiters);
+        statClass = ToasterStatIoctl;
+    } else {
+        ToasterFileUnparkRead(file);
+        statClass = ToasterStatRead;
+    }
+
+    if (file != NULL) {
+        InterlockedIncrement(&file->Expired);
+    }
+
+    ToasterStatsRecord(IoData,
+                       statClass,
+                       STATUS_IO_TIMEOUT,
+                       0,
+                       ToasterRequestGetContext(Request)->StartTicks);
+
+    ToasterTlRequestStop(Request, STATUS_IO_TIMEOUT, 0);
+
+    WdfRequestComplete(Request, STATUS_IO_TIMEOUT);
+}
@@ -0,0 +1,533 @@
+/*++
+
+Module Name:
+
+    Dma.c
+
+Abstract:
+
+    Scatter/gather DMA for the hardware-backed toaster.
+
+    A small read or write is cheapest copied by the processor between the
+    caller's buffer and the data ring. From DmaThreshold bytes up the
+    device does the copy instead: the caller's buffer is described to it by
+    a scatter/gather list and the request is handed over without the
+    processor touching the data. For that the data ring is in a common
+    buffer rather than in pool.
+
+    Transfers take their WDFDMATRANSACTION from a pool created with the
+    enabler, so starting one allocates nothing. A transfer owns a span of
+    the data ring (ToasterRingReserve, ToasterRingClaim) until the device
+    has finished with it; it is finished with the copied requests, from
+    the DPC of Interrupt.c, and in the same batches.
+
+    Reads of a handle with a shared cursor are always copied, since they
+    do not consume what they read, and so are reads taken from a
+    PendingReadQueue: that queue is not power-managed, and a transfer from
+    it could still be on the device when the interrupt is disabled.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "dma.tmh"
+
+EVT_WDF_PROGRAM_DMA     ToasterEvtProgramDma;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterDmaPrepare)
+#pragma alloc_text(PAGE, ToasterDmaRelease)
+#endif
+
+
+//被ToasterEvtDevicePrepareHardware调用
+NTSTATUS
+ToasterDmaPrepare(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Creates the DMA enabler of a toaster with a register BAR, the common
+    buffers for the command ring, the element tables and the data ring,
+    and the transaction pool. Called after ToasterHwPrepare. Whatever was
+    created is deleted by ToasterDmaRelease, also when this fails.
+
+Return Value:
+
+    STATUS_SUCCESS, also when the device has no register BAR.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_DATA               fdoData;
+    PFDO_IO_DATA            ioData;
+    PTOASTER_DMA            dma;
+    PTOASTER_HW             hw;
+    PTOASTER_DMA_SLOT       slot;
+    WDF_DMA_ENABLER_CONFIG  dmaConfig;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    WDFDMATRANSACTION       transaction;
+    PTOASTER_HW_ELEMENT     elements;
+    PHYSICAL_ADDRESS        elementsLogical;
+    ULONG                   i;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
+    dma = &ioData->Dma;
+    hw = &ioData->Hw;
+
+    KeInitializeSpinLock(&dma->Lock);
+    InitializeListHead(&dma->Free);
+
+    if (hw->Registers == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Reads and writes run at the same time, and no transfer is longer
+    // than one stage.
+    //
+    WDF_DMA_ENABLER_CONFIG_INIT(&dmaConfig,
+                                WdfDmaProfileScatterGather64Duplex,
+                                TOASTER_DMA_MAX_LENGTH);
+
+    status = WdfDmaEnablerCreate(Device,
+                                 &dmaConfig,
+                                 WDF_NO_OBJECT_ATTRIBUTES,
+                                 &dma->Enabler);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfDmaEnablerCreate failed 0x%x\n",
+                           status);
+        dma->Enabler = NULL;
+        return status;
+    }
+
+    WdfDmaEnablerSetMaximumScatterGatherElements(dma->Enabler,
+                                                 TOASTER_DMA_MAX_ELEMENTS);
+
+    status = WdfCommonBufferCreate(dma->Enabler,
+                                   TOASTER_HW_QUEUE_DEPTH * sizeof(TOASTER_HW_COMMAND),
+                                   WDF_NO_OBJECT_ATTRIBUTES,
+                                   &dma->CommandBuffer);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfCommonBufferCreate for the command ring failed 0x%x\n",
+                           status);
+        dma->CommandBuffer = NULL;
+        return status;
+    }
+
+    hw->Commands = WdfCommonBufferGetAlignedVirtualAddress(dma->CommandBuffer);
+    hw->CommandsLogical = WdfCommonBufferGetAlignedLogicalAddress(dma->CommandBuffer);
+
+    RtlZeroMemory(hw->Commands, TOASTER_HW_QUEUE_DEPTH * sizeof(TOASTER_HW_COMMAND));
+
+    status = WdfCommonBufferCreate(dma->Enabler,
+                                   TOASTER_DMA_POOL_SIZE * TOASTER_DMA_MAX_ELEMENTS * sizeof(TOASTER_HW_ELEMENT),
+                                   WDF_NO_OBJECT_ATTRIBUTES,
+                                   &dma->ElementBuffer);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfCommonBufferCreate for the element tables failed 0x%x\n",
+                           status);
+        dma->ElementBuffer = NULL;
+        return status;
+    }
+
+    elements = WdfCommonBufferGetAlignedVirtualAddress(dma->ElementBuffer);
+    elementsLogical = WdfCommonBufferGetAlignedLogicalAddress(dma->ElementBuffer);
+
+    //
+    // The framework allocates common buffers wherever the adapter wants
+    // them; unlike the pool allocation it replaces, the data ring is not
+    // necessarily on the device's node.
+    //
+    status = WdfCommonBufferCreate(dma->Enabler,
+                                   TOASTER_RING_DEFAULT_SIZE,
+                                   WDF_NO_OBJECT_ATTRIBUTES,
+                                   &dma->RingBuffer);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfCommonBufferCreate for the data ring failed 0x%x\n",
+                           status);
+        dma->RingBuffer = NULL;
+        return status;
+    }
+
+    dma->RingLogical = WdfCommonBufferGetAlignedLogicalAddress(dma->RingBuffer);
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, TOASTER_DMA_SLOT);
+
+    for (i = 0; i < TOASTER_DMA_POOL_SIZE; i++) {
+
+        status = WdfDmaTransactionCreate(dma->Enabler, &attributes, &transaction);
+        if (!NT_SUCCESS(status)) {
+            WppPrintDeviceError(fdoData->WppRecorderLog,
+                               "WdfDmaTransactionCreate failed 0x%x\n",
+                               status);
+            return status;
+        }
+
+        slot = ToasterDmaGetSlot(transaction);
+        slot->Transaction = transaction;
+        slot->Elements = elements + i * TOASTER_DMA_MAX_ELEMENTS;
+        slot->ElementsLogical.QuadPart = elementsLogical.QuadPart +
+            i * TOASTER_DMA_MAX_ELEMENTS * sizeof(TOASTER_HW_ELEMENT);
+
+        InsertTailList(&dma->Free, &slot->Link);
+    }
+
+    WppPrintDevice(fdoData->WppRecorderLog,
+                  "DMA: %d transactions, data ring at 0x%I64x, threshold %d\n",
+                  TOASTER_DMA_POOL_SIZE,
+                  dma->RingLogical.QuadPart,
+                  ToasterParameters.DmaThreshold);
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtDeviceReleaseHardware调用
+VOID
+ToasterDmaRelease(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Deletes the enabler, and with it the common buffers and the
+    transactions. The interrupt is disabled and Pending is empty by now,
+    so no transfer is left.
+
+--*/
+{
+    PFDO_IO_DATA    ioData;
+    PTOASTER_DMA    dma;
+
+    PAGED_CODE();
+
+    ioData = ToasterFdoGetIoData(Device);
+    dma = &ioData->Dma;
+
+    ioData->Hw.Commands = NULL;
+    ioData->Hw.CommandsLogical.QuadPart = 0;
+
+    if (dma->Enabler != NULL) {
+        WdfObjectDelete(dma->Enabler);
+    }
+
+    dma->Enabler = NULL;
+    dma->RingBuffer = NULL;
+    dma->RingLogical.QuadPart = 0;
+    dma->CommandBuffer = NULL;
+    dma->ElementBuffer = NULL;
+
+    InitializeListHead(&dma->Free);
+}
+
+//被ToasterEvtInterruptEnable调用
+VOID
+ToasterDmaProgramDevice(
+    _In_ PFDO_IO_DATA IoData
+    )
+/*++
+
+Routine Description:
+
+    Tells the device where the command ring and the data ring are. Runs at
+    DIRQL; a device loses them in Dx.
+
+--*/
+{
+    PTOASTER_REGISTERS  registers = IoData->Hw.Registers;
+    PTOASTER_DMA        dma = &IoData->Dma;
+
+    if (dma->Enabler == NULL) {
+        return;
+    }
+
+    WRITE_REGISTER_ULONG(&registers->CommandBaseLow, IoData->Hw.CommandsLogical.LowPart);
+    WRITE_REGISTER_ULONG(&registers->CommandBaseHigh, (ULONG) IoData->Hw.CommandsLogical.HighPart);
+    WRITE_REGISTER_ULONG(&registers->CommandDepth, TOASTER_HW_QUEUE_DEPTH);
+
+    WRITE_REGISTER_ULONG(&registers->RingBaseLow, dma->RingLogical.LowPart);
+    WRITE_REGISTER_ULONG(&registers->RingBaseHigh, (ULONG) dma->RingLogical.HighPart);
+    WRITE_REGISTER_ULONG(&registers->RingSize, (ULONG) IoData->DataRing.Size);
+}
+
+//被ToasterEvtIoWrite和ToasterCompleteRead调用
+BOOLEAN
+ToasterDmaStart(
+    _In_  PFDO_IO_DATA  IoData,
+    _In_  WDFREQUEST    Request,
+    _In_  BOOLEAN       IsWrite,
+    _In_  SIZE_T        Length,
+    _In_  LONGLONG      StartTicks,
+    _Out_ PSIZE_T       Bytes
+    )
+/*++
+
+Routine Description:
+
+    Has the device move up to Length bytes of a read or write, if it is
+    large enough and the device can take it. The request completes with
+    the number of bytes in its span of the ring, no more than
+    TOASTER_DMA_MAX_LENGTH, like a partial read or write of a pipe.
+
+Arguments:
+
+    Bytes - receives the number of bytes the transfer moves.
+
+Return Value:
+
+    TRUE if the request is the device's now. FALSE if it is still the
+    caller's, to copy: below the threshold, with the interrupt disabled,
+    with every transaction in use, or with a full ring for a write or an
+    empty one for a read.
+
+--*/
+{
+    NTSTATUS                    status;
+    PTOASTER_DMA                dma = &IoData->Dma;
+    PTOASTER_DMA_SLOT           slot;
+    PTOASTER_REQUEST_CONTEXT    context;
+    KLOCK_QUEUE_HANDLE          lockHandle;
+    PMDL                        mdl;
+    SIZE_T                      length;
+
+    *Bytes = 0;
+
+    if (ToasterParameters.DmaThreshold == 0 ||
+        Length < ToasterParameters.DmaThreshold ||
+        !IoData->Hw.Connected) {
+        return FALSE;
+    }
+
+    KeAcquireInStackQueuedSpinLock(&dma->Lock, &lockHandle);
+
+    slot = NULL;
+    if (!IsListEmpty(&dma->Free)) {
+        slot = CONTAINING_RECORD(RemoveHeadList(&dma->Free), TOASTER_DMA_SLOT, Link);
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    if (slot == NULL) {
+        return FALSE;
+    }
+
+    Length = min(Length, TOASTER_DMA_MAX_LENGTH);
+
+    if (IsWrite) {
+        length = ToasterRingReserve(&IoData->DataRing, Length, &slot->Span);
+        status = WdfRequestRetrieveInputWdmMdl(Request, &mdl);
+    } else {
+        length = ToasterRingClaim(&IoData->DataRing, Length, &slot->Span);
+        status = WdfRequestRetrieveOutputWdmMdl(Request, &mdl);
+    }
+
+    if (length == 0) {
+        goto Free;
+    }
+
+    if (NT_SUCCESS(status)) {
+        status = WdfDmaTransactionInitialize(slot->Transaction,
+                                             ToasterEvtProgramDma,
+                                             IsWrite ? WdfDmaDirectionWriteToDevice :
+                                                       WdfDmaDirectionReadFromDevice,
+                                             mdl,
+                                             MmGetMdlVirtualAddress(mdl),
+                                             length);
+    }
+
+    if (!NT_SUCCESS(status)) {
+        ToasterRingCancel(&IoData->DataRing, &slot->Span, IsWrite);
+        goto Free;
+    }
+
+    //
+    // The command ring entry is set aside now, while the transfer can
+    // still be unwound here, so that EvtProgramDma cannot fail.
+    //
+    if (!ToasterHwReserve(IoData)) {
+        WdfDmaTransactionRelease(slot->Transaction);
+        ToasterRingCancel(&IoData->DataRing, &slot->Span, IsWrite);
+        goto Free;
+    }
+
+    slot->Request = Request;
+    slot->IsWrite = IsWrite;
+    slot->Submitted = FALSE;
+
+    context = ToasterRequestGetContext(Request);
+    context->StartTicks = StartTicks;
+    context->HwClass = IsWrite ? ToasterStatWrite : ToasterStatRead;
+    context->HwSlot = slot;
+
+    status = WdfDmaTransactionExecute(slot->Transaction, slot);
+
+    if (!NT_SUCCESS(status) && !slot->Submitted) {
+        //
+        // EvtProgramDma never ran, so the transfer is still ours alone.
+        //
+        context->HwSlot = NULL;
+        slot->Request = NULL;
+        ToasterHwUnreserve(IoData);
+        WdfDmaTransactionRelease(slot->Transaction);
+        ToasterRingCancel(&IoData->DataRing, &slot->Span, IsWrite);
+        goto Free;
+    }
+
+    //
+    // Once EvtProgramDma has submitted the transfer the request is the
+    // device's, even if Execute reports a failure after that;
+    // ToasterDmaComplete finishes it either way.
+    //
+    *Bytes = length;
+
+    return TRUE;
+
+Free:
+
+    KeAcquireInStackQueuedSpinLock(&dma->Lock, &lockHandle);
+    InsertHeadList(&dma->Free, &slot->Link);
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return FALSE;
+}
+
+//通过WdfDmaTransactionInitialize设置的回调
+BOOLEAN
+ToasterEvtProgramDma(
+    _In_ WDFDMATRANSACTION      Transaction,
+    _In_ WDFDEVICE              Device,
+    _In_ WDFCONTEXT             Context,
+    _In_ WDF_DMA_DIRECTION      Direction,
+    _In_ PSCATTER_GATHER_LIST   SgList
+    )
+/*++
+
+Routine Description:
+
+    Copies the scatter/gather list into the slot's element table and
+    submits the transfer in the command ring entry ToasterDmaStart
+    reserved. It cannot fail, so the slot and the request are released in
+    one place only: ToasterDmaStart before the transfer is submitted,
+    ToasterDmaComplete after.
+
+--*/
+{
+    PFDO_IO_DATA        ioData;
+    PTOASTER_DMA_SLOT   slot = (PTOASTER_DMA_SLOT) Context;
+    TOASTER_HW_COMMAND  command;
+    ULONG               i;
+
+    UNREFERENCED_PARAMETER(Transaction);
+    UNREFERENCED_PARAMETER(Direction);
+
+    ioData = ToasterFdoGetIoData(Device);
+
+    NT_ASSERT(SgList->NumberOfElements <= TOASTER_DMA_MAX_ELEMENTS);
+
+    for (i = 0; i < SgList->NumberOfElements; i++) {
+        slot->Elements[i].Address = (ULONG64) SgList->Elements[i].Address.QuadPart;
+        slot->Elements[i].Length = SgList->Elements[i].Length;
+        slot->Elements[i].Reserved = 0;
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.Opcode = slot->IsWrite ? TOASTER_HW_OP_WRITE : TOASTER_HW_OP_READ;
+    command.ElementCount = SgList->NumberOfElements;
+    command.Length = (ULONG) slot->Span.Length;
+    command.RingOffset = (ULONG) ((SIZE_T) slot->Span.Start & ioData->DataRing.Mask);
+    command.Elements = (ULONG64) slot->ElementsLogical.QuadPart;
+
+    //
+    // Before the submit: the device may complete the transfer, and the
+    // slot go to another one, before ToasterHwSubmit returns.
+    //
+    slot->Submitted = TRUE;
+
+    ToasterHwSubmit(ioData, slot->Request, &command);
+
+    return TRUE;
+}
+
+//被ToasterHwCompleteList调用
+VOID
+ToasterDmaComplete(
+    _In_ PFDO_IO_DATA       IoData,
+    _In_ PTOASTER_DMA_SLOT  Slot,
+    _In_ BOOLEAN            Done
+    )
+/*++
+
+Routine Description:
+
+    Finishes a transfer and completes its request. Done is TRUE when the
+    device has moved the data: the span is committed. Otherwise the span
+    is cancelled, see ToasterRingCancel, and the request completes with
+    STATUS_CANCELLED.
+
+--*/
+{
+    PTOASTER_DMA        dma = &IoData->Dma;
+    WDFREQUEST          request = Slot->Request;
+    BOOLEAN             isWrite = Slot->IsWrite;
+    NTSTATUS            status;
+    NTSTATUS            transferStatus;
+    SIZE_T              length;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    length = Done ? Slot->Span.Length : 0;
+    status = Done ? STATUS_SUCCESS : STATUS_CANCELLED;
+
+    //
+    // Single stage, so this is always the end of the transaction.
+    //
+    (VOID) WdfDmaTransactionDmaCompletedFinal(Slot->Transaction, length, &transferStatus);
+
+    if (Done) {
+        ToasterRingCommit(&IoData->DataRing, &Slot->Span, isWrite);
+        ToasterStateSetDirty(IoData, TOASTER_STATE_RING);
+    } else {
+        ToasterRingCancel(&IoData->DataRing, &Slot->Span, isWrite);
+    }
+
+    WdfDmaTransactionRelease(Slot->Transaction);
+
+    ToasterRequestGetContext(request)->HwSlot = NULL;
+    Slot->Request = NULL;
+
+    KeAcquireInStackQueuedSpinLock(&dma->Lock, &lockHandle);
+    InsertHeadList(&dma->Free, &Slot->Link);
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    ToasterStatsRecord(IoData,
+                       isWrite ? ToasterStatWrite : ToasterStatRead,
+                       status,
+                       length,
+                       ToasterRequestGetContext(request)->StartTicks);
+
+    ToasterTlRequestStop(request, status, length);
+
+    WdfRequestCompleteWithInformation(request, status, length);
+
+    if (Done && isWrite) {
+        ToasterServicePendingReads(IoData);
+    }
+}
@@ -0,0 +1,489 @@
+/*++
+
+Module Name:
+
+    File.c
+
+Abstract:
+
+    Per-handle state for the featured toaster function driver.
+
+    Every WDFFILEOBJECT carries a TOASTER_FILE_CONTEXT with the policy the
+    handle asked for through IOCTL_TOASTER_SET_FILE_POLICY:
+
+    - a priority class, which decides which PendingReadQueue its waiting
+      reads go to, and so the order in which they are served;
+
+    - quotas: how many reads it may have waiting and how much one read may
+      take out of the ring at a time;
+
+    - timeouts for its reads that wait for data and its event waits, see
+      IOCTL_TOASTER_SET_FILE_TIMEOUTS and Deadline.c;
+
+    - optionally record boundaries: a read then returns no more than one
+      write's data, the way a message-mode pipe does, instead of
+      whatever the ring holds;
+
+    - optionally a shared cursor. A handle with one reads the data ring
+      through a position of its own instead of consuming it, so any number
+      of such handles read the same written data straight out of the ring,
+      with no copy per handle. The ring's Tail follows the slowest cursor.
+
+    Handles that never send the IOCTL behave the way every handle did
+    before: they consume from the ring in arrival order.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "file.tmh"
+
+static
+VOID
+ToasterFileReleaseSlowest(
+    _In_ PFDO_IO_DATA IoData
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterFileInitialize)
+#endif
+
+
+//被ToasterEvtDeviceFileCreate调用
+VOID
+ToasterFileInitialize(
+    _In_ WDFFILEOBJECT FileObject
+    )
+{
+    PTOASTER_FILE_CONTEXT   file;
+
+    PAGED_CODE();
+
+    file = ToasterFileGetContext(FileObject);
+
+    //
+    // The framework zeroes the context; only the non-zero defaults remain.
+    //
+    file->Priority = ToasterPriorityNormal;
+    file->MaxPendingReads = TOASTER_FILE_DEFAULT_PENDING_READS;
+
+    InitializeListHead(&file->CursorLink);
+}
+
+//被ToasterEvtFileClose调用
+VOID
+ToasterFileClose(
+    _In_ WDFFILEOBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    Takes the handle's cursor off the list. Done at close rather than at
+    cleanup because no request of the handle can still be running by then.
+
+--*/
+{
+    PFDO_IO_DATA            ioData;
+    PTOASTER_FILE_CONTEXT   file;
+    KLOCK_QUEUE_HANDLE      lockHandle;
+
+    ioData = ToasterFdoGetIoData(WdfFileObjectGetDevice(FileObject));
+    file = ToasterFileGetContext(FileObject);
+
+    KeAcquireInStackQueuedSpinLock(&ioData->CursorLock, &lockHandle);
+
+    if (file->Flags & TOASTER_FILE_SHARED_CURSOR) {
+        RemoveEntryList(&file->CursorLink);
+        InitializeListHead(&file->CursorLink);
+        file->Flags &= ~TOASTER_FILE_SHARED_CURSOR;
+
+        //
+        // It may have been the one holding the ring back.
+        //
+        ToasterFileReleaseSlowest(ioData);
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+}
+
+PTOASTER_FILE_CONTEXT
+ToasterRequestGetFile(
+    _In_ WDFREQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    Returns the context of the handle a request was sent on, or NULL for a
+    request that did not come through a handle of this device.
+
+--*/
+{
+    WDFFILEOBJECT   fileObject = WdfRequestGetFileObject(Request);
+
+    return (fileObject != NULL) ? ToasterFileGetContext(fileObject) : NULL;
+}
+
+VOID
+ToasterFileReleaseSlowest(
+    _In_ PFDO_IO_DATA IoData
+    )
+/*++
+
+Routine Description:
+
+    Gives everything all shared cursors have read back to the producer.
+    Called with CursorLock held. O(cursors); there are never many.
+
+--*/
+{
+    PLIST_ENTRY             entry;
+    PTOASTER_FILE_CONTEXT   file;
+    ULONG64                 slowest = MAXULONG64;
+
+    if (IsListEmpty(&IoData->Cursors)) {
+        return;
+    }
+
+    for (entry = IoData->Cursors.Flink; entry != &IoData->Cursors; entry = entry->Flink) {
+        file = CONTAINING_RECORD(entry, TOASTER_FILE_CONTEXT, CursorLink);
+        slowest = min(slowest, file->Cursor);
+    }
+
+    ToasterRingConsumeTo(&IoData->DataRing, slowest);
+}
+
+SIZE_T
+ToasterFileRead(
+    _In_     PFDO_IO_DATA           IoData,
+    _In_opt_ PTOASTER_FILE_CONTEXT  File,
+    _Out_writes_bytes_to_(Length, return) PVOID Buffer,
+    _In_     SIZE_T                 Length
+    )
+/*++
+
+Routine Description:
+
+    Reads up to Length bytes for a handle: through its cursor if it has
+    one, otherwise by consuming them. A handle with TOASTER_FILE_RECORDS
+    gets no more than the rest of one write.
+
+Return Value:
+
+    Number of bytes copied into Buffer.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    SIZE_T              bytes = 0;
+    ULONG64             skipped = 0;
+    ULONG               maxLength;
+    ULONG               flags;
+    BOOLEAN             shared = FALSE;
+
+    if (File == NULL) {
+        return ToasterRingRead(&IoData->DataRing, Buffer, Length, FALSE);
+    }
+
+    maxLength = ReadULongNoFence(&File->MaxReadLength);
+    if (maxLength != 0 && Length > maxLength) {
+        Length = maxLength;
+    }
+
+    flags = ReadULongNoFence(&File->Flags);
+
+    if (flags & TOASTER_FILE_SHARED_CURSOR) {
+
+        KeAcquireInStackQueuedSpinLock(&IoData->CursorLock, &lockHandle);
+
+        //
+        // The flag can have been cleared since; only the locked check
+        // counts.
+        //
+        if (File->Flags & TOASTER_FILE_SHARED_CURSOR) {
+
+            shared = TRUE;
+
+            bytes = ToasterRingReadAt(&IoData->DataRing,
+                                      &File->Cursor,
+                                      Buffer,
+                                      Length,
+                                      (BOOLEAN) ((flags & TOASTER_FILE_RECORDS) != 0),
+                                      &skipped);
+            if (bytes != 0 || skipped != 0) {
+                ToasterFileReleaseSlowest(IoData);
+            }
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+    }
+
+    if (!shared) {
+        bytes = ToasterRingRead(&IoData->DataRing,
+                                Buffer,
+                                Length,
+                                (BOOLEAN) ((flags & TOASTER_FILE_RECORDS) != 0));
+    }
+
+    if (skipped != 0) {
+        InterlockedAdd64(&File->BytesLost, (LONG64) skipped);
+    }
+
+    InterlockedAdd64(&File->BytesRead, (LONG64) bytes);
+
+    return bytes;
+}
+
+SIZE_T
+ToasterFileGetReadable(
+    _In_     PFDO_IO_DATA           IoData,
+    _In_opt_ PTOASTER_FILE_CONTEXT  File
+    )
+/*++
+
+Routine Description:
+
+    Returns a snapshot of the number of bytes a read on the handle would
+    find, in the same spirit as ToasterRingGetReadable.
+
+--*/
+{
+    ULONG64 head;
+    ULONG64 cursor;
+    SIZE_T  readable;
+
+    readable = ToasterRingGetReadable(&IoData->DataRing);
+
+    if (File == NULL || !(ReadULongNoFence(&File->Flags) & TOASTER_FILE_SHARED_CURSOR)) {
+        return readable;
+    }
+
+    head = ToasterRingGetHead(&IoData->DataRing);
+    cursor = ReadULong64NoFence(&File->Cursor);
+
+    return (SIZE_T) min((ULONG64) readable, head - min(head, cursor));
+}
+
+BOOLEAN
+ToasterFileParkRead(
+    _In_opt_ PTOASTER_FILE_CONTEXT  File
+    )
+/*++
+
+Routine Description:
+
+    Counts a read of the handle about to go into a PendingReadQueue.
+
+Return Value:
+
+    FALSE if the handle already has MaxPendingReads waiting; the read
+    must then not be parked.
+
+--*/
+{
+    if (File == NULL) {
+        return TRUE;
+    }
+
+    if ((ULONG) InterlockedIncrement(&File->PendingReads) > ReadULongNoFence(&File->MaxPendingReads)) {
+        InterlockedDecrement(&File->PendingReads);
+        InterlockedIncrement64(&File->QuotaRejects);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+VOID
+ToasterFileUnparkRead(
+    _In_opt_ PTOASTER_FILE_CONTEXT  File
+    )
+{
+    if (File != NULL) {
+        InterlockedDecrement(&File->PendingReads);
+    }
+}
+
+//被ToasterEvtIoInCallerContext调用
+NTSTATUS
+ToasterFileSetPolicy(
+    _In_ WDFDEVICE      Device,
+    _In_ WDFREQUEST     Request
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_TOASTER_SET_FILE_POLICY. A handle that turns on the
+    shared cursor starts reading at the current end of the data; one that
+    turns it off goes back to consuming.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_IO_DATA            ioData;
+    PTOASTER_FILE_CONTEXT   file;
+    PTOASTER_FILE_POLICY    policy;
+    KLOCK_QUEUE_HANDLE      lockHandle;
+    ULONG                   flags;
+
+    ioData = ToasterFdoGetIoData(Device);
+
+    file = ToasterRequestGetFile(Request);
+    if (file == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(TOASTER_FILE_POLICY),
+                                           (PVOID*) &policy,
+                                           NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (policy->Priority >= ToasterPriorityMaximum ||
+        (policy->Flags & ~TOASTER_FILE_VALID_FLAGS) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    flags = policy->Flags;
+
+    WriteULongNoFence(&file->Priority, policy->Priority);
+    WriteULongNoFence(&file->MaxReadLength, policy->MaxReadLength);
+    WriteULongNoFence(&file->MaxPendingReads,
+                      (policy->MaxPendingReads != 0) ? policy->MaxPendingReads :
+                                                       TOASTER_FILE_DEFAULT_PENDING_READS);
+
+    KeAcquireInStackQueuedSpinLock(&ioData->CursorLock, &lockHandle);
+
+    if ((flags & TOASTER_FILE_SHARED_CURSOR) &&
+        !(file->Flags & TOASTER_FILE_SHARED_CURSOR)) {
+
+        file->Cursor = ToasterRingGetHead(&ioData->DataRing);
+        InsertTailList(&ioData->Cursors, &file->CursorLink);
+
+    } else if (!(flags & TOASTER_FILE_SHARED_CURSOR) &&
+               (file->Flags & TOASTER_FILE_SHARED_CURSOR)) {
+
+        RemoveEntryList(&file->CursorLink);
+        InitializeListHead(&file->CursorLink);
+        ToasterFileReleaseSlowest(ioData);
+    }
+
+    WriteULongNoFence(&file->Flags, flags);
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtIoInCallerContext调用
+NTSTATUS
+ToasterFileSetTimeouts(
+    _In_ WDFDEVICE      Device,
+    _In_ WDFREQUEST     Request
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_TOASTER_SET_FILE_TIMEOUTS. Requests of the handle that
+    are already parked keep the deadline they were parked with.
+
+--*/
+{
+    NTSTATUS                status;
+    PTOASTER_FILE_CONTEXT   file;
+    PTOASTER_FILE_TIMEOUTS  timeouts;
+
+    UNREFERENCED_PARAMETER(Device);
+
+    file = ToasterRequestGetFile(Request);
+    if (file == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(TOASTER_FILE_TIMEOUTS),
+                                           (PVOID*) &timeouts,
+                                           NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    WriteULongNoFence(&file->ReadTimeout, timeouts->ReadTimeout);
+    WriteULongNoFence(&file->WaitTimeout, timeouts->WaitTimeout);
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtIoInCallerContext调用
+NTSTATUS
+ToasterFileGetInfo(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_TOASTER_GET_FILE_INFO.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_IO_DATA            ioData;
+    PTOASTER_FILE_CONTEXT   file;
+    PTOASTER_FILE_INFO      info;
+
+    *Information = 0;
+
+    ioData = ToasterFdoGetIoData(Device);
+
+    file = ToasterRequestGetFile(Request);
+    if (file == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(TOASTER_FILE_INFO),
+                                            (PVOID*) &info,
+                                            NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    RtlZeroMemory(info, sizeof(TOASTER_FILE_INFO));
+
+    info->Policy.Priority = ReadULongNoFence(&file->Priority);
+    info->Policy.Flags = ReadULongNoFence(&file->Flags);
+    info->Policy.MaxPendingReads = ReadULongNoFence(&file->MaxPendingReads);
+    info->Policy.MaxReadLength = ReadULongNoFence(&file->MaxReadLength);
+
+    info->PendingReads = (ULONG) ReadNoFence(&file->PendingReads);
+    info->Expired = (ULONG) ReadNoFence(&file->Expired);
+    info->Reads = (ULONG64) ReadNoFence64(&file->Reads);
+    info->BytesRead = (ULONG64) ReadNoFence64(&file->BytesRead);
+    info->BytesLost = (ULONG64) ReadNoFence64(&file->BytesLost);
+    info->QuotaRejects = (ULONG64) ReadNoFence64(&file->QuotaRejects);
+
+    if (info->Policy.Flags & TOASTER_FILE_SHARED_CURSOR) {
+        info->Lag = ToasterFileGetReadable(ioData, file);
+    }
+
+    *Information = sizeof(TOASTER_FILE_INFO);
+
+    return STATUS_SUCCESS;
+}
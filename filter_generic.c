@@ -7,10 +7,21 @@ Abstract:
 
     This module shows how to a write a generic filter driver. The driver demonstrates how 
     to support device I/O control requests through queues. All the I/O requests passed on to 
-    the lower driver. This filter driver shows how to handle IRP postprocessing by forwarding 
+    the lower driver; IOCTLs the filter does not inspect bypass the queue, see
+    FilterEvtDeviceWdmIrpPreprocess. This filter driver shows how to handle IRP postprocessing by forwarding 
     the requests with and without a completion routine. To forward with a completion routine
     set the define FORWARD_REQUEST_WITH_COMPLETION to 1. 
 
+    Independently of that define, the filter can time IOCTLs from the
+    forward to the lower driver's completion and keep per-code latency
+    histograms; see IOCTL_FILTER_SET_LATENCY_TRACE.
+
+    For a TraceLogging session (ToasterTl.h) the filter gives every IOCTL
+    it passes down an activity ID, which the toaster function driver logs
+    its own events under. Queued IOCTLs are then forwarded with a
+    completion routine and log a start and a stop; the ones on the fast
+    path log a single PassThrough event.
+
 Environment:
 
     Kernel mode
@@ -18,10 +29,132 @@ Environment:
 --*/
 
 #include "filter.h"
+#include "filterioctl.h"
+#include "toastertl.h"
+
+// {B589F4D4-9CDB-433D-B1CE-5CB3E6246DB8}
+TRACELOGGING_DEFINE_PROVIDER(ToasterTlProvider,
+                             "Toaster.Filter.Generic",
+                             (0xb589f4d4, 0x9cdb, 0x433d, 0xb1, 0xce, 0x5c, 0xb3, 0xe6, 0x24, 0x6d, 0xb8));
+
+//
+// IOCTLs are only worth a framework request when the filter actually looks
+// at them. Every other control code is passed to the lower driver from the
+// preprocess callback, before the framework allocates a WDFREQUEST.
+//
+// The codes of interest come from the REG_BINARY value InterestingIoctls
+// (an array of ULONG) under the service's Parameters key. Without it every
+// IOCTL takes the fast path.
+//
+#define FILTER_PARAM_INTERESTING_IOCTLS L"InterestingIoctls"
+#define FILTER_MAX_INTERESTING_IOCTLS   32
+
+typedef struct _FILTER_INTEREST_SET {
+    ULONG   Count;
+    ULONG   Codes[FILTER_MAX_INTERESTING_IOCTLS];
+} FILTER_INTEREST_SET, *PFILTER_INTEREST_SET;
+
+//
+// Filled in by DriverEntry, read-only afterwards.
+//
+FILTER_INTEREST_SET FilterInterestSet;
+
+//
+// Latency tracer. Every device starts with the tracer as the REG_DWORD
+// value LatencyTrace under the Parameters key says; after that it is
+// switched per device by IOCTL_FILTER_SET_LATENCY_TRACE, like the
+// histograms are kept per device.
+//
+#define FILTER_PARAM_LATENCY_TRACE      L"LatencyTrace"
+
+BOOLEAN FilterLatencyTraceDefault;
+
+//
+// Per-code slots are claimed on first use, open addressed on the function
+// number. A slot is never given back, so a code keeps its slot (and its
+// history) for the lifetime of the device.
+//
+#define FILTER_LATENCY_CODES            64          // power of two
+
+typedef struct _FILTER_LATENCY_SLOT {
+    volatile LONG   IoControlCode;                  // 0: free
+    volatile LONG64 Requests;
+    volatile LONG64 Errors;
+    volatile LONG64 Histogram[FILTER_LATENCY_BUCKETS];
+} FILTER_LATENCY_SLOT, *PFILTER_LATENCY_SLOT;
+
+typedef struct _FILTER_LATENCY_DATA {
+    LONGLONG            Frequency;
+    volatile LONG       Enabled;        // the tracer's switch for this device
+    volatile LONG       InFlight;       // timed requests at the lower driver
+    volatile LONG       Total;
+    volatile LONG64     Untracked;
+    FILTER_LATENCY_SLOT Slots[FILTER_LATENCY_CODES];
+} FILTER_LATENCY_DATA, *PFILTER_LATENCY_DATA;
+
+//
+// FILTER_EXTENSION is shared with the other samples built from filter.h,
+// so the histograms live in a context of their own on the same device.
+//
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILTER_LATENCY_DATA, FilterGetLatencyData)
+
+//
+// Allocated by the framework with every request object, so stamping a
+// request costs no pool allocation. Timed is set when the latency tracer
+// was on at the forward, Traced when a TraceLogging session was.
+//
+typedef struct _FILTER_REQUEST_CONTEXT {
+    LONGLONG    ForwardTicks;
+    ULONG       IoControlCode;
+    BOOLEAN     Timed;
+    BOOLEAN     Traced;
+    GUID        ActivityId;
+} FILTER_REQUEST_CONTEXT, *PFILTER_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILTER_REQUEST_CONTEXT, FilterGetRequestContext)
+
+EVT_WDF_DRIVER_UNLOAD FilterEvtDriverUnload;
+EVT_WDFDEVICE_WDM_IRP_PREPROCESS FilterEvtDeviceWdmIrpPreprocess;
+EVT_WDF_REQUEST_COMPLETION_ROUTINE FilterTimedCompletionRoutine;
+EVT_WDF_IO_QUEUE_IO_STOP FilterEvtIoStop;
+EVT_WDF_IO_QUEUE_IO_RESUME FilterEvtIoResume;
+
+static
+VOID
+FilterReadParameters(
+    _In_ WDFDRIVER Driver
+    );
+
+static
+VOID
+FilterForwardRequestTimed(
+    _In_ WDFREQUEST             Request,
+    _In_ WDFIOTARGET            Target,
+    _In_ PFILTER_LATENCY_DATA   Latency,
+    _In_ ULONG                  IoControlCode,
+    _In_ BOOLEAN                Timed
+    );
+
+static
+NTSTATUS
+FilterIoctlSetLatencyTrace(
+    _In_ PFILTER_LATENCY_DATA   Latency,
+    _In_ WDFREQUEST             Request
+    );
+
+static
+NTSTATUS
+FilterIoctlGetLatency(
+    _In_  PFILTER_LATENCY_DATA  Latency,
+    _In_  WDFREQUEST            Request,
+    _Out_ PULONG_PTR            Information
+    );
 
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (INIT, DriverEntry)
+#pragma alloc_text (INIT, FilterReadParameters)
+#pragma alloc_text (PAGE, FilterEvtDriverUnload)
 #pragma alloc_text (PAGE, FilterEvtDeviceAdd)
 #endif
 
@@ -58,6 +191,11 @@ Return Value:
 
     KdPrint(("Toaster Generic Filter Driver Sample - Driver Framework Edition.\n"));
 
+    //
+    // A failure only means that no session will see the filter's events.
+    //
+    (VOID) TraceLoggingRegister(ToasterTlProvider);
+
     //
     // Initiialize driver config to control the attributes that
     // are global to the driver. Note that framework by default
@@ -73,6 +211,11 @@ Return Value:
         FilterEvtDeviceAdd
     );
 
+    //
+    // The provider has to be unregistered before the image goes away.
+    //
+    config.EvtDriverUnload = FilterEvtDriverUnload;
+
     //
     // Create a framework driver object to represent our driver.
     //
@@ -83,11 +226,97 @@ Return Value:
                             &hDriver);//输出
     if (!NT_SUCCESS(status)) {
         KdPrint( ("WdfDriverCreate failed with status 0x%x\n", status));
+        TraceLoggingUnregister(ToasterTlProvider);
+        return status;
     }
-    
+
+    FilterReadParameters(hDriver);
+
     return status;
 }
 
+VOID
+FilterEvtDriverUnload(
+    IN WDFDRIVER Driver
+    )
+/*++
+Routine Description:
+
+    Unregisters the TraceLogging provider.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Driver);
+
+    PAGED_CODE();
+
+    KdPrint(("FilterEvtDriverUnload called.\n"));
+
+    TraceLoggingUnregister(ToasterTlProvider);
+}
+
+//被DriverEntry调用
+VOID
+FilterReadParameters(
+    _In_ WDFDRIVER Driver
+    )
+/*++
+
+Routine Description:
+
+    Reads the set of IOCTL codes that must go through the queue and the
+    initial state of the latency tracer. A missing or malformed value
+    leaves the set empty and the tracer off.
+
+--*/
+{
+    NTSTATUS    status;
+    WDFKEY      key;
+    ULONG       length = 0;
+    ULONG       type = 0;
+    ULONG       latencyTrace = 0;
+    DECLARE_CONST_UNICODE_STRING(valueName, FILTER_PARAM_INTERESTING_IOCTLS);
+    DECLARE_CONST_UNICODE_STRING(traceName, FILTER_PARAM_LATENCY_TRACE);
+
+    PAGED_CODE();
+
+    status = WdfDriverOpenParametersRegistryKey(Driver,
+                                                KEY_READ,
+                                                WDF_NO_OBJECT_ATTRIBUTES,
+                                                &key);
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    status = WdfRegistryQueryValue(key,
+                                   &valueName,
+                                   sizeof(FilterInterestSet.Codes),
+                                   FilterInterestSet.Codes,
+                                   &length,
+                                   &type);
+
+    if (NT_SUCCESS(status) && type == REG_BINARY) {
+        FilterInterestSet.Count = length / sizeof(ULONG);
+    } else {
+        if (status == STATUS_BUFFER_OVERFLOW) {
+            KdPrint(("%ws has more than %d codes, ignored\n",
+                     FILTER_PARAM_INTERESTING_IOCTLS,
+                     FILTER_MAX_INTERESTING_IOCTLS));
+        }
+        FilterInterestSet.Count = 0;
+    }
+
+    KdPrint(("%d IOCTL codes go through the queue\n", FilterInterestSet.Count));
+
+    status = WdfRegistryQueryULong(key, &traceName, &latencyTrace);
+    if (NT_SUCCESS(status) && latencyTrace != 0) {
+        KdPrint(("Latency trace enabled\n"));
+        FilterLatencyTraceDefault = TRUE;
+    }
+
+    WdfRegistryClose(key);
+}
+
 
 NTSTATUS
 FilterEvtDeviceAdd(
@@ -118,10 +347,15 @@ Return Value:
 --*/
 {
     WDF_OBJECT_ATTRIBUTES   deviceAttributes;
+    WDF_OBJECT_ATTRIBUTES   requestAttributes;
+    WDF_OBJECT_ATTRIBUTES   latencyAttributes;
     PFILTER_EXTENSION       filterExt;
+    PFILTER_LATENCY_DATA    latency;
+    LARGE_INTEGER           frequency;
     NTSTATUS                status;
     WDFDEVICE               device;    
     WDF_IO_QUEUE_CONFIG     ioQueueConfig;
+    WDF_REMOVE_LOCK_OPTIONS removeLockOptions;
 
     PAGED_CODE ();
 
@@ -134,6 +368,36 @@ Return Value:
     //
     WdfFdoInitSetFilter(DeviceInit);//告诉frame这是一个filter驱动
 
+    //
+    // See every IRP_MJ_DEVICE_CONTROL before the framework does, so that
+    // uninteresting ones can skip the queue altogether.
+    //
+    status = WdfDeviceInitAssignWdmIrpPreprocessCallback(DeviceInit,
+                                                         FilterEvtDeviceWdmIrpPreprocess,
+                                                         IRP_MJ_DEVICE_CONTROL,
+                                                         NULL,
+                                                         0);
+    if (!NT_SUCCESS(status)) {
+        KdPrint( ("WdfDeviceInitAssignWdmIrpPreprocessCallback failed 0x%x\n", status));
+        return status;
+    }
+
+    //
+    // IRPs passed down from the preprocess callback are not tracked by the
+    // framework's I/O targets, so have the framework hold the remove lock
+    // for them until they complete. That keeps the lower device attached
+    // for as long as one of them is outstanding.
+    //
+    WDF_REMOVE_LOCK_OPTIONS_INIT(&removeLockOptions,
+                                 WDF_REMOVE_LOCK_OPTION_ACQUIRE_FOR_IO);
+    WdfDeviceInitSetRemoveLockOptions(DeviceInit, &removeLockOptions);
+
+    //
+    // Room for the latency tracer's time stamp in every request.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, FILTER_REQUEST_CONTEXT);
+    WdfDeviceInitSetRequestAttributes(DeviceInit, &requestAttributes);
+
     //
     // Specify the size of device extension where we track per device
     // context.
@@ -154,6 +418,18 @@ Return Value:
 
     filterExt = FilterGetData(device);
 
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&latencyAttributes, FILTER_LATENCY_DATA);
+
+    status = WdfObjectAllocateContext(device, &latencyAttributes, (PVOID*) &latency);
+    if (!NT_SUCCESS(status)) {
+        KdPrint( ("WdfObjectAllocateContext failed 0x%x\n", status));
+        return status;
+    }
+
+    KeQueryPerformanceCounter(&frequency);
+    latency->Frequency = frequency.QuadPart;
+    latency->Enabled = FilterLatencyTraceDefault;
+
     //
     // Configure the default queue to be Parallel. 
     //
@@ -166,6 +442,15 @@ Return Value:
     //
     ioQueueConfig.EvtIoDeviceControl = FilterEvtIoDeviceControl;
 
+    //
+    // A request forwarded with a completion routine stays owned by the
+    // filter until the lower driver completes it, which can take as long as
+    // the lower driver likes. Without EvtIoStop a purge of the queue would
+    // wait for every one of them.
+    //
+    ioQueueConfig.EvtIoStop = FilterEvtIoStop;
+    ioQueueConfig.EvtIoResume = FilterEvtIoResume;
+
     status = WdfIoQueueCreate(device,
                             &ioQueueConfig,
                             WDF_NO_OBJECT_ATTRIBUTES,
@@ -179,6 +464,80 @@ Return Value:
     return status;
 }
 
+FORCEINLINE
+BOOLEAN
+FilterIsInterestingIoctl(
+    _In_ PFILTER_LATENCY_DATA   Latency,
+    _In_ ULONG                  IoControlCode
+    )
+{
+    ULONG i;
+
+    //
+    // The tracer has to see everything, and its own codes must never reach
+    // the function driver.
+    //
+    if (ReadNoFence(&Latency->Enabled) ||
+        IoControlCode == IOCTL_FILTER_SET_LATENCY_TRACE ||
+        IoControlCode == IOCTL_FILTER_GET_LATENCY) {
+        return TRUE;
+    }
+
+    for (i = 0; i < FilterInterestSet.Count; i++) {
+        if (FilterInterestSet.Codes[i] == IoControlCode) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+NTSTATUS
+FilterEvtDeviceWdmIrpPreprocess(
+    IN WDFDEVICE Device,
+    IN OUT PIRP  Irp
+    )
+/*++
+
+Routine Description:
+
+    Fast path for IRP_MJ_DEVICE_CONTROL. Codes outside FilterInterestSet are
+    sent straight to the lower device, so they cost the filter no WDFREQUEST,
+    no queue and no framework send. Codes in the set, the tracer's own codes
+    and, while the tracer is on, every other code are handed back to the
+    framework and reach FilterEvtIoDeviceControl as before.
+
+--*/
+{
+    PIO_STACK_LOCATION  stack;
+    GUID                activityId;
+
+    stack = IoGetCurrentIrpStackLocation(Irp);
+
+    if (!FilterIsInterestingIoctl(FilterGetLatencyData(Device),
+                                  stack->Parameters.DeviceIoControl.IoControlCode)) {
+
+        if (ToasterTlEnabled(TOASTER_TL_KEYWORD_REQUEST)) {
+            ToasterTlGetActivityId(Irp, &activityId);
+
+            TraceLoggingWriteActivity(ToasterTlProvider,
+                                      "PassThrough",
+                                      &activityId,
+                                      NULL,
+                                      TraceLoggingLevel(TOASTER_TL_LEVEL),
+                                      TraceLoggingKeyword(TOASTER_TL_KEYWORD_REQUEST),
+                                      TraceLoggingPointer(Device, "Device"),
+                                      TraceLoggingHexUInt32(stack->Parameters.DeviceIoControl.IoControlCode,
+                                                            "IoControlCode"));
+        }
+
+        IoSkipCurrentIrpStackLocation(Irp);
+        return IoCallDriver(WdfDeviceWdmGetAttachedDevice(Device), Irp);
+    }
+
+    return WdfDeviceWdmDispatchPreprocessedIrp(Device, Irp);
+}
+
 VOID
 FilterEvtIoDeviceControl(
     IN WDFQUEUE      Queue,
@@ -192,6 +551,8 @@ FilterEvtIoDeviceControl(
 Routine Description:
 
     This routine is the dispatch routine for internal device control requests.
+    Only the codes in FilterInterestSet get here, unless the latency tracer
+    is on; see FilterEvtDeviceWdmIrpPreprocess.
     
 Arguments:
 
@@ -214,8 +575,11 @@ Return Value:
 --*/
 {
     PFILTER_EXTENSION               filterExt;
+    PFILTER_LATENCY_DATA            latency;
     NTSTATUS                        status = STATUS_SUCCESS;
     WDFDEVICE                       device;
+    ULONG_PTR                       information = 0;
+    BOOLEAN                         timed;
 
     UNREFERENCED_PARAMETER(OutputBufferLength);
     UNREFERENCED_PARAMETER(InputBufferLength);
@@ -225,12 +589,26 @@ Return Value:
     device = WdfIoQueueGetDevice(Queue);
 
     filterExt = FilterGetData(device);
+    latency = FilterGetLatencyData(device);
 
     switch (IoControlCode) {
 
     //
     // Put your cases for handling IOCTLs here
     //
+
+    //
+    // The tracer's own codes are answered here and not passed on.
+    //
+    case IOCTL_FILTER_SET_LATENCY_TRACE:
+        status = FilterIoctlSetLatencyTrace(latency, Request);
+        WdfRequestComplete(Request, status);
+        return;
+
+    case IOCTL_FILTER_GET_LATENCY:
+        status = FilterIoctlGetLatency(latency, Request, &information);
+        WdfRequestCompleteWithInformation(Request, status, information);
+        return;
     }
     
     if (!NT_SUCCESS(status)) {
@@ -241,8 +619,20 @@ Return Value:
     //
     // Forward the request down. WdfDeviceGetIoTarget returns
     // the default target, which represents the device attached to us below in
-    // the stack.
+    // the stack. A request is only timed, or traced, with a completion
+    // routine.
     //
+    timed = (BOOLEAN) (ReadNoFence(&latency->Enabled) != 0);
+
+    if (timed || ToasterTlEnabled(TOASTER_TL_KEYWORD_REQUEST)) {
+        FilterForwardRequestTimed(Request,
+                                  WdfDeviceGetIoTarget(device),
+                                  latency,
+                                  IoControlCode,
+                                  timed);
+        return;
+    }
+
 #if FORWARD_REQUEST_WITH_COMPLETION
     //
     // Use this routine to forward a request if you are interested in post
@@ -291,6 +681,416 @@ Routine Description:
     return;
 }
 
+VOID
+FilterEvtIoStop(
+    IN WDFQUEUE      Queue,
+    IN WDFREQUEST    Request,
+    IN ULONG         ActionFlags
+    )
+/*++
+
+Routine Description:
+
+    Called for each request the filter owns when its queue is stopped or
+    purged. Requests sent with SEND_AND_FORGET are no longer the filter's
+    and never get here; the ones that do were sent with a completion
+    routine and are sitting in the lower driver.
+
+    The filter's queue is not power-managed, so a stop for a power
+    transition should not happen; if it does, the lower driver applies its
+    own power policy to the request and the filter does not hold up the
+    transition. On a purge the request is cancelled in the lower driver so
+    that removal does not wait for it; it still comes back through the
+    completion routine.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Queue);
+
+    KdPrint(("FilterEvtIoStop: Request 0x%p, Flags 0x%x, %d in flight\n",
+             Request,
+             ActionFlags,
+             ReadNoFence(&FilterGetLatencyData(WdfIoQueueGetDevice(Queue))->InFlight)));
+
+    if (ActionFlags & WdfRequestStopActionPurge) {
+        (VOID) WdfRequestCancelSentRequest(Request);
+    } else if (ActionFlags & WdfRequestStopActionSuspend) {
+        WdfRequestStopAcknowledge(Request, FALSE);
+    }
+}
+
+VOID
+FilterEvtIoResume(
+    IN WDFQUEUE      Queue,
+    IN WDFREQUEST    Request
+    )
+/*++
+
+Routine Description:
+
+    Counterpart of FilterEvtIoStop. The request stayed with the lower
+    driver the whole time, so there is nothing to restart.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Queue);
+    UNREFERENCED_PARAMETER(Request);
+
+    KdPrint(("FilterEvtIoResume: Request 0x%p\n", Request));
+}
+
+static
+PFILTER_LATENCY_SLOT
+FilterLatencyGetSlot(
+    _In_ PFILTER_LATENCY_DATA   Latency,
+    _In_ ULONG                  IoControlCode
+    )
+/*++
+
+Routine Description:
+
+    Finds the slot that accounts IoControlCode, claiming a free one the first
+    time the code is seen. Returns NULL once every slot belongs to another
+    code.
+
+--*/
+{
+    PFILTER_LATENCY_SLOT    slot;
+    ULONG                   index;
+    ULONG                   probe;
+    LONG                    code;
+
+    //
+    // The function number sits in bits 2-13 and is what tells codes of the
+    // same device type apart.
+    //
+    index = IoControlCode >> 2;
+
+    for (probe = 0; probe < FILTER_LATENCY_CODES; probe++, index++) {
+
+        slot = &Latency->Slots[index & (FILTER_LATENCY_CODES - 1)];
+
+        code = ReadNoFence(&slot->IoControlCode);
+
+        if (code == 0) {
+            code = InterlockedCompareExchange(&slot->IoControlCode,
+                                              (LONG) IoControlCode,
+                                              0);
+            if (code == 0) {
+                InterlockedIncrement(&Latency->Total);
+                return slot;
+            }
+        }
+
+        if ((ULONG) code == IoControlCode) {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+static
+VOID
+FilterLatencyRecord(
+    _In_ PFILTER_LATENCY_DATA   Latency,
+    _In_ ULONG                  IoControlCode,
+    _In_ NTSTATUS               Status,
+    _In_ ULONG64                Micros
+    )
+/*++
+
+Routine Description:
+
+    Adds one completed request to its code's histogram.
+
+--*/
+{
+    PFILTER_LATENCY_SLOT    slot;
+    ULONG                   bucket;
+
+    slot = FilterLatencyGetSlot(Latency, IoControlCode);
+
+    if (slot == NULL) {
+        InterlockedIncrementNoFence64(&Latency->Untracked);
+        return;
+    }
+
+    InterlockedIncrementNoFence64(&slot->Requests);
+
+    if (!NT_SUCCESS(Status)) {
+        InterlockedIncrementNoFence64(&slot->Errors);
+    }
+
+    //
+    // Bucket n holds [2^(n-1), 2^n) microseconds; bucket 0 holds < 1us.
+    //
+    if (Micros == 0) {
+        bucket = 0;
+    } else {
+        _BitScanReverse64(&bucket, Micros);
+        bucket = min(bucket + 1, FILTER_LATENCY_BUCKETS - 1);
+    }
+
+    InterlockedIncrementNoFence64(&slot->Histogram[bucket]);
+}
+
+VOID
+FilterForwardRequestTimed(
+    _In_ WDFREQUEST             Request,
+    _In_ WDFIOTARGET            Target,
+    _In_ PFILTER_LATENCY_DATA   Latency,
+    _In_ ULONG                  IoControlCode,
+    _In_ BOOLEAN                Timed
+    )
+/*++
+Routine Description:
+
+    Forwards the request with FilterTimedCompletionRoutine, stamping it
+    first so that the completion routine can account the time the lower
+    driver had it.
+
+    With a TraceLogging session listening the request gets an activity ID
+    before it goes down, and a ForwardStart event; the completion routine
+    logs the ForwardStop.
+
+Arguments:
+
+    Timed - add the request to the latency histograms.
+
+--*/
+{
+    PFILTER_REQUEST_CONTEXT reqContext;
+    BOOLEAN ret;
+    NTSTATUS status;
+
+    reqContext = FilterGetRequestContext(Request);
+    reqContext->IoControlCode = IoControlCode;
+    reqContext->Timed = Timed;
+    reqContext->Traced = FALSE;
+
+    if (ToasterTlEnabled(TOASTER_TL_KEYWORD_REQUEST)) {
+        ToasterTlGetActivityId(WdfRequestWdmGetIrp(Request), &reqContext->ActivityId);
+        reqContext->Traced = TRUE;
+
+        TraceLoggingWriteActivity(ToasterTlProvider,
+                                  "ForwardStart",
+                                  &reqContext->ActivityId,
+                                  NULL,
+                                  TraceLoggingOpcode(WINEVENT_OPCODE_START),
+                                  TraceLoggingLevel(TOASTER_TL_LEVEL),
+                                  TraceLoggingKeyword(TOASTER_TL_KEYWORD_REQUEST),
+                                  TraceLoggingPointer(Request, "Request"),
+                                  TraceLoggingHexUInt32(IoControlCode, "IoControlCode"));
+    }
+
+    WdfRequestFormatRequestUsingCurrentType(Request);
+
+    WdfRequestSetCompletionRoutine(Request,
+                                FilterTimedCompletionRoutine,
+                                Latency);
+
+    InterlockedIncrement(&Latency->InFlight);
+
+    reqContext->ForwardTicks = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    ret = WdfRequestSend(Request,
+                         Target,
+                         WDF_NO_SEND_OPTIONS);
+
+    if (ret == FALSE) {
+        InterlockedDecrement(&Latency->InFlight);
+        status = WdfRequestGetStatus (Request);
+        KdPrint( ("WdfRequestSend failed: 0x%x\n", status));
+        WdfRequestComplete(Request, status);
+    }
+
+    return;
+}
+
+VOID
+FilterTimedCompletionRoutine(
+    IN WDFREQUEST                  Request,
+    IN WDFIOTARGET                 Target,
+    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+    IN WDFCONTEXT                  Context
+   )
+/*++
+
+Routine Description:
+
+    Completion routine of FilterForwardRequestTimed. Adds the request to its
+    code's histogram if it was timed, logs its ForwardStop if it was traced
+    and completes it with the lower driver's result.
+
+Arguments:
+
+    Context - the device's FILTER_LATENCY_DATA
+
+--*/
+{
+    PFILTER_LATENCY_DATA    latency = (PFILTER_LATENCY_DATA) Context;
+    PFILTER_REQUEST_CONTEXT reqContext;
+    ULONG64                 micros;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    InterlockedDecrement(&latency->InFlight);
+
+    reqContext = FilterGetRequestContext(Request);
+
+    micros = (ULONG64) (KeQueryPerformanceCounter(NULL).QuadPart - reqContext->ForwardTicks) *
+             1000000 / (ULONG64) latency->Frequency;
+
+    if (reqContext->Traced) {
+        TraceLoggingWriteActivity(ToasterTlProvider,
+                                  "ForwardStop",
+                                  &reqContext->ActivityId,
+                                  NULL,
+                                  TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+                                  TraceLoggingLevel(TOASTER_TL_LEVEL),
+                                  TraceLoggingKeyword(TOASTER_TL_KEYWORD_REQUEST),
+                                  TraceLoggingPointer(Request, "Request"),
+                                  TraceLoggingNTStatus(CompletionParams->IoStatus.Status, "Status"),
+                                  TraceLoggingUInt64((ULONG64) CompletionParams->IoStatus.Information,
+                                                     "Information"),
+                                  TraceLoggingUInt64(micros, "DurationUs"));
+    }
+
+    if (reqContext->Timed) {
+        FilterLatencyRecord(latency,
+                            reqContext->IoControlCode,
+                            CompletionParams->IoStatus.Status,
+                            micros);
+    }
+
+    WdfRequestCompleteWithInformation(Request,
+                                      CompletionParams->IoStatus.Status,
+                                      CompletionParams->IoStatus.Information);
+
+    return;
+}
+
+//被FilterEvtIoDeviceControl调用
+NTSTATUS
+FilterIoctlSetLatencyTrace(
+    _In_ PFILTER_LATENCY_DATA   Latency,
+    _In_ WDFREQUEST             Request
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_FILTER_SET_LATENCY_TRACE. Both the switch and a reset
+    apply to this device only; codes keep the slots they already own.
+
+--*/
+{
+    NTSTATUS                status;
+    PFILTER_LATENCY_TRACE   trace;
+    ULONG                   i;
+    ULONG                   bucket;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(FILTER_LATENCY_TRACE),
+                                           (PVOID*) &trace,
+                                           NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (trace->Reset) {
+
+        InterlockedExchange64(&Latency->Untracked, 0);
+
+        for (i = 0; i < FILTER_LATENCY_CODES; i++) {
+            InterlockedExchange64(&Latency->Slots[i].Requests, 0);
+            InterlockedExchange64(&Latency->Slots[i].Errors, 0);
+            for (bucket = 0; bucket < FILTER_LATENCY_BUCKETS; bucket++) {
+                InterlockedExchange64(&Latency->Slots[i].Histogram[bucket], 0);
+            }
+        }
+    }
+
+    KdPrint(("Latency trace %s\n", trace->Enable ? "enabled" : "disabled"));
+
+    InterlockedExchange(&Latency->Enabled, trace->Enable != 0);
+
+    return STATUS_SUCCESS;
+}
+
+//被FilterEvtIoDeviceControl调用
+NTSTATUS
+FilterIoctlGetLatency(
+    _In_  PFILTER_LATENCY_DATA  Latency,
+    _In_  WDFREQUEST            Request,
+    _Out_ PULONG_PTR            Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_FILTER_GET_LATENCY. The counters keep moving while they
+    are copied, so an entry is only exact if the device is idle.
+
+--*/
+{
+    NTSTATUS                status;
+    PFILTER_LATENCY_OUTPUT  output;
+    PFILTER_LATENCY_ENTRY   entry;
+    PFILTER_LATENCY_SLOT    slot;
+    size_t                  length;
+    ULONG                   capacity;
+    ULONG                   i;
+    ULONG                   bucket;
+    LONG                    code;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            FIELD_OFFSET(FILTER_LATENCY_OUTPUT, Entries),
+                                            (PVOID*) &output,
+                                            &length);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    capacity = (ULONG) ((length - FIELD_OFFSET(FILTER_LATENCY_OUTPUT, Entries)) /
+                        sizeof(FILTER_LATENCY_ENTRY));
+
+    output->Enabled = (ULONG) ReadNoFence(&Latency->Enabled);
+    output->Total = (ULONG) ReadNoFence(&Latency->Total);
+    output->Returned = 0;
+    output->Reserved = 0;
+    output->Untracked = (ULONG64) ReadNoFence64(&Latency->Untracked);
+
+    for (i = 0; i < FILTER_LATENCY_CODES && output->Returned < capacity; i++) {
+
+        slot = &Latency->Slots[i];
+
+        code = ReadNoFence(&slot->IoControlCode);
+        if (code == 0) {
+            continue;
+        }
+
+        entry = &output->Entries[output->Returned++];
+
+        entry->IoControlCode = (ULONG) code;
+        entry->Reserved = 0;
+        entry->Requests = (ULONG64) ReadNoFence64(&slot->Requests);
+        entry->Errors = (ULONG64) ReadNoFence64(&slot->Errors);
+
+        for (bucket = 0; bucket < FILTER_LATENCY_BUCKETS; bucket++) {
+            entry->Histogram[bucket] = (ULONG64) ReadNoFence64(&slot->Histogram[bucket]);
+        }
+    }
+
+    *Information = FIELD_OFFSET(FILTER_LATENCY_OUTPUT, Entries) +
+                   output->Returned * sizeof(FILTER_LATENCY_ENTRY);
+
+    return STATUS_SUCCESS;
+}
+
 #if FORWARD_REQUEST_WITH_COMPLETION
 
 VOID
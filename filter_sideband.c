@@ -19,6 +19,9 @@ Abstract:
     the filter attaches to so that it can provide a direct sideband communication 
     with the usermode application. The KbFilter driver demonstrates that approach.
 
+    Requests to the control device log a ControlStart and a ControlStop
+    TraceLogging event for a session that has the control keyword on, see
+    ToasterTl.h.
     
 
 Environment:
@@ -28,18 +31,103 @@ Environment:
 --*/
 
 #include "filter.h"
+#include "filterioctl.h"
+#include "toasterioctl.h"
+#include "toastertl.h"
+
+// {9F493899-FB8A-4ACD-A09B-FC5D31D4BE15}
+TRACELOGGING_DEFINE_PROVIDER(ToasterTlProvider,
+                             "Toaster.Filter.Sideband",
+                             (0x9f493899, 0xfb8a, 0x4acd, 0xa0, 0x9b, 0xfc, 0x5d, 0x31, 0xd4, 0xbe, 0x15));
+
+EVT_WDF_DRIVER_UNLOAD FilterEvtDriverUnload;
+
+//
+// All FilterDevice objects are kept in a small hash table keyed by serial
+// number, so that the control device can find a specific instance of the
+// device without walking every one of them.
+//
+// The table is read far more often than it changes: every control request
+// looks devices up, only AddDevice and cleanup insert and remove. Lookups
+// take FilterRegistryLock shared, so control requests never serialize
+// against one another; insert and remove take it exclusive.
+//
+#define FILTER_REGISTRY_BUCKETS     64      // power of two
+
+typedef struct _FILTER_REGISTRY_ENTRY {
+
+    struct _FILTER_REGISTRY_ENTRY*  Next;
+    WDFDEVICE                       Device;
+    ULONG                           SerialNo;
+
+    //
+    // Per-instance state served by the control device. Lock protects it so
+    // that control requests for different instances never contend, and the
+    // control queue can dispatch in parallel.
+    //
+    KSPIN_LOCK                      Lock;
+    ULONG                           Tag;
+    volatile LONG64                 ControlRequests;
+
+} FILTER_REGISTRY_ENTRY, *PFILTER_REGISTRY_ENTRY;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILTER_REGISTRY_ENTRY, FilterGetRegistryEntry)
+
+PFILTER_REGISTRY_ENTRY  FilterRegistry[FILTER_REGISTRY_BUCKETS];
+EX_SPIN_LOCK            FilterRegistryLock;
+ULONG                   FilterRegistryCount;
 
 //
-// Collection object is used to store all the FilterDevice objects so
-// that any event callback routine can easily walk thru the list and pick a
-// specific instance of the device for filtering.
+// Serializes FilterEvtDeviceAdd and FilterEvtDeviceContextCleanup, and with
+// them the creation and deletion of the control device. Never taken on the
+// control request path.
 //
-WDFCOLLECTION   FilterDeviceCollection;
-WDFWAITLOCK     FilterDeviceCollectionLock;
+WDFWAITLOCK             FilterControlDeviceLock;
+
+static
+VOID
+FilterRegistryInsert(
+    _In_ PFILTER_REGISTRY_ENTRY Entry
+    );
+
+static
+VOID
+FilterRegistryRemove(
+    _In_ PFILTER_REGISTRY_ENTRY Entry
+    );
+
+static
+WDFDEVICE
+FilterRegistryLookup(
+    _In_ ULONG SerialNo
+    );
+
+static
+NTSTATUS
+FilterEnumInstances(
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    );
+
+static
+NTSTATUS
+FilterTargetInstances(
+    _In_  WDFREQUEST    Request,
+    _In_  ULONG         IoControlCode,
+    _Out_ PULONG_PTR    Information
+    );
+
+static
+NTSTATUS
+FilterGetPowerLog(
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    );
 
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (INIT, DriverEntry)
+#pragma alloc_text (PAGE, FilterEvtDriverUnload)
 #pragma alloc_text (PAGE, FilterEvtDeviceAdd)
 #pragma alloc_text (PAGE, FilterEvtDeviceContextCleanup)
 #endif
@@ -56,7 +144,6 @@ WDFWAITLOCK     FilterDeviceCollectionLock;
 WDFDEVICE       ControlDevice = NULL;
 
 #ifdef ALLOC_PRAGMA
-#pragma alloc_text (PAGE, FilterEvtIoDeviceControl)
 #pragma alloc_text (PAGE, FilterCreateControlDevice)
 #pragma alloc_text (PAGE, FilterDeleteControlDevice)
 #endif
@@ -94,6 +181,11 @@ Return Value:
 
     KdPrint(("Toaster SideBand Filter Driver Sample - Driver Framework Edition.\n"));
 
+    //
+    // A failure only means that no session will see the filter's events.
+    //
+    (VOID) TraceLoggingRegister(ToasterTlProvider);
+
     //
     // Initiialize driver config to control the attributes that
     // are global to the driver. Note that framework by default
@@ -109,6 +201,11 @@ Return Value:
         FilterEvtDeviceAdd
     );
 
+    //
+    // The provider has to be unregistered before the image goes away.
+    //
+    config.EvtDriverUnload = FilterEvtDriverUnload;
+
     //
     // Create a framework driver object to represent our driver.
     //
@@ -119,30 +216,28 @@ Return Value:
                             &hDriver);
     if (!NT_SUCCESS(status)) {
         KdPrint( ("WdfDriverCreate failed with status 0x%x\n", status));
+
+        //
+        // EvtDriverUnload will not be called.
+        //
+        TraceLoggingUnregister(ToasterTlProvider);
+        return status;
     }
 
     //
     // Since there is only one control-device for all the instances
     // of the physical device, we need an ability to get to particular instance
-    // of the device in our FilterEvtIoDeviceControlForControl. For that we
-    // will create a collection object and store filter device objects.        
-    // The collection object has the driver object as a default parent.
+    // of the device in our FilterEvtIoDeviceControl. For that we keep the
+    // filter device objects in FilterRegistry. The table and its lock are
+    // globals, zero-initialized, and need no setup here.
     //
 
-    status = WdfCollectionCreate(WDF_NO_OBJECT_ATTRIBUTES,
-                                &FilterDeviceCollection/*输出，全局变量*/);
-    if (!NT_SUCCESS(status))
-    {
-        KdPrint( ("WdfCollectionCreate failed with status 0x%x\n", status));
-        return status;
-    }
-
     //
     // The wait-lock object has the driver object as a default parent.
     //
 
     status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES,
-                                &FilterDeviceCollectionLock/*输出，全局变量*/);
+                                &FilterControlDeviceLock/*输出，全局变量*/);
     if (!NT_SUCCESS(status))
     {
         KdPrint( ("WdfWaitLockCreate failed with status 0x%x\n", status));
@@ -152,6 +247,27 @@ Return Value:
     return status;
 }
 
+_Use_decl_annotations_
+VOID
+FilterEvtDriverUnload(
+    WDFDRIVER Driver
+    )
+/*++
+Routine Description:
+
+    Unregisters the TraceLogging provider.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Driver);
+
+    PAGED_CODE();
+
+    KdPrint(("FilterEvtDriverUnload called.\n"));
+
+    TraceLoggingUnregister(ToasterTlProvider);
+}
+
 _Use_decl_annotations_
 NTSTATUS
 FilterEvtDeviceAdd(
@@ -182,10 +298,12 @@ Return Value:
 --*/
 {
     WDF_OBJECT_ATTRIBUTES   deviceAttributes;
+    WDF_OBJECT_ATTRIBUTES   entryAttributes;
     PFILTER_EXTENSION       filterExt;
+    PFILTER_REGISTRY_ENTRY  entry;
     NTSTATUS                status;
     WDFDEVICE               device;
-    ULONG                   serialNo;
+    ULONG                   serialNo = 0;
     ULONG                   returnSize;
 
     PAGED_CODE ();
@@ -244,18 +362,24 @@ Return Value:
     filterExt->SerialNo = serialNo; //上面通过WdfFdoInitQueryProperty得到的
 
     //
-    // Add this device to the FilterDevice collection.
-    //
-    WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+    // Add this device to the FilterDevice registry. The entry is a context
+    // on the device itself, so it goes away with the device.
     //
-    // WdfCollectionAdd takes a reference on the item object and removes
-    // it when you call WdfCollectionRemove.
-    //
-    status = WdfCollectionAdd(FilterDeviceCollection, device/*刚刚创建的*/);
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&entryAttributes, FILTER_REGISTRY_ENTRY);
+
+    status = WdfObjectAllocateContext(device, &entryAttributes, &entry);
     if (!NT_SUCCESS(status)) {
-        KdPrint( ("WdfCollectionAdd failed with status code 0x%x\n", status));
+        KdPrint( ("WdfObjectAllocateContext failed with status code 0x%x\n", status));
+        return status;
     }
-    WdfWaitLockRelease(FilterDeviceCollectionLock);
+
+    entry->Device = device/*刚刚创建的*/;
+    entry->SerialNo = serialNo;
+    KeInitializeSpinLock(&entry->Lock);
+
+    WdfWaitLockAcquire(FilterControlDeviceLock, NULL);
+    FilterRegistryInsert(entry);
+    WdfWaitLockRelease(FilterControlDeviceLock);
 
     //-----------------------------------------------------------
     // 重要的地方：Create a control device
@@ -300,23 +424,29 @@ Return Value:
 
 --*/
 {
-    ULONG   count;
+    PFILTER_REGISTRY_ENTRY  entry;
 
     PAGED_CODE();
 
     KdPrint(("Entered FilterEvtDeviceContextCleanup\n"));
 
-    WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+    //
+    // FilterEvtDeviceAdd may have failed before the device was registered.
+    //
+    entry = FilterGetRegistryEntry((WDFDEVICE)Device);
+    if (entry == NULL) {
+        return;
+    }
 
-    count = WdfCollectionGetCount(FilterDeviceCollection);//对象数量
+    WdfWaitLockAcquire(FilterControlDeviceLock, NULL);
 
-    if(count == 1)
+    if(FilterRegistryCount == 1)
     {
          //
          // We are the last instance. So let us delete the control-device
          // so that driver can unload when the FilterDevice is deleted.
          // We absolutely have to do the deletion of control device with
-         // the collection lock acquired because we implicitly use this
+         // FilterControlDeviceLock acquired because we implicitly use this
          // lock to protect ControlDevice global variable. We need to make
          // sure another thread doesn't attempt to create while we are
          // deleting the device.
@@ -324,9 +454,9 @@ Return Value:
          FilterDeleteControlDevice((WDFDEVICE)Device);//本地函数，在下面，最多创建1个管理所有的device
      }
 
-    WdfCollectionRemove(FilterDeviceCollection, Device);//移除到collection外
+    FilterRegistryRemove(entry);//移除到registry外
 
-    WdfWaitLockRelease(FilterDeviceCollectionLock);
+    WdfWaitLockRelease(FilterControlDeviceLock);
 }
 #pragma warning(pop) // enable 28118 again
 
@@ -377,16 +507,16 @@ Return Value:
 
     //
     // First find out whether any ControlDevice has been created. If the
-    // collection has more than one device then we know somebody has already
+    // registry has more than one device then we know somebody has already
     // created or in the process of creating the device.
     //
-    WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+    WdfWaitLockAcquire(FilterControlDeviceLock, NULL);
 
-    if(WdfCollectionGetCount(FilterDeviceCollection) == 1) {
+    if(FilterRegistryCount == 1) {
         bCreate = TRUE;
     }
 
-    WdfWaitLockRelease(FilterDeviceCollectionLock);
+    WdfWaitLockRelease(FilterControlDeviceLock);
 
     if(!bCreate) {
         //
@@ -462,11 +592,13 @@ Return Value:
 
     //
     // Configure the default queue associated with the control device object
-    // to be Serial so that request passed to EvtIoDeviceControl are serialized.
+    // to be Parallel. Requests only share the registry, which they take
+    // shared, and per-instance state, which has its own lock, so there is
+    // nothing left to serialize them for.
     //
 
     WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&ioQueueConfig,
-                             WdfIoQueueDispatchSequential);
+                             WdfIoQueueDispatchParallel);
 
     ioQueueConfig.EvtIoDeviceControl = FilterEvtIoDeviceControl;
 
@@ -549,7 +681,7 @@ Return Value:
     }
 }
 
-//该控制设备（control deviceobject）例子只有这么个实际功能演示
+//控制设备（control deviceobject）的IOCTL入口
 //ioQueueConfig.EvtIoDeviceControl = FilterEvtIoDeviceControl;
 #pragma warning(push)
 #pragma warning(disable:28118) // this callback will run at IRQL=PASSIVE_LEVEL
@@ -566,7 +698,7 @@ FilterEvtIoDeviceControl(
 Routine Description:
 
     This event is called when the framework receives IRP_MJ_DEVICE_CONTROL
-    requests from the system.
+    requests from the system. See FilterIoctl.h for the control codes.
 
 Arguments:
 
@@ -588,35 +720,409 @@ Return Value:
 
 --*/
 {
-    ULONG               i;
-    ULONG               noItems;
-    WDFDEVICE           hFilterDevice;
-    PFILTER_EXTENSION   filterExt;
+    NTSTATUS    status;
+    ULONG_PTR   information = 0;
+    BOOLEAN     traced = FALSE;
+    GUID        activityId = { 0 };
 
     UNREFERENCED_PARAMETER(Queue);
     UNREFERENCED_PARAMETER(OutputBufferLength);
     UNREFERENCED_PARAMETER(InputBufferLength);
-    UNREFERENCED_PARAMETER(IoControlCode);
 
-    PAGED_CODE();
+    //
+    // Not pageable: the registry is walked at DISPATCH_LEVEL.
+    //
 
     KdPrint(("Ioctl recieved into filter control object.\n"));
 
-    WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+    if (ToasterTlEnabled(TOASTER_TL_KEYWORD_CONTROL)) {
+        ToasterTlGetActivityId(WdfRequestWdmGetIrp(Request), &activityId);
+        traced = TRUE;
+
+        TraceLoggingWriteActivity(ToasterTlProvider,
+                                  "ControlStart",
+                                  &activityId,
+                                  NULL,
+                                  TraceLoggingOpcode(WINEVENT_OPCODE_START),
+                                  TraceLoggingLevel(TOASTER_TL_LEVEL),
+                                  TraceLoggingKeyword(TOASTER_TL_KEYWORD_CONTROL),
+                                  TraceLoggingPointer(Request, "Request"),
+                                  TraceLoggingHexUInt32(IoControlCode, "IoControlCode"));
+    }
 
-    noItems = WdfCollectionGetCount(FilterDeviceCollection);
+    switch (IoControlCode) {
 
-    for(i=0; i<noItems ; i++) {
+    case IOCTL_FILTER_ENUM_INSTANCES:
+        status = FilterEnumInstances(Request, &information);
+        break;
 
-        hFilterDevice = WdfCollectionGetItem(FilterDeviceCollection, i);
+    case IOCTL_FILTER_GET_INSTANCE_INFO:
+    case IOCTL_FILTER_SET_INSTANCE_TAG:
+        status = FilterTargetInstances(Request, IoControlCode, &information);
+        break;
 
-        filterExt = FilterGetData(hFilterDevice);
+    case IOCTL_FILTER_GET_POWER_LOG:
+        status = FilterGetPowerLog(Request, &information);
+        break;
 
-        KdPrint(("Serial No: %d\n", filterExt->SerialNo));
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
     }
 
-    WdfWaitLockRelease(FilterDeviceCollectionLock);
+    if (traced) {
+        TraceLoggingWriteActivity(ToasterTlProvider,
+                                  "ControlStop",
+                                  &activityId,
+                                  NULL,
+                                  TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+                                  TraceLoggingLevel(TOASTER_TL_LEVEL),
+                                  TraceLoggingKeyword(TOASTER_TL_KEYWORD_CONTROL),
+                                  TraceLoggingPointer(Request, "Request"),
+                                  TraceLoggingNTStatus(status, "Status"),
+                                  TraceLoggingUInt64((ULONG64) information, "Information"));
+    }
 
-    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, 0);
+    WdfRequestCompleteWithInformation(Request, status, information);
 }
 #pragma warning(pop) // enable 28118 again
+
+//被FilterEvtIoDeviceControl调用
+NTSTATUS
+FilterEnumInstances(
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_FILTER_ENUM_INSTANCES: reports the serial number of every
+    attached instance that fits in the output buffer.
+
+--*/
+{
+    NTSTATUS                status;
+    PFILTER_ENUM_OUTPUT     output;
+    size_t                  outputLength;
+    ULONG                   capacity;
+    ULONG                   i;
+    PFILTER_REGISTRY_ENTRY  entry;
+    KIRQL                   oldIrql;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            FIELD_OFFSET(FILTER_ENUM_OUTPUT, SerialNo),
+                                            (PVOID*) &output,
+                                            &outputLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    capacity = (ULONG) min((outputLength - FIELD_OFFSET(FILTER_ENUM_OUTPUT, SerialNo)) / sizeof(ULONG),
+                           MAXULONG);
+
+    output->Returned = 0;
+
+    //
+    // The buffered system buffer is non-paged, so it can be filled in while
+    // the registry is held.
+    //
+    oldIrql = ExAcquireSpinLockShared(&FilterRegistryLock);
+
+    output->Total = FilterRegistryCount;
+
+    for (i = 0; i < FILTER_REGISTRY_BUCKETS; i++) {
+        for (entry = FilterRegistry[i]; entry != NULL; entry = entry->Next) {
+            if (output->Returned < capacity) {
+                output->SerialNo[output->Returned++] = entry->SerialNo;
+            }
+        }
+    }
+
+    ExReleaseSpinLockShared(&FilterRegistryLock, oldIrql);
+
+    *Information = FIELD_OFFSET(FILTER_ENUM_OUTPUT, SerialNo) +
+                   (ULONG_PTR) output->Returned * sizeof(ULONG);
+
+    return (output->Returned < output->Total) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+//被FilterEvtIoDeviceControl调用
+NTSTATUS
+FilterTargetInstances(
+    _In_  WDFREQUEST    Request,
+    _In_  ULONG         IoControlCode,
+    _Out_ PULONG_PTR    Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_FILTER_GET_INSTANCE_INFO and IOCTL_FILTER_SET_INSTANCE_TAG.
+    Each serial number is a hash lookup; nothing walks the registry.
+
+--*/
+{
+    NTSTATUS                status;
+    PFILTER_TARGETS         targets;
+    PULONG                  serialNo;
+    size_t                  inputLength;
+    size_t                  elementSize;
+    PVOID                   output;
+    FILTER_INSTANCE_INFO    info;
+    WDFDEVICE               device;
+    PFILTER_REGISTRY_ENTRY  entry;
+    KLOCK_QUEUE_HANDLE      lockHandle;
+    ULONG                   i;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(FILTER_TARGETS),
+                                           (PVOID*) &targets,
+                                           &inputLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (targets->Count == 0 || targets->Count > FILTER_MAX_TARGETS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (inputLength - sizeof(FILTER_TARGETS) < (size_t) targets->Count * sizeof(ULONG)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    serialNo = (PULONG) (targets + 1);
+
+    elementSize = (IoControlCode == IOCTL_FILTER_GET_INSTANCE_INFO) ?
+                  sizeof(FILTER_INSTANCE_INFO) : sizeof(LONG);
+
+    //
+    // METHOD_OUT_DIRECT: the output is the caller's locked pages, separate
+    // from the input copy, so the serial numbers stay intact as results
+    // are written.
+    //
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            (size_t) targets->Count * elementSize,
+                                            &output,
+                                            NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    for (i = 0; i < targets->Count; i++) {
+
+        RtlZeroMemory(&info, sizeof(info));
+        info.SerialNo = serialNo[i];
+
+        device = FilterRegistryLookup(serialNo[i]);
+
+        if (device == NULL) {
+            info.Status = STATUS_NOT_FOUND;
+        } else {
+            entry = FilterGetRegistryEntry(device);
+
+            info.ControlRequests = InterlockedIncrement64(&entry->ControlRequests);
+
+            KeAcquireInStackQueuedSpinLock(&entry->Lock, &lockHandle);
+
+            if (IoControlCode == IOCTL_FILTER_SET_INSTANCE_TAG) {
+                entry->Tag = targets->Value;
+            }
+            info.Tag = entry->Tag;
+
+            KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+            WdfObjectDereference(device);
+
+            info.Status = STATUS_SUCCESS;
+        }
+
+        //
+        // The output buffer is mapped user memory; only ever write to it.
+        //
+        if (IoControlCode == IOCTL_FILTER_GET_INSTANCE_INFO) {
+            ((PFILTER_INSTANCE_INFO) output)[i] = info;
+        } else {
+            ((PLONG) output)[i] = info.Status;
+        }
+    }
+
+    *Information = (ULONG_PTR) targets->Count * elementSize;
+
+    return STATUS_SUCCESS;
+}
+
+//被FilterEvtIoDeviceControl调用
+NTSTATUS
+FilterGetPowerLog(
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_FILTER_GET_POWER_LOG. The filter sits above the toaster
+    function driver, so its default I/O target is the toaster; the request
+    is answered there before it is queued and does not wake the device.
+
+--*/
+{
+    NTSTATUS                    status;
+    PFILTER_POWER_LOG_INPUT     input;
+    ULONG                       serialNo;
+    WDFMEMORY                   outputMemory;
+    WDF_MEMORY_DESCRIPTOR       outputDescriptor;
+    WDF_REQUEST_SEND_OPTIONS    options;
+    WDFDEVICE                   device;
+    ULONG_PTR                   bytesReturned = 0;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(FILTER_POWER_LOG_INPUT),
+                                           (PVOID*) &input,
+                                           NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    //
+    // METHOD_BUFFERED: the output overwrites the input in the same system
+    // buffer.
+    //
+    serialNo = input->SerialNo;
+
+    status = WdfRequestRetrieveOutputMemory(Request, &outputMemory);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    device = FilterRegistryLookup(serialNo);
+    if (device == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    InterlockedIncrement64(&FilterGetRegistryEntry(device)->ControlRequests);
+
+    WDF_MEMORY_DESCRIPTOR_INIT_HANDLE(&outputDescriptor, outputMemory, NULL);
+
+    //
+    // The toaster completes this inline, a stuck stack must not hold the
+    // control queue forever.
+    //
+    WDF_REQUEST_SEND_OPTIONS_INIT(&options, WDF_REQUEST_SEND_OPTION_TIMEOUT);
+    WDF_REQUEST_SEND_OPTIONS_SET_TIMEOUT(&options, WDF_REL_TIMEOUT_IN_SEC(1));
+
+    status = WdfIoTargetSendIoctlSynchronously(WdfDeviceGetIoTarget(device),
+                                               NULL,
+                                               IOCTL_TOASTER_GET_POWER_LOG,
+                                               NULL,
+                                               &outputDescriptor,
+                                               &options,
+                                               &bytesReturned);
+
+    WdfObjectDereference(device);
+
+    *Information = bytesReturned;
+
+    return status;
+}
+
+//
+// FilterRegistry helpers. They run at DISPATCH_LEVEL under
+// FilterRegistryLock and cannot be pageable.
+//
+
+//被FilterEvtDeviceAdd调用，持有FilterControlDeviceLock
+VOID
+FilterRegistryInsert(
+    _In_ PFILTER_REGISTRY_ENTRY Entry
+    )
+{
+    PFILTER_REGISTRY_ENTRY* bucket;
+    KIRQL                   oldIrql;
+
+    bucket = &FilterRegistry[Entry->SerialNo & (FILTER_REGISTRY_BUCKETS - 1)];
+
+    oldIrql = ExAcquireSpinLockExclusive(&FilterRegistryLock);
+
+    Entry->Next = *bucket;
+    *bucket = Entry;
+    FilterRegistryCount++;
+
+    ExReleaseSpinLockExclusive(&FilterRegistryLock, oldIrql);
+}
+
+//被FilterEvtDeviceContextCleanup调用，持有FilterControlDeviceLock
+VOID
+FilterRegistryRemove(
+    _In_ PFILTER_REGISTRY_ENTRY Entry
+    )
+{
+    PFILTER_REGISTRY_ENTRY* link;
+    KIRQL                   oldIrql;
+
+    link = &FilterRegistry[Entry->SerialNo & (FILTER_REGISTRY_BUCKETS - 1)];
+
+    oldIrql = ExAcquireSpinLockExclusive(&FilterRegistryLock);
+
+    while (*link != NULL && *link != Entry) {
+        link = &(*link)->Next;
+    }
+
+    if (*link != NULL) {
+        *link = Entry->Next;
+        Entry->Next = NULL;
+        FilterRegistryCount--;
+    }
+
+    ExReleaseSpinLockExclusive(&FilterRegistryLock, oldIrql);
+}
+
+WDFDEVICE
+FilterRegistryLookup(
+    _In_ ULONG SerialNo
+    )
+/*++
+
+Routine Description:
+
+    Finds the filter device with the given serial number.
+
+Return Value:
+
+    The device with a reference taken on it, which the caller releases with
+    WdfObjectDereference, or NULL if no such device is attached.
+
+--*/
+{
+    PFILTER_REGISTRY_ENTRY  entry;
+    WDFDEVICE               device = NULL;
+    KIRQL                   oldIrql;
+
+    oldIrql = ExAcquireSpinLockShared(&FilterRegistryLock);
+
+    for (entry = FilterRegistry[SerialNo & (FILTER_REGISTRY_BUCKETS - 1)];
+         entry != NULL;
+         entry = entry->Next) {
+
+        if (entry->SerialNo == SerialNo) {
+            //
+            // The reference keeps the device object valid after the lock is
+            // dropped, even if cleanup removes the entry in the meantime.
+            //
+            device = entry->Device;
+            WdfObjectReference(device);
+            break;
+        }
+    }
+
+    ExReleaseSpinLockShared(&FilterRegistryLock, oldIrql);
+
+    return device;
+}
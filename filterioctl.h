@@ -0,0 +1,149 @@
+/*++
+
+Module Name:
+
+    FilterIoctl.h
+
+Abstract:
+
+    I/O control codes and buffer layouts understood by the sideband filter's
+    control device (\\.\ToasterFilter) and by the generic filter. Shared
+    between the filters and user-mode applications.
+
+    Instances are addressed by serial number, the UINumber the toaster bus
+    reports for each toaster.
+
+Environment:
+
+    User and kernel mode
+
+--*/
+
+#if !defined(_FILTER_IOCTL_H_)
+#define _FILTER_IOCTL_H_
+
+//
+// FILTER_IOCTL_WRITE codes are only accepted on a handle opened for
+// writing.
+//
+#define FILTER_IOCTL(_index_, _method_) \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0xA00 + (_index_), _method_, FILE_ANY_ACCESS)
+
+#define FILTER_IOCTL_WRITE(_index_, _method_) \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0xA00 + (_index_), _method_, FILE_WRITE_ACCESS)
+
+//
+// IOCTL_FILTER_ENUM_INSTANCES
+//
+// Output buffer: FILTER_ENUM_OUTPUT, with as many SerialNo entries as fit.
+// Total is always filled in, so a caller can size a second attempt.
+//
+#define IOCTL_FILTER_ENUM_INSTANCES     FILTER_IOCTL(0x00, METHOD_BUFFERED)
+
+//
+// IOCTL_FILTER_GET_INSTANCE_INFO
+//
+// Input buffer:  FILTER_TARGETS, followed by ULONG SerialNo[Count]
+// Output buffer: FILTER_INSTANCE_INFO Info[Count]
+//
+// IOCTL_FILTER_SET_INSTANCE_TAG
+//
+// Input buffer:  FILTER_TARGETS, followed by ULONG SerialNo[Count];
+//                Value is the new tag
+// Output buffer: LONG Status[Count]
+//
+// Each target gets its own status; a serial number that is not attached
+// reports STATUS_NOT_FOUND without failing the request. Setting a tag
+// needs a handle opened for writing.
+//
+#define IOCTL_FILTER_GET_INSTANCE_INFO  FILTER_IOCTL(0x01, METHOD_OUT_DIRECT)
+#define IOCTL_FILTER_SET_INSTANCE_TAG   FILTER_IOCTL_WRITE(0x02, METHOD_OUT_DIRECT)
+
+#define FILTER_MAX_TARGETS              1024
+
+typedef struct _FILTER_TARGETS {
+    ULONG   Count;              // number of serial numbers that follow
+    ULONG   Value;              // IOCTL_FILTER_SET_INSTANCE_TAG: new tag
+} FILTER_TARGETS, *PFILTER_TARGETS;
+
+typedef struct _FILTER_INSTANCE_INFO {
+    ULONG   SerialNo;
+    LONG    Status;             // NTSTATUS of the lookup
+    ULONG   Tag;                // last value set by IOCTL_FILTER_SET_INSTANCE_TAG
+    ULONG   Reserved;
+    ULONG64 ControlRequests;    // control requests that addressed this instance
+} FILTER_INSTANCE_INFO, *PFILTER_INSTANCE_INFO;
+
+typedef struct _FILTER_ENUM_OUTPUT {
+    ULONG   Total;              // instances attached
+    ULONG   Returned;           // entries in SerialNo
+    ULONG   SerialNo[1];
+} FILTER_ENUM_OUTPUT, *PFILTER_ENUM_OUTPUT;
+
+//
+// IOCTL_FILTER_GET_POWER_LOG
+//
+// Input buffer:  FILTER_POWER_LOG_INPUT
+// Output buffer: TOASTER_POWER_LOG (ToasterIoctl.h)
+//
+// The control device asks the toaster underneath the addressed instance
+// for its power log (IOCTL_TOASTER_GET_POWER_LOG) and returns the answer
+// unchanged, so one handle can collect the logs of every toaster.
+//
+#define IOCTL_FILTER_GET_POWER_LOG      FILTER_IOCTL(0x03, METHOD_BUFFERED)
+
+typedef struct _FILTER_POWER_LOG_INPUT {
+    ULONG   SerialNo;
+} FILTER_POWER_LOG_INPUT, *PFILTER_POWER_LOG_INPUT;
+
+//
+// The codes below are not for the control device. They are sent to the
+// toaster itself and answered by the generic filter on its way down the
+// stack; the function driver never sees them.
+//
+// IOCTL_FILTER_SET_LATENCY_TRACE
+//
+// Input buffer:  FILTER_LATENCY_TRACE
+//
+// Turns the latency tracer of the addressed toaster on or off. While it
+// is on, every IOCTL to that toaster goes through the filter's queue and
+// is timed from the forward to the lower driver's completion, whether or
+// not it is in InterestingIoctls. Needs a handle opened for writing.
+//
+// IOCTL_FILTER_GET_LATENCY
+//
+// Output buffer: FILTER_LATENCY_OUTPUT, with as many Entries as fit.
+// Total is always filled in, so a caller can size a second attempt.
+//
+#define IOCTL_FILTER_SET_LATENCY_TRACE  FILTER_IOCTL_WRITE(0x10, METHOD_BUFFERED)
+#define IOCTL_FILTER_GET_LATENCY        FILTER_IOCTL(0x11, METHOD_BUFFERED)
+
+#define FILTER_LATENCY_BUCKETS          16
+
+typedef struct _FILTER_LATENCY_TRACE {
+    ULONG   Enable;
+    ULONG   Reset;              // nonzero: clear the histograms first
+} FILTER_LATENCY_TRACE, *PFILTER_LATENCY_TRACE;
+
+//
+// Bucket n holds [2^(n-1), 2^n) microseconds; bucket 0 holds < 1us and the
+// last bucket everything above.
+//
+typedef struct _FILTER_LATENCY_ENTRY {
+    ULONG   IoControlCode;
+    ULONG   Reserved;
+    ULONG64 Requests;
+    ULONG64 Errors;
+    ULONG64 Histogram[FILTER_LATENCY_BUCKETS];
+} FILTER_LATENCY_ENTRY, *PFILTER_LATENCY_ENTRY;
+
+typedef struct _FILTER_LATENCY_OUTPUT {
+    ULONG   Enabled;
+    ULONG   Total;              // codes seen since the device started
+    ULONG   Returned;           // entries in Entries
+    ULONG   Reserved;
+    ULONG64 Untracked;          // timed requests whose code found no free slot
+    FILTER_LATENCY_ENTRY Entries[1];
+} FILTER_LATENCY_OUTPUT, *PFILTER_LATENCY_OUTPUT;
+
+#endif // _FILTER_IOCTL_H_
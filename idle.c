@@ -0,0 +1,363 @@
+/*++
+
+Module Name:
+
+    Idle.c
+
+Abstract:
+
+    Adaptive S0 idle timeout for the featured toaster function driver.
+
+    The read, write and control paths stamp the arrival of each request
+    (ToasterIdleNoteArrival). Whenever a millisecond or more has passed
+    since the last stamp, the gap goes into a log2 histogram. Every
+    TOASTER_IDLE_RETUNE_SAMPLES gaps a work item picks the timeout that
+    covers the Percentile-th percentile of the gaps shorter than
+    MaximumTimeout: bursty traffic with short lulls keeps the device in D0
+    through them, while a device that sees long lulls goes to Dx soon
+    after the last request. The histogram is halved on every retune so
+    that it follows the workload.
+
+    Nothing here can fail a request. The policy is set through the
+    ToasterIdlePolicy WMI block.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "idle.tmh"
+
+EVT_WDF_WORKITEM ToasterIdleEvtRetune;
+
+static
+ULONG
+ToasterIdleComputeTimeout(
+    _In_ PTOASTER_IDLE Idle
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterIdleInitialize)
+#pragma alloc_text(PAGE, ToasterIdleEvtRetune)
+#pragma alloc_text(PAGE, ToasterIdleComputeTimeout)
+#pragma alloc_text(PAGE, ToasterIdleQuery)
+#pragma alloc_text(PAGE, ToasterIdleSetPolicy)
+#endif
+
+
+//被ToasterEvtDeviceAdd调用
+NTSTATUS
+ToasterIdleInitialize(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Sets up the default policy and the retune work item. Must run after
+    ToasterStatsAllocate, whose counter frequency it borrows. The caller
+    assigns the initial S0 idle settings with Idle.CurrentTimeout.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_DATA               fdoData;
+    PTOASTER_IDLE           idle;
+    WDF_WORKITEM_CONFIG     workItemConfig;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    idle = &ToasterFdoGetIoData(Device)->Idle;
+
+    idle->TicksPerMs = ToasterFdoGetIoData(Device)->Stats.Frequency / 1000;
+
+    idle->Enabled = TRUE;
+    idle->MinimumTimeout = TOASTER_IDLE_DEFAULT_MIN_TIMEOUT;
+    idle->MaximumTimeout = TOASTER_IDLE_DEFAULT_MAX_TIMEOUT;
+    idle->Percentile = TOASTER_IDLE_DEFAULT_PERCENTILE;
+    idle->CurrentTimeout = TOASTER_IDLE_DEFAULT_TIMEOUT;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfWaitLockCreate(&attributes, &idle->Lock);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfWaitLockCreate failed 0x%x\n",
+                           status);
+        return status;
+    }
+
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, ToasterIdleEvtRetune);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfWorkItemCreate(&workItemConfig, &attributes, &idle->RetuneWorkItem);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfWorkItemCreate failed 0x%x\n",
+                           status);
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ToasterIdleRecordGap(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ LONGLONG       LastArrival,
+    _In_ LONGLONG       Ticks
+    )
+/*++
+
+Routine Description:
+
+    Slow half of ToasterIdleNoteArrival. Of the requests that see the same
+    stale stamp only the one that replaces it records the gap.
+
+Arguments:
+
+    IoData - data path context of the device.
+
+    LastArrival - the stamp the caller compared against.
+
+    Ticks - arrival time of the current request.
+
+--*/
+{
+    PTOASTER_IDLE   idle = &IoData->Idle;
+    ULONG64         millis;
+    ULONG           bucket;
+
+    if (InterlockedCompareExchange64(&idle->LastArrival, Ticks, LastArrival) != LastArrival) {
+        return;
+    }
+
+    //
+    // The first request after the device was added has nothing to measure
+    // against.
+    //
+    if (LastArrival == 0) {
+        return;
+    }
+
+    millis = (ULONG64) (Ticks - LastArrival) / (ULONG64) idle->TicksPerMs;
+
+    _BitScanReverse64(&bucket, millis);
+    bucket = min(bucket, TOASTER_IDLE_GAP_BUCKETS - 1);
+
+    InterlockedIncrementNoFence(&idle->GapHistogram[bucket]);
+
+    if ((InterlockedIncrement(&idle->Samples) % TOASTER_IDLE_RETUNE_SAMPLES) == 0) {
+        WdfWorkItemEnqueue(idle->RetuneWorkItem);
+    }
+}
+
+ULONG
+ToasterIdleComputeTimeout(
+    _In_ PTOASTER_IDLE Idle
+    )
+/*++
+
+Routine Description:
+
+    Picks the timeout for the current histogram and halves the histogram.
+    Called with Idle->Lock held.
+
+Return Value:
+
+    Idle timeout in milliseconds, within the policy bounds.
+
+--*/
+{
+    LONG    counts[TOASTER_IDLE_GAP_BUCKETS];
+    ULONG64 total = 0;
+    ULONG64 covered = 0;
+    ULONG64 timeout;
+    ULONG   bucket;
+
+    PAGED_CODE();
+
+    for (bucket = 0; bucket < TOASTER_IDLE_GAP_BUCKETS; bucket++) {
+        counts[bucket] = ReadNoFence(&Idle->GapHistogram[bucket]);
+        InterlockedAdd(&Idle->GapHistogram[bucket], -(counts[bucket] / 2));
+    }
+
+    if (!Idle->Enabled) {
+        return Idle->MaximumTimeout;
+    }
+
+    //
+    // Gaps that start at or above the maximum are lulls the device should
+    // sleep through no matter what; they say nothing about the timeout.
+    //
+    for (bucket = 0;
+         bucket < TOASTER_IDLE_GAP_BUCKETS && (1ULL << bucket) < Idle->MaximumTimeout;
+         bucket++) {
+        total += counts[bucket];
+    }
+
+    if (total == 0) {
+        return Idle->MinimumTimeout;
+    }
+
+    for (bucket = 0; bucket < TOASTER_IDLE_GAP_BUCKETS; bucket++) {
+        covered += counts[bucket];
+        if (covered * 100 >= total * Idle->Percentile) {
+            break;
+        }
+    }
+
+    //
+    // The upper edge of the bucket, so every gap in it is covered.
+    //
+    timeout = 2ULL << bucket;
+
+    timeout = max(timeout, Idle->MinimumTimeout);
+    timeout = min(timeout, Idle->MaximumTimeout);
+
+    return (ULONG) timeout;
+}
+
+//通过WdfWorkItemCreate设置的回调
+VOID
+ToasterIdleEvtRetune(
+    _In_ WDFWORKITEM WorkItem
+    )
+/*++
+
+Routine Description:
+
+    Applies the timeout chosen by ToasterIdleComputeTimeout. The S0 idle
+    settings can only be changed at PASSIVE_LEVEL, which is why this is a
+    work item and not done from the I/O path.
+
+--*/
+{
+    NTSTATUS                                status;
+    WDFDEVICE                               device;
+    PFDO_DATA                               fdoData;
+    PTOASTER_IDLE                           idle;
+    WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS   idleSettings;
+    ULONG                                   timeout;
+
+    PAGED_CODE();
+
+    device = WdfWorkItemGetParentObject(WorkItem);
+    fdoData = ToasterFdoGetData(device);
+    idle = &ToasterFdoGetIoData(device)->Idle;
+
+    WdfWaitLockAcquire(idle->Lock, NULL);
+
+    timeout = ToasterIdleComputeTimeout(idle);
+
+    if (timeout != idle->CurrentTimeout) {
+
+        WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(&idleSettings, IdleCannotWakeFromS0);
+        idleSettings.IdleTimeout = timeout;
+
+        status = WdfDeviceAssignS0IdleSettings(device, &idleSettings);
+        if (NT_SUCCESS(status)) {
+            WppPrintDevice(fdoData->WppRecorderLog,
+                          "Idle timeout %d -> %d ms\n",
+                          idle->CurrentTimeout,
+                          timeout);
+            idle->CurrentTimeout = timeout;
+            idle->Retunes++;
+        } else {
+            WppPrintDeviceError(fdoData->WppRecorderLog,
+                               "WdfDeviceAssignS0IdleSettings failed 0x%x\n",
+                               status);
+        }
+    }
+
+    WdfWaitLockRelease(idle->Lock);
+}
+
+//被EvtWmiInstanceIdlePolicyQueryInstance调用
+VOID
+ToasterIdleQuery(
+    _In_  WDFDEVICE             Device,
+    _Out_ PToasterIdlePolicy    Policy
+    )
+{
+    PTOASTER_IDLE   idle;
+    ULONG           bucket;
+
+    PAGED_CODE();
+
+    C_ASSERT(ARRAYSIZE(Policy->GapHistogram) == TOASTER_IDLE_GAP_BUCKETS);
+
+    idle = &ToasterFdoGetIoData(Device)->Idle;
+
+    WdfWaitLockAcquire(idle->Lock, NULL);
+
+    Policy->Enabled = idle->Enabled;
+    Policy->MinimumIdleTimeout = idle->MinimumTimeout;
+    Policy->MaximumIdleTimeout = idle->MaximumTimeout;
+    Policy->Percentile = idle->Percentile;
+    Policy->CurrentIdleTimeout = idle->CurrentTimeout;
+    Policy->Retunes = idle->Retunes;
+
+    WdfWaitLockRelease(idle->Lock);
+
+    Policy->Resumes = (ULONG) ReadNoFence(&idle->Resumes);
+
+    for (bucket = 0; bucket < TOASTER_IDLE_GAP_BUCKETS; bucket++) {
+        Policy->GapHistogram[bucket] = (ULONG) ReadNoFence(&idle->GapHistogram[bucket]);
+    }
+}
+
+//被EvtWmiInstanceIdlePolicySetInstance调用
+NTSTATUS
+ToasterIdleSetPolicy(
+    _In_ WDFDEVICE              Device,
+    _In_ PToasterIdlePolicy     Policy
+    )
+/*++
+
+Routine Description:
+
+    Replaces the writable part of the policy and retunes right away, so a
+    new bound takes effect without waiting for more traffic.
+
+--*/
+{
+    PTOASTER_IDLE   idle;
+
+    PAGED_CODE();
+
+    if (Policy->MinimumIdleTimeout == 0 ||
+        Policy->MinimumIdleTimeout > Policy->MaximumIdleTimeout ||
+        Policy->Percentile == 0 ||
+        Policy->Percentile > 99) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    idle = &ToasterFdoGetIoData(Device)->Idle;
+
+    WdfWaitLockAcquire(idle->Lock, NULL);
+
+    idle->Enabled = (Policy->Enabled != 0);
+    idle->MinimumTimeout = Policy->MinimumIdleTimeout;
+    idle->MaximumTimeout = Policy->MaximumIdleTimeout;
+    idle->Percentile = Policy->Percentile;
+
+    WdfWaitLockRelease(idle->Lock);
+
+    WdfWorkItemEnqueue(idle->RetuneWorkItem);
+
+    return STATUS_SUCCESS;
+}
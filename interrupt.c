@@ -0,0 +1,839 @@
+/*++
+
+Module Name:
+
+    Interrupt.c
+
+Abstract:
+
+    Interrupt-driven completion for the hardware-backed toaster.
+
+    A toaster with a register BAR (ToasterHw.h) does not complete reads and
+    writes in the queue callbacks. Once the data has moved, the request is
+    handed to the device through the doorbell and completed when the
+    device reports it done. The ISR only acknowledges the interrupt; the DPC
+    reads how far the device has got and completes that many requests in
+    one pass, so the cost of an interrupt and a DPC is shared by every
+    request the device finished in between. How many that is, is up to
+    interrupt moderation (ToasterInterruptModeration): the device holds the
+    interrupt back until CoalesceCount requests have finished, or until
+    CoalesceTimer has run out on the oldest one.
+
+    Large requests have the device move the data (Dma.c) and are finished
+    by ToasterDmaComplete. Requests whose data the processor has copied
+    complete inline, unless the device still has requests of its own: then
+    they take a no-op entry of the command ring behind them, so that they
+    do not complete ahead of a transfer issued before them.
+
+    A toaster without a register BAR completes every request inline, as
+    before.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "interrupt.tmh"
+
+EVT_WDF_INTERRUPT_ISR       ToasterEvtInterruptIsr;
+EVT_WDF_INTERRUPT_DPC       ToasterEvtInterruptDpc;
+EVT_WDF_INTERRUPT_ENABLE    ToasterEvtInterruptEnable;
+EVT_WDF_INTERRUPT_DISABLE   ToasterEvtInterruptDisable;
+
+static
+VOID
+ToasterHwPush(
+    _In_ PTOASTER_HW                Hw,
+    _In_ PTOASTER_REQUEST_CONTEXT   Context,
+    _In_ PTOASTER_HW_COMMAND        Command
+    );
+
+static
+ULONG
+ToasterHwCompleteList(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ PLIST_ENTRY    List,
+    _In_ BOOLEAN        Flushed
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterHwInitialize)
+#pragma alloc_text(PAGE, ToasterHwPrepare)
+#pragma alloc_text(PAGE, ToasterHwRelease)
+#pragma alloc_text(PAGE, ToasterHwQueryModeration)
+#pragma alloc_text(PAGE, ToasterHwSetModeration)
+#endif
+
+
+//被ToasterEvtDeviceAdd调用
+VOID
+ToasterHwInitialize(
+    _In_ WDFDEVICE Device
+    )
+{
+    PTOASTER_HW hw;
+
+    PAGED_CODE();
+
+    hw = &ToasterFdoGetIoData(Device)->Hw;
+
+    KeInitializeSpinLock(&hw->Lock);
+    InitializeListHead(&hw->Pending);
+
+    hw->CoalesceCount = TOASTER_HW_DEFAULT_COALESCE_COUNT;
+    hw->CoalesceTimer = TOASTER_HW_DEFAULT_COALESCE_TIMER;
+}
+
+//被ToasterEvtDevicePrepareHardware调用
+NTSTATUS
+ToasterHwPrepare(
+    _In_ WDFDEVICE      Device,
+    _In_ WDFCMRESLIST   ResourcesRaw,
+    _In_ WDFCMRESLIST   ResourcesTranslated
+    )
+/*++
+
+Routine Description:
+
+    Maps the register BAR, the first memory resource large enough to hold
+    TOASTER_REGISTERS, and creates the interrupt for the first interrupt
+    resource. The framework connects the interrupt before D0Entry returns
+    and deletes it after ToasterEvtDeviceReleaseHardware; the registers
+    are unmapped by ToasterHwRelease.
+
+Return Value:
+
+    STATUS_SUCCESS, also when the device has no register BAR. A BAR that
+    is not a toaster's, or one without an interrupt, fails the start.
+
+--*/
+{
+    NTSTATUS                        status;
+    PFDO_DATA                       fdoData;
+    PTOASTER_HW                     hw;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR descriptor;
+    WDF_INTERRUPT_CONFIG            interruptConfig;
+    ULONG                           count;
+    ULONG                           interrupt = MAXULONG;
+    ULONG                           id;
+    ULONG                           i;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    hw = &ToasterFdoGetIoData(Device)->Hw;
+
+    count = WdfCmResourceListGetCount(ResourcesTranslated);
+
+    for (i = 0; i < count; i++) {
+
+        descriptor = WdfCmResourceListGetDescriptor(ResourcesTranslated, i);
+
+        switch (descriptor->Type) {
+
+        case CmResourceTypeMemory:
+
+            if (hw->Registers != NULL ||
+                descriptor->u.Memory.Length < sizeof(TOASTER_REGISTERS)) {
+                break;
+            }
+
+            hw->Registers = MmMapIoSpaceEx(descriptor->u.Memory.Start,
+                                           descriptor->u.Memory.Length,
+                                           PAGE_READWRITE | PAGE_NOCACHE);
+            if (hw->Registers == NULL) {
+                WppPrintDeviceError(fdoData->WppRecorderLog,
+                                   "Failed to map %d byte register BAR\n",
+                                   descriptor->u.Memory.Length);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            hw->RegistersLength = descriptor->u.Memory.Length;
+            break;
+
+        case CmResourceTypeInterrupt:
+
+            if (interrupt == MAXULONG) {
+                interrupt = i;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (hw->Registers == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    id = READ_REGISTER_ULONG(&hw->Registers->Id);
+    if (id != TOASTER_HW_ID) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "Register BAR has id 0x%x, not a toaster\n",
+                           id);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    if (interrupt == MAXULONG) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "Register BAR but no interrupt resource\n");
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    WDF_INTERRUPT_CONFIG_INIT(&interruptConfig,
+                              ToasterEvtInterruptIsr,
+                              ToasterEvtInterruptDpc);
+
+    interruptConfig.EvtInterruptEnable = ToasterEvtInterruptEnable;
+    interruptConfig.EvtInterruptDisable = ToasterEvtInterruptDisable;
+    interruptConfig.InterruptRaw = WdfCmResourceListGetDescriptor(ResourcesRaw, interrupt);
+    interruptConfig.InterruptTranslated = WdfCmResourceListGetDescriptor(ResourcesTranslated, interrupt);
+
+    status = WdfInterruptCreate(Device,
+                                &interruptConfig,
+                                WDF_NO_OBJECT_ATTRIBUTES,
+                                &hw->Interrupt);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfInterruptCreate failed 0x%x\n",
+                           status);
+        hw->Interrupt = NULL;
+        return status;
+    }
+
+    WppPrintDevice(fdoData->WppRecorderLog,
+                  "Hardware toaster: %Id byte register BAR, interrupt resource %d\n",
+                  hw->RegistersLength,
+                  interrupt);
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtDeviceReleaseHardware调用
+VOID
+ToasterHwRelease(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Unmaps the registers. The interrupt is disabled by now, and whatever
+    the device still had was completed by ToasterHwFlush.
+
+--*/
+{
+    PTOASTER_HW         hw;
+    PTOASTER_REGISTERS  registers;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    PAGED_CODE();
+
+    hw = &ToasterFdoGetIoData(Device)->Hw;
+
+    NT_ASSERT(!hw->Connected);
+    NT_ASSERT(IsListEmpty(&hw->Pending));
+
+    //
+    // ToasterHwSetModeration writes the registers under the lock.
+    //
+    KeAcquireInStackQueuedSpinLock(&hw->Lock, &lockHandle);
+    registers = hw->Registers;
+    hw->Registers = NULL;
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    if (registers != NULL) {
+        MmUnmapIoSpace(registers, hw->RegistersLength);
+        hw->RegistersLength = 0;
+    }
+
+    hw->Interrupt = NULL;
+}
+
+//被ToasterCompleteRead和ToasterEvtIoWrite调用
+VOID
+ToasterHwCompleteRequest(
+    _In_ PFDO_IO_DATA       IoData,
+    _In_ WDFREQUEST         Request,
+    _In_ TOASTER_STAT_CLASS Class,
+    _In_ NTSTATUS           Status,
+    _In_ ULONG_PTR          Information,
+    _In_ LONGLONG           StartTicks
+    )
+/*++
+
+Routine Description:
+
+    Completes a read or write whose data has moved. On a hardware toaster
+    with its interrupt enabled and requests still on Pending, the request
+    goes to the device behind them instead, as a no-op command, and
+    ToasterEvtInterruptDpc completes it, with the same status and
+    information, once the device is done with it. That costs the request
+    an interrupt and the coalescing delay, so it is only done to keep it
+    from overtaking a DMA transfer: with nothing pending, or with the
+    command ring as full as copied requests may make it, the request
+    completes right here.
+
+--*/
+{
+    PTOASTER_HW                 hw = &IoData->Hw;
+    PTOASTER_REQUEST_CONTEXT    context;
+    KLOCK_QUEUE_HANDLE          lockHandle;
+    TOASTER_HW_COMMAND          command;
+
+    if (hw->Connected) {
+
+        context = ToasterRequestGetContext(Request);
+        context->StartTicks = StartTicks;
+        context->HwClass = Class;
+        context->HwStatus = Status;
+        context->HwInformation = Information;
+        context->HwSlot = NULL;
+
+        RtlZeroMemory(&command, sizeof(command));
+        command.Opcode = TOASTER_HW_OP_NOP;
+
+        KeAcquireInStackQueuedSpinLock(&hw->Lock, &lockHandle);
+
+        if (hw->Connected &&
+            !IsListEmpty(&hw->Pending) &&
+            hw->Submitted - hw->Completed < TOASTER_HW_COPY_DEPTH) {
+
+            ToasterHwPush(hw, context, &command);
+
+            KeReleaseInStackQueuedSpinLock(&lockHandle);
+            return;
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+    }
+
+    ToasterStatsRecord(IoData, Class, Status, Information, StartTicks);
+
+    ToasterTlRequestStop(Request, Status, Information);
+
+    WdfRequestCompleteWithInformation(Request, Status, Information);
+}
+
+//被ToasterDmaStart调用
+BOOLEAN
+ToasterHwReserve(
+    _In_ PFDO_IO_DATA IoData
+    )
+/*++
+
+Routine Description:
+
+    Sets a command ring entry aside for a DMA transfer, before
+    WdfDmaTransactionExecute, so that ToasterHwSubmit cannot fail from
+    inside EvtProgramDma. The entry is taken by ToasterHwSubmit or given
+    back by ToasterHwUnreserve.
+
+Return Value:
+
+    FALSE if the interrupt is not enabled or the command ring is full.
+
+--*/
+{
+    PTOASTER_HW         hw = &IoData->Hw;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    BOOLEAN             reserved = FALSE;
+
+    KeAcquireInStackQueuedSpinLock(&hw->Lock, &lockHandle);
+
+    if (hw->Connected &&
+        hw->Submitted + hw->Reserved - hw->Completed < TOASTER_HW_QUEUE_DEPTH) {
+
+        hw->Reserved++;
+        reserved = TRUE;
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return reserved;
+}
+
+//被ToasterDmaStart调用
+VOID
+ToasterHwUnreserve(
+    _In_ PFDO_IO_DATA IoData
+    )
+/*++
+
+Routine Description:
+
+    Gives back an entry of ToasterHwReserve that no transfer was submitted
+    with.
+
+--*/
+{
+    PTOASTER_HW         hw = &IoData->Hw;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    KeAcquireInStackQueuedSpinLock(&hw->Lock, &lockHandle);
+
+    NT_ASSERT(hw->Reserved != 0);
+    hw->Reserved--;
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+}
+
+//被ToasterEvtProgramDma调用
+VOID
+ToasterHwSubmit(
+    _In_ PFDO_IO_DATA           IoData,
+    _In_ WDFREQUEST             Request,
+    _In_ PTOASTER_HW_COMMAND    Command
+    )
+/*++
+
+Routine Description:
+
+    Hands a request the device moves the data for to the device, in the
+    entry ToasterHwReserve set aside. The caller has filled in the request
+    context.
+
+    If the interrupt was disabled since the entry was reserved, the
+    request is on Pending all the same and ToasterHwFlush cancels it from
+    D0Exit, like any request of a device that is being disabled.
+
+--*/
+{
+    PTOASTER_HW         hw = &IoData->Hw;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    KeAcquireInStackQueuedSpinLock(&hw->Lock, &lockHandle);
+
+    NT_ASSERT(hw->Reserved != 0);
+    hw->Reserved--;
+
+    ToasterHwPush(hw, ToasterRequestGetContext(Request), Command);
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+}
+
+VOID
+ToasterHwPush(
+    _In_ PTOASTER_HW                Hw,
+    _In_ PTOASTER_REQUEST_CONTEXT   Context,
+    _In_ PTOASTER_HW_COMMAND        Command
+    )
+/*++
+
+Routine Description:
+
+    Puts a request on Pending and its command in the next entry of the
+    command ring, and rings the doorbell. Called with Lock held, so that
+    the device sees the requests in the order they are on Pending. The
+    doorbell write is a barrier: the device cannot fetch the command
+    before it is in memory.
+
+--*/
+{
+    Hw->Commands[Hw->Submitted & (TOASTER_HW_QUEUE_DEPTH - 1)] = *Command;
+
+    InsertTailList(&Hw->Pending, &Context->HwLink);
+    Hw->Submitted++;
+
+    WRITE_REGISTER_ULONG(&Hw->Registers->Doorbell, Hw->Submitted);
+}
+
+ULONG
+ToasterHwCompleteList(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ PLIST_ENTRY    List,
+    _In_ BOOLEAN        Flushed
+    )
+/*++
+
+Routine Description:
+
+    Completes the requests on List, which the caller took off Pending.
+    Flushed is TRUE when the device has not finished them: the data of a
+    copied request has moved anyway, that of a DMA request has not.
+
+Return Value:
+
+    Number of requests completed.
+
+--*/
+{
+    PTOASTER_REQUEST_CONTEXT    context;
+    WDFREQUEST                  request;
+    ULONG                       completed = 0;
+
+    while (!IsListEmpty(List)) {
+
+        context = CONTAINING_RECORD(RemoveHeadList(List),
+                                    TOASTER_REQUEST_CONTEXT,
+                                    HwLink);
+        completed++;
+
+        if (context->HwSlot != NULL) {
+            ToasterDmaComplete(IoData, context->HwSlot, !Flushed);
+            continue;
+        }
+
+        request = (WDFREQUEST) WdfObjectContextGetObject(context);
+
+        ToasterStatsRecord(IoData,
+                           (TOASTER_STAT_CLASS) context->HwClass,
+                           context->HwStatus,
+                           context->HwInformation,
+                           context->StartTicks);
+
+        ToasterTlRequestStop(request, context->HwStatus, context->HwInformation);
+
+        WdfRequestCompleteWithInformation(request,
+                                          context->HwStatus,
+                                          context->HwInformation);
+    }
+
+    return completed;
+}
+
+//被ToasterEvtDeviceD0Exit和ToasterEvtIoStop调用
+VOID
+ToasterHwFlush(
+    _In_ PFDO_IO_DATA IoData
+    )
+/*++
+
+Routine Description:
+
+    Completes every request the device still has without waiting for it:
+    the data has moved already, only the device's acknowledgement is
+    missing. For a device that is gone (surprise removal) and for requests
+    that were submitted while the interrupt was being disabled. A DMA
+    request is cancelled instead, see ToasterDmaComplete.
+
+--*/
+{
+    PTOASTER_HW         hw = &IoData->Hw;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    LIST_ENTRY          flushed;
+
+    InitializeListHead(&flushed);
+
+    KeAcquireInStackQueuedSpinLock(&hw->Lock, &lockHandle);
+
+    while (!IsListEmpty(&hw->Pending)) {
+        InsertTailList(&flushed, RemoveHeadList(&hw->Pending));
+    }
+
+    //
+    // The device may still count the flushed requests as it gets to them;
+    // ToasterEvtInterruptDpc ignores completions up to Submitted.
+    //
+    hw->Completed = hw->Submitted;
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    (VOID) ToasterHwCompleteList(IoData, &flushed, TRUE);
+}
+
+//被ToasterEvtIoStop调用
+BOOLEAN
+ToasterHwStopAcknowledge(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request
+    )
+/*++
+
+Routine Description:
+
+    Acknowledges the stop of a request the device holds, a copied request
+    behind its no-op or a DMA transfer, without requeueing it: the device
+    has it, so it cannot be presented again. The DPC completes it as
+    before, or ToasterHwFlush does from D0Exit.
+
+    Acknowledged under Lock, so that the DPC cannot take the request off
+    Pending and complete it in between.
+
+Return Value:
+
+    FALSE if the request is not on Pending.
+
+--*/
+{
+    PTOASTER_HW                 hw = &IoData->Hw;
+    PTOASTER_REQUEST_CONTEXT    context = ToasterRequestGetContext(Request);
+    KLOCK_QUEUE_HANDLE          lockHandle;
+    PLIST_ENTRY                 entry;
+    BOOLEAN                     found = FALSE;
+
+    KeAcquireInStackQueuedSpinLock(&hw->Lock, &lockHandle);
+
+    for (entry = hw->Pending.Flink; entry != &hw->Pending; entry = entry->Flink) {
+        if (entry == &context->HwLink) {
+            WdfRequestStopAcknowledge(Request, FALSE);
+            found = TRUE;
+            break;
+        }
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return found;
+}
+
+//通过WDF_INTERRUPT_CONFIG_INIT设置的回调
+BOOLEAN
+ToasterEvtInterruptIsr(
+    _In_ WDFINTERRUPT   Interrupt,
+    _In_ ULONG          MessageID
+    )
+/*++
+
+Routine Description:
+
+    Acknowledges the interrupt and leaves the rest to the DPC. Completions
+    the device signals while the DPC is already queued are picked up by
+    the same run.
+
+Return Value:
+
+    FALSE if the interrupt is not the toaster's (shared line).
+
+--*/
+{
+    PTOASTER_HW hw;
+    ULONG       status;
+
+    UNREFERENCED_PARAMETER(MessageID);
+
+    hw = &ToasterFdoGetIoData(WdfInterruptGetDevice(Interrupt))->Hw;
+
+    status = READ_REGISTER_ULONG(&hw->Registers->InterruptStatus) & TOASTER_HW_INT_ALL;
+    if (status == 0) {
+        return FALSE;
+    }
+
+    WRITE_REGISTER_ULONG(&hw->Registers->InterruptStatus, status);
+
+    InterlockedIncrementNoFence64(&hw->Interrupts);
+
+    WdfInterruptQueueDpcForIsr(Interrupt);
+
+    return TRUE;
+}
+
+//通过WDF_INTERRUPT_CONFIG_INIT设置的回调
+VOID
+ToasterEvtInterruptDpc(
+    _In_ WDFINTERRUPT   Interrupt,
+    _In_ WDFOBJECT      AssociatedObject
+    )
+/*++
+
+Routine Description:
+
+    Completes every request the device has finished since the last run.
+    The requests are taken off Pending under the lock and completed after
+    it is dropped, so submissions are never held up by completions.
+
+    Runs on the processor that took the interrupt, which is in the
+    interrupt's affinity and so next to the device (Numa.c).
+
+--*/
+{
+    PFDO_IO_DATA        ioData;
+    PTOASTER_HW         hw;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    LIST_ENTRY          done;
+    ULONG               completed;
+    ULONG               count;
+    ULONG               batch;
+
+    UNREFERENCED_PARAMETER(Interrupt);
+
+    ioData = ToasterFdoGetIoData((WDFDEVICE) AssociatedObject);
+    hw = &ioData->Hw;
+
+    InitializeListHead(&done);
+
+    InterlockedIncrementNoFence64(&hw->Dpcs);
+
+    completed = READ_REGISTER_ULONG(&hw->Registers->Completed);
+
+    KeAcquireInStackQueuedSpinLock(&hw->Lock, &lockHandle);
+
+    //
+    // Signed, because after ToasterHwFlush the device's count can trail
+    // Completed until it catches up with the flushed requests.
+    //
+    if ((LONG) (completed - hw->Completed) > 0) {
+
+        count = min(completed - hw->Completed, hw->Submitted - hw->Completed);
+        hw->Completed += count;
+
+        while (count-- != 0) {
+            InsertTailList(&done, RemoveHeadList(&hw->Pending));
+        }
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    batch = ToasterHwCompleteList(ioData, &done, FALSE);
+    if (batch == 0) {
+        return;
+    }
+
+    InterlockedAddNoFence64(&hw->Requests, batch);
+
+    //
+    // Only ever grows; a lost update between two runs on different
+    // processors just keeps the smaller of two new maxima.
+    //
+    if (batch > ReadULongNoFence(&hw->MaxBatch)) {
+        WriteULongNoFence(&hw->MaxBatch, batch);
+    }
+}
+
+//通过WDF_INTERRUPT_CONFIG的EvtInterruptEnable设置的回调
+NTSTATUS
+ToasterEvtInterruptEnable(
+    _In_ WDFINTERRUPT   Interrupt,
+    _In_ WDFDEVICE      AssociatedDevice
+    )
+/*++
+
+Routine Description:
+
+    Programs moderation and the rings (ToasterDmaProgramDevice) and
+    unmasks the completion interrupt. Runs at DIRQL after D0Entry. The queues have not been started yet and Pending
+    is empty (ToasterHwFlush ran in the last D0Exit), so the counters are
+    taken from the device without the lock.
+
+--*/
+{
+    PTOASTER_HW         hw;
+    PTOASTER_REGISTERS  registers;
+
+    UNREFERENCED_PARAMETER(Interrupt);
+
+    hw = &ToasterFdoGetIoData(AssociatedDevice)->Hw;
+    registers = hw->Registers;
+
+    WRITE_REGISTER_ULONG(&registers->CoalesceCount, hw->CoalesceCount);
+    WRITE_REGISTER_ULONG(&registers->CoalesceTimer, hw->CoalesceTimer);
+
+    ToasterDmaProgramDevice(ToasterFdoGetIoData(AssociatedDevice));
+
+    NT_ASSERT(hw->Reserved == 0);
+
+    hw->Completed = READ_REGISTER_ULONG(&registers->Completed);
+    hw->Submitted = hw->Completed;
+    WRITE_REGISTER_ULONG(&registers->Doorbell, hw->Submitted);
+
+    WRITE_REGISTER_ULONG(&registers->InterruptStatus, TOASTER_HW_INT_ALL);
+    WRITE_REGISTER_ULONG(&registers->InterruptMask, TOASTER_HW_INT_COMPLETION);
+
+    hw->Connected = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+//通过WDF_INTERRUPT_CONFIG的EvtInterruptDisable设置的回调
+NTSTATUS
+ToasterEvtInterruptDisable(
+    _In_ WDFINTERRUPT   Interrupt,
+    _In_ WDFDEVICE      AssociatedDevice
+    )
+/*++
+
+Routine Description:
+
+    Masks the interrupt before D0Exit. From here on reads and writes
+    complete inline; anything the device still has, such as requests
+    ToasterEvtIoStop acknowledged, is completed by ToasterHwFlush from
+    D0Exit.
+
+--*/
+{
+    PTOASTER_HW hw;
+
+    UNREFERENCED_PARAMETER(Interrupt);
+
+    hw = &ToasterFdoGetIoData(AssociatedDevice)->Hw;
+
+    hw->Connected = FALSE;
+
+    WRITE_REGISTER_ULONG(&hw->Registers->InterruptMask, 0);
+
+    return STATUS_SUCCESS;
+}
+
+//被EvtWmiInstanceInterruptModerationQueryInstance调用
+VOID
+ToasterHwQueryModeration(
+    _In_  WDFDEVICE                     Device,
+    _Out_ PToasterInterruptModeration   Moderation
+    )
+{
+    PTOASTER_HW hw;
+
+    PAGED_CODE();
+
+    hw = &ToasterFdoGetIoData(Device)->Hw;
+
+    Moderation->CoalesceCount = hw->CoalesceCount;
+    Moderation->CoalesceTimer = hw->CoalesceTimer;
+    Moderation->Connected = hw->Connected;
+    Moderation->MaxBatch = ReadULongNoFence(&hw->MaxBatch);
+    Moderation->Interrupts = (ULONGLONG) ReadNoFence64(&hw->Interrupts);
+    Moderation->Dpcs = (ULONGLONG) ReadNoFence64(&hw->Dpcs);
+    Moderation->Requests = (ULONGLONG) ReadNoFence64(&hw->Requests);
+}
+
+//被EvtWmiInstanceInterruptModerationSetInstance和SetItem调用
+NTSTATUS
+ToasterHwSetModeration(
+    _In_ WDFDEVICE                      Device,
+    _In_ PToasterInterruptModeration    Moderation
+    )
+/*++
+
+Routine Description:
+
+    Replaces the writable part of the moderation settings. A device in D0
+    gets them right away; otherwise they are programmed on the next
+    EvtInterruptEnable.
+
+--*/
+{
+    PTOASTER_HW         hw;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    PAGED_CODE();
+
+    if (Moderation->CoalesceCount > TOASTER_HW_MAX_COALESCE_COUNT ||
+        Moderation->CoalesceTimer > TOASTER_HW_MAX_COALESCE_TIMER) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    hw = &ToasterFdoGetIoData(Device)->Hw;
+
+    KeAcquireInStackQueuedSpinLock(&hw->Lock, &lockHandle);
+
+    hw->CoalesceCount = Moderation->CoalesceCount;
+    hw->CoalesceTimer = Moderation->CoalesceTimer;
+
+    if (hw->Connected && hw->Registers != NULL) {
+        WRITE_REGISTER_ULONG(&hw->Registers->CoalesceCount, hw->CoalesceCount);
+        WRITE_REGISTER_ULONG(&hw->Registers->CoalesceTimer, hw->CoalesceTimer);
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return STATUS_SUCCESS;
+}
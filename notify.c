@@ -0,0 +1,432 @@
+/*++
+
+Module Name:
+
+    Notify.c
+
+Abstract:
+
+    Event notification for the featured toaster function driver.
+
+    A consumer keeps an IOCTL_TOASTER_WAIT_EVENTS request outstanding
+    instead of polling WMI or the device. Parked waits sit in a manual
+    queue; ToasterNotify records an event and queues a DPC, which walks
+    the queue and completes every wait the events since its Sequence
+    satisfy. Events that come in while the DPC is already queued ride along
+    with the same run, and a wait that was not outstanding when they
+    happened gets all of them at once with its next call.
+
+    Events: data in the ring (Toaster.c, Batch.c), crispiness changes
+    (Bus.c), D0Entry and D0Exit (Power.c) and device arrival (Wmi.c).
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "notify.tmh"
+
+EVT_WDF_DPC                             ToasterNotifyEvtDpc;
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE   ToasterNotifyEvtCanceled;
+
+static
+ULONG
+ToasterNotifyGetPending(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request
+    );
+
+static
+ULONG_PTR
+ToasterNotifyFill(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request,
+    _In_ ULONG          Events
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterNotifyInitialize)
+#endif
+
+
+//被ToasterEvtDeviceAdd调用
+NTSTATUS
+ToasterNotifyInitialize(
+    _In_ WDFDEVICE Device
+    )
+{
+    NTSTATUS                status;
+    PFDO_DATA               fdoData;
+    PTOASTER_NOTIFY         notify;
+    WDF_IO_QUEUE_CONFIG     queueConfig;
+    WDF_DPC_CONFIG          dpcConfig;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    notify = &ToasterFdoGetIoData(Device)->Notify;
+
+    KeInitializeSpinLock(&notify->Lock);
+
+    notify->PowerState = WdfPowerDeviceD0;
+
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+    queueConfig.EvtIoCanceledOnQueue = ToasterNotifyEvtCanceled;
+
+    status = WdfIoQueueCreate(Device,
+                              &queueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES,
+                              &notify->WaitQueue);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfIoQueueCreate for event waits failed 0x%x\n",
+                           status);
+        return status;
+    }
+
+    WDF_DPC_CONFIG_INIT(&dpcConfig, ToasterNotifyEvtDpc);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfDpcCreate(&dpcConfig, &attributes, &notify->Dpc);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfDpcCreate failed 0x%x\n",
+                           status);
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ToasterNotify(
+    _In_ PFDO_IO_DATA       IoData,
+    _In_ TOASTER_EVENT_TYPE Type
+    )
+/*++
+
+Routine Description:
+
+    Records an event. Recorded even with nobody waiting, so that the next
+    wait reports it. Callable at DISPATCH_LEVEL and below.
+
+--*/
+{
+    PTOASTER_NOTIFY     notify = &IoData->Notify;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    KeAcquireInStackQueuedSpinLock(&notify->Lock, &lockHandle);
+
+    notify->Sequence++;
+    notify->LastSequence[Type] = notify->Sequence;
+    notify->Counts[Type]++;
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    if (ReadNoFence(&notify->Waiters) != 0) {
+        WdfDpcEnqueue(notify->Dpc);
+    }
+}
+
+ULONG
+ToasterNotifyGetPending(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request
+    )
+/*++
+
+Routine Description:
+
+    Returns the events a wait asked for that have happened since its
+    Sequence, zero if none.
+
+--*/
+{
+    PTOASTER_NOTIFY             notify = &IoData->Notify;
+    PTOASTER_REQUEST_CONTEXT    context = ToasterRequestGetContext(Request);
+    KLOCK_QUEUE_HANDLE          lockHandle;
+    ULONG                       events = 0;
+    ULONG                       type;
+
+    KeAcquireInStackQueuedSpinLock(&notify->Lock, &lockHandle);
+
+    for (type = ToasterEventData + 1; type < ToasterEventMaximum; type++) {
+        if (notify->LastSequence[type] > context->EventSequence) {
+            events |= 1 << type;
+        }
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    if ((context->EventMask & TOASTER_EVENT_DATA) &&
+        ToasterFileGetReadable(IoData, ToasterRequestGetFile(Request)) != 0) {
+        events |= TOASTER_EVENT_DATA;
+    }
+
+    return events & context->EventMask;
+}
+
+ULONG_PTR
+ToasterNotifyFill(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request,
+    _In_ ULONG          Events
+    )
+/*++
+
+Routine Description:
+
+    Writes TOASTER_EVENTS into the output buffer of a wait, whose size
+    ToasterNotifyWait has checked.
+
+Return Value:
+
+    Number of bytes written.
+
+--*/
+{
+    PTOASTER_NOTIFY     notify = &IoData->Notify;
+    PTOASTER_EVENTS     output;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                   sizeof(TOASTER_EVENTS),
+                                                   (PVOID*) &output,
+                                                   NULL))) {
+        return 0;
+    }
+
+    RtlZeroMemory(output, sizeof(TOASTER_EVENTS));
+
+    KeAcquireInStackQueuedSpinLock(&notify->Lock, &lockHandle);
+
+    output->Sequence = notify->Sequence;
+    RtlCopyMemory(output->Counts, notify->Counts, sizeof(output->Counts));
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    output->Events = Events;
+    output->CrispinessLevel = (ULONG) ReadNoFence(&IoData->CrispinessLevel);
+    output->SafetyLockEnabled = (ULONG) ReadNoFence(&IoData->SafetyLockEnabled);
+    output->PowerState = ReadULongNoFence(&notify->PowerState);
+    output->Readable = ToasterFileGetReadable(IoData, ToasterRequestGetFile(Request));
+
+    return sizeof(TOASTER_EVENTS);
+}
+
+//被ToasterEvtIoDeviceControl调用
+NTSTATUS
+ToasterNotifyWait(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_TOASTER_WAIT_EVENTS: completes the wait right away if
+    it is already satisfied, otherwise parks it.
+
+Return Value:
+
+    STATUS_PENDING if the request was parked; it is then completed by
+    ToasterNotifyEvtDpc, ToasterNotifyEvtCanceled or, once the handle's
+    WaitTimeout is up, by the sweep of Deadline.c. Anything else is for
+    the caller to complete the request with.
+
+--*/
+{
+    NTSTATUS                    status;
+    PFDO_IO_DATA                ioData;
+    PTOASTER_NOTIFY             notify;
+    PTOASTER_EVENT_WAIT         input;
+    PTOASTER_REQUEST_CONTEXT    context;
+    PTOASTER_FILE_CONTEXT       file;
+    ULONG                       events;
+    LONGLONG                    deadline;
+
+    *Information = 0;
+
+    ioData = ToasterFdoGetIoData(Device);
+    notify = &ioData->Notify;
+    context = ToasterRequestGetContext(Request);
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(TOASTER_EVENT_WAIT),
+                                           (PVOID*) &input,
+                                           NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (input->Mask == 0 || (input->Mask & ~TOASTER_EVENT_ALL) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // The input and output share the system buffer; take the input out
+    // before anything writes to it.
+    //
+    context->EventMask = input->Mask;
+    context->EventSequence = input->Sequence;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(TOASTER_EVENTS),
+                                            NULL,
+                                            NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    events = ToasterNotifyGetPending(ioData, Request);
+    if (events != 0) {
+        *Information = ToasterNotifyFill(ioData, Request, events);
+        return STATUS_SUCCESS;
+    }
+
+    InterlockedIncrement(&notify->Waiters);
+
+    file = ToasterRequestGetFile(Request);
+
+    deadline = ToasterDeadlineSet(ioData,
+                                  Request,
+                                  (file != NULL) ? ReadULongNoFence(&file->WaitTimeout) : 0);
+
+    status = WdfRequestForwardToIoQueue(Request, notify->WaitQueue);
+    if (!NT_SUCCESS(status)) {
+        InterlockedDecrement(&notify->Waiters);
+        return status;
+    }
+
+    ToasterDeadlineArm(ioData, deadline);
+
+    //
+    // An event that came in after the check above saw no waiter to
+    // complete; have the DPC look at this one.
+    //
+    WdfDpcEnqueue(notify->Dpc);
+
+    return STATUS_PENDING;
+}
+
+//通过WdfDpcCreate设置的回调
+VOID
+ToasterNotifyEvtDpc(
+    _In_ WDFDPC Dpc
+    )
+/*++
+
+Routine Description:
+
+    Completes every parked wait that has something to report. The walk
+    keeps a reference on the last wait it left in the queue, which is
+    where it picks up after each completion.
+
+--*/
+{
+    NTSTATUS        status;
+    PFDO_IO_DATA    ioData;
+    PTOASTER_NOTIFY notify;
+    WDFREQUEST      previous = NULL;
+    WDFREQUEST      found;
+    WDFREQUEST      request;
+    ULONG           events;
+    ULONG_PTR       information;
+
+    ioData = ToasterFdoGetIoData(WdfDpcGetParentObject(Dpc));
+    notify = &ioData->Notify;
+
+    for (;;) {
+
+        status = WdfIoQueueFindRequest(notify->WaitQueue,
+                                       previous,
+                                       NULL,
+                                       NULL,
+                                       &found);
+
+        if (status == STATUS_NOT_FOUND && previous != NULL) {
+            //
+            // The wait the walk was positioned on was canceled; start
+            // over.
+            //
+            WdfObjectDereference(previous);
+            previous = NULL;
+            continue;
+        }
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        events = ToasterNotifyGetPending(ioData, found);
+
+        if (events == 0) {
+            if (previous != NULL) {
+                WdfObjectDereference(previous);
+            }
+            previous = found;
+            continue;
+        }
+
+        status = WdfIoQueueRetrieveFoundRequest(notify->WaitQueue, found, &request);
+        WdfObjectDereference(found);
+
+        if (NT_SUCCESS(status)) {
+
+            InterlockedDecrement(&notify->Waiters);
+
+            information = ToasterNotifyFill(ioData, request, events);
+
+            ToasterStatsRecord(ioData,
+                               ToasterStatIoctl,
+                               STATUS_SUCCESS,
+                               information,
+                               ToasterRequestGetContext(request)->StartTicks);
+
+            ToasterTlRequestStop(request, STATUS_SUCCESS, information);
+
+            WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, information);
+        }
+    }
+
+    if (previous != NULL) {
+        WdfObjectDereference(previous);
+    }
+}
+
+//通过WDF_IO_QUEUE_CONFIG的EvtIoCanceledOnQueue设置的回调
+VOID
+ToasterNotifyEvtCanceled(
+    _In_ WDFQUEUE   Queue,
+    _In_ WDFREQUEST Request
+    )
+{
+    PFDO_IO_DATA    ioData;
+
+    ioData = ToasterFdoGetIoData(WdfIoQueueGetDevice(Queue));
+
+    InterlockedDecrement(&ioData->Notify.Waiters);
+
+    ToasterStatsRecord(ioData,
+                       ToasterStatIoctl,
+                       STATUS_CANCELLED,
+                       0,
+                       ToasterRequestGetContext(Request)->StartTicks);
+
+    ToasterTlRequestStop(Request, STATUS_CANCELLED, 0);
+
+    WdfRequestComplete(Request, STATUS_CANCELLED);
+}
@@ -0,0 +1,244 @@
+/*++
+
+Module Name:
+
+    Numa.c
+
+Abstract:
+
+    NUMA placement for the featured toaster function driver.
+
+    The node comes from the PDO (IoGetDeviceNumaNode) when the device is
+    added. The buffers the device keeps for its lifetime or for a start
+    (the data ring, the ring snapshot, the shared rings and the statistics)
+    are allocated on that node through ToasterNumaAllocate, which falls
+    back to any node rather than failing when the node is short of memory.
+
+    The processors the DPCs are targeted at come from the device's
+    interrupt resource, or from the node when the device has no interrupt,
+    so that completions run next to both the memory and the device. A
+    queued DPC cannot be retargeted, and event waiters, which queue the
+    notification DPC, survive a stop; so the target is set by the first
+    start, before the device can be opened, and kept by every later one.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "numa.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterNumaInitialize)
+#pragma alloc_text(PAGE, ToasterNumaSetInterrupt)
+#pragma alloc_text(PAGE, ToasterNumaApplyAffinity)
+#endif
+
+
+//被ToasterEvtDeviceAdd调用
+VOID
+ToasterNumaInitialize(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Records the node the PDO reports. Called before anything is allocated
+    for the device. A PDO without a node (a single-node machine, or a bus
+    that does not report proximity) leaves NumaNode at MM_ANY_NODE_OK.
+
+--*/
+{
+    PFDO_DATA       fdoData;
+    PFDO_IO_DATA    ioData;
+    USHORT          node;
+    NTSTATUS        status;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
+
+    ioData->NumaNode = MM_ANY_NODE_OK;
+    RtlZeroMemory(&ioData->InterruptAffinity, sizeof(GROUP_AFFINITY));
+    ioData->DpcTargeted = FALSE;
+
+    status = IoGetDeviceNumaNode(WdfDeviceWdmGetPhysicalDevice(Device), &node);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDevice(fdoData->WppRecorderLog,
+                      "No NUMA node for the device 0x%x\n",
+                      status);
+        return;
+    }
+
+    ioData->NumaNode = node;
+
+    WppPrintDevice(fdoData->WppRecorderLog, "NUMA node %d\n", node);
+}
+
+PVOID
+ToasterNumaAllocate(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ SIZE_T         Size,
+    _In_ BOOLEAN        CacheAligned
+    )
+/*++
+
+Routine Description:
+
+    Allocates non-paged, non-executable memory on the device's node. The
+    memory is not zeroed, like ExAllocatePoolWithTag's, and is freed with
+    ExFreePoolWithTag(..., TOASTER_POOL_TAG).
+
+    ExAllocatePool3 is used only because it is the one pool allocator that
+    takes a preferred node; the fallback is the ExAllocatePoolWithTag the
+    rest of the driver uses.
+
+--*/
+{
+    POOL_EXTENDED_PARAMETER parameter;
+    POOL_FLAGS              flags;
+    PVOID                   buffer;
+
+    flags = POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED;
+    if (CacheAligned) {
+        flags |= POOL_FLAG_CACHE_ALIGNED;
+    }
+
+    if (IoData->NumaNode != MM_ANY_NODE_OK) {
+
+        RtlZeroMemory(&parameter, sizeof(parameter));
+        parameter.Type = PoolExtendedParameterNumaNode;
+        parameter.PreferredNode = IoData->NumaNode;
+
+        buffer = ExAllocatePool3(flags, Size, TOASTER_POOL_TAG, &parameter, 1);
+        if (buffer != NULL) {
+            return buffer;
+        }
+    }
+
+    //
+    // Memory on another node only costs throughput; no memory costs the
+    // start.
+    //
+    return ExAllocatePoolWithTag(CacheAligned ? NonPagedPoolNxCacheAligned : NonPagedPoolNx,
+                                 Size,
+                                 TOASTER_POOL_TAG);
+}
+
+//被ToasterEvtDevicePrepareHardware调用
+VOID
+ToasterNumaSetInterrupt(
+    _In_ WDFDEVICE                          Device,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR    Descriptor
+    )
+/*++
+
+Routine Description:
+
+    Takes the processors of a translated CmResourceTypeInterrupt
+    descriptor. With several interrupts (MSI-X) the first one is used.
+
+--*/
+{
+    PFDO_IO_DATA    ioData;
+    USHORT          group;
+    KAFFINITY       mask;
+
+    PAGED_CODE();
+
+    ioData = ToasterFdoGetIoData(Device);
+
+    if (ioData->InterruptAffinity.Mask != 0) {
+        return;
+    }
+
+    if (Descriptor->Flags & CM_RESOURCE_INTERRUPT_MESSAGE) {
+        group = Descriptor->u.MessageInterrupt.Translated.Group;
+        mask = Descriptor->u.MessageInterrupt.Translated.Affinity;
+    } else {
+        group = Descriptor->u.Interrupt.Group;
+        mask = Descriptor->u.Interrupt.Affinity;
+    }
+
+    ioData->InterruptAffinity.Group = group;
+    ioData->InterruptAffinity.Mask = mask;
+}
+
+//被ToasterEvtDevicePrepareHardware调用
+VOID
+ToasterNumaApplyAffinity(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Targets the DPCs at the lowest processor of the interrupt's affinity,
+    or of the node's when the device has no interrupt. Without either they
+    keep running wherever they are queued. Called once the resource list
+    has been walked; the interrupt affinity is cleared again for the next
+    start.
+
+    Only the first start targets the DPCs. Nothing can have queued them
+    yet: the notification DPC is only queued for event waiters, and there
+    are none before the device has started once. Later starts keep that
+    target, since waiters that survived the stop can have it queued.
+
+--*/
+{
+    PFDO_DATA           fdoData;
+    PFDO_IO_DATA        ioData;
+    GROUP_AFFINITY      affinity;
+    PROCESSOR_NUMBER    processor;
+    NTSTATUS            status;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
+
+    affinity = ioData->InterruptAffinity;
+    RtlZeroMemory(&ioData->InterruptAffinity, sizeof(GROUP_AFFINITY));
+
+    if (ioData->DpcTargeted) {
+        return;
+    }
+
+    ioData->DpcTargeted = TRUE;
+
+    if (affinity.Mask == 0 && ioData->NumaNode != MM_ANY_NODE_OK) {
+        KeQueryNodeActiveAffinity(ioData->NumaNode, &affinity, NULL);
+    }
+
+    if (affinity.Mask == 0) {
+        return;
+    }
+
+    RtlZeroMemory(&processor, sizeof(processor));
+    processor.Group = affinity.Group;
+    processor.Number = (UCHAR) RtlFindLeastSignificantBit((ULONGLONG) affinity.Mask);
+
+    status = KeSetTargetProcessorDpcEx(WdfDpcWdmGetDpc(ioData->Notify.Dpc), &processor);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "KeSetTargetProcessorDpcEx failed 0x%x\n",
+                           status);
+        return;
+    }
+
+    WppPrintDevice(fdoData->WppRecorderLog,
+                  "DPCs target processor %d:%d (affinity 0x%Ix)\n",
+                  processor.Group,
+                  processor.Number,
+                  affinity.Mask);
+}
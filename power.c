@@ -8,6 +8,12 @@ Abstract:
     Implements callbacks to manager power transition, wait-wake and selective
     suspend.
 
+    Every callback is recorded in a small ring in FDO_IO_DATA, so that
+    request latency spikes can be lined up with power transitions after
+    the fact. The ring is read through IOCTL_TOASTER_GET_POWER_LOG and the
+    ToasterPowerLog WMI block. A session with the power keyword on gets
+    each one as a TraceLogging PowerEvent as well, see ToasterTl.h.
+
 Environment:
 
     Kernel mode
@@ -15,6 +21,7 @@ Environment:
 --*/
 
 #include "toaster.h"
+#include "toasterio.h"
 
 #include "trace.h"
 //
@@ -23,11 +30,8 @@ Environment:
 #include "power.tmh"
 
 #ifdef ALLOC_PRAGMA
-#pragma alloc_text(PAGE, ToasterEvtDeviceD0Exit)
 #pragma alloc_text(PAGE, ToasterEvtDeviceArmWakeFromS0)
 #pragma alloc_text(PAGE, ToasterEvtDeviceArmWakeFromSx)
-#pragma alloc_text(PAGE, ToasterEvtDeviceWakeFromS0Triggered)
-#pragma alloc_text(PAGE, DbgDevicePowerString)
 #endif // ALLOC_PRAGMA
 
 //pnpPowerCallbacks的回调
@@ -68,15 +72,46 @@ Return Value:
 --*/
 {
     PFDO_DATA            fdoData;
+    LONGLONG             startTicks;
 
     UNREFERENCED_PARAMETER(RecentPowerState);
 
+    startTicks = ToasterStatsStart();
+
     fdoData = ToasterFdoGetData(Device);
 
     WppPrintDevice(fdoData->WppRecorderLog,
                    "ToasterEvtDeviceD0Entry - coming from %s\n",
                    DbgDevicePowerString(RecentPowerState));
 
+    //
+    // Every resume from a low-power state is a cost the idle policy tries
+    // to avoid, see idle.c. The first start is not one.
+    //
+    if (RecentPowerState != WdfPowerDeviceD3Final) {
+        InterlockedIncrement(&ToasterFdoGetIoData(Device)->Idle.Resumes);
+
+        //
+        // What D0Exit saved is put back by the first request that needs
+        // it, not here, see state.c.
+        //
+        ToasterStateResumed(Device);
+    }
+
+    //
+    // Small writes may go straight into the ring again, see
+    // ToasterCoalesceWrite.
+    //
+    ExReInitializeRundownProtection(&ToasterFdoGetIoData(Device)->CoalesceRundown);
+
+    ToasterStateRecordTransition(Device, TRUE, startTicks);
+
+    ToasterPowerLogRecord(Device,
+                          ToasterPowerEventD0Entry,
+                          RecentPowerState,
+                          WdfPowerDeviceD0,
+                          startTicks);
+
     return STATUS_SUCCESS;
 }
 
@@ -95,6 +130,11 @@ Routine Description:
     sends this request when the power policy manager of this device stack
     (probaby the FDO) requests a change in D-state by calling PoRequestPowerIrp.
 
+    Dirty device state is saved here, see state.c. This function is not
+    marked pageable: the paging device may already be on its way down
+    during a system suspend, and a page fault here would stretch the
+    transition that the ToasterPowerState block times.
+
 Arguments:
 
     Device - handle to a framework device object.
@@ -110,10 +150,9 @@ Return Value:
 --*/
 {
     PFDO_DATA            fdoData;
+    LONGLONG             startTicks;
 
-    UNREFERENCED_PARAMETER(PowerState);
-
-    PAGED_CODE();
+    startTicks = ToasterStatsStart();
 
     fdoData = ToasterFdoGetData(Device);
 
@@ -121,6 +160,34 @@ Return Value:
                    "ToasterEvtDeviceD0Exit %s\n",
                    DbgDevicePowerString(PowerState));
 
+    //
+    // From here on small writes wait in the write queue as well.
+    //
+    ExWaitForRundownProtectionRelease(&ToasterFdoGetIoData(Device)->CoalesceRundown);
+
+    //
+    // The interrupt is disabled; requests the device got while it was
+    // being disabled, and the ones ToasterEvtIoStop acknowledged, would
+    // otherwise never complete, see interrupt.c. Before the save, so that
+    // no transfer still holds a span of the ring.
+    //
+    ToasterHwFlush(ToasterFdoGetIoData(Device));
+
+    //
+    // Nothing survives a remove, so there is nothing to save for it.
+    //
+    if (PowerState != WdfPowerDeviceD3Final) {
+        ToasterStateSave(Device);
+    }
+
+    ToasterStateRecordTransition(Device, FALSE, startTicks);
+
+    ToasterPowerLogRecord(Device,
+                          ToasterPowerEventD0Exit,
+                          WdfPowerDeviceD0,
+                          PowerState,
+                          startTicks);
+
     return STATUS_SUCCESS;
 }
 
@@ -152,13 +219,22 @@ Return Value:
 --*/
 {
     PFDO_DATA            fdoData;
+    LONGLONG             startTicks;
 
     PAGED_CODE();
 
+    startTicks = ToasterStatsStart();
+
     fdoData = ToasterFdoGetData(Device);
 
     WppPrintDevice(fdoData->WppRecorderLog, "--> ToasterEvtDeviceArmWakeFromS0\n");
 
+    ToasterPowerLogRecord(Device,
+                          ToasterPowerEventArmWakeFromS0,
+                          WdfPowerDeviceInvalid,
+                          WdfPowerDeviceInvalid,
+                          startTicks);
+
     WppPrintDevice(fdoData->WppRecorderLog, "<-- ToasterEvtDeviceArmWakeFromS0\n");
 
     return STATUS_SUCCESS;
@@ -192,13 +268,22 @@ Return Value:
 --*/
 {
     PFDO_DATA            fdoData;
+    LONGLONG             startTicks;
 
     PAGED_CODE();
 
+    startTicks = ToasterStatsStart();
+
     fdoData = ToasterFdoGetData(Device);
 
     WppPrintDevice(fdoData->WppRecorderLog, "--> ToasterEvtDeviceArmWakeFromSx\n");
 
+    ToasterPowerLogRecord(Device,
+                          ToasterPowerEventArmWakeFromSx,
+                          WdfPowerDeviceInvalid,
+                          WdfPowerDeviceInvalid,
+                          startTicks);
+
     WppPrintDevice(fdoData->WppRecorderLog, "<-- ToasterEvtDeviceArmWakeFromSx\n");
 
     return STATUS_SUCCESS;
@@ -232,11 +317,20 @@ Return Value:
 --*/
 {
     PFDO_DATA            fdoData;
+    LONGLONG             startTicks;
+
+    startTicks = ToasterStatsStart();
 
     fdoData = ToasterFdoGetData(Device);
 
     WppPrintDevice(fdoData->WppRecorderLog, "--> ToasterEvtDeviceDisarmWakeFromS0\n");
 
+    ToasterPowerLogRecord(Device,
+                          ToasterPowerEventDisarmWakeFromS0,
+                          WdfPowerDeviceInvalid,
+                          WdfPowerDeviceInvalid,
+                          startTicks);
+
     WppPrintDevice(fdoData->WppRecorderLog, "<-- ToasterEvtDeviceDisarmWakeFromS0\n");
 
     return ;
@@ -272,11 +366,20 @@ Return Value:
 --*/
 {
     PFDO_DATA            fdoData;
+    LONGLONG             startTicks;
+
+    startTicks = ToasterStatsStart();
 
     fdoData = ToasterFdoGetData(Device);
 
     WppPrintDevice(fdoData->WppRecorderLog, "--> ToasterEvtDeviceDisarmWakeFromSx\n");
 
+    ToasterPowerLogRecord(Device,
+                          ToasterPowerEventDisarmWakeFromSx,
+                          WdfPowerDeviceInvalid,
+                          WdfPowerDeviceInvalid,
+                          startTicks);
+
     WppPrintDevice(fdoData->WppRecorderLog, "<-- ToasterEvtDeviceDisarmWakeFromSx\n");
 
     return ;
@@ -294,7 +397,13 @@ Routine Description:
     EvtDeviceWakeFromS0Triggered will be called whenever the device triggers its
     wake signal after being armed for wake.
 
-    This function is pageable and runs at PASSIVE_LEVEL.
+    This function runs at PASSIVE_LEVEL.
+
+    This function is not marked pageable because this function is in the
+    device power up path. When a function is marked pagable and the code
+    section is paged out, it will generate a page fault which could impact
+    the fast resume behavior because the client driver will have to wait
+    until the system drivers can service this page fault.
 
 Arguments:
 
@@ -307,13 +416,19 @@ Return Value:
 --*/
 {
     PFDO_DATA            fdoData;
+    LONGLONG             startTicks;
 
-    PAGED_CODE();
+    startTicks = ToasterStatsStart();
 
     fdoData = ToasterFdoGetData(Device);
 
     WppPrintDevice(fdoData->WppRecorderLog, "--> ToasterEvtDeviceWakeFromS0Triggered\n");
 
+    ToasterPowerLogRecord(Device,
+                          ToasterPowerEventWakeFromS0Triggered,
+                          WdfPowerDeviceInvalid,
+                          WdfPowerDeviceInvalid,
+                          startTicks);
 
     WppPrintDevice(fdoData->WppRecorderLog, "<-- ToasterEvtDeviceWakeFromS0Triggered\n");
 
@@ -350,15 +465,249 @@ Return Value:
 --*/
 {
     PFDO_DATA            fdoData;
+    LONGLONG             startTicks;
+
+    startTicks = ToasterStatsStart();
 
     fdoData = ToasterFdoGetData(Device);
 
     WppPrintDevice(fdoData->WppRecorderLog, "--> ToasterEvtDeviceWakeFromSxTriggered\n");
 
+    ToasterPowerLogRecord(Device,
+                          ToasterPowerEventWakeFromSxTriggered,
+                          WdfPowerDeviceInvalid,
+                          WdfPowerDeviceInvalid,
+                          startTicks);
+
     WppPrintDevice(fdoData->WppRecorderLog, "<-- ToasterEvtDeviceWakeFromSxTriggered\n");
 
 }
 
+static
+ULONG
+ToasterPowerQueueDepth(
+    _In_ PFDO_IO_DATA IoData
+    )
+/*++
+
+Routine Description:
+
+    Requests waiting in, or presented by, the driver's queues.
+
+--*/
+{
+    WDFQUEUE    queues[3 + ToasterPriorityMaximum];
+    ULONG       queueRequests;
+    ULONG       driverRequests;
+    ULONG       depth = 0;
+    ULONG       i;
+
+    queues[0] = IoData->ReadQueue;
+    queues[1] = IoData->WriteQueue;
+    queues[2] = IoData->IoctlQueue;
+    for (i = 0; i < ToasterPriorityMaximum; i++) {
+        queues[3 + i] = IoData->PendingReadQueue[i];
+    }
+
+    for (i = 0; i < ARRAYSIZE(queues); i++) {
+        if (queues[i] != NULL) {
+            (VOID) WdfIoQueueGetState(queues[i], &queueRequests, &driverRequests);
+            depth += queueRequests + driverRequests;
+        }
+    }
+
+    return depth;
+}
+
+VOID
+ToasterPowerLogRecord(
+    _In_ WDFDEVICE                  Device,
+    _In_ TOASTER_POWER_EVENT_TYPE   Type,
+    _In_ WDF_POWER_DEVICE_STATE     FromState,
+    _In_ WDF_POWER_DEVICE_STATE     ToState,
+    _In_ LONGLONG                   StartTicks
+    )
+/*++
+
+Routine Description:
+
+    Appends one event to the power log, overwriting the oldest one once
+    the ring is full. Called at the end of each power callback.
+
+Arguments:
+
+    Device - Handle to a framework device object.
+
+    Type - the callback.
+
+    FromState, ToState - the transition, WdfPowerDeviceInvalid if the
+        callback is not given one.
+
+    StartTicks - ToasterStatsStart value taken when the callback started.
+
+--*/
+{
+    PFDO_IO_DATA            ioData = ToasterFdoGetIoData(Device);
+    PTOASTER_POWER_LOG_RING log = &ioData->PowerLog;
+    TOASTER_POWER_EVENT     event;
+    LARGE_INTEGER           now;
+    ULONG64                 micros;
+    KLOCK_QUEUE_HANDLE      lockHandle;
+
+    micros = (ULONG64) (ToasterStatsStart() - StartTicks) * 1000000 /
+             (ULONG64) ioData->Stats.Frequency;
+
+    KeQuerySystemTimePrecise(&now);
+
+    event.Timestamp = (ULONG64) now.QuadPart - micros * 10;
+    event.Type = Type;
+    event.FromState = FromState;
+    event.ToState = ToState;
+    event.Duration = (ULONG) min(micros, MAXULONG);
+    event.QueueDepth = ToasterPowerQueueDepth(ioData);
+
+    KeAcquireInStackQueuedSpinLock(&log->Lock, &lockHandle);
+
+    event.Sequence = log->Next;
+    log->Events[log->Next & (TOASTER_POWER_LOG_ENTRIES - 1)] = event;
+    log->Next++;
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    TraceLoggingWrite(ToasterTlProvider,
+                      "PowerEvent",
+                      TraceLoggingLevel(TOASTER_TL_LEVEL),
+                      TraceLoggingKeyword(TOASTER_TL_KEYWORD_POWER),
+                      TraceLoggingPointer(Device, "Device"),
+                      TraceLoggingUInt32((ULONG) Type, "Type"),
+                      TraceLoggingUInt32((ULONG) FromState, "FromState"),
+                      TraceLoggingUInt32((ULONG) ToState, "ToState"),
+                      TraceLoggingUInt32(event.Duration, "DurationUs"),
+                      TraceLoggingUInt32(event.QueueDepth, "QueueDepth"));
+
+    if (Type == ToasterPowerEventD0Entry || Type == ToasterPowerEventD0Exit) {
+        WriteULongNoFence(&ioData->Notify.PowerState, ToState);
+        ToasterNotify(ioData, ToasterEventPower);
+    }
+}
+
+//被ToasterEvtIoInCallerContext调用
+NTSTATUS
+ToasterPowerLogGet(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_TOASTER_GET_POWER_LOG: copies the most recent events that
+    fit in the output buffer, oldest first.
+
+--*/
+{
+    NTSTATUS                status;
+    PTOASTER_POWER_LOG_RING log;
+    PTOASTER_POWER_LOG      output;
+    size_t                  outputLength;
+    ULONG                   capacity;
+    ULONG                   available;
+    ULONG                   total;
+    ULONG                   i;
+    KLOCK_QUEUE_HANDLE      lockHandle;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            FIELD_OFFSET(TOASTER_POWER_LOG, Events),
+                                            (PVOID*) &output,
+                                            &outputLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    capacity = (ULONG) min((outputLength - FIELD_OFFSET(TOASTER_POWER_LOG, Events)) /
+                               sizeof(TOASTER_POWER_EVENT),
+                           TOASTER_POWER_LOG_ENTRIES);
+
+    log = &ToasterFdoGetIoData(Device)->PowerLog;
+
+    //
+    // The buffered system buffer is non-paged, so it can be filled in while
+    // the lock is held.
+    //
+    KeAcquireInStackQueuedSpinLock(&log->Lock, &lockHandle);
+
+    total = log->Next;
+    available = min(total, TOASTER_POWER_LOG_ENTRIES);
+
+    output->Returned = min(available, capacity);
+
+    for (i = 0; i < output->Returned; i++) {
+        output->Events[i] = log->Events[(total - output->Returned + i) &
+                                        (TOASTER_POWER_LOG_ENTRIES - 1)];
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    output->Total = total;
+
+    *Information = FIELD_OFFSET(TOASTER_POWER_LOG, Events) +
+                   (ULONG_PTR) output->Returned * sizeof(TOASTER_POWER_EVENT);
+
+    return (output->Returned < available) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+//被EvtWmiInstancePowerLogQueryInstance调用
+VOID
+ToasterPowerLogQuery(
+    _In_  WDFDEVICE         Device,
+    _Out_ PToasterPowerLog  PowerLog
+    )
+/*++
+
+Routine Description:
+
+    Fills in the ToasterPowerLog layout, one array per event field. Not
+    pageable because of the lock; the WMI buffer is non-paged.
+
+--*/
+{
+    PTOASTER_POWER_LOG_RING log;
+    PTOASTER_POWER_EVENT    event;
+    ULONG                   total;
+    ULONG                   i;
+    KLOCK_QUEUE_HANDLE      lockHandle;
+
+    C_ASSERT(ARRAYSIZE(PowerLog->Timestamp) == TOASTER_POWER_LOG_ENTRIES);
+
+    log = &ToasterFdoGetIoData(Device)->PowerLog;
+
+    RtlZeroMemory(PowerLog, ToasterPowerLog_SIZE);
+
+    KeAcquireInStackQueuedSpinLock(&log->Lock, &lockHandle);
+
+    total = log->Next;
+
+    PowerLog->TotalEvents = total;
+    PowerLog->Count = min(total, TOASTER_POWER_LOG_ENTRIES);
+
+    for (i = 0; i < PowerLog->Count; i++) {
+
+        event = &log->Events[(total - PowerLog->Count + i) & (TOASTER_POWER_LOG_ENTRIES - 1)];
+
+        PowerLog->Timestamp[i] = event->Timestamp;
+        PowerLog->Type[i] = event->Type;
+        PowerLog->FromState[i] = event->FromState;
+        PowerLog->ToState[i] = event->ToState;
+        PowerLog->Duration[i] = event->Duration;
+        PowerLog->QueueDepth[i] = event->QueueDepth;
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+}
+
 PCHAR
 DbgDevicePowerString(
     IN WDF_POWER_DEVICE_STATE Type
@@ -377,10 +726,10 @@ Return Value Description:
     DbgDevicePowerString returns a pointer to a string that represents the
     text description of the incoming device power state code.
 
+    Not pageable, D0Entry and D0Exit trace with it.
+
 --*/
 {
-    PAGED_CODE();
-
     switch (Type)
     {
     case WdfPowerDeviceInvalid:
@@ -0,0 +1,796 @@
+/*++
+
+Module Name:
+
+    Ring.c
+
+Abstract:
+
+    Single-producer/single-consumer byte ring used as the data channel of
+    the featured toaster function driver. Nothing here allocates memory; the
+    backing buffer is supplied by the caller once per start.
+
+    These routines are called from the read and write queue callbacks and
+    must stay resident, so none of them is placed in a pageable section.
+
+    Spans handed out by ToasterRingReserve and ToasterRingClaim are filled
+    or drained by someone else, the DMA engine (Dma.c), and closed with
+    ToasterRingCommit in whatever order that finishes them.
+
+    With a record table (ToasterRingSetRecords) the producer side also
+    notes where each write and reservation ends, and a reader that asks
+    for a record stops there.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+static
+VOID
+ToasterRingAddRecord(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ ULONG64 End
+    );
+
+static
+VOID
+ToasterRingDropRecord(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ ULONG64 End
+    );
+
+static
+SIZE_T
+ToasterRingLimitToRecord(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ ULONG64 Position,
+    _In_ SIZE_T Length
+    );
+
+VOID
+ToasterRingInitialize(
+    _Out_ PTOASTER_RING Ring,
+    _In_reads_bytes_(Size) PUCHAR Buffer,
+    _In_ SIZE_T Size
+    )
+/*++
+
+Routine Description:
+
+    Attaches a backing buffer to the ring and empties it.
+
+Arguments:
+
+    Ring - ring to initialize.
+
+    Buffer - non-paged backing store.
+
+    Size - size of Buffer in bytes. Must be a power of two.
+
+--*/
+{
+    NT_ASSERT(Size != 0 && (Size & (Size - 1)) == 0);
+
+    RtlZeroMemory(Ring, sizeof(TOASTER_RING));
+
+    KeInitializeSpinLock(&Ring->ProducerLock);
+    KeInitializeSpinLock(&Ring->ConsumerLock);
+
+    InitializeListHead(&Ring->Reservations);
+    InitializeListHead(&Ring->Claims);
+
+    Ring->Buffer = Buffer;
+    Ring->Size = Size;
+    Ring->Mask = Size - 1;
+}
+
+VOID
+ToasterRingSetRecords(
+    _Inout_ PTOASTER_RING Ring,
+    _Out_writes_(Count) PULONG64 Records,
+    _In_ ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Gives a freshly initialized ring a table to keep record ends in.
+
+Arguments:
+
+    Records - non-paged table of Count entries, owned by the caller.
+
+    Count - must be a power of two.
+
+--*/
+{
+    NT_ASSERT(Count != 0 && (Count & (Count - 1)) == 0);
+
+    KeInitializeSpinLock(&Ring->RecordLock);
+
+    Ring->Records = Records;
+    Ring->RecordMask = Count - 1;
+    Ring->RecordNext = 0;
+}
+
+VOID
+ToasterRingAddRecord(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ ULONG64 End
+    )
+/*++
+
+Routine Description:
+
+    Notes the end of a write. Called with ProducerLock held, before the
+    data is published. An end at or behind the newest one is a write put
+    back by ToasterRingRewind, whose ends are still in the table.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    if (Ring->Records == NULL) {
+        return;
+    }
+
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ring->RecordLock, &lockHandle);
+
+    if (Ring->RecordNext == 0 ||
+        Ring->Records[(Ring->RecordNext - 1) & Ring->RecordMask] < End) {
+
+        Ring->Records[Ring->RecordNext & Ring->RecordMask] = End;
+        Ring->RecordNext++;
+    }
+
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lockHandle);
+}
+
+VOID
+ToasterRingDropRecord(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ ULONG64 End
+    )
+/*++
+
+Routine Description:
+
+    Forgets the newest record end if it is End, for a reservation that was
+    given back. Called with ProducerLock held.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    if (Ring->Records == NULL) {
+        return;
+    }
+
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ring->RecordLock, &lockHandle);
+
+    if (Ring->RecordNext != 0 &&
+        Ring->Records[(Ring->RecordNext - 1) & Ring->RecordMask] == End) {
+        Ring->RecordNext--;
+    }
+
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lockHandle);
+}
+
+SIZE_T
+ToasterRingLimitToRecord(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ ULONG64 Position,
+    _In_ SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    Cuts Length so that a read at Position stops at the end of the record
+    it starts in. Called with ConsumerLock held.
+
+    The ends are in ascending order, so the first one past Position is
+    found by bisection over the ones the table still holds.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    ULONG64             low;
+    ULONG64             high;
+    ULONG64             middle;
+    ULONG64             end;
+
+    if (Ring->Records == NULL) {
+        return Length;
+    }
+
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ring->RecordLock, &lockHandle);
+
+    high = Ring->RecordNext;
+    low = (high > (ULONG64) Ring->RecordMask + 1) ? high - Ring->RecordMask - 1 : 0;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (Ring->Records[middle & Ring->RecordMask] > Position) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    if (low < Ring->RecordNext) {
+        end = Ring->Records[low & Ring->RecordMask];
+        Length = (SIZE_T) min((ULONG64) Length, end - Position);
+    }
+
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lockHandle);
+
+    return Length;
+}
+
+VOID
+ToasterRingReset(
+    _Inout_ PTOASTER_RING Ring
+    )
+/*++
+
+Routine Description:
+
+    Discards any buffered data. Both sides are locked so that the reset is
+    not observed half way by a concurrent reader or writer. There must be
+    no open span.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  producerHandle;
+    KLOCK_QUEUE_HANDLE  consumerHandle;
+    ULONG64             head;
+
+    KeAcquireInStackQueuedSpinLock(&Ring->ProducerLock, &producerHandle);
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ring->ConsumerLock, &consumerHandle);
+
+    NT_ASSERT(IsListEmpty(&Ring->Reservations) && IsListEmpty(&Ring->Claims));
+
+    head = ReadULong64NoFence(&Ring->Head);
+
+    WriteULong64Release(&Ring->Claimed, head);
+    WriteULong64Release(&Ring->Tail, head);
+
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&consumerHandle);
+    KeReleaseInStackQueuedSpinLock(&producerHandle);
+}
+
+SIZE_T
+ToasterRingWrite(
+    _Inout_ PTOASTER_RING Ring,
+    _In_reads_bytes_(Length) PVOID Source,
+    _In_ SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    Copies as much of Source into the ring as currently fits. Behind an
+    open reservation the data only becomes readable once the reservation
+    is committed.
+
+Return Value:
+
+    Number of bytes accepted. Zero if the ring is full.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    ULONG64             reserved;
+    ULONG64             tail;
+    SIZE_T              space;
+    SIZE_T              offset;
+    SIZE_T              chunk;
+    PUCHAR              source = (PUCHAR) Source;
+
+    KeAcquireInStackQueuedSpinLock(&Ring->ProducerLock, &lockHandle);
+
+    //
+    // Reserved is private to the producer. Tail is published by the
+    // consumer with release semantics, so everything it has finished
+    // reading is free once we observe the new value.
+    //
+    reserved = Ring->Reserved;
+    tail = ReadULong64Acquire(&Ring->Tail);
+
+    space = Ring->Size - (SIZE_T) (reserved - tail);
+    if (Length > space) {
+        Length = space;
+    }
+
+    if (Length != 0) {
+
+        offset = (SIZE_T) reserved & Ring->Mask;
+        chunk = min(Length, Ring->Size - offset);
+
+        RtlCopyMemory(Ring->Buffer + offset, source, chunk);
+        RtlCopyMemory(Ring->Buffer, source + chunk, Length - chunk);
+
+        Ring->Reserved = reserved + Length;
+
+        ToasterRingAddRecord(Ring, Ring->Reserved);
+
+        //
+        // Publish the data only after it has been copied in.
+        //
+        if (IsListEmpty(&Ring->Reservations)) {
+            WriteULong64Release(&Ring->Head, Ring->Reserved);
+        }
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return Length;
+}
+
+SIZE_T
+ToasterRingRead(
+    _Inout_ PTOASTER_RING Ring,
+    _Out_writes_bytes_to_(Length, return) PVOID Destination,
+    _In_ SIZE_T Length,
+    _In_ BOOLEAN Record
+    )
+/*++
+
+Routine Description:
+
+    Moves up to Length bytes out of the ring. Behind an open claim the
+    space only goes back to the producer once the claim is committed.
+
+Arguments:
+
+    Record - stop at the end of the record the read starts in.
+
+Return Value:
+
+    Number of bytes copied. Zero if the ring is empty.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    ULONG64             head;
+    ULONG64             claimed;
+    SIZE_T              available;
+    SIZE_T              offset;
+    SIZE_T              chunk;
+    PUCHAR              destination = (PUCHAR) Destination;
+
+    KeAcquireInStackQueuedSpinLock(&Ring->ConsumerLock, &lockHandle);
+
+    claimed = ReadULong64NoFence(&Ring->Claimed);
+    head = ReadULong64Acquire(&Ring->Head);
+
+    available = (SIZE_T) (head - claimed);
+    if (Length > available) {
+        Length = available;
+    }
+
+    if (Record && Length != 0) {
+        Length = ToasterRingLimitToRecord(Ring, claimed, Length);
+    }
+
+    if (Length != 0) {
+
+        offset = (SIZE_T) claimed & Ring->Mask;
+        chunk = min(Length, Ring->Size - offset);
+
+        RtlCopyMemory(destination, Ring->Buffer + offset, chunk);
+        RtlCopyMemory(destination + chunk, Ring->Buffer, Length - chunk);
+
+        WriteULong64Release(&Ring->Claimed, claimed + Length);
+
+        //
+        // Hand the space back to the producer only after the copy out.
+        //
+        if (IsListEmpty(&Ring->Claims)) {
+            WriteULong64Release(&Ring->Tail, claimed + Length);
+        }
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return Length;
+}
+
+SIZE_T
+ToasterRingGetReadable(
+    _In_ PTOASTER_RING Ring
+    )
+/*++
+
+Routine Description:
+
+    Returns a snapshot of the number of buffered bytes nobody has taken
+    yet. The value can be stale by the time the caller looks at it; it is
+    meant for statistics and for deciding whether a read is worth
+    attempting.
+
+--*/
+{
+    ULONG64 claimed = ReadULong64Acquire(&Ring->Claimed);
+    ULONG64 head = ReadULong64Acquire(&Ring->Head);
+
+    return (SIZE_T) (head - claimed);
+}
+
+ULONG64
+ToasterRingGetHead(
+    _In_ PTOASTER_RING Ring
+    )
+/*++
+
+Routine Description:
+
+    Returns the position the next byte written will have.
+
+--*/
+{
+    return ReadULong64Acquire(&Ring->Head);
+}
+
+SIZE_T
+ToasterRingReadAt(
+    _Inout_ PTOASTER_RING Ring,
+    _Inout_ PULONG64 Position,
+    _Out_writes_bytes_to_(Length, return) PVOID Destination,
+    _In_ SIZE_T Length,
+    _In_ BOOLEAN Record,
+    _Out_ PULONG64 Skipped
+    )
+/*++
+
+Routine Description:
+
+    Copies up to Length bytes starting at *Position and advances *Position
+    past them. Unlike ToasterRingRead this does not consume anything;
+    the space only goes back to the producer through ToasterRingConsumeTo.
+
+Arguments:
+
+    Position - the caller's own read position. If the data it points to
+        has already been consumed or claimed it is moved up to the oldest
+        data left.
+
+    Record - stop at the end of the record the read starts in.
+
+    Skipped - receives the number of bytes Position was moved up by.
+
+Return Value:
+
+    Number of bytes copied. Zero if there is nothing at or after *Position.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    ULONG64             head;
+    ULONG64             tail;
+    ULONG64             position;
+    SIZE_T              available;
+    SIZE_T              offset;
+    SIZE_T              chunk;
+    PUCHAR              destination = (PUCHAR) Destination;
+
+    //
+    // Holding the consumer lock keeps Tail where it is, so the producer
+    // cannot overwrite [Tail, Head) while it is being copied. Claimed is
+    // never behind Tail.
+    //
+    KeAcquireInStackQueuedSpinLock(&Ring->ConsumerLock, &lockHandle);
+
+    tail = ReadULong64NoFence(&Ring->Claimed);
+    head = ReadULong64Acquire(&Ring->Head);
+
+    position = *Position;
+    *Skipped = 0;
+
+    if (position < tail) {
+        *Skipped = tail - position;
+        position = tail;
+    }
+
+    available = (SIZE_T) (head - position);
+    if (Length > available) {
+        Length = available;
+    }
+
+    if (Record && Length != 0) {
+        Length = ToasterRingLimitToRecord(Ring, position, Length);
+    }
+
+    if (Length != 0) {
+
+        offset = (SIZE_T) position & Ring->Mask;
+        chunk = min(Length, Ring->Size - offset);
+
+        RtlCopyMemory(destination, Ring->Buffer + offset, chunk);
+        RtlCopyMemory(destination + chunk, Ring->Buffer, Length - chunk);
+    }
+
+    *Position = position + Length;
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return Length;
+}
+
+VOID
+ToasterRingConsumeTo(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ ULONG64 Position
+    )
+/*++
+
+Routine Description:
+
+    Consumes everything before Position and hands it back to the producer,
+    once no claim before it is open. A Position at or behind Claimed
+    changes nothing.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    KeAcquireInStackQueuedSpinLock(&Ring->ConsumerLock, &lockHandle);
+
+    if (Position > ReadULong64NoFence(&Ring->Claimed) &&
+        Position <= ReadULong64Acquire(&Ring->Head)) {
+
+        WriteULong64Release(&Ring->Claimed, Position);
+
+        if (IsListEmpty(&Ring->Claims)) {
+            WriteULong64Release(&Ring->Tail, Position);
+        }
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+}
+
+VOID
+ToasterRingRewind(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    Moves both positions of an empty ring back by Length, so that writing
+    the last Length bytes ToasterRingRead took out puts them back at the
+    stream positions, and buffer offsets, they had before. Positions kept
+    by ToasterRingReadAt callers stay valid across such a round trip.
+
+    Does nothing if the ring is not empty or has an open span.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  producerHandle;
+    KLOCK_QUEUE_HANDLE  consumerHandle;
+    ULONG64             head;
+
+    KeAcquireInStackQueuedSpinLock(&Ring->ProducerLock, &producerHandle);
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ring->ConsumerLock, &consumerHandle);
+
+    head = ReadULong64NoFence(&Ring->Head);
+
+    if (ReadULong64NoFence(&Ring->Tail) == head &&
+        Ring->Reserved == head &&
+        IsListEmpty(&Ring->Claims) &&
+        head >= Length) {
+
+        Ring->Reserved = head - Length;
+        WriteULong64Release(&Ring->Head, head - Length);
+        WriteULong64Release(&Ring->Claimed, head - Length);
+        WriteULong64Release(&Ring->Tail, head - Length);
+    }
+
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&consumerHandle);
+    KeReleaseInStackQueuedSpinLock(&producerHandle);
+}
+
+SIZE_T
+ToasterRingReserve(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ SIZE_T Length,
+    _Out_ PTOASTER_RING_SPAN Span
+    )
+/*++
+
+Routine Description:
+
+    Takes up to Length bytes of free space for the caller to fill later.
+    Nothing written after the span becomes readable before the span is
+    committed.
+
+Return Value:
+
+    Length of the span. Zero if the ring is full; Span is then not open.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    ULONG64             tail;
+    SIZE_T              space;
+
+    KeAcquireInStackQueuedSpinLock(&Ring->ProducerLock, &lockHandle);
+
+    tail = ReadULong64Acquire(&Ring->Tail);
+
+    space = Ring->Size - (SIZE_T) (Ring->Reserved - tail);
+    if (Length > space) {
+        Length = space;
+    }
+
+    if (Length != 0) {
+        Span->Start = Ring->Reserved;
+        Span->Length = Length;
+        InsertTailList(&Ring->Reservations, &Span->Link);
+
+        Ring->Reserved += Length;
+
+        ToasterRingAddRecord(Ring, Ring->Reserved);
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return Length;
+}
+
+SIZE_T
+ToasterRingClaim(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ SIZE_T Length,
+    _Out_ PTOASTER_RING_SPAN Span
+    )
+/*++
+
+Routine Description:
+
+    Takes up to Length bytes of data for the caller to drain later. Other
+    readers go on after the span; its space, and that of anything read
+    after it, goes back to the producer when the span is committed.
+
+Return Value:
+
+    Length of the span. Zero if the ring is empty; Span is then not open.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    ULONG64             claimed;
+    SIZE_T              available;
+
+    KeAcquireInStackQueuedSpinLock(&Ring->ConsumerLock, &lockHandle);
+
+    claimed = ReadULong64NoFence(&Ring->Claimed);
+
+    available = (SIZE_T) (ReadULong64Acquire(&Ring->Head) - claimed);
+    if (Length > available) {
+        Length = available;
+    }
+
+    if (Length != 0) {
+        Span->Start = claimed;
+        Span->Length = Length;
+        InsertTailList(&Ring->Claims, &Span->Link);
+
+        WriteULong64Release(&Ring->Claimed, claimed + Length);
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return Length;
+}
+
+VOID
+ToasterRingCommit(
+    _Inout_ PTOASTER_RING Ring,
+    _Inout_ PTOASTER_RING_SPAN Span,
+    _In_ BOOLEAN Reservation
+    )
+/*++
+
+Routine Description:
+
+    Closes a span that has been filled (Reservation) or drained. Head or
+    Tail moves up to the oldest span still open on that side, or all the
+    way if none is.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    PKSPIN_LOCK         lock;
+    PLIST_ENTRY         spans;
+    volatile ULONG64*   position;
+    ULONG64             limit;
+
+    if (Reservation) {
+        lock = &Ring->ProducerLock;
+        spans = &Ring->Reservations;
+        position = &Ring->Head;
+    } else {
+        lock = &Ring->ConsumerLock;
+        spans = &Ring->Claims;
+        position = &Ring->Tail;
+    }
+
+    KeAcquireInStackQueuedSpinLock(lock, &lockHandle);
+
+    RemoveEntryList(&Span->Link);
+
+    if (!IsListEmpty(spans)) {
+        limit = CONTAINING_RECORD(spans->Flink, TOASTER_RING_SPAN, Link)->Start;
+    } else if (Reservation) {
+        limit = Ring->Reserved;
+    } else {
+        limit = ReadULong64NoFence(&Ring->Claimed);
+    }
+
+    WriteULong64Release(position, limit);
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+}
+
+VOID
+ToasterRingCancel(
+    _Inout_ PTOASTER_RING Ring,
+    _Inout_ PTOASTER_RING_SPAN Span,
+    _In_ BOOLEAN Reservation
+    )
+/*++
+
+Routine Description:
+
+    Closes a span that was never filled or drained. The newest span on its
+    side is simply given back. An older one cannot be: a reservation is
+    zeroed and committed, so the stream keeps its length, and the data of
+    a claim is dropped.
+
+--*/
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    SIZE_T              offset;
+    SIZE_T              chunk;
+    BOOLEAN             newest;
+
+    if (Reservation) {
+
+        KeAcquireInStackQueuedSpinLock(&Ring->ProducerLock, &lockHandle);
+
+        newest = (Span->Start + Span->Length == Ring->Reserved);
+        if (newest) {
+            ToasterRingDropRecord(Ring, Ring->Reserved);
+            Ring->Reserved = Span->Start;
+        } else {
+            offset = (SIZE_T) Span->Start & Ring->Mask;
+            chunk = min(Span->Length, Ring->Size - offset);
+
+            RtlZeroMemory(Ring->Buffer + offset, chunk);
+            RtlZeroMemory(Ring->Buffer, Span->Length - chunk);
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    } else {
+
+        KeAcquireInStackQueuedSpinLock(&Ring->ConsumerLock, &lockHandle);
+
+        newest = (Span->Start + Span->Length == ReadULong64NoFence(&Ring->Claimed));
+        if (newest) {
+            WriteULong64Release(&Ring->Claimed, Span->Start);
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+    }
+
+    ToasterRingCommit(Ring, Span, Reservation);
+}
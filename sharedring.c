@@ -0,0 +1,657 @@
+/*++
+
+Module Name:
+
+    SharedRing.c
+
+Abstract:
+
+    Submission/completion rings shared between an application and the
+    toaster FDO. The application maps them once with IOCTL_TOASTER_MAP_RINGS,
+    fills submission entries directly in memory and rings the doorbell
+    (IOCTL_TOASTER_RING_DOORBELL) when it has queued work, so a whole ring of
+    operations costs one IRP instead of one per operation.
+
+    The memory is whole pages of its own, not pool, allocated once in
+    EvtDeviceSelfManagedIoInit and released in
+    EvtDeviceSelfManagedIoCleanup, so nothing but the rings is ever
+    exposed to user mode. The mapping into the process is owned by a
+    single WDFFILEOBJECT and is removed in its EvtFileCleanup. That need
+    not run in the process that mapped the rings, if the handle was
+    duplicated or inherited, so the unmap attaches to that process; and
+    if the process exits first, ToasterSharedRingsProcessNotify unmaps the
+    rings as it goes.
+
+    Everything the application can write is treated as untrusted: the
+    driver keeps its own copies of SqHead and CqTail, validates the indexes
+    it reads and captures every submission entry before looking at it.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "sharedring.tmh"
+
+static
+VOID
+ToasterSharedRingsProcessNotify(
+    _In_ HANDLE     ParentId,
+    _In_ HANDLE     ProcessId,
+    _In_ BOOLEAN    Create
+    );
+
+static
+VOID
+ToasterSharedRingsRelease(
+    _In_ PTOASTER_SHARED_RINGS Rings
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, ToasterSharedRingsDriverInitialize)
+#pragma alloc_text(PAGE, ToasterSharedRingsDriverUnload)
+#pragma alloc_text(PAGE, ToasterSharedRingsProcessNotify)
+#pragma alloc_text(PAGE, ToasterSharedRingsRelease)
+#pragma alloc_text(PAGE, ToasterSharedRingsAllocate)
+#pragma alloc_text(PAGE, ToasterSharedRingsFree)
+#pragma alloc_text(PAGE, ToasterSharedRingsMap)
+#pragma alloc_text(PAGE, ToasterSharedRingsUnmap)
+#pragma alloc_text(PAGE, ToasterSharedRingsDoorbell)
+#endif
+
+//
+// Layout of the shared mapping. The data area starts on a page boundary.
+//
+#define TOASTER_SHARED_SQ_OFFSET \
+    ALIGN_UP_BY(sizeof(TOASTER_SHARED_RINGS_HEADER), SYSTEM_CACHE_ALIGNMENT_SIZE)
+
+#define TOASTER_SHARED_CQ_OFFSET \
+    (TOASTER_SHARED_SQ_OFFSET + TOASTER_SQ_ENTRIES * sizeof(TOASTER_SQE))
+
+#define TOASTER_SHARED_DATA_OFFSET \
+    ALIGN_UP_BY(TOASTER_SHARED_CQ_OFFSET + TOASTER_CQ_ENTRIES * sizeof(TOASTER_CQE), PAGE_SIZE)
+
+#define TOASTER_SHARED_LENGTH \
+    (TOASTER_SHARED_DATA_OFFSET + TOASTER_SHARED_DATA_LENGTH)
+
+C_ASSERT((TOASTER_SQ_ENTRIES & (TOASTER_SQ_ENTRIES - 1)) == 0);
+C_ASSERT((TOASTER_CQ_ENTRIES & (TOASTER_CQ_ENTRIES - 1)) == 0);
+C_ASSERT((TOASTER_SHARED_LENGTH % PAGE_SIZE) == 0);
+
+//
+// Rings of every device that are mapped into a process, linked through
+// TOASTER_SHARED_RINGS.MappedLink. The lock nests inside the rings' own.
+//
+static LIST_ENTRY   ToasterSharedRingsMapped;
+static FAST_MUTEX   ToasterSharedRingsMappedLock;
+
+
+//被DriverEntry调用
+NTSTATUS
+ToasterSharedRingsDriverInitialize(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Registers for process exits, so that rings still mapped into a process
+    that exits are unmapped before its address space goes away.
+
+--*/
+{
+    InitializeListHead(&ToasterSharedRingsMapped);
+    ExInitializeFastMutex(&ToasterSharedRingsMappedLock);
+
+    return PsSetCreateProcessNotifyRoutine(ToasterSharedRingsProcessNotify, FALSE);
+}
+
+//被ToasterEvtDriverUnload调用
+VOID
+ToasterSharedRingsDriverUnload(
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    NT_ASSERT(IsListEmpty(&ToasterSharedRingsMapped));
+
+    (VOID) PsSetCreateProcessNotifyRoutine(ToasterSharedRingsProcessNotify, TRUE);
+}
+
+//通过PsSetCreateProcessNotifyRoutine设置的回调
+VOID
+ToasterSharedRingsProcessNotify(
+    _In_ HANDLE     ParentId,
+    _In_ HANDLE     ProcessId,
+    _In_ BOOLEAN    Create
+    )
+/*++
+
+Routine Description:
+
+    Unmaps every ring mapped into an exiting process whose file object
+    outlives it, through a handle duplicated into another process. Runs in
+    the context of the exiting process.
+
+--*/
+{
+    PEPROCESS               process = PsGetCurrentProcess();
+    PLIST_ENTRY             entry;
+    PTOASTER_SHARED_RINGS   rings;
+    WDFDEVICE               device;
+
+    UNREFERENCED_PARAMETER(ParentId);
+    UNREFERENCED_PARAMETER(ProcessId);
+
+    PAGED_CODE();
+
+    if (Create) {
+        return;
+    }
+
+    for (;;) {
+
+        device = NULL;
+
+        ExAcquireFastMutex(&ToasterSharedRingsMappedLock);
+
+        for (entry = ToasterSharedRingsMapped.Flink;
+             entry != &ToasterSharedRingsMapped;
+             entry = entry->Flink) {
+
+            rings = CONTAINING_RECORD(entry, TOASTER_SHARED_RINGS, MappedLink);
+
+            if (rings->OwnerProcess == process) {
+                //
+                // Unmapped rings leave the list before their device can go
+                // away, so the device is still there to reference.
+                //
+                device = rings->Device;
+                WdfObjectReference(device);
+                break;
+            }
+        }
+
+        ExReleaseFastMutex(&ToasterSharedRingsMappedLock);
+
+        if (device == NULL) {
+            break;
+        }
+
+        rings = &ToasterFdoGetIoData(device)->SharedRings;
+
+        WdfWaitLockAcquire(rings->Lock, NULL);
+
+        if (rings->OwnerProcess == process) {
+            ToasterSharedRingsRelease(rings);
+        }
+
+        WdfWaitLockRelease(rings->Lock);
+
+        WdfObjectDereference(device);
+    }
+}
+
+
+//被ToasterEvtDeviceSelfManagedIoInit调用
+NTSTATUS
+ToasterSharedRingsAllocate(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Allocates the pages backing the shared rings, described by an MDL so
+    they can later be mapped into a process, and maps them for the driver.
+    They are pages of their own, zeroed, not pool: pool cannot be mapped
+    to user mode, and would share its pages with other allocations.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_DATA               fdoData;
+    PTOASTER_SHARED_RINGS   rings;
+    PHYSICAL_ADDRESS        lowAddress;
+    PHYSICAL_ADDRESS        highAddress;
+    PHYSICAL_ADDRESS        skipBytes;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    rings = &ToasterFdoGetIoData(Device)->SharedRings;
+
+    rings->Device = Device;
+    InitializeListHead(&rings->MappedLink);
+
+    status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &rings->Lock);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    lowAddress.QuadPart = 0;
+    highAddress.QuadPart = -1;
+    skipBytes.QuadPart = 0;
+
+    rings->Mdl = MmAllocatePagesForMdlEx(lowAddress,
+                                         highAddress,
+                                         skipBytes,
+                                         TOASTER_SHARED_LENGTH,
+                                         MmCached,
+                                         MM_ALLOCATE_FULLY_REQUIRED);
+    if (rings->Mdl == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    rings->Base = MmGetSystemAddressForMdlSafe(rings->Mdl,
+                                               NormalPagePriority | MdlMappingNoExecute);
+    if (rings->Base == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    rings->Length = TOASTER_SHARED_LENGTH;
+
+    return STATUS_SUCCESS;
+
+Error:
+
+    WppPrintDeviceError(fdoData->WppRecorderLog,
+                       "Failed to allocate shared rings 0x%x\n",
+                       status);
+
+    ToasterSharedRingsFree(Device);
+
+    return status;
+}
+
+//被ToasterEvtDeviceSelfManagedIoCleanup调用
+VOID
+ToasterSharedRingsFree(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Releases what ToasterSharedRingsAllocate set up. By the time the device
+    is torn down every file object has been cleaned up, so the rings can no
+    longer be mapped into any process.
+
+--*/
+{
+    PTOASTER_SHARED_RINGS   rings;
+
+    PAGED_CODE();
+
+    rings = &ToasterFdoGetIoData(Device)->SharedRings;
+
+    NT_ASSERT(rings->Owner == NULL);
+
+    if (rings->Mdl != NULL) {
+        if (rings->Base != NULL) {
+            MmUnmapLockedPages(rings->Base, rings->Mdl);
+            rings->Base = NULL;
+        }
+        MmFreePagesFromMdl(rings->Mdl);
+        ExFreePool(rings->Mdl);
+        rings->Mdl = NULL;
+    }
+
+    if (rings->Lock != NULL) {
+        WdfObjectDelete(rings->Lock);
+        rings->Lock = NULL;
+    }
+}
+
+//被ToasterEvtIoInCallerContext调用，必须在调用者的进程上下文中运行
+NTSTATUS
+ToasterSharedRingsMap(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_TOASTER_MAP_RINGS. Runs in the context of the requesting
+    thread, which is required both for mapping pages into its process and
+    for resolving the optional event handle.
+
+Return Value:
+
+    STATUS_DEVICE_BUSY if another handle already owns the mapping.
+
+--*/
+{
+    NTSTATUS                        status;
+    PFDO_DATA                       fdoData;
+    PTOASTER_SHARED_RINGS           rings;
+    PTOASTER_SHARED_RINGS_HEADER    header;
+    PTOASTER_MAP_RINGS_INPUT        input;
+    PTOASTER_MAP_RINGS_OUTPUT       output;
+    WDFFILEOBJECT                   fileObject;
+    PKEVENT                         event = NULL;
+    PVOID                           userBase = NULL;
+
+    PAGED_CODE();
+
+    *Information = 0;
+
+    fdoData = ToasterFdoGetData(Device);
+    rings = &ToasterFdoGetIoData(Device)->SharedRings;
+
+    if (rings->Base == NULL) {
+        //
+        // EvtDeviceSelfManagedIoInit has not run yet.
+        //
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    fileObject = WdfRequestGetFileObject(Request);
+    if (fileObject == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(TOASTER_MAP_RINGS_OUTPUT),
+                                            &output,
+                                            NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(TOASTER_MAP_RINGS_INPUT),
+                                           &input,
+                                           NULL);
+    if (NT_SUCCESS(status) && input->CompletionEvent != 0) {
+
+        status = ObReferenceObjectByHandle((HANDLE) (ULONG_PTR) input->CompletionEvent,
+                                           EVENT_MODIFY_STATE,
+                                           *ExEventObjectType,
+                                           UserMode,
+                                           &event,
+                                           NULL);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    WdfWaitLockAcquire(rings->Lock, NULL);
+
+    if (rings->Owner != NULL) {
+        status = STATUS_DEVICE_BUSY;
+        goto Exit;
+    }
+
+    //
+    // Start the new owner from empty rings.
+    //
+    header = (PTOASTER_SHARED_RINGS_HEADER) rings->Base;
+    RtlZeroMemory(header, sizeof(TOASTER_SHARED_RINGS_HEADER));
+
+    header->SqEntries = TOASTER_SQ_ENTRIES;
+    header->CqEntries = TOASTER_CQ_ENTRIES;
+    header->SqOffset = TOASTER_SHARED_SQ_OFFSET;
+    header->CqOffset = TOASTER_SHARED_CQ_OFFSET;
+    header->DataOffset = TOASTER_SHARED_DATA_OFFSET;
+    header->DataLength = TOASTER_SHARED_DATA_LENGTH;
+
+    rings->SqHead = 0;
+    rings->CqTail = 0;
+
+    __try {
+        userBase = MmMapLockedPagesSpecifyCache(rings->Mdl,
+                                                UserMode,
+                                                MmCached,
+                                                NULL,
+                                                FALSE,
+                                                NormalPagePriority);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        userBase = NULL;
+    }
+
+    if (userBase == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    rings->UserBase = userBase;
+    rings->Owner = fileObject;
+    rings->OwnerProcess = PsGetCurrentProcess();
+    rings->CompletionEvent = event;
+    event = NULL;
+
+    ObReferenceObject(rings->OwnerProcess);
+
+    ExAcquireFastMutex(&ToasterSharedRingsMappedLock);
+    InsertTailList(&ToasterSharedRingsMapped, &rings->MappedLink);
+    ExReleaseFastMutex(&ToasterSharedRingsMappedLock);
+
+    output->Base = (ULONG64) (ULONG_PTR) userBase;
+    output->Length = (ULONG) rings->Length;
+    output->Reserved = 0;
+
+    *Information = sizeof(TOASTER_MAP_RINGS_OUTPUT);
+
+    WppPrintDevice(fdoData->WppRecorderLog,
+                  "Shared rings mapped at %p for file object %p\n",
+                  userBase,
+                  fileObject);
+
+Exit:
+
+    WdfWaitLockRelease(rings->Lock);
+
+    if (event != NULL) {
+        ObDereferenceObject(event);
+    }
+
+    return status;
+}
+
+//被ToasterEvtFileCleanup调用
+VOID
+ToasterSharedRingsUnmap(
+    _In_ WDFDEVICE      Device,
+    _In_ WDFFILEOBJECT  FileObject
+    )
+/*++
+
+Routine Description:
+
+    Removes the process mapping if FileObject owns it. Runs in whatever
+    process closed the last handle; see ToasterSharedRingsRelease.
+
+--*/
+{
+    PTOASTER_SHARED_RINGS   rings;
+
+    PAGED_CODE();
+
+    rings = &ToasterFdoGetIoData(Device)->SharedRings;
+
+    if (rings->Lock == NULL) {
+        return;
+    }
+
+    WdfWaitLockAcquire(rings->Lock, NULL);
+
+    if (rings->Owner == FileObject) {
+        ToasterSharedRingsRelease(rings);
+    }
+
+    WdfWaitLockRelease(rings->Lock);
+}
+
+//被ToasterSharedRingsUnmap和ToasterSharedRingsProcessNotify调用
+VOID
+ToasterSharedRingsRelease(
+    _In_ PTOASTER_SHARED_RINGS Rings
+    )
+/*++
+
+Routine Description:
+
+    Unmaps the rings from the process they are mapped into and drops the
+    owner. Called with Rings->Lock held. A user mapping can only be
+    removed from within its process, so a caller in any other process
+    attaches to it for the unmap.
+
+--*/
+{
+    KAPC_STATE apcState;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&ToasterSharedRingsMappedLock);
+    RemoveEntryList(&Rings->MappedLink);
+    InitializeListHead(&Rings->MappedLink);
+    ExReleaseFastMutex(&ToasterSharedRingsMappedLock);
+
+    if (Rings->OwnerProcess == PsGetCurrentProcess()) {
+        MmUnmapLockedPages(Rings->UserBase, Rings->Mdl);
+    } else {
+        KeStackAttachProcess((PRKPROCESS) Rings->OwnerProcess, &apcState);
+        MmUnmapLockedPages(Rings->UserBase, Rings->Mdl);
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    if (Rings->CompletionEvent != NULL) {
+        ObDereferenceObject(Rings->CompletionEvent);
+        Rings->CompletionEvent = NULL;
+    }
+
+    ObDereferenceObject(Rings->OwnerProcess);
+
+    Rings->OwnerProcess = NULL;
+    Rings->UserBase = NULL;
+    Rings->Owner = NULL;
+}
+
+//被ToasterEvtIoDeviceControl调用
+NTSTATUS
+ToasterSharedRingsDoorbell(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    )
+/*++
+
+Routine Description:
+
+    Handles IOCTL_TOASTER_RING_DOORBELL. Works on the system address of the
+    rings, so it can run in any thread context.
+
+Return Value:
+
+    STATUS_INVALID_DEVICE_STATE if the caller does not own the mapping,
+    STATUS_INVALID_PARAMETER if the application corrupted an index.
+
+--*/
+{
+    NTSTATUS                        status = STATUS_SUCCESS;
+    PTOASTER_SHARED_RINGS           rings;
+    PTOASTER_SHARED_RINGS_HEADER    header;
+    PTOASTER_SQE                    sq;
+    PTOASTER_CQE                    cq;
+    PUCHAR                          data;
+    TOASTER_SQE                     sqe;
+    TOASTER_CQE                     cqe;
+    ULONG                           sqHead;
+    ULONG                           sqTail;
+    ULONG                           cqHead;
+    ULONG                           cqTail;
+    ULONG                           posted = 0;
+
+    PAGED_CODE();
+
+    *Information = 0;
+
+    rings = &ToasterFdoGetIoData(Device)->SharedRings;
+
+    if (rings->Lock == NULL) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    WdfWaitLockAcquire(rings->Lock, NULL);
+
+    if (rings->Owner == NULL || rings->Owner != WdfRequestGetFileObject(Request)) {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto Exit;
+    }
+
+    header = (PTOASTER_SHARED_RINGS_HEADER) rings->Base;
+    sq = (PTOASTER_SQE) ((PUCHAR) rings->Base + TOASTER_SHARED_SQ_OFFSET);
+    cq = (PTOASTER_CQE) ((PUCHAR) rings->Base + TOASTER_SHARED_CQ_OFFSET);
+    data = (PUCHAR) rings->Base + TOASTER_SHARED_DATA_OFFSET;
+
+    sqHead = rings->SqHead;
+    cqTail = rings->CqTail;
+
+    sqTail = ReadULongAcquire(&header->SqTail);
+    cqHead = ReadULongAcquire(&header->CqHead);
+
+    if (sqTail - sqHead > TOASTER_SQ_ENTRIES ||
+        cqTail - cqHead > TOASTER_CQ_ENTRIES) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    while (sqHead != sqTail && cqTail - cqHead < TOASTER_CQ_ENTRIES) {
+
+        //
+        // Capture the entry; the application can rewrite the slot at any
+        // time.
+        //
+        RtlCopyMemory(&sqe, &sq[sqHead & (TOASTER_SQ_ENTRIES - 1)], sizeof(TOASTER_SQE));
+
+        cqe.UserData = sqe.UserData;
+
+        ToasterExecuteOp(Device,
+                         &sqe.Op,
+                         data,
+                         TOASTER_SHARED_DATA_LENGTH,
+                         data,
+                         TOASTER_SHARED_DATA_LENGTH,
+                         &cqe.Result);
+
+        RtlCopyMemory(&cq[cqTail & (TOASTER_CQ_ENTRIES - 1)], &cqe, sizeof(TOASTER_CQE));
+
+        sqHead++;
+        cqTail++;
+        posted++;
+    }
+
+    //
+    // Publish the consumed submissions and the new completions only after
+    // the completion entries are fully written.
+    //
+    rings->SqHead = sqHead;
+    rings->CqTail = cqTail;
+
+    WriteULongRelease(&header->SqHead, sqHead);
+    WriteULongRelease(&header->CqTail, cqTail);
+
+    if (posted != 0 && rings->CompletionEvent != NULL) {
+        KeSetEvent(rings->CompletionEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+Exit:
+
+    WdfWaitLockRelease(rings->Lock);
+
+    return status;
+}
@@ -0,0 +1,241 @@
+/*++
+
+Module Name:
+
+    Start.c
+
+Abstract:
+
+    Start-up work of the featured toaster function driver that is kept off
+    the PnP path.
+
+    PnP starts the devices of a bus one after the other, so whatever
+    EvtDeviceAdd and EvtDevicePrepareHardware wait on, every toaster
+    behind it waits on too. Nothing the data path needs is deferred; what
+    is deferred only serves WMI:
+
+    - the WMI blocks. Registering them makes the framework register the
+      device with WMI, and looking up the friendly name the events carry
+      queries the device's properties;
+
+    - the arrival event, which cannot be heard before the event blocks are
+      registered anyway.
+
+    The work runs on a work item queued at the end of PrepareHardware. The
+    blocks are registered by the first start only; the arrival event is
+    fired by every start. ReleaseHardware waits for the work item, so it
+    never runs for a device that is stopped.
+
+    The time each phase took is reported through the ToasterPowerState
+    WMI block.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "start.tmh"
+
+EVT_WDF_WORKITEM ToasterStartEvtWorkItem;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterStartInitialize)
+#pragma alloc_text(PAGE, ToasterStartDeferred)
+#pragma alloc_text(PAGE, ToasterStartFlush)
+#pragma alloc_text(PAGE, ToasterStartEvtWorkItem)
+#pragma alloc_text(PAGE, ToasterStartQuery)
+#endif
+
+
+//被ToasterEvtDeviceAdd调用
+NTSTATUS
+ToasterStartInitialize(
+    _In_ WDFDEVICE  Device,
+    _In_ LONGLONG   AddTicks
+    )
+/*++
+
+Routine Description:
+
+    Creates the work item and accounts the duration of EvtDeviceAdd. Must
+    run last in EvtDeviceAdd, after ToasterStatsAllocate.
+
+Arguments:
+
+    AddTicks - ToasterStatsStart when EvtDeviceAdd was called.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_DATA               fdoData;
+    PFDO_IO_DATA            ioData;
+    WDF_WORKITEM_CONFIG     workItemConfig;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
+
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, ToasterStartEvtWorkItem);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfWorkItemCreate(&workItemConfig, &attributes, &ioData->Start.WorkItem);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfWorkItemCreate failed 0x%x\n",
+                           status);
+        return status;
+    }
+
+    ioData->Start.DeviceAddTime = ToasterStateMicroseconds(ioData, AddTicks);
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtDevicePrepareHardware调用
+VOID
+ToasterStartDeferred(
+    _In_ WDFDEVICE  Device,
+    _In_ LONGLONG   PrepareTicks
+    )
+/*++
+
+Routine Description:
+
+    Accounts the duration of PrepareHardware and hands the rest of the
+    start to the work item. Called last in a PrepareHardware that
+    succeeds.
+
+Arguments:
+
+    PrepareTicks - ToasterStatsStart when PrepareHardware was called.
+
+--*/
+{
+    PTOASTER_START start = &ToasterFdoGetIoData(Device)->Start;
+
+    PAGED_CODE();
+
+    start->PrepareTicks = PrepareTicks;
+    start->LastPrepareHardwareTime = ToasterStateMicroseconds(ToasterFdoGetIoData(Device),
+                                                              PrepareTicks);
+
+    WdfWorkItemEnqueue(start->WorkItem);
+}
+
+//被ToasterEvtDeviceReleaseHardware调用
+VOID
+ToasterStartFlush(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Waits for the deferred work of the start that is ending.
+
+--*/
+{
+    PAGED_CODE();
+
+    WdfWorkItemFlush(ToasterFdoGetIoData(Device)->Start.WorkItem);
+}
+
+//通过WdfWorkItemCreate设置的回调
+VOID
+ToasterStartEvtWorkItem(
+    _In_ WDFWORKITEM WorkItem
+    )
+/*++
+
+Routine Description:
+
+    Registers the WMI blocks on the first start and fires the arrival
+    event.
+
+    A failure to register does not fail the device, which by now is
+    started; it runs without WMI, the way it would have failed to start
+    while WMI was registered from EvtDeviceAdd. Registration is not tried
+    again on a later start: the blocks that did register stay with the
+    device until it is removed.
+
+--*/
+{
+    NTSTATUS        status;
+    WDFDEVICE       device;
+    PFDO_DATA       fdoData;
+    PFDO_IO_DATA    ioData;
+    PTOASTER_START  start;
+    LONGLONG        startTicks;
+
+    PAGED_CODE();
+
+    startTicks = ToasterStatsStart();
+
+    device = (WDFDEVICE) WdfWorkItemGetParentObject(WorkItem);
+    fdoData = ToasterFdoGetData(device);
+    ioData = ToasterFdoGetIoData(device);
+    start = &ioData->Start;
+
+    if (!start->WmiRegistered) {
+
+        start->WmiRegistered = TRUE;
+
+        status = ToasterWmiRegistration(device);
+        if (!NT_SUCCESS(status)) {
+            WppPrintDeviceError(fdoData->WppRecorderLog,
+                               "ToasterWmiRegistration failed 0x%x, running without WMI\n",
+                               status);
+        }
+    }
+
+    ToasterFireArrivalEvent(device);//在WMI.c中
+
+    start->LastDeferredTime = ToasterStateMicroseconds(ioData, startTicks);
+    start->LastStartLatency = ToasterStateMicroseconds(ioData, start->PrepareTicks);
+
+    WppPrintDevice(fdoData->WppRecorderLog,
+                   "Start: DeviceAdd %d us, PrepareHardware %d us, deferred %d us, ready after %d us\n",
+                   start->DeviceAddTime,
+                   start->LastPrepareHardwareTime,
+                   start->LastDeferredTime,
+                   start->LastStartLatency);
+}
+
+//被EvtWmiInstancePowerStateQueryInstance调用
+VOID
+ToasterStartQuery(
+    _In_  WDFDEVICE             Device,
+    _Out_ PToasterPowerState    PowerState
+    )
+/*++
+
+Routine Description:
+
+    Fills in the start timing of the ToasterPowerState block. The rest of
+    it comes from ToasterStateQuery.
+
+--*/
+{
+    PTOASTER_START start;
+
+    PAGED_CODE();
+
+    start = &ToasterFdoGetIoData(Device)->Start;
+
+    PowerState->DeviceAddTime = start->DeviceAddTime;
+    PowerState->LastPrepareHardwareTime = start->LastPrepareHardwareTime;
+    PowerState->LastDeferredStartTime = start->LastDeferredTime;
+    PowerState->LastStartLatency = start->LastStartLatency;
+}
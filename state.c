@@ -0,0 +1,506 @@
+/*++
+
+Module Name:
+
+    State.c
+
+Abstract:
+
+    Save and restore of device state across low-power states for the
+    featured toaster function driver.
+
+    The I/O paths mark an item dirty the first time they change it in a
+    power cycle (ToasterStateSetDirty). D0Exit snapshots only the dirty
+    items into non-paged memory; an item that has not changed since the
+    last save keeps its previous snapshot. D0Entry does not put anything
+    back: it only marks the snapshot pending, and the first request that
+    depends on an item restores it (ToasterStateRestore). A device that
+    wakes up and goes idle again without being used pays for neither.
+
+    The crispiness level lives in the bus driver and the data ring in the
+    device; both are treated as lost in Dx. The ring is only retained when
+    the RetainRing parameter is set.
+
+    Both transitions and the restores are timed, so that resume latency can
+    be followed in the field through the ToasterPowerState WMI block.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "state.tmh"
+
+static
+VOID
+ToasterStateWaitForRing(
+    _In_ PTOASTER_SAVED_STATE State
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterStateInitialize)
+#pragma alloc_text(PAGE, ToasterStateAllocate)
+#pragma alloc_text(PAGE, ToasterStateFree)
+#pragma alloc_text(PAGE, ToasterStateQuery)
+#endif
+
+
+//被ToasterEvtDeviceAdd调用
+NTSTATUS
+ToasterStateInitialize(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Creates what serializes the restores. Must run in EvtDeviceAdd: the
+    crispiness level is set from PrepareHardware already.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_DATA               fdoData;
+    PTOASTER_SAVED_STATE    state;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    state = &ToasterFdoGetIoData(Device)->SavedState;
+
+    KeInitializeEvent(&state->RingRestored, NotificationEvent, TRUE);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfWaitLockCreate(&attributes, &state->CrispinessLock);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfWaitLockCreate failed 0x%x\n",
+                           status);
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtDevicePrepareHardware调用
+VOID
+ToasterStateAllocate(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Starts every start with an empty snapshot and, if the ring is to be
+    retained, allocates the buffer D0Exit saves it into. Allocating here
+    keeps D0Exit free of allocations. If the buffer cannot be had the
+    device runs without retention rather than failing the start.
+
+    The timing counters are kept across starts.
+
+--*/
+{
+    PFDO_DATA               fdoData;
+    PTOASTER_SAVED_STATE    state;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    state = &ToasterFdoGetIoData(Device)->SavedState;
+
+    //
+    // The level the bus driver starts with is not in any snapshot yet.
+    //
+    state->Dirty = TOASTER_STATE_CRISPINESS;
+    state->RestorePending = 0;
+    state->Valid = 0;
+    state->RingLength = 0;
+
+    if (ToasterParameters.RetainRing) {
+        state->RingSnapshot = ToasterNumaAllocate(ToasterFdoGetIoData(Device),
+                                                  TOASTER_RING_DEFAULT_SIZE,
+                                                  FALSE);
+        if (state->RingSnapshot == NULL) {
+            WppPrintDeviceError(fdoData->WppRecorderLog,
+                               "Failed to allocate %d byte ring snapshot, ring is not retained\n",
+                               TOASTER_RING_DEFAULT_SIZE);
+        }
+    }
+}
+
+//被ToasterEvtDeviceReleaseHardware调用
+VOID
+ToasterStateFree(
+    _In_ WDFDEVICE Device
+    )
+{
+    PTOASTER_SAVED_STATE    state;
+
+    PAGED_CODE();
+
+    state = &ToasterFdoGetIoData(Device)->SavedState;
+
+    if (state->RingSnapshot != NULL) {
+        ExFreePoolWithTag(state->RingSnapshot, TOASTER_POOL_TAG);
+        state->RingSnapshot = NULL;
+    }
+
+    state->RestorePending = 0;
+    state->Valid = 0;
+    state->RingLength = 0;
+
+    KeSetEvent(&state->RingRestored, IO_NO_INCREMENT, FALSE);
+}
+
+//也被Start.c调用
+ULONG
+ToasterStateMicroseconds(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ LONGLONG       StartTicks
+    )
+/*++
+
+Routine Description:
+
+    Microseconds since StartTicks, a ToasterStatsStart value.
+
+--*/
+{
+    ULONG64 micros;
+
+    micros = (ULONG64) (ToasterStatsStart() - StartTicks) * 1000000 /
+             (ULONG64) IoData->Stats.Frequency;
+
+    return (ULONG) min(micros, MAXULONG);
+}
+
+//被ToasterEvtDeviceD0Exit调用
+VOID
+ToasterStateSave(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Snapshots the dirty items. Called from D0Exit for every target state
+    but WdfPowerDeviceD3Final. The power-managed queues are stopped, so
+    nothing touches the ring or the crispiness level while this runs.
+
+--*/
+{
+    PFDO_DATA               fdoData;
+    PFDO_IO_DATA            ioData;
+    PTOASTER_SAVED_STATE    state;
+    LONG                    dirty;
+
+    fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
+    state = &ioData->SavedState;
+
+    //
+    // Anything not restored by now stays in the snapshot for the next
+    // D0Entry; nothing may try to restore it while the device is in Dx.
+    //
+    InterlockedExchange(&state->RestorePending, 0);
+    KeSetEvent(&state->RingRestored, IO_NO_INCREMENT, FALSE);
+
+    dirty = InterlockedExchange(&state->Dirty, 0);
+
+    if (dirty & TOASTER_STATE_CRISPINESS) {
+        state->Crispiness = (ULONG) ReadNoFence(&ioData->CrispinessLevel);
+        state->Valid |= TOASTER_STATE_CRISPINESS;
+    }
+
+    if (state->RingSnapshot == NULL) {
+
+        //
+        // Not retained: whatever was in the ring is gone.
+        //
+        ToasterRingReset(&ioData->DataRing);
+
+    } else if (dirty & TOASTER_STATE_RING) {
+
+        //
+        // Reading the ring out also empties it, which is what the device
+        // is about to lose anyway.
+        //
+        state->RingLength = ToasterRingRead(&ioData->DataRing,
+                                            state->RingSnapshot,
+                                            TOASTER_RING_DEFAULT_SIZE,
+                                            FALSE);
+        state->Valid |= TOASTER_STATE_RING;
+        state->LastSavedBytes = (ULONG) state->RingLength;
+
+    } else {
+
+        //
+        // Either the ring was restored and has not changed since, so it
+        // holds exactly the snapshot, or it was never restored and is
+        // empty. The snapshot stays as it is.
+        //
+        ToasterRingReset(&ioData->DataRing);
+    }
+
+    state->Saves++;
+
+    WppPrintDevice(fdoData->WppRecorderLog,
+                  "Saved state: dirty 0x%x, valid 0x%x, %Id ring bytes\n",
+                  dirty,
+                  state->Valid,
+                  state->RingLength);
+}
+
+//被ToasterEvtDeviceD0Entry调用
+VOID
+ToasterStateResumed(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Marks everything in the snapshot as waiting to be restored. Nothing is
+    put back here; D0Entry stays as short as the device allows.
+
+--*/
+{
+    PTOASTER_SAVED_STATE    state;
+
+    state = &ToasterFdoGetIoData(Device)->SavedState;
+
+    state->D0EntryTicks = ToasterStatsStart();
+
+    if (state->Valid & TOASTER_STATE_RING) {
+        KeClearEvent(&state->RingRestored);
+    }
+
+    WriteRelease(&state->RestorePending, state->Valid);
+}
+
+VOID
+ToasterStateRestoreSlow(
+    _In_ WDFDEVICE  Device,
+    _In_ LONG       Items
+    )
+/*++
+
+Routine Description:
+
+    Slow half of ToasterStateRestore. Each pending item is restored by
+    exactly one caller, and no spinlock is held while it is: the ring copy
+    is as long as the ring, and the crispiness level goes through the bus
+    interface.
+
+    The crispiness level is only restored at PASSIVE_LEVEL, under
+    CrispinessLock; above it the item stays pending for the next caller
+    at PASSIVE_LEVEL. Requests that need the ring while another caller
+    writes it back wait for RingRestored; at DISPATCH_LEVEL, where they
+    cannot, they watch the pending bit instead.
+
+Arguments:
+
+    Device - Handle to a framework device object.
+
+    Items - pending items the caller depends on.
+
+--*/
+{
+    PFDO_DATA               fdoData;
+    PFDO_IO_DATA            ioData;
+    PTOASTER_SAVED_STATE    state;
+    LONGLONG                startTicks;
+    LONG                    previous = 0;
+    LONG                    restored = 0;
+    ULONG                   elapsed;
+    NTSTATUS                status;
+
+    fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
+    state = &ioData->SavedState;
+
+    startTicks = ToasterStatsStart();
+
+    if ((Items & TOASTER_STATE_CRISPINESS) && KeGetCurrentIrql() == PASSIVE_LEVEL) {
+
+        WdfWaitLockAcquire(state->CrispinessLock, NULL);
+
+        if (ReadNoFence(&state->RestorePending) & TOASTER_STATE_CRISPINESS) {
+
+            status = ToasterSetCrispinessLocked(Device, (UCHAR) state->Crispiness);
+
+            //
+            // A level that did not take stays pending and is tried again
+            // by the next caller. Without the interface there is nothing
+            // to retry against.
+            //
+            if (NT_SUCCESS(status) || status == STATUS_NOT_SUPPORTED) {
+                previous = InterlockedAnd(&state->RestorePending, ~TOASTER_STATE_CRISPINESS);
+                restored |= TOASTER_STATE_CRISPINESS;
+            }
+
+            if (!NT_SUCCESS(status)) {
+                WppPrintDeviceError(fdoData->WppRecorderLog,
+                                   "Failed to restore crispiness %d 0x%x\n",
+                                   state->Crispiness,
+                                   status);
+            }
+        }
+
+        WdfWaitLockRelease(state->CrispinessLock);
+    }
+
+    if (Items & TOASTER_STATE_RING) {
+
+        if (InterlockedOr(&state->Restoring, TOASTER_STATE_RING) & TOASTER_STATE_RING) {
+
+            ToasterStateWaitForRing(state);
+
+        } else {
+
+            //
+            // Checked again now that the item is ours: whoever had it
+            // before may have finished in between.
+            //
+            if (ReadAcquire(&state->RestorePending) & TOASTER_STATE_RING) {
+
+                //
+                // Back at the positions it was saved from, so that shared
+                // cursors (File.c) still point at the same data.
+                //
+                ToasterRingRewind(&ioData->DataRing, state->RingLength);
+
+                (VOID) ToasterRingWrite(&ioData->DataRing,
+                                        state->RingSnapshot,
+                                        state->RingLength);
+
+                previous = InterlockedAnd(&state->RestorePending, ~TOASTER_STATE_RING);
+                restored |= TOASTER_STATE_RING;
+
+                KeSetEvent(&state->RingRestored, IO_NO_INCREMENT, FALSE);
+            }
+
+            InterlockedAnd(&state->Restoring, ~TOASTER_STATE_RING);
+        }
+    }
+
+    if (restored == 0) {
+        return;
+    }
+
+    //
+    // Restores of different items can overlap, so the timing is only as
+    // exact as a per-item measurement can be.
+    //
+    elapsed = ToasterStateMicroseconds(ioData, startTicks);
+    state->LastRestoreTime = elapsed;
+    state->MaxRestoreTime = max(state->MaxRestoreTime, elapsed);
+
+    InterlockedIncrementNoFence((volatile LONG *) &state->Restores);
+
+    //
+    // Whoever cleared the last pending bit closes the resume.
+    //
+    if ((previous & ~restored) == 0) {
+        elapsed = ToasterStateMicroseconds(ioData, state->D0EntryTicks);
+        state->LastResumeLatency = elapsed;
+        state->MaxResumeLatency = max(state->MaxResumeLatency, elapsed);
+    }
+}
+
+//被ToasterStateRestoreSlow调用
+VOID
+ToasterStateWaitForRing(
+    _In_ PTOASTER_SAVED_STATE State
+    )
+/*++
+
+Routine Description:
+
+    Waits for the caller that is writing the ring back. Below
+    DISPATCH_LEVEL the wait is on RingRestored; at DISPATCH_LEVEL all that
+    can be done is to watch the pending bit until the copy is over.
+
+--*/
+{
+    if (KeGetCurrentIrql() < DISPATCH_LEVEL) {
+        (VOID) KeWaitForSingleObject(&State->RingRestored,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+        return;
+    }
+
+    while (ReadAcquire(&State->RestorePending) & TOASTER_STATE_RING) {
+        YieldProcessor();
+    }
+}
+
+VOID
+ToasterStateRecordTransition(
+    _In_ WDFDEVICE  Device,
+    _In_ BOOLEAN    Entry,
+    _In_ LONGLONG   StartTicks
+    )
+/*++
+
+Routine Description:
+
+    Accounts the duration of a D0Entry or D0Exit callback. The framework
+    never runs the two at the same time.
+
+--*/
+{
+    PFDO_IO_DATA            ioData = ToasterFdoGetIoData(Device);
+    PTOASTER_SAVED_STATE    state = &ioData->SavedState;
+    ULONG                   elapsed;
+
+    elapsed = ToasterStateMicroseconds(ioData, StartTicks);
+
+    if (Entry) {
+        state->LastD0EntryTime = elapsed;
+        state->MaxD0EntryTime = max(state->MaxD0EntryTime, elapsed);
+    } else {
+        state->LastD0ExitTime = elapsed;
+        state->MaxD0ExitTime = max(state->MaxD0ExitTime, elapsed);
+    }
+}
+
+//被EvtWmiInstancePowerStateQueryInstance调用
+VOID
+ToasterStateQuery(
+    _In_  WDFDEVICE             Device,
+    _Out_ PToasterPowerState    PowerState
+    )
+{
+    PTOASTER_SAVED_STATE    state;
+
+    PAGED_CODE();
+
+    state = &ToasterFdoGetIoData(Device)->SavedState;
+
+    PowerState->RetainRing = (state->RingSnapshot != NULL);
+    PowerState->Saves = state->Saves;
+    PowerState->Restores = state->Restores;
+    PowerState->LastSavedBytes = state->LastSavedBytes;
+    PowerState->LastD0ExitTime = state->LastD0ExitTime;
+    PowerState->MaxD0ExitTime = state->MaxD0ExitTime;
+    PowerState->LastD0EntryTime = state->LastD0EntryTime;
+    PowerState->MaxD0EntryTime = state->MaxD0EntryTime;
+    PowerState->LastRestoreTime = state->LastRestoreTime;
+    PowerState->MaxRestoreTime = state->MaxRestoreTime;
+    PowerState->LastResumeLatency = state->LastResumeLatency;
+    PowerState->MaxResumeLatency = state->MaxResumeLatency;
+}
@@ -0,0 +1,365 @@
+/*++
+
+Module Name:
+
+    Stats.c
+
+Abstract:
+
+    Per-processor I/O statistics for the featured toaster function driver.
+
+    Every processor has its own cache-aligned TOASTER_CPU_STATS, so the
+    read, write and IOCTL paths only touch lines that no other processor
+    writes. The increments are still interlocked because a passive-level
+    caller can be rescheduled between picking its slot and updating it, but
+    an interlocked operation on a line the processor already owns costs
+    about as much as a plain add. The counters are only summed when the
+    ToasterPerfStatistics WMI block is queried.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "toaster.h"
+#include "toasterio.h"
+
+#include "trace.h"
+//
+// This tmh is generated by the WPP Preprocessor
+//
+#include "stats.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ToasterStatsAllocate)
+#pragma alloc_text(PAGE, ToasterStatsFree)
+#pragma alloc_text(PAGE, ToasterStatsQuery)
+#pragma alloc_text(PAGE, ToasterStatsQueryTotals)
+#endif
+
+
+//被ToasterEvtDeviceAdd调用
+NTSTATUS
+ToasterStatsAllocate(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Allocates one counter set for every processor that can ever be present,
+    including ones hot-added later, so the hot path never needs a bounds
+    fallback.
+
+--*/
+{
+    PFDO_DATA       fdoData;
+    PTOASTER_STATS  stats;
+    LARGE_INTEGER   frequency;
+    SIZE_T          size;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    stats = &ToasterFdoGetIoData(Device)->Stats;
+
+    stats->ProcessorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    size = (SIZE_T) stats->ProcessorCount * sizeof(TOASTER_CPU_STATS);
+
+    stats->PerCpu = ToasterNumaAllocate(ToasterFdoGetIoData(Device), size, TRUE);
+    if (stats->PerCpu == NULL) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "Failed to allocate statistics for %d processors\n",
+                           stats->ProcessorCount);
+        stats->ProcessorCount = 0;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(stats->PerCpu, size);
+
+    KeQueryPerformanceCounter(&frequency);
+    stats->Frequency = frequency.QuadPart;
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtDeviceContextCleanup调用
+VOID
+ToasterStatsFree(
+    _In_ WDFDEVICE Device
+    )
+{
+    PFDO_IO_DATA    ioData;
+    PTOASTER_STATS  stats;
+
+    PAGED_CODE();
+
+    //
+    // The device can be deleted before ToasterEvtDeviceAdd got as far as
+    // allocating the I/O context.
+    //
+    ioData = ToasterFdoGetIoData(Device);
+    if (ioData == NULL) {
+        return;
+    }
+
+    stats = &ioData->Stats;
+
+    if (stats->PerCpu != NULL) {
+        ExFreePoolWithTag(stats->PerCpu, TOASTER_POOL_TAG);
+        stats->PerCpu = NULL;
+        stats->ProcessorCount = 0;
+    }
+}
+
+LONGLONG
+ToasterStatsStart(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Returns the time stamp that ToasterStatsRecord measures from.
+
+--*/
+{
+    return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+VOID
+ToasterStatsRecord(
+    _In_ PFDO_IO_DATA       IoData,
+    _In_ TOASTER_STAT_CLASS Class,
+    _In_ NTSTATUS           Status,
+    _In_ ULONG_PTR          Bytes,
+    _In_ LONGLONG           StartTicks
+    )
+/*++
+
+Routine Description:
+
+    Accounts one completed request on the current processor's counters.
+
+Arguments:
+
+    IoData - data path context of the device.
+
+    Class - kind of request.
+
+    Status - completion status.
+
+    Bytes - bytes transferred.
+
+    StartTicks - value returned by ToasterStatsStart when the request was
+        presented to the driver.
+
+--*/
+{
+    PTOASTER_STATS          stats = &IoData->Stats;
+    PTOASTER_CLASS_COUNTERS counters;
+    ULONG                   processor;
+    ULONG64                 micros;
+    ULONG                   bucket;
+
+    if (stats->PerCpu == NULL) {
+        return;
+    }
+
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+    if (processor >= stats->ProcessorCount) {
+        return;
+    }
+
+    counters = &stats->PerCpu[processor].Class[Class];
+
+    InterlockedIncrementNoFence64(&counters->Requests);
+
+    if (Bytes != 0) {
+        InterlockedAddNoFence64(&counters->Bytes, (LONG64) Bytes);
+    }
+
+    if (!NT_SUCCESS(Status)) {
+        InterlockedIncrementNoFence64(&counters->Errors);
+    }
+
+    micros = (ULONG64) (ToasterStatsStart() - StartTicks) * 1000000 /
+             (ULONG64) stats->Frequency;
+
+    //
+    // Bucket n holds [2^(n-1), 2^n) microseconds; bucket 0 holds < 1us.
+    //
+    if (micros == 0) {
+        bucket = 0;
+    } else {
+        _BitScanReverse64(&bucket, micros);
+        bucket = min(bucket + 1, TOASTER_LATENCY_BUCKETS - 1);
+    }
+
+    InterlockedIncrementNoFence64(&counters->Latency[bucket]);
+}
+
+static
+VOID
+ToasterStatsSumClass(
+    _In_  PTOASTER_STATS        Stats,
+    _In_  TOASTER_STAT_CLASS    Class,
+    _Out_ PULONGLONG            Requests,
+    _Out_ PULONGLONG            Bytes,
+    _Out_ PULONGLONG            Errors,
+    _Out_writes_opt_(TOASTER_LATENCY_BUCKETS) PULONGLONG Latency
+    )
+{
+    PTOASTER_CLASS_COUNTERS counters;
+    ULONG                   processor;
+    ULONG                   bucket;
+
+    *Requests = 0;
+    *Bytes = 0;
+    *Errors = 0;
+
+    if (Latency != NULL) {
+        RtlZeroMemory(Latency, TOASTER_LATENCY_BUCKETS * sizeof(ULONGLONG));
+    }
+
+    for (processor = 0; processor < Stats->ProcessorCount; processor++) {
+
+        counters = &Stats->PerCpu[processor].Class[Class];
+
+        *Requests += ReadNoFence64(&counters->Requests);
+        *Bytes += ReadNoFence64(&counters->Bytes);
+        *Errors += ReadNoFence64(&counters->Errors);
+
+        if (Latency == NULL) {
+            continue;
+        }
+
+        for (bucket = 0; bucket < TOASTER_LATENCY_BUCKETS; bucket++) {
+            Latency[bucket] += ReadNoFence64(&counters->Latency[bucket]);
+        }
+    }
+}
+
+//被EvtWmiInstancePerfStatisticsQueryInstance调用
+VOID
+ToasterStatsQuery(
+    _In_  WDFDEVICE                 Device,
+    _Out_ PToasterPerfStatistics    Statistics
+    )
+/*++
+
+Routine Description:
+
+    Sums the per-processor counters into the ToasterPerfStatistics layout.
+    The counters keep moving while they are summed, so the totals are only
+    a consistent snapshot if the device is idle.
+
+--*/
+{
+    PTOASTER_STATS  stats;
+
+    PAGED_CODE();
+
+    C_ASSERT(ARRAYSIZE(Statistics->ReadLatencyHistogram) == TOASTER_LATENCY_BUCKETS);
+
+    stats = &ToasterFdoGetIoData(Device)->Stats;
+
+    ToasterStatsSumClass(stats,
+                         ToasterStatRead,
+                         &Statistics->ReadRequests,
+                         &Statistics->ReadBytes,
+                         &Statistics->ReadErrors,
+                         Statistics->ReadLatencyHistogram);
+
+    ToasterStatsSumClass(stats,
+                         ToasterStatWrite,
+                         &Statistics->WriteRequests,
+                         &Statistics->WriteBytes,
+                         &Statistics->WriteErrors,
+                         Statistics->WriteLatencyHistogram);
+
+    ToasterStatsSumClass(stats,
+                         ToasterStatIoctl,
+                         &Statistics->IoctlRequests,
+                         &Statistics->IoctlBytes,
+                         &Statistics->IoctlErrors,
+                         Statistics->IoctlLatencyHistogram);
+
+    Statistics->ProcessorCount = stats->ProcessorCount;
+}
+
+//被EvtWmiInstanceDeviceSnapshotQueryInstance调用
+VOID
+ToasterStatsQueryTotals(
+    _In_  WDFDEVICE                 Device,
+    _Out_ PToasterDeviceSnapshot    Snapshot
+    )
+/*++
+
+Routine Description:
+
+    Same as ToasterStatsQuery without the latency histograms, for the
+    ToasterDeviceSnapshot block.
+
+--*/
+{
+    PTOASTER_STATS  stats;
+
+    PAGED_CODE();
+
+    stats = &ToasterFdoGetIoData(Device)->Stats;
+
+    ToasterStatsSumClass(stats,
+                         ToasterStatRead,
+                         &Snapshot->ReadRequests,
+                         &Snapshot->ReadBytes,
+                         &Snapshot->ReadErrors,
+                         NULL);
+
+    ToasterStatsSumClass(stats,
+                         ToasterStatWrite,
+                         &Snapshot->WriteRequests,
+                         &Snapshot->WriteBytes,
+                         &Snapshot->WriteErrors,
+                         NULL);
+
+    ToasterStatsSumClass(stats,
+                         ToasterStatIoctl,
+                         &Snapshot->IoctlRequests,
+                         &Snapshot->IoctlBytes,
+                         &Snapshot->IoctlErrors,
+                         NULL);
+
+    Snapshot->ProcessorCount = stats->ProcessorCount;
+}
+
+ULONG64
+ToasterStatsGetErrorCount(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Total errors across all request classes, for
+    ToasterDeviceInformation.ErrorCount.
+
+--*/
+{
+    PTOASTER_STATS  stats;
+    ULONG64         errors = 0;
+    ULONG           processor;
+    ULONG           class;
+
+    stats = &ToasterFdoGetIoData(Device)->Stats;
+
+    for (processor = 0; processor < stats->ProcessorCount; processor++) {
+        for (class = 0; class < ToasterStatClassMaximum; class++) {
+            errors += ReadNoFence64(&stats->PerCpu[processor].Class[class].Errors);
+        }
+    }
+
+    return errors;
+}
@@ -25,6 +25,7 @@ Environment:
 --*/
 
 #include "toaster.h"
+#include "toasterio.h"
 
 #include "trace.h"
 //
@@ -32,19 +33,29 @@ Environment:
 //
 #include "toaster.tmh"
 
+static
+VOID
+ToasterServicePendingQueue(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFQUEUE       Queue
+    );
+
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (INIT, DriverEntry)
+#pragma alloc_text (INIT, ToasterReadDriverParameters)
+#pragma alloc_text (INIT, ToasterReadQueueParameters)
 #pragma alloc_text (PAGE, ToasterEvtDriverUnload)
 #pragma alloc_text (PAGE, ToasterEvtDeviceAdd)
+#pragma alloc_text (PAGE, ToasterCreateQueue)
 #pragma alloc_text (PAGE, ToasterEvtDeviceFileCreate)
 #pragma alloc_text (PAGE, ToasterEvtFileClose)
+#pragma alloc_text (PAGE, ToasterEvtFileCleanup)
 #pragma alloc_text (PAGE, ToasterEvtDevicePrepareHardware)
 #pragma alloc_text (PAGE, ToasterEvtDeviceReleaseHardware)
 #pragma alloc_text (PAGE, ToasterEvtDeviceContextCleanup)
 #pragma alloc_text (PAGE, ToasterEvtIoDeviceControl)
-#pragma alloc_text (PAGE, ToasterEvtIoRead)
-#pragma alloc_text (PAGE, ToasterEvtIoWrite)
 #pragma alloc_text (PAGE, ToasterEvtDeviceSelfManagedIoInit)
+#pragma alloc_text (PAGE, ToasterEvtDeviceSelfManagedIoCleanup)
 #endif
 
 //
@@ -52,6 +63,20 @@ Environment:
 //
 ULONG DebugLevel = 3;
 
+//
+// Driver-wide tunables, filled in from the registry by DriverEntry.
+//
+TOASTER_PARAMETERS ToasterParameters = {
+    0,                                                          // DirectIo
+    0,                                                          // PendingReads
+    0,                                                          // RetainRing
+    TOASTER_DEFAULT_DMA_THRESHOLD,                              // DmaThreshold
+    TOASTER_DEFAULT_COALESCE_LIMIT,                             // CoalesceLimit
+    { WdfIoQueueDispatchParallel,   (ULONG) -1 },               // ReadQueue
+    { WdfIoQueueDispatchParallel,   (ULONG) -1 },               // WriteQueue
+    { WdfIoQueueDispatchSequential, (ULONG) -1 },               // IoctlQueue
+};
+
 NTSTATUS
 DriverEntry(
     IN PDRIVER_OBJECT  DriverObject,
@@ -86,12 +111,19 @@ Return Value:
     NTSTATUS                    status = STATUS_SUCCESS;
     RECORDER_CONFIGURE_PARAMS   recorderConfigureParams; //WppRecorder.h
     WDF_DRIVER_CONFIG           config;
+    WDFDRIVER                   driver;
 
     //
     // WPP Initialization
     //
     WPP_INIT_TRACING(DriverObject, RegistryPath);//只要调用这个，后面就要调用WPP_CLEANUP(DriverObject);
 
+    //
+    // TraceLogging events, see activity.c. A failure only means that no
+    // session will see them.
+    //
+    (VOID) TraceLoggingRegister(ToasterTlProvider);
+
     //
     // The CreateDefaultLog member is set to TRUE by default by
     // RECORDER_CONFIGURE_PARAMS_INIT().
@@ -133,6 +165,17 @@ Return Value:
     //
     config.EvtDriverUnload = ToasterEvtDriverUnload;//有资源要释放
 
+    //
+    // Process exits, for the shared rings, see SharedRing.c.
+    //
+    status = ToasterSharedRingsDriverInitialize();
+    if (!NT_SUCCESS(status)) {
+        KdPrint( ("ToasterSharedRingsDriverInitialize failed with status 0x%x\n", status));
+        TraceLoggingUnregister(ToasterTlProvider);
+        WPP_CLEANUP(DriverObject);
+        return status;
+    }
+
     //
     // Create a framework driver object to represent our driver.
     //
@@ -141,7 +184,7 @@ Return Value:
                             RegistryPath,
                             WDF_NO_OBJECT_ATTRIBUTES, // Driver Attributes
                             &config,          // 带ToasterEvtDriverUnload
-                            WDF_NO_HANDLE
+                            &driver
                             );
 
     if (!NT_SUCCESS(status)) {
@@ -151,12 +194,156 @@ Return Value:
         // EvtDriverUnload callback will not be called, so we need to clean
         // up the WPP resources here.
         //
+        ToasterSharedRingsDriverUnload();
+        TraceLoggingUnregister(ToasterTlProvider);
         WPP_CLEANUP(DriverObject); //前面调用了WPP_INIT_TRACING()
+        return status;
     }
 
+    ToasterReadDriverParameters(driver);
+
     return status;
 }
 
+//
+// Registry value names for the per-queue dispatch policy.
+//
+typedef struct _TOASTER_QUEUE_PARAMETER {
+    PCWSTR                  DispatchTypeName;
+    PCWSTR                  PresentedLimitName;
+    PTOASTER_QUEUE_POLICY   Policy;
+} TOASTER_QUEUE_PARAMETER;
+
+//被ToasterReadDriverParameters调用
+VOID
+ToasterReadQueueParameters(
+    _In_ WDFKEY Key
+    )
+/*++
+Routine Description:
+
+    Reads the optional <Queue>DispatchType and <Queue>PresentedLimit values
+    for the read, write and control queues. DispatchType is 1 for
+    sequential and 2 for parallel, matching WDF_IO_QUEUE_DISPATCH_TYPE;
+    manual dispatch would leave requests unserviced and is rejected.
+    PresentedLimit only applies to parallel queues.
+
+--*/
+{
+    NTSTATUS        status;
+    ULONG           i;
+    ULONG           value;
+    UNICODE_STRING  name;
+    TOASTER_QUEUE_PARAMETER queueParameters[] = {
+        { L"ReadQueueDispatchType",  L"ReadQueuePresentedLimit",  &ToasterParameters.ReadQueue },
+        { L"WriteQueueDispatchType", L"WriteQueuePresentedLimit", &ToasterParameters.WriteQueue },
+        { L"IoctlQueueDispatchType", L"IoctlQueuePresentedLimit", &ToasterParameters.IoctlQueue },
+    };
+
+    PAGED_CODE();
+
+    for (i = 0; i < ARRAYSIZE(queueParameters); i++) {
+
+        RtlInitUnicodeString(&name, queueParameters[i].DispatchTypeName);
+        status = WdfRegistryQueryULong(Key, &name, &value);
+        if (NT_SUCCESS(status)) {
+            if (value == WdfIoQueueDispatchSequential ||
+                value == WdfIoQueueDispatchParallel) {
+                queueParameters[i].Policy->DispatchType = (WDF_IO_QUEUE_DISPATCH_TYPE) value;
+            } else {
+                KdPrint(("Ignoring %ws = %d\n", queueParameters[i].DispatchTypeName, value));
+            }
+        }
+
+        RtlInitUnicodeString(&name, queueParameters[i].PresentedLimitName);
+        status = WdfRegistryQueryULong(Key, &name, &value);
+        if (NT_SUCCESS(status) && value != 0) {
+            queueParameters[i].Policy->NumberOfPresentedRequests = value;
+        }
+
+        KdPrint(("%ws: dispatch %d, presented limit %d\n",
+                 queueParameters[i].DispatchTypeName,
+                 queueParameters[i].Policy->DispatchType,
+                 queueParameters[i].Policy->NumberOfPresentedRequests));
+    }
+}
+
+//被DriverEntry调用
+VOID
+ToasterReadDriverParameters(
+    _In_ WDFDRIVER Driver
+    )
+/*++
+Routine Description:
+
+    Reads the driver-wide tunables from
+    HKLM\System\CurrentControlSet\Services\<service>\Parameters.
+    A missing key or value leaves the built-in default in place, so an
+    unconfigured system behaves exactly like before.
+
+Arguments:
+
+    Driver - Handle to the framework driver object.
+
+--*/
+{
+    NTSTATUS    status;
+    WDFKEY      key;
+    ULONG       value;
+    DECLARE_CONST_UNICODE_STRING(directIoName, TOASTER_PARAM_DIRECT_IO);
+    DECLARE_CONST_UNICODE_STRING(pendingReadsName, TOASTER_PARAM_PENDING_READS);
+    DECLARE_CONST_UNICODE_STRING(retainRingName, TOASTER_PARAM_RETAIN_RING);
+    DECLARE_CONST_UNICODE_STRING(dmaThresholdName, TOASTER_PARAM_DMA_THRESHOLD);
+    DECLARE_CONST_UNICODE_STRING(coalesceLimitName, TOASTER_PARAM_COALESCE_LIMIT);
+
+    PAGED_CODE();
+
+    status = WdfDriverOpenParametersRegistryKey(Driver,
+                                                KEY_READ,
+                                                WDF_NO_OBJECT_ATTRIBUTES,
+                                                &key);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("WdfDriverOpenParametersRegistryKey failed 0x%x\n", status));
+        return;
+    }
+
+    status = WdfRegistryQueryULong(key, &directIoName, &value);
+    if (NT_SUCCESS(status)) {
+        ToasterParameters.DirectIo = (value != 0);
+    }
+
+    status = WdfRegistryQueryULong(key, &pendingReadsName, &value);
+    if (NT_SUCCESS(status)) {
+        ToasterParameters.PendingReads = (value != 0);
+    }
+
+    status = WdfRegistryQueryULong(key, &retainRingName, &value);
+    if (NT_SUCCESS(status)) {
+        ToasterParameters.RetainRing = (value != 0);
+    }
+
+    status = WdfRegistryQueryULong(key, &dmaThresholdName, &value);
+    if (NT_SUCCESS(status)) {
+        ToasterParameters.DmaThreshold = value;
+    }
+
+    status = WdfRegistryQueryULong(key, &coalesceLimitName, &value);
+    if (NT_SUCCESS(status)) {
+        ToasterParameters.CoalesceLimit = value;
+    }
+
+    ToasterReadQueueParameters(key);
+
+    KdPrint(("Toaster parameters: DirectIo %d, PendingReads %d, RetainRing %d, DmaThreshold %d, CoalesceLimit %d\n",
+             ToasterParameters.DirectIo,
+             ToasterParameters.PendingReads,
+             ToasterParameters.RetainRing,
+             ToasterParameters.DmaThreshold,
+             ToasterParameters.CoalesceLimit));
+
+    WdfRegistryClose(key);
+}
+
 VOID
 ToasterEvtDriverUnload(
     IN WDFDRIVER Driver
@@ -177,6 +364,10 @@ Routine Description:
 
     driverObject = WdfDriverWdmGetDriverObject(Driver);
 
+    ToasterSharedRingsDriverUnload();
+
+    TraceLoggingUnregister(ToasterTlProvider);
+
     WPP_CLEANUP(driverObject);
 }
 
@@ -209,18 +400,25 @@ Return Value:
     WDF_OBJECT_ATTRIBUTES                 fdoAttributes;
     WDFDEVICE                             device;
     WDF_FILEOBJECT_CONFIG                 fileConfig;
+    WDF_OBJECT_ATTRIBUTES                 fileAttributes;
     WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS idleSettings;
     WDF_DEVICE_POWER_POLICY_WAKE_SETTINGS wakeSettings;
     WDF_POWER_POLICY_EVENT_CALLBACKS      powerPolicyCallbacks;
-    WDF_IO_QUEUE_CONFIG                   queueConfig;
     PFDO_DATA                             fdoData;
-    WDFQUEUE                              queue;
+    PFDO_IO_DATA                          ioData;
+    WDF_OBJECT_ATTRIBUTES                 ioDataAttributes;
+    WDF_OBJECT_ATTRIBUTES                 requestAttributes;
+    WDF_IO_QUEUE_CONFIG                   pendingQueueConfig;
     RECORDER_LOG_CREATE_PARAMS            recorderLogCreateParams;
+    ULONG                                 priority;
+    LONGLONG                              addTicks;
 
     UNREFERENCED_PARAMETER(Driver);
 
     PAGED_CODE();
 
+    addTicks = ToasterStatsStart();
+
     KdPrint(("ToasterEvtDeviceAdd called\n"));
 
 	//---------------------------------------------------------------
@@ -240,6 +438,7 @@ Return Value:
     pnpPowerCallbacks.EvtDevicePrepareHardware = ToasterEvtDevicePrepareHardware;
     pnpPowerCallbacks.EvtDeviceReleaseHardware = ToasterEvtDeviceReleaseHardware;
     pnpPowerCallbacks.EvtDeviceSelfManagedIoInit = ToasterEvtDeviceSelfManagedIoInit;
+    pnpPowerCallbacks.EvtDeviceSelfManagedIoCleanup = ToasterEvtDeviceSelfManagedIoCleanup;
 
     pnpPowerCallbacks.EvtDeviceD0Entry = ToasterEvtDeviceD0Entry;
     pnpPowerCallbacks.EvtDeviceD0Exit = ToasterEvtDeviceD0Exit;
@@ -275,6 +474,17 @@ Return Value:
     //
     WdfDeviceInitSetPowerPolicyEventCallbacks(DeviceInit, &powerPolicyCallbacks);
 
+    //---------------------------------------------------------------
+    // Select the buffering method for reads and writes. By default the
+    // I/O manager copies the caller's data into a system buffer and back,
+    // which for large transfers means every byte is copied twice. In
+    // direct mode the caller's pages are locked and described by an MDL so
+    // the ring copies straight into or out of them.
+    //---------------------------------------------------------------
+    if (ToasterParameters.DirectIo) {
+        WdfDeviceInitSetIoType(DeviceInit, WdfDeviceIoDirect);
+    }
+
     //---------------------------------------------------------------
     // Initialize WDF_FILEOBJECT_CONFIG_INIT struct to tell the
     // framework whether you are interested in handling Create, Close and
@@ -290,12 +500,33 @@ Return Value:
                             &fileConfig,
                             ToasterEvtDeviceFileCreate,//干预的filecreate处理，改变缺省行为
                             ToasterEvtFileClose,       //干预的fileclose处理，改变缺省行为
-                            WDF_NO_EVENT_CALLBACK // not interested in Cleanup
+                            ToasterEvtFileCleanup      //用户态映射必须在拥有它的进程上下文中拆除
                             );
+    //
+    // Every handle carries a TOASTER_FILE_CONTEXT; see File.c.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&fileAttributes, TOASTER_FILE_CONTEXT);
+
 	//registers event callback functions and sets configuration information for the driver's framework file objects.
     WdfDeviceInitSetFileObjectConfig(DeviceInit,
                                        &fileConfig,
-                                       WDF_NO_OBJECT_ATTRIBUTES);
+                                       &fileAttributes);
+
+    //---------------------------------------------------------------
+    // Mapping the shared submission/completion rings into a process has to
+    // happen in the context of the requesting thread, which a queue
+    // callback does not guarantee. EvtIoInCallerContext sees every request
+    // before it is queued; it handles IOCTL_TOASTER_MAP_RINGS itself and
+    // hands everything else back to the framework untouched.
+    //---------------------------------------------------------------
+    WdfDeviceInitSetIoInCallerContextCallback(DeviceInit,
+                                              ToasterEvtIoInCallerContext);
+
+    //
+    // Every request carries a TOASTER_REQUEST_CONTEXT; see toasterio.h.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, TOASTER_REQUEST_CONTEXT);
+    WdfDeviceInitSetRequestAttributes(DeviceInit, &requestAttributes);
 
     //---------------------------------------------------------------
 	// 创建device
@@ -348,6 +579,55 @@ Return Value:
         return status;
     }
 
+    //
+    // The data path state is kept in a second context on the device so that
+    // it shares the device's lifetime.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&ioDataAttributes, FDO_IO_DATA);
+
+    status = WdfObjectAllocateContext(device, &ioDataAttributes, &ioData);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfObjectAllocateContext failed 0x%x\n",
+                           status);
+        return status;
+    }
+
+    ExInitializeRundownProtection(&ioData->BusInterfaceRundown);
+
+    //
+    // Closed until the first D0Entry.
+    //
+    ExInitializeRundownProtection(&ioData->CoalesceRundown);
+    ExWaitForRundownProtectionRelease(&ioData->CoalesceRundown);
+
+    KeInitializeSpinLock(&ioData->PowerLog.Lock);
+    KeInitializeSpinLock(&ioData->CursorLock);
+    InitializeListHead(&ioData->Cursors);
+
+    //
+    // Before the first allocation, so that everything lands on the
+    // device's node.
+    //
+    ToasterNumaInitialize(device);
+
+    ToasterHwInitialize(device);
+
+    status = ToasterStatsAllocate(device);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = ToasterIdleInitialize(device);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = ToasterStateInitialize(device);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
 	//---------------------------------------------------------------
 	// 注册接口
 	//---------------------------------------------------------------
@@ -376,53 +656,77 @@ Return Value:
     //
     // Register I/O callbacks to tell the framework that you are interested
     // in handling IRP_MJ_READ, IRP_MJ_WRITE, and IRP_MJ_DEVICE_CONTROL requests.
-    // In case a specific handler is not specified for one of these,
-    // the request will be dispatched to the EvtIoDefault handler, if any.
-    // If there is no EvtIoDefault handler, the request will be failed with
-    // STATUS_INVALID_DEVICE_REQUEST.
-    // WdfIoQueueDispatchParallel means that we are capable of handling
-    // all the I/O request simultaneously and we are responsible for protecting
-    // data that could be accessed by these callbacks simultaneously.
-    // A default queue gets all the requests that are not
-    // configure-fowarded using WdfDeviceConfigureRequestDispatching.
-    //
-    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig,
-                             WdfIoQueueDispatchParallel); // 枚举，EvtIoCancel
-
-    queueConfig.EvtIoRead = ToasterEvtIoRead; //我们感兴趣IRP_MJ_READ
-    queueConfig.EvtIoWrite = ToasterEvtIoWrite; //我们感兴趣IRP_MJ_WRITE
-    queueConfig.EvtIoDeviceControl = ToasterEvtIoDeviceControl; //我们感兴趣IRP_MJ_DEVICE_CONTROL
-
-    //
-    // By default, Static Driver Verifier (SDV) displays a warning if it 
-    // doesn't find the EvtIoStop callback on a power-managed queue. 
-    // The 'assume' below causes SDV to suppress this warning. If the driver 
-    // has not explicitly set PowerManaged to WdfFalse, the framework creates
-    // power-managed queues when the device is not a filter driver.  Normally 
-    // the EvtIoStop is required for power-managed queues, but for this driver
-    // it is not needed b/c the driver doesn't hold on to the requests or 
-    // forward them to other drivers. This driver completes the requests 
-    // directly in the queue's handlers. If the EvtIoStop callback is not 
-    // implemented, the framework waits for all driver-owned requests to be
-    // done before moving in the Dx/sleep states or before removing the 
-    // device, which is the correct behavior for this type of driver.
-    // If the requests were taking an indeterminate amount of time to complete,
-    // or if the driver forwarded the requests to a lower driver/another stack,
-    // the queue should have an EvtIoStop/EvtIoResume.
-    //
-    __analysis_assume(queueConfig.EvtIoStop != 0);//抑制SDV的警告
-    status = WdfIoQueueCreate(device,
-                              &queueConfig, //带上面三个回调
-                              WDF_NO_OBJECT_ATTRIBUTES,
-                              &queue //创建的queue
-                              );
-    __analysis_assume(queueConfig.EvtIoStop == 0);//恢复SDV的警告
+    // Each request type gets its own queue, wired up with
+    // WdfDeviceConfigureRequestDispatching, so that a burst of control
+    // requests does not contend for the same framework queue lock as the
+    // data path. There is no default queue; any other request type is
+    // failed by the framework with STATUS_INVALID_DEVICE_REQUEST.
+    //
+    // The dispatch type and presented-request limit of every queue can be
+    // tuned from the registry (see ToasterReadDriverParameters). By default
+    // reads and writes are parallel and control requests are sequential.
+    //
+    status = ToasterCreateQueue(device,
+                                &ToasterParameters.ReadQueue,
+                                WdfRequestTypeRead,
+                                &ioData->ReadQueue);
+    if (!NT_SUCCESS (status)) {
+        return status;
+    }
 
+    status = ToasterCreateQueue(device,
+                                &ToasterParameters.WriteQueue,
+                                WdfRequestTypeWrite,
+                                &ioData->WriteQueue);
     if (!NT_SUCCESS (status)) {
+        return status;
+    }
 
-        WppPrintDeviceError(fdoData->WppRecorderLog,
-                           "WdfIoQueueCreate failed 0x%x\n",
-                           status);
+    status = ToasterCreateQueue(device,
+                                &ToasterParameters.IoctlQueue,
+                                WdfRequestTypeDeviceIoControl,
+                                &ioData->IoctlQueue);
+    if (!NT_SUCCESS (status)) {
+        return status;
+    }
+
+    //
+    // Reads that have to wait for data are moved out of the read queue into
+    // these, one per priority class, see ToasterEvtIoRead. Nothing
+    // dispatches from them; writes pull requests out with
+    // ToasterServicePendingReads.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&pendingQueueConfig, WdfIoQueueDispatchManual);
+    pendingQueueConfig.PowerManaged = WdfFalse;
+    pendingQueueConfig.EvtIoCanceledOnQueue = ToasterEvtPendingReadCanceled;
+
+    for (priority = 0; priority < ToasterPriorityMaximum; priority++) {
+
+        status = WdfIoQueueCreate(device,
+                                  &pendingQueueConfig,
+                                  WDF_NO_OBJECT_ATTRIBUTES,
+                                  &ioData->PendingReadQueue[priority]);
+        if (!NT_SUCCESS (status)) {
+            WppPrintDeviceError(fdoData->WppRecorderLog,
+                               "WdfIoQueueCreate for pending reads failed 0x%x\n",
+                               status);
+            return status;
+        }
+    }
+
+    //
+    // Pended IOCTL_TOASTER_WAIT_EVENTS requests, see Notify.c.
+    //
+    status = ToasterNotifyInitialize(device);
+    if (!NT_SUCCESS (status)) {
+        return status;
+    }
+
+    //
+    // Timeouts of the parked reads and waits, see Deadline.c.
+    //
+    status = ToasterDeadlineInitialize(device);
+    if (!NT_SUCCESS (status)) {
         return status;
     }
 
@@ -437,8 +741,11 @@ Return Value:
     // way the device can be brought to D0 is if the device recieves an I/O from
     // the system.
     //
+    // This is only the starting point. Idle.c retunes the timeout from the
+    // gaps it sees between requests, within the ToasterIdlePolicy bounds.
+    //
     WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(&idleSettings, IdleCannotWakeFromS0);//设备不能从S0醒来？
-    idleSettings.IdleTimeout = 60000; // 60 secs idle timeout
+    idleSettings.IdleTimeout = ioData->Idle.CurrentTimeout;
     status = WdfDeviceAssignS0IdleSettings(device, &idleSettings);
     if (!NT_SUCCESS(status)) {
         WppPrintDeviceError(fdoData->WppRecorderLog,
@@ -472,9 +779,10 @@ Return Value:
     }
 
     //--------------------------------------------------------------------
-    // Finally register all our WMI datablocks with WMI subsystem.
+    // Finally set up the work item that registers all our WMI datablocks
+    // with WMI subsystem once the device has started, see Start.c.
     //--------------------------------------------------------------------
-    status = ToasterWmiRegistration(device);
+    status = ToasterStartInitialize(device, addTicks);
 
     //
     // Please note that if this event fails or eventually device gets removed
@@ -487,6 +795,107 @@ Return Value:
     return status;
 }
 
+//被ToasterEvtDeviceAdd调用
+NTSTATUS
+ToasterCreateQueue(
+    _In_  WDFDEVICE             Device,
+    _In_  PTOASTER_QUEUE_POLICY Policy,
+    _In_  WDF_REQUEST_TYPE      RequestType,
+    _Out_ WDFQUEUE*             Queue
+    )
+/*++
+Routine Description:
+
+    Creates one of the per-request-type I/O queues of the device and tells
+    the framework to route all requests of RequestType to it.
+
+Arguments:
+
+    Device - Handle to the framework device object.
+
+    Policy - Dispatch type and presented-request limit for the queue.
+
+    RequestType - WdfRequestTypeRead, WdfRequestTypeWrite or
+        WdfRequestTypeDeviceIoControl.
+
+    Queue - Receives the new queue.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+    NTSTATUS            status;
+    WDF_IO_QUEUE_CONFIG queueConfig;
+    PFDO_DATA           fdoData;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, Policy->DispatchType);
+
+    if (Policy->DispatchType == WdfIoQueueDispatchParallel) {
+        queueConfig.Settings.Parallel.NumberOfPresentedRequests =
+                                        Policy->NumberOfPresentedRequests;
+    }
+
+    switch (RequestType) {
+    case WdfRequestTypeRead:
+        queueConfig.EvtIoRead = ToasterEvtIoRead; //我们感兴趣IRP_MJ_READ
+        break;
+    case WdfRequestTypeWrite:
+        queueConfig.EvtIoWrite = ToasterEvtIoWrite; //我们感兴趣IRP_MJ_WRITE
+        break;
+    case WdfRequestTypeDeviceIoControl:
+        queueConfig.EvtIoDeviceControl = ToasterEvtIoDeviceControl; //我们感兴趣IRP_MJ_DEVICE_CONTROL
+        break;
+    default:
+        NT_ASSERT(FALSE);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // If the driver has not explicitly set PowerManaged to WdfFalse, the
+    // framework creates power-managed queues when the device is not a
+    // filter driver, and it will not move the device to Dx while any
+    // request presented by them is still owned by the driver. The queue
+    // handlers never hold on to a request: they complete it before
+    // returning, and a read that has to wait for data is handed to
+    // PendingReadQueue, which the framework owns. ToasterEvtIoStop has to
+    // let such an in-progress request finish, and acknowledges the ones a
+    // hardware toaster holds.
+    //
+    queueConfig.EvtIoStop = ToasterEvtIoStop;
+    queueConfig.EvtIoResume = ToasterEvtIoResume;
+
+    status = WdfIoQueueCreate(Device,
+                              &queueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES,
+                              Queue //创建的queue
+                              );
+
+    if (!NT_SUCCESS (status)) {
+
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfIoQueueCreate failed 0x%x\n",
+                           status);
+        return status;
+    }
+
+    status = WdfDeviceConfigureRequestDispatching(Device, *Queue, RequestType);
+    if (!NT_SUCCESS (status)) {
+
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "WdfDeviceConfigureRequestDispatching failed 0x%x\n",
+                           status);
+        return status;
+    }
+
+    return status;
+}
+
 //pnpPowerCallbacks的回调，执行那些使得设备可以工作的操作
 //在IRP_MN_START_DEVICE被执行
 NTSTATUS
@@ -535,15 +944,21 @@ Return Value:
 --*/
 {
     PFDO_DATA   fdoData;
+    PFDO_IO_DATA ioData;
     NTSTATUS status = STATUS_SUCCESS;
     ULONG i;
     PCM_PARTIAL_RESOURCE_DESCRIPTOR descriptor;
-
-    UNREFERENCED_PARAMETER(ResourcesRaw);
+    PUCHAR ringBuffer;
+    PULONG64 records;
+    ULONG priority;
+    LONGLONG startTicks;
 
     PAGED_CODE();
 
+    startTicks = ToasterStatsStart();
+
     fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
 
     WppPrintDevice(fdoData->WppRecorderLog, "ToasterEvtDevicePrepareHardware called\n");
 
@@ -580,6 +995,8 @@ Return Value:
                           descriptor->u.Interrupt.Level,
                           descriptor->u.Interrupt.Vector,
                           descriptor->u.Interrupt.Affinity);
+
+            ToasterNumaSetInterrupt(Device, descriptor);
             break;
 
         default:
@@ -588,11 +1005,91 @@ Return Value:
 
     }
 
+    //
+    // A hardware toaster's registers and interrupt, see Interrupt.c.
+    //
+    status = ToasterHwPrepare(Device, ResourcesRaw, ResourcesTranslated);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    //
+    // And what it needs to move data itself, see Dma.c.
+    //
+    status = ToasterDmaPrepare(Device);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    //
+    // Run the DPCs where the interrupt goes, or at least on the device's
+    // node.
+    //
+    ToasterNumaApplyAffinity(Device);
+
+    //
+    // Allocate the data ring once per start. The read and write paths only
+    // copy in and out of it, so no memory is allocated per request. It is
+    // on the device's node, like everything else the I/O paths touch,
+    // except on a toaster that can DMA: the device has to reach it, so it
+    // is the common buffer ToasterDmaPrepare created.
+    //
+    if (ioData->Dma.RingBuffer != NULL) {
+        ringBuffer = WdfCommonBufferGetAlignedVirtualAddress(ioData->Dma.RingBuffer);
+    } else {
+        ringBuffer = ToasterNumaAllocate(ioData,
+                                         TOASTER_RING_DEFAULT_SIZE,
+                                         FALSE);
+        if (ringBuffer == NULL) {
+            WppPrintDeviceError(fdoData->WppRecorderLog,
+                               "Failed to allocate %d byte data ring\n",
+                               TOASTER_RING_DEFAULT_SIZE);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    ToasterRingInitialize(&ioData->DataRing, ringBuffer, TOASTER_RING_DEFAULT_SIZE);
+
+    //
+    // Where the ring keeps the ends of the writes for handles that read
+    // record by record.
+    //
+    records = ToasterNumaAllocate(ioData,
+                                  TOASTER_RING_RECORDS * sizeof(ULONG64),
+                                  FALSE);
+    if (records == NULL) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                           "Failed to allocate %d entry record table\n",
+                           TOASTER_RING_RECORDS);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ToasterRingSetRecords(&ioData->DataRing, records, TOASTER_RING_RECORDS);
+
+    //
+    // What D0Exit saves the ring into, so that it does not allocate.
+    //
+    ToasterStateAllocate(Device);
+
+    //
+    // ReleaseHardware purged the parked reads of the previous start.
+    //
+    for (priority = 0; priority < ToasterPriorityMaximum; priority++) {
+        WdfIoQueueStart(ioData->PendingReadQueue[priority]);
+    }
+
+    //
+    // Take the bus direct-call interface here, and hold it until
+    // ReleaseHardware, so that its lifetime follows the device's start/stop
+    // cycle and the I/O paths never have to query it.
+    //
+    ToasterBusInterfaceAcquire(Device);
 
     //
-    // Fire device arrival event.
+    // WMI registration and the device arrival event are left to a work
+    // item, so that PnP can go on to start the next device.
     //
-    ToasterFireArrivalEvent(Device);//在WMI.c中
+    ToasterStartDeferred(Device, startTicks);
 
     return status;
 
@@ -634,6 +1131,8 @@ Return Value:
 --*/
 {
     PFDO_DATA   fdoData;
+    PFDO_IO_DATA ioData;
+    ULONG       priority;
 
     UNREFERENCED_PARAMETER(Device);
     UNREFERENCED_PARAMETER(ResourcesTranslated);
@@ -641,25 +1140,64 @@ Return Value:
     PAGED_CODE();
 
     fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
 
     WppPrintDevice(fdoData->WppRecorderLog, "ToasterEvtDeviceReleaseHardware called\n");
 
     //
-    // Unmap any I/O ports, registers that you mapped in PrepareHardware.
-    // Disconnecting from the interrupt will be done automatically by the framework.
+    // The deferred start-up work of this start, if it has not run yet.
     //
-    return STATUS_SUCCESS;
-}
+    ToasterStartFlush(Device);
 
-////pnpPowerCallbacks的回调
-//initializes and starts the device's self-managed I/O operations
-NTSTATUS
-ToasterEvtDeviceSelfManagedIoInit(
-    IN  WDFDEVICE Device
-    )
-/*++
+    ToasterBusInterfaceRelease(Device);
 
-Routine Description:
+    //
+    // Parked reads are not power-managed and would outlive the ring, so
+    // cancel them before it goes away.
+    //
+    for (priority = 0; priority < ToasterPriorityMaximum; priority++) {
+        WdfIoQueuePurgeSynchronously(ioData->PendingReadQueue[priority]);
+    }
+
+    //
+    // The other queues are power-managed, so no read or write can be
+    // touching the ring by the time we get here.
+    //
+    if (ioData->DataRing.Buffer != NULL) {
+        if (ioData->Dma.RingBuffer == NULL) {
+            ExFreePoolWithTag(ioData->DataRing.Buffer, TOASTER_POOL_TAG);
+        }
+        if (ioData->DataRing.Records != NULL) {
+            ExFreePoolWithTag(ioData->DataRing.Records, TOASTER_POOL_TAG);
+        }
+        RtlZeroMemory(&ioData->DataRing, sizeof(TOASTER_RING));
+    }
+
+    ToasterStateFree(Device);
+
+    //
+    // The common buffers, the data ring's among them, go with the enabler.
+    //
+    ToasterDmaRelease(Device);
+
+    //
+    // Unmap any I/O ports, registers that you mapped in PrepareHardware.
+    // Disconnecting from the interrupt will be done automatically by the framework.
+    //
+    ToasterHwRelease(Device);
+
+    return STATUS_SUCCESS;
+}
+
+////pnpPowerCallbacks的回调
+//initializes and starts the device's self-managed I/O operations
+NTSTATUS
+ToasterEvtDeviceSelfManagedIoInit(
+    IN  WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
 
     EvtDeviceSelfManagedIoInit is called it once for each device,
     after the framework has called the driver's EvtDeviceD0Entry
@@ -682,7 +1220,6 @@ Return Value:
 
 --*/
 {
-    NTSTATUS            status;
     PFDO_DATA           fdoData;
 
     PAGED_CODE();
@@ -692,47 +1229,55 @@ Return Value:
     WppPrintDevice(fdoData->WppRecorderLog, "ToasterEvtDeviceSelfManagedIoInit called\n");
 
     //
-    // We will provide an example on how to get a bus-specific direct
-    // call interface from a bus driver.
+    // We will provide an example on how to use the bus-specific direct
+    // call interface taken in ToasterEvtDevicePrepareHardware. If this
+    // driver is loaded on top of a bus other than toaster the interface is
+    // not available; we don't want to fail start just because of that.
     //
-    status = WdfFdoQueryForInterface(Device,
-                                   &GUID_TOASTER_INTERFACE_STANDARD,
-                                   (PINTERFACE) &fdoData->BusInterface,//输出
-                                   sizeof(TOASTER_INTERFACE_STANDARD), //大小
-                                   1, //Version
-                                   NULL);// InterfaceSpecific Data
-    if(NT_SUCCESS(status))
     {
-        UCHAR powerlevel;
+        UCHAR   powerlevel;
+        BOOLEAN safetyLock;
 
-        //
-        // Call the direct callback functions to get the property or
-        // configuration information of the device.
-        //
-        (*fdoData->BusInterface.GetCrispinessLevel)(fdoData->BusInterface.InterfaceHeader.Context,
-                                                                                &powerlevel);
-        (*fdoData->BusInterface.SetCrispinessLevel)(fdoData->BusInterface.InterfaceHeader.Context, 8);
-        (*fdoData->BusInterface.IsSafetyLockEnabled)(fdoData->BusInterface.InterfaceHeader.Context);
+        (VOID) ToasterGetCrispiness(Device, &powerlevel);
+        (VOID) ToasterSetCrispiness(Device, 8);
+        (VOID) ToasterGetSafetyLock(Device, &safetyLock);
+    }
 
-        //
-        // Provider of this interface may have taken a reference on it.
-        // So we must release the interface as soon as we are done using it.
-        //
-        (*fdoData->BusInterface.InterfaceHeader.InterfaceDereference)
-                            ((PVOID)fdoData->BusInterface.InterfaceHeader.Context);
+    //
+    // The shared rings are optional; a failure here only means that
+    // IOCTL_TOASTER_MAP_RINGS will be refused.
+    //
+    (VOID) ToasterSharedRingsAllocate(Device);
 
+    return STATUS_SUCCESS;
+}
 
-    } else {
-        //
-        // In this sample, we don't want to fail start just because we weren't
-        // able to get the direct-call interface. If this driver is loaded on top
-        // of a bus other than toaster, ToasterGetStandardInterface will return
-        // an error.
-        //
-        status = STATUS_SUCCESS;
-    }
+////pnpPowerCallbacks的回调
+//与ToasterEvtDeviceSelfManagedIoInit对应
+VOID
+ToasterEvtDeviceSelfManagedIoCleanup(
+    IN  WDFDEVICE Device
+    )
+/*++
 
-    return status;
+Routine Description:
+
+    EvtDeviceSelfManagedIoCleanup is called once when the device is being
+    removed, and undoes what EvtDeviceSelfManagedIoInit set up.
+
+Arguments:
+
+    Device - Handle to a framework device object.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PAGED_CODE();
+
+    ToasterSharedRingsFree(Device);
 }
 
 //WdfDeviceCreate的清理函数
@@ -767,6 +1312,8 @@ Return Value:
 
     WppPrintDevice(fdoData->WppRecorderLog, "ToasterEvtDeviceContextCleanup called\n");
 
+    ToasterStatsFree((WDFDEVICE)Device);
+
     WppRecorderLogDelete(fdoData->WppRecorderLog);
     fdoData->WppRecorderLog = NULL;
 
@@ -806,8 +1353,6 @@ Return Value:
 {
     PFDO_DATA   fdoData;
 
-    UNREFERENCED_PARAMETER(FileObject);
-
     PAGED_CODE ();
 
     //
@@ -817,6 +1362,8 @@ Return Value:
 
     WppPrintDevice(fdoData->WppRecorderLog, "ToasterEvtDeviceFileCreate %p\n", Device);
 
+    ToasterFileInitialize(FileObject);
+
     WdfRequestComplete(Request, STATUS_SUCCESS);//作为演示并没有真正打开，完成了
 
     return;
@@ -857,9 +1404,571 @@ Return Value:
 
     WppPrintDevice(fdoData->WppRecorderLog, "ToasterEvtFileClose\n");
 
+    ToasterFileClose(FileObject);
+
     return;
 }
 
+//WdfDeviceInitSetFileObjectConfig时，希望对cleanup干预
+//在IRP_MJ_CLEANUP时被调用
+VOID
+ToasterEvtFileCleanup (
+    IN WDFFILEOBJECT    FileObject
+    )
+/*++
+
+Routine Description:
+
+   EvtFileCleanup is called when the last handle to the FileObject is
+   closed. Unlike EvtFileClose it runs in the context of the process that
+   owned the handle, so this is where the user-mode view of the shared
+   rings is removed. ToasterEvtFileClose runs after this.
+
+Arguments:
+
+    FileObject - Pointer to fileobject that represents the open handle.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PAGED_CODE ();
+
+    ToasterSharedRingsUnmap(WdfFileObjectGetDevice(FileObject), FileObject);
+
+    return;
+}
+
+//通过WdfDeviceInitSetIoInCallerContextCallback设置的回调
+//在请求进入queue之前、在发起者线程上下文中被调用
+VOID
+ToasterEvtIoInCallerContext(
+    IN WDFDEVICE  Device,
+    IN WDFREQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    Called for every request before it is queued, in the context of the
+    thread that issued it. Only IOCTL_TOASTER_MAP_RINGS,
+    IOCTL_TOASTER_GET_POWER_LOG and the per-handle IOCTLs of File.c are
+    serviced here, the others so that they never power the device up;
+    so are small writes while the device is in D0, see
+    ToasterCoalesceWrite. Every other request
+    goes straight back to the framework, which queues it as if this
+    callback did not exist. Kept resident because it is on the path of
+    every request.
+
+Arguments:
+
+    Device - Handle to a framework device object.
+
+    Request - Handle to a framework request object.
+
+Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS                status;
+    WDF_REQUEST_PARAMETERS  params;
+    ULONG_PTR               information = 0;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+
+    if (params.Type == WdfRequestTypeDeviceIoControl &&
+        params.Parameters.DeviceIoControl.IoControlCode == IOCTL_TOASTER_MAP_RINGS) {
+
+        if (KeGetCurrentIrql() != PASSIVE_LEVEL ||
+            WdfRequestGetRequestorMode(Request) != UserMode) {
+            status = STATUS_INVALID_DEVICE_REQUEST;
+        } else {
+            status = ToasterSharedRingsMap(Device, Request, &information);
+        }
+
+        WdfRequestCompleteWithInformation(Request, status, information);
+        return;
+    }
+
+    if (params.Type == WdfRequestTypeDeviceIoControl &&
+        params.Parameters.DeviceIoControl.IoControlCode == IOCTL_TOASTER_GET_POWER_LOG) {
+
+        status = ToasterPowerLogGet(Device, Request, &information);
+
+        WdfRequestCompleteWithInformation(Request, status, information);
+        return;
+    }
+
+    if (params.Type == WdfRequestTypeDeviceIoControl &&
+        params.Parameters.DeviceIoControl.IoControlCode == IOCTL_TOASTER_SET_FILE_POLICY) {
+
+        status = ToasterFileSetPolicy(Device, Request);
+
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    if (params.Type == WdfRequestTypeDeviceIoControl &&
+        params.Parameters.DeviceIoControl.IoControlCode == IOCTL_TOASTER_SET_FILE_TIMEOUTS) {
+
+        status = ToasterFileSetTimeouts(Device, Request);
+
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    if (params.Type == WdfRequestTypeDeviceIoControl &&
+        params.Parameters.DeviceIoControl.IoControlCode == IOCTL_TOASTER_GET_FILE_INFO) {
+
+        status = ToasterFileGetInfo(Device, Request, &information);
+
+        WdfRequestCompleteWithInformation(Request, status, information);
+        return;
+    }
+
+    if (params.Type == WdfRequestTypeWrite &&
+        params.Parameters.Write.Length != 0 &&
+        params.Parameters.Write.Length <= ToasterParameters.CoalesceLimit &&
+        ToasterCoalesceWrite(Device, Request, params.Parameters.Write.Length)) {
+        return;
+    }
+
+    status = WdfDeviceEnqueueRequest(Device, Request);
+    if (!NT_SUCCESS(status)) {
+        WdfRequestComplete(Request, status);
+    }
+}
+
+//被ToasterEvtIoInCallerContext调用
+BOOLEAN
+ToasterCoalesceWrite(
+    _In_ WDFDEVICE  Device,
+    _In_ WDFREQUEST Request,
+    _In_ size_t     Length
+    )
+/*++
+
+Routine Description:
+
+    Copies a small write into the data ring and completes it in the
+    caller's context. Many small writes then cost one copy each into the
+    ring, where they run together for stream readers, instead of a trip
+    through the write queue each.
+
+    The write queue is what keeps queued writes from touching the ring
+    outside D0 and what tells the framework the device is in use; here a
+    power reference taken without waiting does both for idle, and
+    CoalesceRundown fences the write against a D0Exit for a system
+    transition, which does not wait for power references. A write that
+    finds the device out of D0, or the ring not yet restored since it came
+    back, is left to the queue, which powers the device up and restores
+    the ring first.
+
+    So is a write that finds writes queued or in progress in WriteQueue:
+    taking it here would put it into the ring ahead of them.
+
+Return Value:
+
+    TRUE if the request was completed, FALSE if the caller must queue it.
+
+--*/
+{
+    NTSTATUS        status;
+    PFDO_IO_DATA    ioData = ToasterFdoGetIoData(Device);
+    ULONG_PTR       bytesWritten = 0;
+    PVOID           buffer;
+    size_t          bufferLength;
+    LONGLONG        startTicks;
+    ULONG           queued;
+    ULONG           inProgress;
+
+    (VOID) WdfIoQueueGetState(ioData->WriteQueue, &queued, &inProgress);
+    if (queued != 0 || inProgress != 0) {
+        return FALSE;
+    }
+
+    //
+    // STATUS_PENDING means the device is on its way to D0; the reference
+    // is taken all the same.
+    //
+    status = WdfDeviceStopIdle(Device, FALSE);
+    if (status != STATUS_SUCCESS) {
+        if (NT_SUCCESS(status)) {
+            WdfDeviceResumeIdle(Device);
+        }
+        return FALSE;
+    }
+
+    if (!ExAcquireRundownProtection(&ioData->CoalesceRundown)) {
+        WdfDeviceResumeIdle(Device);
+        return FALSE;
+    }
+
+    if (ReadAcquire(&ioData->SavedState.RestorePending) & TOASTER_STATE_RING) {
+        ExReleaseRundownProtection(&ioData->CoalesceRundown);
+        WdfDeviceResumeIdle(Device);
+        return FALSE;
+    }
+
+    startTicks = ToasterStatsStart();
+
+    ToasterIdleNoteArrival(ioData, startTicks);
+
+    ToasterTlRequestStart(Request, ToasterStatWrite, Length, 0);
+
+    if (ToasterParameters.DirectIo) {
+        status = ToasterRequestMapMdl(Request, FALSE, &buffer, &bufferLength);
+    } else {
+        status = WdfRequestRetrieveInputBuffer(Request, Length, &buffer, &bufferLength);
+    }
+
+    if (NT_SUCCESS(status)) {
+        bytesWritten = ToasterRingWrite(&ioData->DataRing, buffer, bufferLength);
+
+        if (bytesWritten != 0) {
+            ToasterStateSetDirty(ioData, TOASTER_STATE_RING);
+            ToasterServicePendingReads(ioData);
+        }
+    }
+
+    ExReleaseRundownProtection(&ioData->CoalesceRundown);
+
+    ToasterStatsRecord(ioData, ToasterStatWrite, status, bytesWritten, startTicks);
+
+    ToasterTlRequestStop(Request, status, bytesWritten);
+
+    WdfRequestCompleteWithInformation(Request, status, bytesWritten);
+
+    WdfDeviceResumeIdle(Device);
+
+    return TRUE;
+}
+
+
+//被ToasterEvtIoRead, ToasterEvtIoWrite和ToasterCoalesceWrite调用
+NTSTATUS
+ToasterRequestMapMdl(
+    _In_  WDFREQUEST Request,
+    _In_  BOOLEAN    IsRead,
+    _Out_ PVOID*     Buffer,
+    _Out_ size_t*    Length
+    )
+/*++
+
+Routine Description:
+
+    Returns a system address for the user pages described by the MDL of a
+    direct I/O read or write. The MDL is already probed and locked by the
+    I/O manager; mapping it only reserves system PTEs, no data is copied.
+
+Arguments:
+
+    Request - A read or write request on a device using WdfDeviceIoDirect.
+
+    IsRead - TRUE for the output MDL of a read, FALSE for the input MDL of
+        a write.
+
+    Buffer - Receives the system address of the caller's buffer.
+
+    Length - Receives the length of the caller's buffer.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+    NTSTATUS    status;
+    PMDL        mdl;
+    PVOID       address;
+
+    *Buffer = NULL;
+    *Length = 0;
+
+    if (IsRead) {
+        status = WdfRequestRetrieveOutputWdmMdl(Request, &mdl);
+    } else {
+        status = WdfRequestRetrieveInputWdmMdl(Request, &mdl);
+    }
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    address = MmGetSystemAddressForMdlSafe(mdl,
+                                           NormalPagePriority | MdlMappingNoExecute);
+    if (address == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *Buffer = address;
+    *Length = MmGetMdlByteCount(mdl);
+
+    return STATUS_SUCCESS;
+}
+
+//被ToasterEvtIoRead和ToasterServicePendingReads调用
+BOOLEAN
+ToasterCompleteRead(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request,
+    _In_ size_t         Length,
+    _In_ BOOLEAN        RequeueIfEmpty
+    )
+/*++
+
+Routine Description:
+
+    Drains whatever is buffered, up to the size of the request, into a read
+    and completes it. A read on a handle with a shared cursor takes what
+    that handle has not read yet instead, see File.c. A large read straight
+    from the read queue is left to the device, see Dma.c, and completes
+    when it is done.
+
+Arguments:
+
+    IoData - data path context of the device.
+
+    Request - a read the caller owns.
+
+    Length - length of the read.
+
+    RequeueIfEmpty - TRUE for a read taken from PendingReadQueue: if the
+        ring turns out to be empty the request goes back to the head of
+        that queue instead of completing with zero bytes.
+
+Return Value:
+
+    FALSE if the request was requeued, TRUE if it was completed.
+
+--*/
+{
+    NTSTATUS                status;
+    ULONG_PTR               bytesCopied = 0;
+    PVOID                   buffer;
+    size_t                  bufferLength;
+    PTOASTER_FILE_CONTEXT   file = ToasterRequestGetFile(Request);
+    ULONG                   maxLength = 0;
+    SIZE_T                  bytesMoved;
+    LONGLONG                deadline;
+
+    if (!RequeueIfEmpty &&
+        (file == NULL ||
+         !(ReadULongNoFence(&file->Flags) & (TOASTER_FILE_SHARED_CURSOR | TOASTER_FILE_RECORDS)))) {
+
+        if (file != NULL) {
+            maxLength = ReadULongNoFence(&file->MaxReadLength);
+        }
+
+        if (ToasterDmaStart(IoData,
+                            Request,
+                            FALSE,
+                            (maxLength != 0) ? min(Length, maxLength) : Length,
+                            ToasterRequestGetContext(Request)->StartTicks,
+                            &bytesMoved)) {
+
+            if (file != NULL) {
+                InterlockedIncrement64(&file->Reads);
+                InterlockedAdd64(&file->BytesRead, (LONG64) bytesMoved);
+            }
+
+            return TRUE;
+        }
+    }
+
+    if (ToasterParameters.DirectIo) {
+        status = ToasterRequestMapMdl(Request, TRUE, &buffer, &bufferLength);
+    } else {
+        status = WdfRequestRetrieveOutputBuffer(Request, Length, &buffer, &bufferLength);
+    }
+
+    if(NT_SUCCESS(status) ) {
+        bytesCopied = ToasterFileRead(IoData, file, buffer, bufferLength);
+
+        if (bytesCopied != 0) {
+            ToasterStateSetDirty(IoData, TOASTER_STATE_RING);
+        }
+
+        if (bytesCopied == 0 && RequeueIfEmpty) {
+            //
+            // Another reader got to the data first. A sweep that ran while
+            // the read was out of its queue did not see its deadline.
+            //
+            deadline = ToasterRequestGetContext(Request)->Deadline;
+
+            status = WdfRequestRequeue(Request);
+            if (NT_SUCCESS(status)) {
+                ToasterDeadlineArm(IoData, deadline);
+                return FALSE;
+            }
+        }
+    }
+
+    if (RequeueIfEmpty) {
+        ToasterFileUnparkRead(file);
+    }
+
+    if (file != NULL) {
+        InterlockedIncrement64(&file->Reads);
+    }
+
+    ToasterHwCompleteRequest(IoData,
+                             Request,
+                             ToasterStatRead,
+                             status,
+                             bytesCopied,
+                             ToasterRequestGetContext(Request)->StartTicks);
+
+    return TRUE;
+}
+
+VOID
+ToasterServicePendingReads(
+    _In_ PFDO_IO_DATA IoData
+    )
+/*++
+
+Routine Description:
+
+    Completes parked reads for as long as the ring has data, those of the
+    highest priority class first. Called after anything that adds to the
+    ring.
+
+--*/
+{
+    ULONG priority;
+
+    ToasterNotifyDataAvailable(IoData);
+
+    if (!ToasterParameters.PendingReads) {
+        return;
+    }
+
+    for (priority = ToasterPriorityMaximum; priority-- > 0; ) {
+
+        if (ToasterRingGetReadable(&IoData->DataRing) == 0) {
+            return;
+        }
+
+        ToasterServicePendingQueue(IoData, IoData->PendingReadQueue[priority]);
+    }
+}
+
+//被ToasterServicePendingReads调用
+VOID
+ToasterServicePendingQueue(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFQUEUE       Queue
+    )
+/*++
+
+Routine Description:
+
+    Completes the reads of one PendingReadQueue that have something to
+    read, in queue order. A read whose handle has nothing new, a shared
+    cursor that has caught up with the writers, stays where it is and the
+    walk goes on past it, so it holds up neither the reads behind it nor
+    the lower priorities. The walk works like the one of
+    ToasterNotifyEvtDpc.
+
+    A read that comes up empty all the same, because another reader got
+    to the data first, goes back to the head of its queue. A write that
+    ran while it was out of the queue did not see it, so the walk starts
+    over from the head for as long as the ring has data.
+
+--*/
+{
+    NTSTATUS                status;
+    WDFREQUEST              previous = NULL;
+    WDFREQUEST              found;
+    WDFREQUEST              request;
+    WDF_REQUEST_PARAMETERS  params;
+
+    while (ToasterRingGetReadable(&IoData->DataRing) != 0) {
+
+        status = WdfIoQueueFindRequest(Queue, previous, NULL, NULL, &found);
+
+        if (status == STATUS_NOT_FOUND && previous != NULL) {
+            //
+            // The read the walk was positioned on left the queue; start
+            // over.
+            //
+            WdfObjectDereference(previous);
+            previous = NULL;
+            continue;
+        }
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        if (ToasterFileGetReadable(IoData, ToasterRequestGetFile(found)) == 0) {
+            if (previous != NULL) {
+                WdfObjectDereference(previous);
+            }
+            previous = found;
+            continue;
+        }
+
+        status = WdfIoQueueRetrieveFoundRequest(Queue, found, &request);
+        WdfObjectDereference(found);
+
+        if (!NT_SUCCESS(status)) {
+            continue;
+        }
+
+        WDF_REQUEST_PARAMETERS_INIT(&params);
+        WdfRequestGetParameters(request, &params);
+
+        if (!ToasterCompleteRead(IoData, request, params.Parameters.Read.Length, TRUE) &&
+            previous != NULL) {
+            WdfObjectDereference(previous);
+            previous = NULL;
+        }
+    }
+
+    if (previous != NULL) {
+        WdfObjectDereference(previous);
+    }
+}
+
+//通过WDF_IO_QUEUE_CONFIG的EvtIoCanceledOnQueue设置的回调
+VOID
+ToasterEvtPendingReadCanceled(
+    IN WDFQUEUE   Queue,
+    IN WDFREQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    Called for a parked read that is canceled, or purged by
+    ToasterEvtDeviceReleaseHardware, while it waits in a PendingReadQueue.
+    Gives the handle its quota back.
+
+--*/
+{
+    PFDO_IO_DATA    ioData;
+
+    ioData = ToasterFdoGetIoData(WdfIoQueueGetDevice(Queue));
+
+    ToasterFileUnparkRead(ToasterRequestGetFile(Request));
+
+    ToasterStatsRecord(ioData,
+                       ToasterStatRead,
+                       STATUS_CANCELLED,
+                       0,
+                       ToasterRequestGetContext(Request)->StartTicks);
+
+    ToasterTlRequestStop(Request, STATUS_CANCELLED, 0);
+
+    WdfRequestComplete(Request, STATUS_CANCELLED);
+}
 
 //通过WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE设置的回调
 //在IRP_MJ_READ时被调用
@@ -895,33 +2004,79 @@ Return Value:
 --*/
 {
     PFDO_DATA    fdoData;
+    PFDO_IO_DATA ioData;
     NTSTATUS    status;
-    ULONG_PTR bytesCopied =0;
-    WDFMEMORY memory;
+    LONGLONG startTicks = ToasterStatsStart();
+    PTOASTER_FILE_CONTEXT file;
+    LONGLONG deadline = 0;
 
-    UNREFERENCED_PARAMETER(Length);
+    fdoData = ToasterFdoGetData(WdfIoQueueGetDevice(Queue));
+    ioData = ToasterFdoGetIoData(WdfIoQueueGetDevice(Queue));
 
-    PAGED_CODE();
+    InterlockedIncrement(&ioData->InFlight[ToasterStatRead]);
 
-    fdoData = ToasterFdoGetData(WdfIoQueueGetDevice(Queue));
+    ToasterIdleNoteArrival(ioData, startTicks);
 
-    WppPrintDevice(fdoData->WppRecorderLog,
-                  "ToasterEvtIoRead: Request: 0x%p, Queue: 0x%p\n",
-                  Request,
-                  Queue);
+    ToasterRequestGetContext(Request)->StartTicks = startTicks;
+
+    ToasterTlRequestStart(Request, ToasterStatRead, Length, 0);
+
+    if (ToasterHotPathTraceEnabled(ioData, ToasterStatRead)) {
+        WppPrintDevice(fdoData->WppRecorderLog,
+                      "ToasterEvtIoRead: Request: 0x%p, Queue: 0x%p\n",
+                      Request,
+                      Queue);
+    }
+
+    ToasterStateRestore(WdfIoQueueGetDevice(Queue), ioData, TOASTER_STATE_RING);
+
+    file = ToasterRequestGetFile(Request);
+
+    if (ToasterParameters.PendingReads &&
+        ToasterFileGetReadable(ioData, file) == 0) {
 
-    //
-    // Get the request memory and perform read operation here
-    //
-    status = WdfRequestRetrieveOutputMemory(Request, &memory);
-    if(NT_SUCCESS(status) ) {
         //
-        // Copy data into the memory buffer using WdfMemoryCopyFromBuffer
+        // Nothing buffered. Hand the read to the pending queue of its
+        // handle's priority class so that the driver does not own it while
+        // it waits, unless the handle already has its quota waiting.
         //
-    }
+        if (!ToasterFileParkRead(file)) {
+            status = STATUS_QUOTA_EXCEEDED;
+        } else {
+            deadline = ToasterDeadlineSet(ioData,
+                                          Request,
+                                          (file != NULL) ? ReadULongNoFence(&file->ReadTimeout) : 0);
+
+            status = WdfRequestForwardToIoQueue(Request,
+                                                ioData->PendingReadQueue[ToasterFileGetPriority(file)]);
+            if (!NT_SUCCESS(status)) {
+                ToasterFileUnparkRead(file);
+            }
+        }
+
+        if (NT_SUCCESS(status)) {
+            ToasterDeadlineArm(ioData, deadline);
+
+            //
+            // A write that ran between the check and the forward found no
+            // read to serve.
+            //
+            ToasterServicePendingReads(ioData);
+        } else {
+            ToasterStatsRecord(ioData, ToasterStatRead, status, 0, startTicks);
+            ToasterTlRequestStop(Request, status, 0);
+            WdfRequestComplete(Request, status);
+        }
 
-    WdfRequestCompleteWithInformation(Request, status, bytesCopied);
+    } else {
+        //
+        // Drain whatever is buffered, up to the size of the request. An
+        // empty ring completes the read with zero bytes.
+        //
+        (VOID) ToasterCompleteRead(ioData, Request, Length, FALSE);
+    }
 
+    InterlockedDecrement(&ioData->InFlight[ToasterStatRead]);
 }
 
 //通过WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE设置的回调
@@ -959,34 +2114,70 @@ Return Value:
 
 {
     NTSTATUS    status;
-    WDFMEMORY   memory;
     PFDO_DATA   fdoData;
-
-    PAGED_CODE();
+    PFDO_IO_DATA ioData;
+    ULONG_PTR   bytesWritten = 0;
+    PVOID       buffer;
+    size_t      bufferLength;
+    SIZE_T      bytesMoved;
+    LONGLONG    startTicks = ToasterStatsStart();
 
     fdoData = ToasterFdoGetData(WdfIoQueueGetDevice(Queue));
+    ioData = ToasterFdoGetIoData(WdfIoQueueGetDevice(Queue));
+
+    InterlockedIncrement(&ioData->InFlight[ToasterStatWrite]);
+
+    ToasterIdleNoteArrival(ioData, startTicks);
+
+    ToasterTlRequestStart(Request, ToasterStatWrite, Length, 0);
+
+    if (ToasterHotPathTraceEnabled(ioData, ToasterStatWrite)) {
+        WppPrintDevice(fdoData->WppRecorderLog,
+                      "ToasterEvtIoWrite. Request: 0x%p, Queue: 0x%p\n",
+                      Request,
+                      Queue);
+    }
+    ToasterStateRestore(WdfIoQueueGetDevice(Queue), ioData, TOASTER_STATE_RING);
 
-    WppPrintDevice(fdoData->WppRecorderLog,
-                  "ToasterEvtIoWrite. Request: 0x%p, Queue: 0x%p\n",
-                  Request,
-                  Queue);
     //
-    // Get the request buffer and perform write operation here
+    // A large payload is moved into the ring by the device, see Dma.c.
     //
-    status = WdfRequestRetrieveInputMemory(Request, &memory);
+    if (ToasterDmaStart(ioData, Request, TRUE, Length, startTicks, &bytesMoved)) {
+        InterlockedDecrement(&ioData->InFlight[ToasterStatWrite]);
+        return;
+    }
+
+    //
+    // Copy the payload into the data ring. If the ring does not have room
+    // for all of it the write completes with the number of bytes accepted,
+    // the same way a partial write to a pipe does.
+    //
+    if (ToasterParameters.DirectIo) {
+        status = ToasterRequestMapMdl(Request, FALSE, &buffer, &bufferLength);
+    } else {
+        status = WdfRequestRetrieveInputBuffer(Request, Length, &buffer, &bufferLength);
+    }
+
     if(NT_SUCCESS(status) ) {
-        //
-        // 1) Use WdfMemoryCopyToBuffer to copy data from the request
-        // to driver buffer.
-        // 2) Or get the buffer pointer from the request by calling
-        // WdfRequestRetrieveInputBuffer to  transfer data to the hw
-        // 3) Or you can get the buffer pointer from the memory handle
-        // by calling WdfMemoryGetBuffer to  transfer data to the hw.
-        //
+        bytesWritten = ToasterRingWrite(&ioData->DataRing, buffer, bufferLength);
+
+        if (bytesWritten != 0) {
+            ToasterStateSetDirty(ioData, TOASTER_STATE_RING);
+        }
     }
 
-    WdfRequestCompleteWithInformation(Request, status, Length);
+    ToasterHwCompleteRequest(ioData,
+                             Request,
+                             ToasterStatWrite,
+                             status,
+                             bytesWritten,
+                             startTicks);
+
+    if (bytesWritten != 0) {
+        ToasterServicePendingReads(ioData);
+    }
 
+    InterlockedDecrement(&ioData->InFlight[ToasterStatWrite]);
 }
 
 //通过WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE设置的回调
@@ -1029,17 +2220,30 @@ Return Value:
     WDF_DEVICE_STATE     deviceState;
     WDFDEVICE            hDevice = WdfIoQueueGetDevice(Queue);
     PFDO_DATA            fdoData;
+    PFDO_IO_DATA         ioData;
+    ULONG_PTR            information = 0;
+    LONGLONG             startTicks = ToasterStatsStart();
 
 
-    UNREFERENCED_PARAMETER(OutputBufferLength);
     UNREFERENCED_PARAMETER(InputBufferLength);
 
     PAGED_CODE();
 
     fdoData = ToasterFdoGetData(hDevice);
+    ioData = ToasterFdoGetIoData(hDevice);
 
-    WppPrintDevice(fdoData->WppRecorderLog,
-                  "ToasterEvtIoDeviceControl called\n");
+    InterlockedIncrement(&ioData->InFlight[ToasterStatIoctl]);
+
+    ToasterIdleNoteArrival(ioData, startTicks);
+
+    ToasterRequestGetContext(Request)->StartTicks = startTicks;
+
+    ToasterTlRequestStart(Request, ToasterStatIoctl, OutputBufferLength, IoControlCode);
+
+    if (ToasterHotPathTraceEnabled(ioData, ToasterStatIoctl)) {
+        WppPrintDevice(fdoData->WppRecorderLog,
+                      "ToasterEvtIoDeviceControl called\n");
+    }
 
     switch (IoControlCode) {
 
@@ -1057,13 +2261,152 @@ Return Value:
             );
         break;
 
+    case IOCTL_TOASTER_SUBMIT_BATCH:
+        //
+        // Many operations in one user/kernel transition. See batch.c.
+        //
+        status = ToasterSubmitBatch(hDevice, Request, &information);
+        break;
+
+    case IOCTL_TOASTER_RING_DOORBELL:
+        //
+        // The owner of the shared rings has queued submissions.
+        //
+        status = ToasterSharedRingsDoorbell(hDevice, Request, &information);
+        break;
+
+    case IOCTL_TOASTER_GET_CRISPINESS:
+        //
+        // Served from the cached copy; no call into the bus driver.
+        //
+        status = ToasterIoctlGetCrispiness(hDevice, Request, &information);
+        break;
+
+    case IOCTL_TOASTER_SET_CRISPINESS:
+        status = ToasterIoctlSetCrispiness(hDevice, Request);
+        break;
+
+    case IOCTL_TOASTER_WAIT_EVENTS:
+        //
+        // Parked until an event satisfies it, unless one already has. See
+        // notify.c.
+        //
+        status = ToasterNotifyWait(hDevice, Request, &information);
+        break;
+
     default:
         status = STATUS_INVALID_DEVICE_REQUEST;
     }
 
+    if (status == STATUS_PENDING) {
+        //
+        // Notify.c completes and accounts the request.
+        //
+        InterlockedDecrement(&ioData->InFlight[ToasterStatIoctl]);
+        return;
+    }
+
+    ToasterStatsRecord(ioData,
+                       ToasterStatIoctl,
+                       status,
+                       information,
+                       startTicks);
+
+    ToasterTlRequestStop(Request, status, information);
+
     //
     // Complete the Request.
     //
-    WdfRequestCompleteWithInformation(Request, status, (ULONG_PTR) 0);
+    WdfRequestCompleteWithInformation(Request, status, information);
+
+    InterlockedDecrement(&ioData->InFlight[ToasterStatIoctl]);
+}
+
+//通过ToasterCreateQueue设置的回调
+//队列因电源转换停止或因移除被清空时被调用
+VOID
+ToasterEvtIoStop(
+    IN WDFQUEUE   Queue,
+    IN WDFREQUEST Request,
+    IN ULONG      ActionFlags
+    )
+/*++
+
+Routine Description:
+
+    Called for each request the driver owns when a power-managed queue is
+    stopped for a Dx transition or purged for a removal. Such a request is
+    either one a queue handler is still executing or, on a hardware
+    toaster, one the device holds. Reads waiting for data never get here;
+    they are in PendingReadQueue.
+
+    A request in a handler is completed by the handler without waiting on
+    anything, so it is neither acknowledged nor requeued: acknowledging
+    would let D0Exit and ReleaseHardware run underneath a handler that is
+    still copying into the ring.
+
+    A request the device holds is acknowledged for a Dx transition, so
+    that the transition does not wait on the device; the interrupt
+    completes it until it is disabled, ToasterHwFlush from D0Exit after
+    that. For a removal the device may be gone, so everything it has is
+    completed here.
+
+Arguments:
+
+    Queue - Handle to the queue that presented the request.
+
+    Request - Handle to the request.
+
+    ActionFlags - WDF_REQUEST_STOP_ACTION_FLAGS.
 
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA       fdoData;
+    PFDO_IO_DATA    ioData;
+
+    fdoData = ToasterFdoGetData(WdfIoQueueGetDevice(Queue));
+    ioData = ToasterFdoGetIoData(WdfIoQueueGetDevice(Queue));
+
+    WppPrintDevice(fdoData->WppRecorderLog,
+                  "ToasterEvtIoStop: Request 0x%p, Flags 0x%x, in flight %d/%d/%d\n",
+                  Request,
+                  ActionFlags,
+                  ReadNoFence(&ioData->InFlight[ToasterStatRead]),
+                  ReadNoFence(&ioData->InFlight[ToasterStatWrite]),
+                  ReadNoFence(&ioData->InFlight[ToasterStatIoctl]));
+
+    if (ActionFlags & WdfRequestStopActionPurge) {
+        ToasterHwFlush(ioData);
+    } else if (ActionFlags & WdfRequestStopActionSuspend) {
+        (VOID) ToasterHwStopAcknowledge(ioData, Request);
+    }
+}
+
+//通过ToasterCreateQueue设置的回调
+VOID
+ToasterEvtIoResume(
+    IN WDFQUEUE   Queue,
+    IN WDFREQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    Counterpart of ToasterEvtIoStop. The only requests it acknowledged
+    were completed from D0Exit at the latest, so there is nothing to
+    restart.
+
+--*/
+{
+    PFDO_DATA       fdoData;
+
+    fdoData = ToasterFdoGetData(WdfIoQueueGetDevice(Queue));
+
+    WppPrintDevice(fdoData->WppRecorderLog,
+                  "ToasterEvtIoResume: Request 0x%p\n",
+                  Request);
 }
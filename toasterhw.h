@@ -0,0 +1,95 @@
+/*++
+
+Module Name:
+
+    ToasterHw.h
+
+Abstract:
+
+    Register layout of the hardware-backed toaster, see Interrupt.c. The
+    registers are in the first memory BAR; a toaster without one (the
+    bus-enumerated toaster) has no registers and completes every request
+    inline.
+
+    The device completes requests in the order they are submitted. The
+    driver writes the number of requests it has submitted so far to
+    Doorbell; the device counts the ones it has finished in Completed. Both
+    are free running. The device raises TOASTER_HW_INT_COMPLETION after
+    CoalesceCount completions, or CoalesceTimer microseconds after the
+    first completion it has not yet signalled, whichever comes first.
+
+    Every request takes the next entry of the command ring, a common buffer
+    of CommandDepth TOASTER_HW_COMMANDs: entry n % CommandDepth describes
+    the request that raises Doorbell to n + 1. A request whose data the
+    driver has already copied is a TOASTER_HW_OP_NOP. The others move
+    Length bytes between the scatter/gather list at Elements and the data
+    ring at RingBase, starting RingOffset bytes in and wrapping at
+    RingSize, see Dma.c.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#if !defined(_TOASTER_HW_H_)
+#define _TOASTER_HW_H_
+
+#define TOASTER_HW_ID                   0x54535452      // 'TSTR'
+
+//
+// InterruptStatus (write 1 to clear) and InterruptMask (1 enables).
+//
+#define TOASTER_HW_INT_COMPLETION       0x00000001
+#define TOASTER_HW_INT_ALL              TOASTER_HW_INT_COMPLETION
+
+//
+// TOASTER_HW_COMMAND.Opcode. The direction is the request's: a write goes
+// from the elements into the ring, a read from the ring into the elements.
+//
+#define TOASTER_HW_OP_NOP               0
+#define TOASTER_HW_OP_WRITE             1
+#define TOASTER_HW_OP_READ              2
+
+typedef struct _TOASTER_REGISTERS {
+    ULONG   Id;                 // 0x00 TOASTER_HW_ID, read only
+    ULONG   Reserved;           // 0x04
+    ULONG   InterruptStatus;    // 0x08
+    ULONG   InterruptMask;      // 0x0C
+    ULONG   Doorbell;           // 0x10 requests submitted, written by the driver
+    ULONG   Completed;          // 0x14 requests finished, read only
+    ULONG   CoalesceCount;      // 0x18 0 or 1: signal every completion
+    ULONG   CoalesceTimer;      // 0x1C microseconds, 0: no timer
+    ULONG   CommandBaseLow;     // 0x20 logical address of the command ring
+    ULONG   CommandBaseHigh;    // 0x24
+    ULONG   CommandDepth;       // 0x28 entries, a power of two
+    ULONG   Reserved2;          // 0x2C
+    ULONG   RingBaseLow;        // 0x30 logical address of the data ring
+    ULONG   RingBaseHigh;       // 0x34
+    ULONG   RingSize;           // 0x38 bytes, a power of two
+    ULONG   Reserved3;          // 0x3C
+} TOASTER_REGISTERS, *PTOASTER_REGISTERS;
+
+C_ASSERT(FIELD_OFFSET(TOASTER_REGISTERS, CoalesceTimer) == 0x1C);
+C_ASSERT(FIELD_OFFSET(TOASTER_REGISTERS, RingSize) == 0x38);
+
+typedef struct _TOASTER_HW_ELEMENT {
+    ULONG64 Address;
+    ULONG   Length;
+    ULONG   Reserved;
+} TOASTER_HW_ELEMENT, *PTOASTER_HW_ELEMENT;
+
+C_ASSERT(sizeof(TOASTER_HW_ELEMENT) == 16);
+
+typedef struct _TOASTER_HW_COMMAND {
+    ULONG   Opcode;             // TOASTER_HW_OP_*
+    ULONG   ElementCount;
+    ULONG   Length;             // bytes, the sum of the element lengths
+    ULONG   RingOffset;
+    ULONG64 Elements;           // logical address of ElementCount elements
+    ULONG64 Reserved;
+} TOASTER_HW_COMMAND, *PTOASTER_HW_COMMAND;
+
+C_ASSERT(sizeof(TOASTER_HW_COMMAND) == 32);
+
+#endif // _TOASTER_HW_H_
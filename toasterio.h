@@ -0,0 +1,1744 @@
+/*++
+
+Module Name:
+
+    ToasterIo.h
+
+Abstract:
+
+    Per-device data path state for the featured toaster function driver.
+    FDO_DATA (toaster.h) keeps the PnP/WMI bookkeeping; everything the
+    read/write path needs lives in FDO_IO_DATA, which is allocated as a
+    second context on the same WDFDEVICE in ToasterEvtDeviceAdd.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#if !defined(_TOASTER_IO_H_)
+#define _TOASTER_IO_H_
+
+#include "toasterioctl.h"
+#include "toasterhw.h"
+#include "ToasterExtMof.h"
+#include "toastertl.h"
+
+//
+// Default size of the per-device data ring. Must be a power of two so that
+// ring positions can be turned into buffer offsets with a mask.
+//
+#define TOASTER_RING_DEFAULT_SIZE       (1024 * 1024)
+
+//
+// Keep the producer and consumer halves of the ring on separate cache lines
+// so that a reader draining the ring does not bounce the line the writer is
+// updating (and vice versa).
+//
+#define TOASTER_CACHE_LINE_PAD(_used_)  (SYSTEM_CACHE_ALIGNMENT_SIZE - (_used_))
+
+//
+// Single-producer/single-consumer byte ring.
+//
+// Head and Tail are free running 64-bit stream positions; (Head - Tail) is
+// the number of readable bytes and (Position & Mask) is the buffer offset.
+// Head is only written by the producer and Tail only by the consumer, so the
+// two sides never take a common lock. Because the read and write queues can
+// present requests in parallel, each side serializes its own callers with a
+// side-local queued spinlock; a reader never waits on a writer.
+//
+// Readers that keep a position of their own (ToasterRingReadAt) are on the
+// consumer side too: they copy under ConsumerLock, which keeps Tail, and
+// with it the data they copy, from moving.
+//
+// Either side can also hand a span of the ring to someone else to fill or
+// drain later, the DMA engine (Dma.c): ToasterRingReserve takes free space
+// at Reserved, ToasterRingClaim takes data at Claimed. Head stops at the
+// oldest reservation still open, so readers never see a span before it is
+// filled; Tail stops at the oldest open claim, so the producer never
+// overwrites a span before it is drained. With nothing open,
+// Reserved == Head and Claimed == Tail.
+//
+// A ring can also remember where each write (or reservation) ended, for
+// readers that want one write's data per read. The ends are kept in a
+// table of their own with RecordLock, which both sides take last; once a
+// write's end has been overwritten by newer ones, its data runs into the
+// following record.
+//
+#define TOASTER_RING_RECORDS            4096        // power of two
+typedef struct _TOASTER_RING_SPAN {
+    LIST_ENTRY          Link;
+    ULONG64             Start;
+    SIZE_T              Length;
+} TOASTER_RING_SPAN, *PTOASTER_RING_SPAN;
+
+typedef struct _TOASTER_RING {
+
+    //
+    // Producer side. Reservations holds the open reservations, oldest
+    // first.
+    //
+    volatile ULONG64    Head;
+    ULONG64             Reserved;
+    KSPIN_LOCK          ProducerLock;
+    LIST_ENTRY          Reservations;
+    UCHAR               ProducerPad[TOASTER_CACHE_LINE_PAD(2 * sizeof(ULONG64) + sizeof(KSPIN_LOCK) + sizeof(LIST_ENTRY))];
+
+    //
+    // Consumer side. Claims holds the open claims, oldest first.
+    //
+    volatile ULONG64    Tail;
+    volatile ULONG64    Claimed;
+    KSPIN_LOCK          ConsumerLock;
+    LIST_ENTRY          Claims;
+    UCHAR               ConsumerPad[TOASTER_CACHE_LINE_PAD(2 * sizeof(ULONG64) + sizeof(KSPIN_LOCK) + sizeof(LIST_ENTRY))];
+
+    //
+    // Read-only after ToasterRingInitialize.
+    //
+    PUCHAR              Buffer;
+    SIZE_T              Size;
+    SIZE_T              Mask;
+
+    //
+    // Record ends, NULL if the ring keeps none. Records[n & RecordMask] is
+    // where the n-th write ended; RecordNext counts the writes.
+    //
+    PULONG64            Records;
+    ULONG               RecordMask;
+    ULONG64             RecordNext;
+    KSPIN_LOCK          RecordLock;
+
+} TOASTER_RING, *PTOASTER_RING;
+
+//
+// Driver-wide tunables read from the service's Parameters key in
+// DriverEntry. They apply to every device the driver adds.
+//
+#define TOASTER_PARAM_DIRECT_IO         L"DirectIo"
+#define TOASTER_PARAM_PENDING_READS     L"PendingReads"
+#define TOASTER_PARAM_RETAIN_RING       L"RetainRing"
+#define TOASTER_PARAM_DMA_THRESHOLD     L"DmaThreshold"
+#define TOASTER_PARAM_COALESCE_LIMIT    L"CoalesceLimit"
+
+#define TOASTER_DEFAULT_DMA_THRESHOLD   (64 * 1024)
+#define TOASTER_DEFAULT_COALESCE_LIMIT  256
+
+typedef struct _TOASTER_QUEUE_POLICY {
+
+    WDF_IO_QUEUE_DISPATCH_TYPE  DispatchType;
+
+    //
+    // Only used for WdfIoQueueDispatchParallel. (ULONG) -1 means no limit.
+    //
+    ULONG                       NumberOfPresentedRequests;
+
+} TOASTER_QUEUE_POLICY, *PTOASTER_QUEUE_POLICY;
+
+typedef struct _TOASTER_PARAMETERS {
+
+    //
+    // When non-zero the read and write paths use direct I/O: the I/O manager
+    // locks the caller's pages and the driver copies between the ring and
+    // the request MDL, instead of staging through a system buffer.
+    //
+    ULONG               DirectIo;
+
+    //
+    // When non-zero a read that finds the data ring empty waits for the
+    // next write instead of completing with zero bytes.
+    //
+    ULONG               PendingReads;
+
+    //
+    // When non-zero the contents of the data ring are saved on the way to
+    // a low-power state and put back afterwards; otherwise, the default,
+    // they are lost, the way they would be in device memory that is not
+    // retained.
+    //
+    ULONG               RetainRing;
+
+    //
+    // On a hardware toaster, reads and writes of at least this many bytes
+    // have the device move the data (Dma.c) instead of the processor. Zero
+    // turns DMA off.
+    //
+    ULONG               DmaThreshold;
+
+    //
+    // Writes of at most this many bytes are copied into the ring in the
+    // caller's context and completed there, without going through the
+    // write queue (ToasterCoalesceWrite). Zero sends every write through
+    // the queue.
+    //
+    ULONG               CoalesceLimit;
+
+    //
+    // Per-request-type queue policy.
+    //
+    TOASTER_QUEUE_POLICY ReadQueue;
+    TOASTER_QUEUE_POLICY WriteQueue;
+    TOASTER_QUEUE_POLICY IoctlQueue;
+
+} TOASTER_PARAMETERS, *PTOASTER_PARAMETERS;
+
+extern TOASTER_PARAMETERS ToasterParameters;
+
+//
+// Submission/completion rings shared with one user-mode owner, see
+// SharedRing.c.
+//
+typedef struct _TOASTER_SHARED_RINGS {
+
+    //
+    // Whole pages from MmAllocatePagesForMdlEx, allocated in
+    // ToasterEvtDeviceSelfManagedIoInit, and their system mapping.
+    //
+    PVOID               Base;
+    SIZE_T              Length;
+    PMDL                Mdl;
+    WDFDEVICE           Device;
+
+    //
+    // Serializes map, unmap and doorbell processing.
+    //
+    WDFWAITLOCK         Lock;
+
+    //
+    // Current owner, if any, and the process the rings are mapped into,
+    // referenced. While mapped the rings are on the driver-wide list that
+    // ToasterSharedRingsProcessNotify looks at.
+    //
+    WDFFILEOBJECT       Owner;
+    PEPROCESS           OwnerProcess;
+    PVOID               UserBase;
+    PKEVENT             CompletionEvent;
+    LIST_ENTRY          MappedLink;
+
+    //
+    // Private copies of the driver-owned indexes. The copies in the shared
+    // header are only ever written, never trusted.
+    //
+    ULONG               SqHead;
+    ULONG               CqTail;
+
+} TOASTER_SHARED_RINGS, *PTOASTER_SHARED_RINGS;
+
+//
+// Per-processor I/O statistics, see Stats.c.
+//
+typedef enum _TOASTER_STAT_CLASS {
+    ToasterStatRead = 0,
+    ToasterStatWrite,
+    ToasterStatIoctl,
+    ToasterStatClassMaximum
+} TOASTER_STAT_CLASS;
+
+//
+// Bucket n counts requests whose service time was below 2^n microseconds;
+// the last bucket also takes everything slower.
+//
+#define TOASTER_LATENCY_BUCKETS         16
+
+typedef struct _TOASTER_CLASS_COUNTERS {
+    volatile LONG64     Requests;
+    volatile LONG64     Bytes;
+    volatile LONG64     Errors;
+    volatile LONG64     Latency[TOASTER_LATENCY_BUCKETS];
+} TOASTER_CLASS_COUNTERS, *PTOASTER_CLASS_COUNTERS;
+
+//
+// One of these per processor. Each starts on its own cache line, so a
+// processor only ever writes lines no other processor writes.
+//
+typedef DECLSPEC_CACHEALIGN struct _TOASTER_CPU_STATS {
+    TOASTER_CLASS_COUNTERS Class[ToasterStatClassMaximum];
+} TOASTER_CPU_STATS, *PTOASTER_CPU_STATS;
+
+typedef struct _TOASTER_STATS {
+
+    //
+    // ProcessorCount entries, indexed by KeGetCurrentProcessorNumberEx.
+    // Allocated in ToasterEvtDeviceAdd, freed in
+    // ToasterEvtDeviceContextCleanup.
+    //
+    PTOASTER_CPU_STATS  PerCpu;
+    ULONG               ProcessorCount;
+
+    //
+    // Performance counter ticks per second.
+    //
+    LONGLONG            Frequency;
+
+} TOASTER_STATS, *PTOASTER_STATS;
+
+//
+// WMI events fired through ToasterFireEvent, see Wmi.c.
+//
+#define TOASTER_WMI_MAX_EVENTS          8
+
+typedef struct _TOASTER_WMI_EVENT {
+
+    CONST GUID*         Guid;
+    WDFWMIINSTANCE      Instance;
+
+    //
+    // Set while at least one WMI consumer has the event enabled.
+    //
+    volatile LONG       Enabled;
+
+} TOASTER_WMI_EVENT, *PTOASTER_WMI_EVENT;
+
+typedef struct _TOASTER_WMI_EVENTS {
+
+    //
+    // The device's friendly name, already in the counted-string form that
+    // follows the WNODE header. Non-paged, parented to the device.
+    //
+    WDFMEMORY           InstanceNameMemory;
+    PVOID               InstanceName;
+    ULONG               InstanceNameSize;
+
+    ULONG               ProviderId;
+
+    //
+    // Filled in by ToasterWmiRegistration, read-only afterwards.
+    //
+    ULONG               Count;
+    TOASTER_WMI_EVENT   Events[TOASTER_WMI_MAX_EVENTS];
+
+} TOASTER_WMI_EVENTS, *PTOASTER_WMI_EVENTS;
+
+//
+// Adaptive S0 idle timeout, see Idle.c.
+//
+// Bucket n of the gap histogram counts gaps between requests of
+// [2^n, 2^(n+1)) milliseconds; the last bucket is open ended. Gaps under a
+// millisecond can never let the device idle and are not recorded.
+//
+#define TOASTER_IDLE_GAP_BUCKETS            17
+#define TOASTER_IDLE_RETUNE_SAMPLES         32
+
+#define TOASTER_IDLE_DEFAULT_TIMEOUT        10000       // ms, until the first retune
+#define TOASTER_IDLE_DEFAULT_MIN_TIMEOUT    1000        // ms
+#define TOASTER_IDLE_DEFAULT_MAX_TIMEOUT    60000       // ms
+#define TOASTER_IDLE_DEFAULT_PERCENTILE     90
+
+typedef struct _TOASTER_IDLE {
+
+    //
+    // Written from the I/O paths, at most once a millisecond.
+    //
+    volatile LONG64     LastArrival;                // performance counter ticks
+    volatile LONG       Samples;
+    volatile LONG       GapHistogram[TOASTER_IDLE_GAP_BUCKETS];
+
+    volatile LONG       Resumes;
+
+    //
+    // Read-only after ToasterIdleInitialize.
+    //
+    LONGLONG            TicksPerMs;
+    WDFWORKITEM         RetuneWorkItem;
+
+    //
+    // Policy and the timeout in effect. Lock serializes the retune work
+    // item with WMI; both run at PASSIVE_LEVEL.
+    //
+    WDFWAITLOCK         Lock;
+    ULONG               Enabled;
+    ULONG               MinimumTimeout;
+    ULONG               MaximumTimeout;
+    ULONG               Percentile;
+    ULONG               CurrentTimeout;
+    ULONG               Retunes;
+
+} TOASTER_IDLE, *PTOASTER_IDLE;
+
+//
+// Device state saved across low-power states, see State.c.
+//
+#define TOASTER_STATE_CRISPINESS        0x00000001
+#define TOASTER_STATE_RING              0x00000002
+
+typedef struct _TOASTER_SAVED_STATE {
+
+    //
+    // Items changed since the last save. Set from the I/O paths, at most
+    // once per item per power cycle.
+    //
+    volatile LONG       Dirty;
+
+    //
+    // Items saved at D0Exit that have not been put back yet.
+    //
+    volatile LONG       RestorePending;
+
+    //
+    // Items the snapshot holds.
+    //
+    LONG                Valid;
+
+    //
+    // Items a caller has taken on and is putting back. No lock is held
+    // while the ring is written back; requests that need it meanwhile
+    // wait for RingRestored, set whenever TOASTER_STATE_RING is not
+    // pending.
+    //
+    volatile LONG       Restoring;
+    KEVENT              RingRestored;
+
+    //
+    // Serializes the crispiness restore with ToasterSetCrispiness. Both
+    // call the bus interface, so both run at PASSIVE_LEVEL.
+    //
+    WDFWAITLOCK         CrispinessLock;
+
+    ULONG               Crispiness;
+
+    //
+    // Non-paged, TOASTER_RING_DEFAULT_SIZE bytes. NULL unless RetainRing.
+    //
+    PUCHAR              RingSnapshot;
+    SIZE_T              RingLength;
+
+    //
+    // Transition timing, in microseconds.
+    //
+    LONGLONG            D0EntryTicks;
+    ULONG               LastD0ExitTime;
+    ULONG               MaxD0ExitTime;
+    ULONG               LastD0EntryTime;
+    ULONG               MaxD0EntryTime;
+    ULONG               LastRestoreTime;
+    ULONG               MaxRestoreTime;
+    ULONG               LastResumeLatency;
+    ULONG               MaxResumeLatency;
+    ULONG               Saves;
+    ULONG               Restores;
+    ULONG               LastSavedBytes;
+
+} TOASTER_SAVED_STATE, *PTOASTER_SAVED_STATE;
+
+//
+// Recent power callbacks, see Power.c. Written a few times per transition
+// and read on demand, so a spinlock is all the synchronization it needs.
+//
+typedef struct _TOASTER_POWER_LOG_RING {
+
+    KSPIN_LOCK          Lock;
+
+    //
+    // Events recorded so far; the next one goes to
+    // Events[Next & (TOASTER_POWER_LOG_ENTRIES - 1)].
+    //
+    ULONG               Next;
+
+    TOASTER_POWER_EVENT Events[TOASTER_POWER_LOG_ENTRIES];
+
+} TOASTER_POWER_LOG_RING, *PTOASTER_POWER_LOG_RING;
+
+//
+// Pended IOCTL_TOASTER_WAIT_EVENTS requests, see Notify.c.
+//
+typedef struct _TOASTER_NOTIFY {
+
+    //
+    // Manual and not power-managed: waiters never keep the device in D0.
+    //
+    WDFQUEUE            WaitQueue;
+
+    //
+    // Completes the waiters an event satisfies. Events that come in while
+    // it is queued all go out with the same run.
+    //
+    WDFDPC              Dpc;
+
+    volatile LONG       Waiters;
+
+    //
+    // Lock protects Sequence and the arrays. Every event takes the next
+    // Sequence value; LastSequence holds the value of the latest event of
+    // each type.
+    //
+    KSPIN_LOCK          Lock;
+    ULONG64             Sequence;
+    ULONG64             LastSequence[ToasterEventMaximum];
+    ULONG               Counts[ToasterEventMaximum];
+
+    volatile ULONG      PowerState;
+
+} TOASTER_NOTIFY, *PTOASTER_NOTIFY;
+
+//
+// Interrupt-driven completion of the hardware-backed toaster, see
+// Interrupt.c.
+//
+#define TOASTER_HW_DEFAULT_COALESCE_COUNT   16
+#define TOASTER_HW_DEFAULT_COALESCE_TIMER   50          // us
+#define TOASTER_HW_MAX_COALESCE_COUNT       256
+#define TOASTER_HW_MAX_COALESCE_TIMER       10000       // us
+
+//
+// Entries of the command ring. Copied requests may only fill it up to
+// TOASTER_HW_COPY_DEPTH, so that a DMA request always finds one free.
+//
+#define TOASTER_HW_QUEUE_DEPTH              256
+#define TOASTER_HW_COPY_DEPTH               (TOASTER_HW_QUEUE_DEPTH - TOASTER_DMA_POOL_SIZE)
+
+typedef struct _TOASTER_HW {
+
+    //
+    // Mapped in ToasterEvtDevicePrepareHardware. NULL on a toaster without
+    // a register BAR, which completes every request inline.
+    //
+    PTOASTER_REGISTERS  Registers;
+    SIZE_T              RegistersLength;
+
+    //
+    // Created with the registers; the framework deletes it after
+    // ToasterEvtDeviceReleaseHardware. Connected is only changed by
+    // EvtInterruptEnable and EvtInterruptDisable: requests go to the device
+    // while it is set.
+    //
+    WDFINTERRUPT        Interrupt;
+    volatile BOOLEAN    Connected;
+
+    //
+    // Lock protects Pending, Submitted, Completed, Reserved and register
+    // writes outside the interrupt callbacks. Pending holds the requests
+    // the device has, oldest first, linked through
+    // TOASTER_REQUEST_CONTEXT.HwLink. Submitted is the last value written to
+    // Doorbell; Completed the part of the device's count already
+    // completed. Reserved counts the command ring entries DMA transfers
+    // have set aside before their EvtProgramDma runs, see ToasterHwReserve.
+    //
+    KSPIN_LOCK          Lock;
+    LIST_ENTRY          Pending;
+    ULONG               Submitted;
+    ULONG               Completed;
+    ULONG               Reserved;
+
+    //
+    // TOASTER_HW_QUEUE_DEPTH entries in a common buffer, created by
+    // ToasterDmaPrepare with the registers. Written under Lock.
+    //
+    PTOASTER_HW_COMMAND Commands;
+    PHYSICAL_ADDRESS    CommandsLogical;
+
+    //
+    // ToasterInterruptModeration. Kept across starts.
+    //
+    ULONG               CoalesceCount;
+    ULONG               CoalesceTimer;
+
+    volatile LONG64     Interrupts;
+    volatile LONG64     Dpcs;
+    volatile LONG64     Requests;
+    volatile ULONG      MaxBatch;
+
+} TOASTER_HW, *PTOASTER_HW;
+
+//
+// Scatter/gather DMA of the hardware-backed toaster, see Dma.c.
+//
+// Transfers are capped at TOASTER_DMA_MAX_LENGTH, which the enabler is
+// created with, so that each one is a single stage and a single command.
+// An unaligned buffer of that length spans one page more than it holds.
+//
+#define TOASTER_DMA_POOL_SIZE               32
+#define TOASTER_DMA_MAX_LENGTH              (256 * 1024)
+#define TOASTER_DMA_MAX_ELEMENTS            (TOASTER_DMA_MAX_LENGTH / PAGE_SIZE + 1)
+
+//
+// Context of each WDFDMATRANSACTION in the pool. A slot is on
+// TOASTER_DMA.Free or owns Request and its span of the data ring.
+//
+typedef struct _TOASTER_DMA_SLOT {
+
+    LIST_ENTRY          Link;
+    WDFDMATRANSACTION   Transaction;
+
+    //
+    // TOASTER_DMA_MAX_ELEMENTS entries of TOASTER_DMA.Elements.
+    //
+    PTOASTER_HW_ELEMENT Elements;
+    PHYSICAL_ADDRESS    ElementsLogical;
+
+    WDFREQUEST          Request;
+    BOOLEAN             IsWrite;
+    TOASTER_RING_SPAN   Span;
+
+    //
+    // Set by EvtProgramDma once the transfer is on the device's Pending
+    // list; from then on only ToasterDmaComplete releases the slot.
+    //
+    BOOLEAN             Submitted;
+
+} TOASTER_DMA_SLOT, *PTOASTER_DMA_SLOT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(TOASTER_DMA_SLOT, ToasterDmaGetSlot)
+
+typedef struct _TOASTER_DMA {
+
+    //
+    // Created in ToasterEvtDevicePrepareHardware on a toaster with a
+    // register BAR and deleted in ToasterEvtDeviceReleaseHardware, along
+    // with the common buffers and transactions, which are its children.
+    //
+    WDFDMAENABLER       Enabler;
+
+    //
+    // Backing store of the data ring while the toaster can DMA, in place
+    // of the pool allocation Toaster.c makes otherwise.
+    //
+    WDFCOMMONBUFFER     RingBuffer;
+    PHYSICAL_ADDRESS    RingLogical;
+
+    WDFCOMMONBUFFER     CommandBuffer;
+    WDFCOMMONBUFFER     ElementBuffer;
+
+    //
+    // Lock protects Free.
+    //
+    KSPIN_LOCK          Lock;
+    LIST_ENTRY          Free;
+
+} TOASTER_DMA, *PTOASTER_DMA;
+
+//
+// Timeouts of parked requests, see Deadline.c.
+//
+typedef struct _TOASTER_DEADLINE {
+
+    //
+    // One timer sweeps every parked request of the device. Lock protects
+    // NextDue, the deadline the timer is set for, MAXLONGLONG while it is
+    // not set.
+    //
+    WDFTIMER            Timer;
+    KSPIN_LOCK          Lock;
+    LONGLONG            NextDue;
+
+    //
+    // ToasterStatsStart ticks per millisecond, and TOASTER_FILE_TIMEOUT_SLACK
+    // in ticks.
+    //
+    LONGLONG            TicksPerMs;
+    LONGLONG            SlackTicks;
+
+} TOASTER_DEADLINE, *PTOASTER_DEADLINE;
+
+//
+// Start-up work kept off the PnP path, see Start.c. Only PnP callbacks
+// and the work item, which never run at the same time, touch it.
+//
+typedef struct _TOASTER_START {
+
+    WDFWORKITEM         WorkItem;
+
+    //
+    // When the last PrepareHardware was called.
+    //
+    LONGLONG            PrepareTicks;
+
+    //
+    // Set by the first run of the work item.
+    //
+    BOOLEAN             WmiRegistered;
+
+    //
+    // Phase timing, in microseconds.
+    //
+    ULONG               DeviceAddTime;
+    ULONG               LastPrepareHardwareTime;
+    ULONG               LastDeferredTime;
+    ULONG               LastStartLatency;
+
+} TOASTER_START, *PTOASTER_START;
+
+typedef struct _FDO_IO_DATA {
+
+    //
+    // Loopback data channel: ToasterEvtIoWrite fills it, ToasterEvtIoRead
+    // drains it. The buffer is allocated in ToasterEvtDevicePrepareHardware
+    // and freed in ToasterEvtDeviceReleaseHardware.
+    //
+    TOASTER_RING        DataRing;
+
+    //
+    // One queue per request type, see ToasterCreateQueue.
+    //
+    WDFQUEUE            ReadQueue;
+    WDFQUEUE            WriteQueue;
+    WDFQUEUE            IoctlQueue;
+
+    //
+    // Reads parked until the ring has data (ToasterParameters.PendingReads).
+    // A manual queue owns them, not the driver, so they never hold up a
+    // power transition. It is not power-managed either, so parked reads do
+    // not keep the device out of idle.
+    //
+    // There is one such queue per TOASTER_PRIORITY.
+    //
+    WDFQUEUE            PendingReadQueue[ToasterPriorityMaximum];
+
+    //
+    // Handles reading through a shared cursor (TOASTER_FILE_SHARED_CURSOR),
+    // linked through TOASTER_FILE_CONTEXT.CursorLink. CursorLock protects
+    // the list and every cursor on it, and is taken before the ring's
+    // ConsumerLock.
+    //
+    KSPIN_LOCK          CursorLock;
+    LIST_ENTRY          Cursors;
+
+    //
+    // Requests of each TOASTER_STAT_CLASS currently inside a queue callback.
+    //
+    volatile LONG       InFlight[ToasterStatClassMaximum];
+
+    TOASTER_SHARED_RINGS SharedRings;
+
+    //
+    // The bus interface in FDO_DATA stays referenced from
+    // ToasterEvtDevicePrepareHardware to ToasterEvtDeviceReleaseHardware,
+    // see Bus.c. Direct calls into the bus driver hold the rundown
+    // reference so that release can wait for them.
+    //
+    volatile BOOLEAN    BusInterfaceReferenced;
+    BOOLEAN             BusInterfaceRunDown;
+    EX_RUNDOWN_REF      BusInterfaceRundown;
+
+    //
+    // Open from D0Entry to D0Exit. ToasterCoalesceWrite touches the ring
+    // only under a reference, which the power-managed write queue would
+    // otherwise guarantee; D0Exit waits for it before it saves the ring.
+    //
+    EX_RUNDOWN_REF      CoalesceRundown;
+
+    //
+    // Cached bus state. Readers never call into the bus driver.
+    //
+    volatile LONG       CrispinessLevel;
+    volatile LONG       SafetyLockEnabled;
+
+    //
+    // NUMA placement, see Numa.c. NumaNode is the PDO's node, or
+    // MM_ANY_NODE_OK if it reports none. InterruptAffinity only holds the
+    // interrupt resource while ToasterEvtDevicePrepareHardware runs.
+    // DpcTargeted is set by the first start, the only one the DPCs are
+    // targeted in.
+    //
+    USHORT              NumaNode;
+    GROUP_AFFINITY      InterruptAffinity;
+    BOOLEAN             DpcTargeted;
+
+    TOASTER_STATS       Stats;
+
+    TOASTER_WMI_EVENTS  WmiEvents;
+
+    //
+    // Data blocks whose storage ToasterDeviceSnapshot reads, see Wmi.c.
+    // Set once by ToasterWmiRegistration.
+    //
+    WDFWMIINSTANCE      DeviceInformationInstance;
+    WDFWMIINSTANCE      ControlInstance;
+
+    //
+    // Per-slot data of a multi-slot toaster, already in the ToasterSlots
+    // layout so that a query is a single copy. SlotCount comes from the
+    // device's hardware key; Slots is NULL when it is zero.
+    //
+    ULONG               SlotCount;
+    PToasterSlot        Slots;
+
+    TOASTER_IDLE        Idle;
+
+    TOASTER_SAVED_STATE SavedState;
+
+    TOASTER_POWER_LOG_RING PowerLog;
+
+    TOASTER_NOTIFY      Notify;
+
+    TOASTER_HW          Hw;
+
+    TOASTER_DMA         Dma;
+
+    TOASTER_DEADLINE    Deadline;
+
+    TOASTER_START       Start;
+
+} FDO_IO_DATA, *PFDO_IO_DATA;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FDO_IO_DATA, ToasterFdoGetIoData)
+
+//
+// Allocated by the framework with every WDFFILEOBJECT, see File.c.
+//
+typedef struct _TOASTER_FILE_CONTEXT {
+
+    //
+    // Set by IOCTL_TOASTER_SET_FILE_POLICY. Flags only changes under
+    // FDO_IO_DATA.CursorLock; the I/O paths read the rest without a lock.
+    //
+    ULONG               Priority;
+    ULONG               Flags;
+    ULONG               MaxPendingReads;
+    ULONG               MaxReadLength;
+
+    //
+    // Set by IOCTL_TOASTER_SET_FILE_TIMEOUTS, in milliseconds, 0: none.
+    // Expired counts the requests of the handle that timed out.
+    //
+    ULONG               ReadTimeout;
+    ULONG               WaitTimeout;
+    volatile LONG       Expired;
+
+    //
+    // On FDO_IO_DATA.Cursors while Flags has TOASTER_FILE_SHARED_CURSOR.
+    // Cursor is the ring position of the next byte this handle reads.
+    //
+    LIST_ENTRY          CursorLink;
+    ULONG64             Cursor;
+
+    //
+    // Reads of this handle in a PendingReadQueue.
+    //
+    volatile LONG       PendingReads;
+
+    volatile LONG64     Reads;
+    volatile LONG64     BytesRead;
+    volatile LONG64     BytesLost;
+    volatile LONG64     QuotaRejects;
+
+} TOASTER_FILE_CONTEXT, *PTOASTER_FILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(TOASTER_FILE_CONTEXT, ToasterFileGetContext)
+
+//
+// Allocated by the framework with every request.
+//
+typedef struct _TOASTER_REQUEST_CONTEXT {
+
+    //
+    // ToasterStatsStart value taken when the request was first presented,
+    // so a parked read is accounted from its arrival.
+    //
+    LONGLONG            StartTicks;
+
+    //
+    // IOCTL_TOASTER_WAIT_EVENTS: the TOASTER_EVENT_WAIT it was sent with,
+    // kept here while the request is parked.
+    //
+    ULONG               EventMask;
+    ULONG64             EventSequence;
+
+    //
+    // A parked read or wait: the ToasterStatsStart value at which it times
+    // out, 0 for none. Set before the request is parked, see Deadline.c.
+    //
+    LONGLONG            Deadline;
+
+    //
+    // A read or write the device has (Interrupt.c): on TOASTER_HW.Pending,
+    // and what to complete it with once the device is done. HwSlot is set
+    // when the device moves the data itself (Dma.c); the outcome is then
+    // the transfer's.
+    //
+    LIST_ENTRY          HwLink;
+    ULONG               HwClass;
+    NTSTATUS            HwStatus;
+    ULONG_PTR           HwInformation;
+    PTOASTER_DMA_SLOT   HwSlot;
+
+    //
+    // Set by ToasterTlRequestStart when a session was listening for the
+    // request's arrival (Activity.c): its stop is logged under ActivityId.
+    //
+    GUID                ActivityId;
+    BOOLEAN             Traced;
+
+} TOASTER_REQUEST_CONTEXT, *PTOASTER_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(TOASTER_REQUEST_CONTEXT, ToasterRequestGetContext)
+
+//
+// Hot-path tracing.
+//
+// The per-request traces in ToasterEvtIoRead, ToasterEvtIoWrite and
+// ToasterEvtIoDeviceControl are off unless DebugLevel (the DebugPrintLevel
+// item of ToasterDeviceInformation) enables them. The low bits of
+// DebugLevel keep their meaning; the high bits are:
+//
+//      0x00010000  trace reads
+//      0x00020000  trace writes
+//      0x00040000  trace device controls
+//      0x1F000000  sample: trace one request in 2^n per processor (0 = all)
+//
+// Building with TOASTER_HOT_PATH_TRACE defined to 0 removes the traces and
+// the checks altogether.
+//
+#if !defined(TOASTER_HOT_PATH_TRACE)
+#define TOASTER_HOT_PATH_TRACE          1
+#endif
+
+#define TOASTER_TRACE_HOT_READ          0x00010000
+#define TOASTER_TRACE_HOT_WRITE         0x00020000
+#define TOASTER_TRACE_HOT_IOCTL         0x00040000
+#define TOASTER_TRACE_HOT_SAMPLE_SHIFT  24
+#define TOASTER_TRACE_HOT_SAMPLE_MASK   0x1F000000
+
+extern ULONG DebugLevel;
+
+C_ASSERT(TOASTER_TRACE_HOT_WRITE == (TOASTER_TRACE_HOT_READ << ToasterStatWrite));
+C_ASSERT(TOASTER_TRACE_HOT_IOCTL == (TOASTER_TRACE_HOT_READ << ToasterStatIoctl));
+
+FORCEINLINE
+BOOLEAN
+ToasterHotPathTraceCheck(
+    _In_ PFDO_IO_DATA       IoData,
+    _In_ TOASTER_STAT_CLASS Class
+    )
+{
+    ULONG   level = *((volatile ULONG *) &DebugLevel);
+    ULONG   shift;
+    ULONG   processor;
+
+    if ((level & (TOASTER_TRACE_HOT_READ << Class)) == 0) {
+        return FALSE;
+    }
+
+    shift = (level & TOASTER_TRACE_HOT_SAMPLE_MASK) >> TOASTER_TRACE_HOT_SAMPLE_SHIFT;
+    if (shift == 0) {
+        return TRUE;
+    }
+
+    //
+    // Sample off this processor's completion count for the class, so the
+    // decision needs no shared counter of its own.
+    //
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+    if (IoData->Stats.PerCpu == NULL || processor >= IoData->Stats.ProcessorCount) {
+        return FALSE;
+    }
+
+    return (ReadNoFence64(&IoData->Stats.PerCpu[processor].Class[Class].Requests) &
+            ((1LL << shift) - 1)) == 0;
+}
+
+#if TOASTER_HOT_PATH_TRACE
+#define ToasterHotPathTraceEnabled(_iodata_, _class_) \
+    ToasterHotPathTraceCheck((_iodata_), (_class_))
+#else
+#define ToasterHotPathTraceEnabled(_iodata_, _class_)   FALSE
+#endif
+
+//
+// Toaster.c
+//
+EVT_WDF_IO_IN_CALLER_CONTEXT            ToasterEvtIoInCallerContext;
+EVT_WDF_FILE_CLEANUP                    ToasterEvtFileCleanup;
+EVT_WDF_DEVICE_SELF_MANAGED_IO_CLEANUP  ToasterEvtDeviceSelfManagedIoCleanup;
+EVT_WDF_IO_QUEUE_IO_STOP                ToasterEvtIoStop;
+EVT_WDF_IO_QUEUE_IO_RESUME              ToasterEvtIoResume;
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE   ToasterEvtPendingReadCanceled;
+
+VOID
+ToasterReadDriverParameters(
+    _In_ WDFDRIVER Driver
+    );
+
+VOID
+ToasterReadQueueParameters(
+    _In_ WDFKEY Key
+    );
+
+NTSTATUS
+ToasterCreateQueue(
+    _In_  WDFDEVICE             Device,
+    _In_  PTOASTER_QUEUE_POLICY Policy,
+    _In_  WDF_REQUEST_TYPE      RequestType,
+    _Out_ WDFQUEUE*             Queue
+    );
+
+BOOLEAN
+ToasterCoalesceWrite(
+    _In_ WDFDEVICE  Device,
+    _In_ WDFREQUEST Request,
+    _In_ size_t     Length
+    );
+
+NTSTATUS
+ToasterRequestMapMdl(
+    _In_  WDFREQUEST Request,
+    _In_  BOOLEAN    IsRead,
+    _Out_ PVOID*     Buffer,
+    _Out_ size_t*    Length
+    );
+
+BOOLEAN
+ToasterCompleteRead(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request,
+    _In_ size_t         Length,
+    _In_ BOOLEAN        RequeueIfEmpty
+    );
+
+VOID
+ToasterServicePendingReads(
+    _In_ PFDO_IO_DATA IoData
+    );
+
+//
+// Batch.c
+//
+VOID
+ToasterExecuteOp(
+    _In_ WDFDEVICE Device,
+    _In_ PTOASTER_OP Op,
+    _In_reads_bytes_(SourceLength) PUCHAR SourceData,
+    _In_ SIZE_T SourceLength,
+    _Out_writes_bytes_(DestinationLength) PUCHAR DestinationData,
+    _In_ SIZE_T DestinationLength,
+    _Out_ PTOASTER_OP_RESULT Result
+    );
+
+NTSTATUS
+ToasterSubmitBatch(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    );
+
+//
+// SharedRing.c
+//
+NTSTATUS
+ToasterSharedRingsDriverInitialize(
+    VOID
+    );
+
+VOID
+ToasterSharedRingsDriverUnload(
+    VOID
+    );
+
+NTSTATUS
+ToasterSharedRingsAllocate(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterSharedRingsFree(
+    _In_ WDFDEVICE Device
+    );
+
+NTSTATUS
+ToasterSharedRingsMap(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    );
+
+VOID
+ToasterSharedRingsUnmap(
+    _In_ WDFDEVICE      Device,
+    _In_ WDFFILEOBJECT  FileObject
+    );
+
+NTSTATUS
+ToasterSharedRingsDoorbell(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    );
+
+//
+// Bus.c
+//
+VOID
+ToasterBusInterfaceAcquire(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterBusInterfaceRelease(
+    _In_ WDFDEVICE Device
+    );
+
+NTSTATUS
+ToasterGetCrispiness(
+    _In_  WDFDEVICE Device,
+    _Out_ PUCHAR    Level
+    );
+
+NTSTATUS
+ToasterSetCrispiness(
+    _In_ WDFDEVICE  Device,
+    _In_ UCHAR      Level
+    );
+
+NTSTATUS
+ToasterSetCrispinessLocked(
+    _In_ WDFDEVICE  Device,
+    _In_ UCHAR      Level
+    );
+
+NTSTATUS
+ToasterGetSafetyLock(
+    _In_  WDFDEVICE Device,
+    _Out_ PBOOLEAN  Enabled
+    );
+
+NTSTATUS
+ToasterIoctlGetCrispiness(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    );
+
+NTSTATUS
+ToasterIoctlSetCrispiness(
+    _In_ WDFDEVICE      Device,
+    _In_ WDFREQUEST     Request
+    );
+
+//
+// Stats.c
+//
+NTSTATUS
+ToasterStatsAllocate(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterStatsFree(
+    _In_ WDFDEVICE Device
+    );
+
+LONGLONG
+ToasterStatsStart(
+    VOID
+    );
+
+VOID
+ToasterStatsRecord(
+    _In_ PFDO_IO_DATA       IoData,
+    _In_ TOASTER_STAT_CLASS Class,
+    _In_ NTSTATUS           Status,
+    _In_ ULONG_PTR          Bytes,
+    _In_ LONGLONG           StartTicks
+    );
+
+VOID
+ToasterStatsQuery(
+    _In_  WDFDEVICE                 Device,
+    _Out_ PToasterPerfStatistics    Statistics
+    );
+
+VOID
+ToasterStatsQueryTotals(
+    _In_  WDFDEVICE                 Device,
+    _Out_ PToasterDeviceSnapshot    Snapshot
+    );
+
+ULONG64
+ToasterStatsGetErrorCount(
+    _In_ WDFDEVICE Device
+    );
+
+//
+// Idle.c
+//
+NTSTATUS
+ToasterIdleInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterIdleRecordGap(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ LONGLONG       LastArrival,
+    _In_ LONGLONG       Ticks
+    );
+
+VOID
+ToasterIdleQuery(
+    _In_  WDFDEVICE             Device,
+    _Out_ PToasterIdlePolicy    Policy
+    );
+
+NTSTATUS
+ToasterIdleSetPolicy(
+    _In_ WDFDEVICE              Device,
+    _In_ PToasterIdlePolicy     Policy
+    );
+
+FORCEINLINE
+VOID
+ToasterIdleNoteArrival(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ LONGLONG       Ticks
+    )
+/*++
+
+Routine Description:
+
+    Called with the arrival time of every read, write and device control.
+    While requests keep coming less than a millisecond apart this is one
+    read of a line nobody writes.
+
+--*/
+{
+    LONGLONG last = ReadNoFence64(&IoData->Idle.LastArrival);
+
+    if (Ticks - last >= IoData->Idle.TicksPerMs) {
+        ToasterIdleRecordGap(IoData, last, Ticks);
+    }
+}
+
+//
+// State.c
+//
+NTSTATUS
+ToasterStateInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterStateAllocate(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterStateFree(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterStateSave(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterStateResumed(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterStateRecordTransition(
+    _In_ WDFDEVICE  Device,
+    _In_ BOOLEAN    Entry,
+    _In_ LONGLONG   StartTicks
+    );
+
+VOID
+ToasterStateRestoreSlow(
+    _In_ WDFDEVICE  Device,
+    _In_ LONG       Items
+    );
+
+VOID
+ToasterStateQuery(
+    _In_  WDFDEVICE             Device,
+    _Out_ PToasterPowerState    PowerState
+    );
+
+ULONG
+ToasterStateMicroseconds(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ LONGLONG       StartTicks
+    );
+
+FORCEINLINE
+VOID
+ToasterStateSetDirty(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ LONG           Items
+    )
+{
+    if ((ReadNoFence(&IoData->SavedState.Dirty) & Items) != Items) {
+        InterlockedOrNoFence(&IoData->SavedState.Dirty, Items);
+    }
+}
+
+FORCEINLINE
+VOID
+ToasterStateRestore(
+    _In_ WDFDEVICE      Device,
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ LONG           Items
+    )
+/*++
+
+Routine Description:
+
+    Called before anything that depends on the listed items. Outside the
+    first request after a resume this is one read of a line nobody writes.
+
+--*/
+{
+    LONG pending = ReadAcquire(&IoData->SavedState.RestorePending) & Items;
+
+    if (pending != 0) {
+        ToasterStateRestoreSlow(Device, pending);
+    }
+}
+
+//
+// File.c
+//
+VOID
+ToasterFileInitialize(
+    _In_ WDFFILEOBJECT FileObject
+    );
+
+VOID
+ToasterFileClose(
+    _In_ WDFFILEOBJECT FileObject
+    );
+
+PTOASTER_FILE_CONTEXT
+ToasterRequestGetFile(
+    _In_ WDFREQUEST Request
+    );
+
+SIZE_T
+ToasterFileRead(
+    _In_     PFDO_IO_DATA           IoData,
+    _In_opt_ PTOASTER_FILE_CONTEXT  File,
+    _Out_writes_bytes_to_(Length, return) PVOID Buffer,
+    _In_     SIZE_T                 Length
+    );
+
+SIZE_T
+ToasterFileGetReadable(
+    _In_     PFDO_IO_DATA           IoData,
+    _In_opt_ PTOASTER_FILE_CONTEXT  File
+    );
+
+BOOLEAN
+ToasterFileParkRead(
+    _In_opt_ PTOASTER_FILE_CONTEXT  File
+    );
+
+VOID
+ToasterFileUnparkRead(
+    _In_opt_ PTOASTER_FILE_CONTEXT  File
+    );
+
+NTSTATUS
+ToasterFileSetPolicy(
+    _In_ WDFDEVICE      Device,
+    _In_ WDFREQUEST     Request
+    );
+
+NTSTATUS
+ToasterFileGetInfo(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    );
+
+NTSTATUS
+ToasterFileSetTimeouts(
+    _In_ WDFDEVICE      Device,
+    _In_ WDFREQUEST     Request
+    );
+
+FORCEINLINE
+TOASTER_PRIORITY
+ToasterFileGetPriority(
+    _In_opt_ PTOASTER_FILE_CONTEXT File
+    )
+{
+    return (File != NULL) ? (TOASTER_PRIORITY) ReadULongNoFence(&File->Priority) :
+                            ToasterPriorityNormal;
+}
+
+//
+// Notify.c
+//
+NTSTATUS
+ToasterNotifyInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterNotify(
+    _In_ PFDO_IO_DATA       IoData,
+    _In_ TOASTER_EVENT_TYPE Type
+    );
+
+NTSTATUS
+ToasterNotifyWait(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    );
+
+FORCEINLINE
+VOID
+ToasterNotifyDataAvailable(
+    _In_ PFDO_IO_DATA IoData
+    )
+/*++
+
+Routine Description:
+
+    Called after anything that adds to the ring. Data is a level, so there
+    is nothing to record; waiters only need to look again.
+
+--*/
+{
+    if (ReadNoFence(&IoData->Notify.Waiters) != 0) {
+        WdfDpcEnqueue(IoData->Notify.Dpc);
+    }
+}
+
+//
+// Numa.c
+//
+VOID
+ToasterNumaInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+_Must_inspect_result_
+PVOID
+ToasterNumaAllocate(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ SIZE_T         Size,
+    _In_ BOOLEAN        CacheAligned
+    );
+
+VOID
+ToasterNumaSetInterrupt(
+    _In_ WDFDEVICE                          Device,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR    Descriptor
+    );
+
+VOID
+ToasterNumaApplyAffinity(
+    _In_ WDFDEVICE Device
+    );
+
+//
+// Interrupt.c
+//
+VOID
+ToasterHwInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+NTSTATUS
+ToasterHwPrepare(
+    _In_ WDFDEVICE      Device,
+    _In_ WDFCMRESLIST   ResourcesRaw,
+    _In_ WDFCMRESLIST   ResourcesTranslated
+    );
+
+VOID
+ToasterHwRelease(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterHwCompleteRequest(
+    _In_ PFDO_IO_DATA       IoData,
+    _In_ WDFREQUEST         Request,
+    _In_ TOASTER_STAT_CLASS Class,
+    _In_ NTSTATUS           Status,
+    _In_ ULONG_PTR          Information,
+    _In_ LONGLONG           StartTicks
+    );
+
+VOID
+ToasterHwFlush(
+    _In_ PFDO_IO_DATA IoData
+    );
+
+BOOLEAN
+ToasterHwStopAcknowledge(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request
+    );
+
+VOID
+ToasterHwQueryModeration(
+    _In_  WDFDEVICE                     Device,
+    _Out_ PToasterInterruptModeration   Moderation
+    );
+
+NTSTATUS
+ToasterHwSetModeration(
+    _In_ WDFDEVICE                      Device,
+    _In_ PToasterInterruptModeration    Moderation
+    );
+
+BOOLEAN
+ToasterHwReserve(
+    _In_ PFDO_IO_DATA IoData
+    );
+
+VOID
+ToasterHwUnreserve(
+    _In_ PFDO_IO_DATA IoData
+    );
+
+VOID
+ToasterHwSubmit(
+    _In_ PFDO_IO_DATA           IoData,
+    _In_ WDFREQUEST             Request,
+    _In_ PTOASTER_HW_COMMAND    Command
+    );
+
+//
+// Dma.c
+//
+NTSTATUS
+ToasterDmaPrepare(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterDmaRelease(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterDmaProgramDevice(
+    _In_ PFDO_IO_DATA IoData
+    );
+
+BOOLEAN
+ToasterDmaStart(
+    _In_  PFDO_IO_DATA  IoData,
+    _In_  WDFREQUEST    Request,
+    _In_  BOOLEAN       IsWrite,
+    _In_  SIZE_T        Length,
+    _In_  LONGLONG      StartTicks,
+    _Out_ PSIZE_T       Bytes
+    );
+
+VOID
+ToasterDmaComplete(
+    _In_ PFDO_IO_DATA       IoData,
+    _In_ PTOASTER_DMA_SLOT  Slot,
+    _In_ BOOLEAN            Done
+    );
+
+//
+// Deadline.c
+//
+NTSTATUS
+ToasterDeadlineInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+LONGLONG
+ToasterDeadlineSet(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ WDFREQUEST     Request,
+    _In_ ULONG          Timeout
+    );
+
+VOID
+ToasterDeadlineArm(
+    _In_ PFDO_IO_DATA   IoData,
+    _In_ LONGLONG       Deadline
+    );
+
+//
+// Start.c
+//
+NTSTATUS
+ToasterStartInitialize(
+    _In_ WDFDEVICE  Device,
+    _In_ LONGLONG   AddTicks
+    );
+
+VOID
+ToasterStartDeferred(
+    _In_ WDFDEVICE  Device,
+    _In_ LONGLONG   PrepareTicks
+    );
+
+VOID
+ToasterStartFlush(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+ToasterStartQuery(
+    _In_  WDFDEVICE             Device,
+    _Out_ PToasterPowerState    PowerState
+    );
+
+//
+// Activity.c
+//
+VOID
+ToasterTlRequestStart(
+    _In_ WDFREQUEST         Request,
+    _In_ TOASTER_STAT_CLASS Class,
+    _In_ SIZE_T             Length,
+    _In_ ULONG              IoControlCode
+    );
+
+VOID
+ToasterTlRequestStop(
+    _In_ WDFREQUEST         Request,
+    _In_ NTSTATUS           Status,
+    _In_ ULONG_PTR          Information
+    );
+
+//
+// Power.c
+//
+VOID
+ToasterPowerLogRecord(
+    _In_ WDFDEVICE                  Device,
+    _In_ TOASTER_POWER_EVENT_TYPE   Type,
+    _In_ WDF_POWER_DEVICE_STATE     FromState,
+    _In_ WDF_POWER_DEVICE_STATE     ToState,
+    _In_ LONGLONG                   StartTicks
+    );
+
+NTSTATUS
+ToasterPowerLogGet(
+    _In_  WDFDEVICE     Device,
+    _In_  WDFREQUEST    Request,
+    _Out_ PULONG_PTR    Information
+    );
+
+VOID
+ToasterPowerLogQuery(
+    _In_  WDFDEVICE         Device,
+    _Out_ PToasterPowerLog  PowerLog
+    );
+
+//
+// Wmi.c
+//
+
+//
+// ToasterDeviceSnapshot.Version. Fields are only ever appended to the
+// block; Size tells a consumer how much of it the driver filled in.
+//
+#define TOASTER_SNAPSHOT_VERSION        1
+
+//
+// REG_DWORD in the device's hardware key, set by the INF of a multi-slot
+// variant.
+//
+#define TOASTER_REG_SLOT_COUNT          L"SlotCount"
+#define TOASTER_MAX_SLOTS               1024
+
+NTSTATUS
+ToasterFireEvent(
+    _In_ WDFDEVICE  Device,
+    _In_ LPCGUID    Guid,
+    _In_reads_bytes_opt_(PayloadLength) PVOID Payload,
+    _In_ ULONG      PayloadLength
+    );
+
+//
+// Ring.c
+//
+VOID
+ToasterRingInitialize(
+    _Out_ PTOASTER_RING Ring,
+    _In_reads_bytes_(Size) PUCHAR Buffer,
+    _In_ SIZE_T Size
+    );
+
+VOID
+ToasterRingSetRecords(
+    _Inout_ PTOASTER_RING Ring,
+    _Out_writes_(Count) PULONG64 Records,
+    _In_ ULONG Count
+    );
+
+VOID
+ToasterRingReset(
+    _Inout_ PTOASTER_RING Ring
+    );
+
+SIZE_T
+ToasterRingWrite(
+    _Inout_ PTOASTER_RING Ring,
+    _In_reads_bytes_(Length) PVOID Source,
+    _In_ SIZE_T Length
+    );
+
+SIZE_T
+ToasterRingRead(
+    _Inout_ PTOASTER_RING Ring,
+    _Out_writes_bytes_to_(Length, return) PVOID Destination,
+    _In_ SIZE_T Length,
+    _In_ BOOLEAN Record
+    );
+
+SIZE_T
+ToasterRingGetReadable(
+    _In_ PTOASTER_RING Ring
+    );
+
+ULONG64
+ToasterRingGetHead(
+    _In_ PTOASTER_RING Ring
+    );
+
+SIZE_T
+ToasterRingReadAt(
+    _Inout_ PTOASTER_RING Ring,
+    _Inout_ PULONG64 Position,
+    _Out_writes_bytes_to_(Length, return) PVOID Destination,
+    _In_ SIZE_T Length,
+    _In_ BOOLEAN Record,
+    _Out_ PULONG64 Skipped
+    );
+
+VOID
+ToasterRingConsumeTo(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ ULONG64 Position
+    );
+
+VOID
+ToasterRingRewind(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ SIZE_T Length
+    );
+
+SIZE_T
+ToasterRingReserve(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ SIZE_T Length,
+    _Out_ PTOASTER_RING_SPAN Span
+    );
+
+SIZE_T
+ToasterRingClaim(
+    _Inout_ PTOASTER_RING Ring,
+    _In_ SIZE_T Length,
+    _Out_ PTOASTER_RING_SPAN Span
+    );
+
+VOID
+ToasterRingCommit(
+    _Inout_ PTOASTER_RING Ring,
+    _Inout_ PTOASTER_RING_SPAN Span,
+    _In_ BOOLEAN Reservation
+    );
+
+VOID
+ToasterRingCancel(
+    _Inout_ PTOASTER_RING Ring,
+    _Inout_ PTOASTER_RING_SPAN Span,
+    _In_ BOOLEAN Reservation
+    );
+
+#endif // _TOASTER_IO_H_
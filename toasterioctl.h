@@ -0,0 +1,368 @@
+/*++
+
+Module Name:
+
+    ToasterIoctl.h
+
+Abstract:
+
+    I/O control codes and buffer layouts for the data-path extensions of the
+    featured toaster function driver. This header is shared between the
+    driver and user-mode applications; it only uses types available to both.
+
+Environment:
+
+    User and kernel mode
+
+--*/
+
+#if !defined(_TOASTER_IOCTL_H_)
+#define _TOASTER_IOCTL_H_
+
+//
+// The control codes defined here start well above the ones in public.h so
+// the two sets never overlap. TOASTER_IO_IOCTL_WRITE codes change the
+// device or write to it, and are only accepted on a handle opened for
+// writing.
+//
+#define TOASTER_IO_IOCTL(_index_, _method_) \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x900 + (_index_), _method_, FILE_ANY_ACCESS)
+
+#define TOASTER_IO_IOCTL_WRITE(_index_, _method_) \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x900 + (_index_), _method_, FILE_WRITE_ACCESS)
+
+//
+// IOCTL_TOASTER_SUBMIT_BATCH
+//
+// Runs many toaster operations in one DeviceIoControl call.
+//
+// Input buffer:  TOASTER_BATCH_HEADER
+//                TOASTER_OP            Ops[Header.Count]
+//                UCHAR                 WriteData[]
+//
+// Output buffer: TOASTER_OP_RESULT     Results[Header.Count]
+//                UCHAR                 ReadData[]
+//
+// For ToasterOpWrite, DataOffset/Length select the payload within
+// WriteData. For ToasterOpRead they select where the data is placed within
+// ReadData. Operations run in array order. A failed operation does not stop
+// the batch; its own entry in Results carries the failure. The request
+// itself only fails if the header or the buffer sizes are malformed.
+//
+// The output buffer is described by an MDL (METHOD_OUT_DIRECT) so that
+// read data is copied into the caller's pages once.
+//
+#define IOCTL_TOASTER_SUBMIT_BATCH      TOASTER_IO_IOCTL_WRITE(0x00, METHOD_OUT_DIRECT)
+
+#define TOASTER_BATCH_VERSION           1
+
+//
+// Upper bound on Header.Count, to bound the time spent in one dispatch.
+//
+#define TOASTER_BATCH_MAX_OPS           4096
+
+typedef enum _TOASTER_OP_CODE {
+    ToasterOpNop = 0,
+    ToasterOpRead,              // drain up to Length bytes from the data ring
+    ToasterOpWrite,             // append Length bytes to the data ring
+    ToasterOpGetCrispiness,     // Result.Information = current level
+    ToasterOpSetCrispiness,     // level = Value
+    ToasterOpMaximum
+} TOASTER_OP_CODE;
+
+typedef struct _TOASTER_BATCH_HEADER {
+    ULONG   Version;            // TOASTER_BATCH_VERSION
+    ULONG   Count;              // number of TOASTER_OP entries that follow
+} TOASTER_BATCH_HEADER, *PTOASTER_BATCH_HEADER;
+
+typedef struct _TOASTER_OP {
+    ULONG   OpCode;             // TOASTER_OP_CODE
+    ULONG   Length;             // read/write: byte count
+    ULONG   DataOffset;         // read/write: offset into the data area
+    ULONG   Value;              // set crispiness: new level
+} TOASTER_OP, *PTOASTER_OP;
+
+typedef struct _TOASTER_OP_RESULT {
+    LONG    Status;             // NTSTATUS of the operation
+    ULONG   Information;        // bytes transferred, or crispiness level
+} TOASTER_OP_RESULT, *PTOASTER_OP_RESULT;
+
+//
+// IOCTL_TOASTER_MAP_RINGS
+//
+// Maps the device's submission/completion rings into the calling process.
+// Only one handle can own the mapping at a time; it is torn down when that
+// handle is closed.
+//
+// Input buffer:  TOASTER_MAP_RINGS_INPUT (optional)
+// Output buffer: TOASTER_MAP_RINGS_OUTPUT
+//
+// IOCTL_TOASTER_RING_DOORBELL
+//
+// Tells the driver that new submission entries are available. The driver
+// runs every entry between SqHead and SqTail (as long as the completion
+// ring has room), posts one completion entry per submission and, if an
+// event was supplied when mapping, signals it. No buffers.
+//
+#define IOCTL_TOASTER_MAP_RINGS         TOASTER_IO_IOCTL_WRITE(0x01, METHOD_BUFFERED)
+#define IOCTL_TOASTER_RING_DOORBELL     TOASTER_IO_IOCTL_WRITE(0x02, METHOD_BUFFERED)
+
+#define TOASTER_SQ_ENTRIES              256         // power of two
+#define TOASTER_CQ_ENTRIES              512         // power of two
+#define TOASTER_SHARED_DATA_LENGTH      (256 * 1024)
+
+typedef struct _TOASTER_MAP_RINGS_INPUT {
+    ULONG64 CompletionEvent;    // HANDLE to an event, or 0
+} TOASTER_MAP_RINGS_INPUT, *PTOASTER_MAP_RINGS_INPUT;
+
+typedef struct _TOASTER_MAP_RINGS_OUTPUT {
+    ULONG64 Base;               // address of TOASTER_SHARED_RINGS_HEADER
+    ULONG   Length;             // bytes mapped
+    ULONG   Reserved;
+} TOASTER_MAP_RINGS_OUTPUT, *PTOASTER_MAP_RINGS_OUTPUT;
+
+//
+// A submission entry. UserData is copied to the matching completion entry
+// untouched. Op.DataOffset is relative to the start of the shared data
+// area, which serves as both source (writes) and destination (reads).
+//
+typedef struct _TOASTER_SQE {
+    ULONG64     UserData;
+    TOASTER_OP  Op;
+} TOASTER_SQE, *PTOASTER_SQE;
+
+typedef struct _TOASTER_CQE {
+    ULONG64             UserData;
+    TOASTER_OP_RESULT   Result;
+} TOASTER_CQE, *PTOASTER_CQE;
+
+//
+// Start of the shared mapping. Indexes are free running; an entry lives at
+// (Index & (Entries - 1)). The application owns SqTail and CqHead, the
+// driver owns SqHead and CqTail. Each index sits on its own cache line.
+//
+typedef struct _TOASTER_SHARED_RINGS_HEADER {
+    volatile ULONG  SqHead;
+    ULONG           SqHeadPad[15];
+    volatile ULONG  SqTail;
+    ULONG           SqTailPad[15];
+    volatile ULONG  CqHead;
+    ULONG           CqHeadPad[15];
+    volatile ULONG  CqTail;
+    ULONG           CqTailPad[15];
+
+    ULONG           SqEntries;
+    ULONG           CqEntries;
+    ULONG           SqOffset;   // from the start of the mapping
+    ULONG           CqOffset;
+    ULONG           DataOffset;
+    ULONG           DataLength;
+} TOASTER_SHARED_RINGS_HEADER, *PTOASTER_SHARED_RINGS_HEADER;
+
+//
+// IOCTL_TOASTER_GET_CRISPINESS
+//
+// Output buffer: TOASTER_CRISPINESS
+//
+// IOCTL_TOASTER_SET_CRISPINESS
+//
+// Input buffer:  TOASTER_CRISPINESS (only Level is used)
+//
+// Both fail with STATUS_NOT_SUPPORTED when the device is not on the
+// toaster bus.
+//
+#define IOCTL_TOASTER_GET_CRISPINESS    TOASTER_IO_IOCTL(0x03, METHOD_BUFFERED)
+#define IOCTL_TOASTER_SET_CRISPINESS    TOASTER_IO_IOCTL_WRITE(0x04, METHOD_BUFFERED)
+
+typedef struct _TOASTER_CRISPINESS {
+    ULONG   Level;              // 0 - 255
+    ULONG   SafetyLockEnabled;  // get only
+} TOASTER_CRISPINESS, *PTOASTER_CRISPINESS;
+
+//
+// IOCTL_TOASTER_GET_POWER_LOG
+//
+// Output buffer: TOASTER_POWER_LOG, with as many Events as fit, newest
+// last. Total is always filled in, so a caller can tell how many events
+// it missed between two polls.
+//
+// Answered before the request is queued, so it neither waits for nor
+// causes a return to D0.
+//
+#define IOCTL_TOASTER_GET_POWER_LOG     TOASTER_IO_IOCTL(0x05, METHOD_BUFFERED)
+
+//
+// The driver keeps the most recent TOASTER_POWER_LOG_ENTRIES events.
+//
+#define TOASTER_POWER_LOG_ENTRIES       64          // power of two
+
+typedef enum _TOASTER_POWER_EVENT_TYPE {
+    ToasterPowerEventD0Entry = 1,
+    ToasterPowerEventD0Exit,
+    ToasterPowerEventArmWakeFromS0,
+    ToasterPowerEventArmWakeFromSx,
+    ToasterPowerEventDisarmWakeFromS0,
+    ToasterPowerEventDisarmWakeFromSx,
+    ToasterPowerEventWakeFromS0Triggered,
+    ToasterPowerEventWakeFromSxTriggered,
+    ToasterPowerEventMaximum
+} TOASTER_POWER_EVENT_TYPE;
+
+typedef struct _TOASTER_POWER_EVENT {
+    ULONG64 Timestamp;          // system time the callback started, 100ns units since 1601 (UTC)
+    ULONG   Sequence;           // counts every event since the device was added
+    ULONG   Type;               // TOASTER_POWER_EVENT_TYPE
+    ULONG   FromState;          // WDF_POWER_DEVICE_STATE; 0 for the wake callbacks
+    ULONG   ToState;            // WDF_POWER_DEVICE_STATE; 0 for the wake callbacks
+    ULONG   Duration;           // time spent in the callback, in microseconds
+    ULONG   QueueDepth;         // requests queued or owned by the driver at the time
+} TOASTER_POWER_EVENT, *PTOASTER_POWER_EVENT;
+
+typedef struct _TOASTER_POWER_LOG {
+    ULONG   Total;              // events recorded since the device was added
+    ULONG   Returned;           // entries in Events
+    TOASTER_POWER_EVENT Events[1];
+} TOASTER_POWER_LOG, *PTOASTER_POWER_LOG;
+
+//
+// IOCTL_TOASTER_SET_FILE_POLICY
+//
+// Input buffer:  TOASTER_FILE_POLICY
+//
+// IOCTL_TOASTER_GET_FILE_INFO
+//
+// Output buffer: TOASTER_FILE_INFO
+//
+// Both apply to the handle they are sent on, and are answered before the
+// request is queued. A new handle starts with ToasterPriorityNormal, no
+// flags and the default limits.
+//
+// Priority orders the reads that wait for data (PendingReads): when data
+// arrives, waiting reads of a higher class are served first.
+//
+// A handle with TOASTER_FILE_SHARED_CURSOR reads through a cursor of its
+// own instead of consuming the data, so several such handles each see
+// everything written after they set the flag. Written data stays in the
+// ring until the slowest of them has read it. Handles without the flag
+// keep consuming; whatever they or a power transition take away before a
+// shared handle got to it is counted in BytesLost.
+//
+// A handle with TOASTER_FILE_RECORDS keeps the boundaries between writes:
+// each read returns data of one write only, the rest of it if an earlier
+// read took part. Without it a read takes whatever is there, up to its
+// length. The driver remembers the boundaries of the last 4096 writes;
+// older writes still unread run together.
+//
+#define IOCTL_TOASTER_SET_FILE_POLICY   TOASTER_IO_IOCTL_WRITE(0x06, METHOD_BUFFERED)
+#define IOCTL_TOASTER_GET_FILE_INFO     TOASTER_IO_IOCTL(0x07, METHOD_BUFFERED)
+
+typedef enum _TOASTER_PRIORITY {
+    ToasterPriorityBulk = 0,
+    ToasterPriorityNormal,
+    ToasterPriorityLatency,
+    ToasterPriorityMaximum
+} TOASTER_PRIORITY;
+
+#define TOASTER_FILE_SHARED_CURSOR          0x00000001
+#define TOASTER_FILE_RECORDS                0x00000002
+#define TOASTER_FILE_VALID_FLAGS            0x00000003
+
+#define TOASTER_FILE_DEFAULT_PENDING_READS  16
+
+typedef struct _TOASTER_FILE_POLICY {
+    ULONG   Priority;           // TOASTER_PRIORITY
+    ULONG   Flags;              // TOASTER_FILE_*
+    ULONG   MaxPendingReads;    // reads the handle may have waiting for data,
+                                // further ones fail with STATUS_QUOTA_EXCEEDED;
+                                // 0 on set: TOASTER_FILE_DEFAULT_PENDING_READS
+    ULONG   MaxReadLength;      // bytes one read takes at most; 0: no limit
+} TOASTER_FILE_POLICY, *PTOASTER_FILE_POLICY;
+
+typedef struct _TOASTER_FILE_INFO {
+    TOASTER_FILE_POLICY Policy;
+    ULONG   PendingReads;       // reads of the handle waiting for data
+    ULONG   Expired;            // requests of the handle that timed out, see
+                                // IOCTL_TOASTER_SET_FILE_TIMEOUTS
+    ULONG64 Reads;              // reads completed
+    ULONG64 BytesRead;
+    ULONG64 BytesLost;          // shared cursor only, see above
+    ULONG64 QuotaRejects;       // reads failed for MaxPendingReads
+    ULONG64 Lag;                // shared cursor only: bytes not read yet
+} TOASTER_FILE_INFO, *PTOASTER_FILE_INFO;
+
+//
+// IOCTL_TOASTER_WAIT_EVENTS
+//
+// Input buffer:  TOASTER_EVENT_WAIT
+// Output buffer: TOASTER_EVENTS
+//
+// Completes as soon as one of the events in Mask has happened since
+// Sequence, the value the previous wait returned (0 the first time).
+// Whatever happened in between is reported by that one completion, so a
+// consumer that keeps a wait outstanding sees every change without
+// polling, and a burst of changes costs it one wakeup. Cancel the request
+// to stop waiting.
+//
+// TOASTER_EVENT_DATA is a level rather than an event: it is reported
+// whenever a read on the handle would find data.
+//
+#define IOCTL_TOASTER_WAIT_EVENTS       TOASTER_IO_IOCTL(0x08, METHOD_BUFFERED)
+
+typedef enum _TOASTER_EVENT_TYPE {
+    ToasterEventData = 0,       // the data ring has something to read
+    ToasterEventCrispiness,     // the crispiness level changed
+    ToasterEventPower,          // D0Entry or D0Exit ran
+    ToasterEventArrival,        // the device started
+    ToasterEventMaximum
+} TOASTER_EVENT_TYPE;
+
+#define TOASTER_EVENT_DATA              (1 << ToasterEventData)
+#define TOASTER_EVENT_CRISPINESS        (1 << ToasterEventCrispiness)
+#define TOASTER_EVENT_POWER             (1 << ToasterEventPower)
+#define TOASTER_EVENT_ARRIVAL           (1 << ToasterEventArrival)
+#define TOASTER_EVENT_ALL               ((1 << ToasterEventMaximum) - 1)
+
+typedef struct _TOASTER_EVENT_WAIT {
+    ULONG   Mask;               // TOASTER_EVENT_*
+    ULONG   Reserved;
+    ULONG64 Sequence;           // TOASTER_EVENTS.Sequence of the previous wait
+} TOASTER_EVENT_WAIT, *PTOASTER_EVENT_WAIT;
+
+typedef struct _TOASTER_EVENTS {
+    ULONG64 Sequence;           // pass back in the next wait
+    ULONG   Events;             // TOASTER_EVENT_* in Mask that happened
+    ULONG   CrispinessLevel;    // state at completion
+    ULONG   SafetyLockEnabled;
+    ULONG   PowerState;         // WDF_POWER_DEVICE_STATE last entered
+    ULONG64 Readable;           // bytes a read on the handle would find
+    ULONG   Counts[ToasterEventMaximum]; // events of each type since the
+                                // device was added; not kept for
+                                // ToasterEventData
+} TOASTER_EVENTS, *PTOASTER_EVENTS;
+
+//
+// IOCTL_TOASTER_SET_FILE_TIMEOUTS
+//
+// Input buffer:  TOASTER_FILE_TIMEOUTS
+//
+// Applies to the handle it is sent on, and is answered before the request
+// is queued. A read of the handle that has to wait for data
+// (PendingReads), or an IOCTL_TOASTER_WAIT_EVENTS that has to wait for an
+// event, fails with STATUS_IO_TIMEOUT once it has been outstanding for
+// the timeout, counted from its arrival. A new handle has no timeouts:
+// its requests wait until they are satisfied or canceled.
+//
+// Requests are timed out by a periodic sweep, in batches; one may be
+// completed up to TOASTER_FILE_TIMEOUT_SLACK milliseconds late, never
+// early.
+//
+#define IOCTL_TOASTER_SET_FILE_TIMEOUTS TOASTER_IO_IOCTL_WRITE(0x09, METHOD_BUFFERED)
+
+#define TOASTER_FILE_TIMEOUT_SLACK      10          // ms
+
+typedef struct _TOASTER_FILE_TIMEOUTS {
+    ULONG   ReadTimeout;        // milliseconds, 0: none
+    ULONG   WaitTimeout;        // milliseconds, 0: none
+} TOASTER_FILE_TIMEOUTS, *PTOASTER_FILE_TIMEOUTS;
+
+#endif // _TOASTER_IOCTL_H_
@@ -0,0 +1,82 @@
+/*++
+
+Module Name:
+
+    ToasterTl.h
+
+Abstract:
+
+    TraceLogging events of the toaster stack, shared by the function driver
+    (Activity.c) and both filters.
+
+    Each driver registers a provider of its own under the same name in
+    ToasterTlProvider:
+
+        Toaster.Function         {8A53ECEA-A240-4D16-BCB8-887A3824DFF3}
+        Toaster.Filter.Generic   {B589F4D4-9CDB-433D-B1CE-5CB3E6246DB8}
+        Toaster.Filter.Sideband  {9F493899-FB8A-4ACD-A09B-FC5D31D4BE15}
+
+    The providers need no manifest; a session enables them by GUID, e.g.
+
+        tracelog -start toaster -f toaster.etl -guid #8A53ECEA-A240-4D16-BCB8-887A3824DFF3 ...
+
+    A request's events carry an activity ID, which travels with the IRP:
+    the first driver that traces an IRP without one makes one up and stores
+    it in the IRP, and the drivers below log under the same ID. A trace
+    viewer can then line up one request's start and stop in every driver
+    it went through.
+
+    Every event is behind a check of the provider's enable mask for its
+    keyword, so with no session listening an event costs a load and a
+    branch.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#if !defined(_TOASTER_TL_H_)
+#define _TOASTER_TL_H_
+
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+
+//
+// Keywords. A session picks the events it wants with its keyword mask.
+//
+#define TOASTER_TL_KEYWORD_REQUEST      0x0000000000000001ULL   // reads, writes and IOCTLs
+#define TOASTER_TL_KEYWORD_POWER        0x0000000000000002ULL   // power callbacks
+#define TOASTER_TL_KEYWORD_CONTROL      0x0000000000000004ULL   // sideband control device
+
+#define TOASTER_TL_LEVEL                WINEVENT_LEVEL_VERBOSE
+
+TRACELOGGING_DECLARE_PROVIDER(ToasterTlProvider);
+
+#define ToasterTlEnabled(_keyword_) \
+    TraceLoggingProviderEnabled(ToasterTlProvider, TOASTER_TL_LEVEL, (_keyword_))
+
+FORCEINLINE
+VOID
+ToasterTlGetActivityId(
+    _In_  PIRP      Irp,
+    _Out_ LPGUID    ActivityId
+    )
+/*++
+
+Routine Description:
+
+    Returns the activity ID of the IRP, giving it a new one if no driver
+    above (or the I/O manager, for a caller that has one) has. An IRP
+    without room for the ID keeps none; its events still carry the new ID,
+    only the drivers below make up their own.
+
+--*/
+{
+    if (!NT_SUCCESS(IoGetActivityIdIrp(Irp, ActivityId))) {
+        (VOID) EtwActivityIdControl(EVENT_ACTIVITY_CTRL_CREATE_ID, ActivityId);
+        (VOID) IoSetActivityIdIrp(Irp, ActivityId);
+    }
+}
+
+#endif // _TOASTER_TL_H_
@@ -26,6 +26,7 @@ Environment:
 #include <wmilib.h>
 #include <wmistr.h>
 #include <ToasterMof.h>
+#include "toasterio.h"
 
 //
 // This tmh is generated by the WPP Preprocessor
@@ -39,6 +40,28 @@ GetDeviceFriendlyName(
     _Out_ WDFMEMORY* DeviceName
     );
 
+static
+VOID
+ToasterWmiCacheInstanceName(
+    _In_ WDFDEVICE Device
+    );
+
+static
+NTSTATUS
+ToasterWmiRegisterSlots(
+    _In_ WDFDEVICE Device
+    );
+
+static
+NTSTATUS
+ToasterWmiRegisterEvent(
+    _In_      WDFDEVICE       Device,
+    _In_      LPCGUID         Guid,
+    _Out_opt_ WDFWMIINSTANCE* Instance
+    );
+
+EVT_WDF_WMI_PROVIDER_FUNCTION_CONTROL ToasterEvtWmiEventFunctionControl;
+
 static
 ULONG
 ToasterHelperFunction1(
@@ -61,24 +84,132 @@ ToasterHelperFunction3(
     _Out_ PULONG OutData2
     );
 
+//
+// WMI methods are dispatched through a table per class, indexed by method
+// ID. Each entry carries the fixed input and output sizes of the method,
+// so the size checks are the same few instructions for every method and a
+// new method is one table entry.
+//
+// The dispatcher is not pageable. A handler that is not pageable either,
+// and can run at DISPATCH_LEVEL, leaves out TOASTER_WMI_METHOD_PASSIVE;
+// such a method never touches a pageable code path.
+//
+typedef
+NTSTATUS
+TOASTER_WMI_METHOD_HANDLER(
+    _In_    WDFWMIINSTANCE  WmiInstance,
+    _Inout_ PVOID           Buffer
+    );
+
+typedef TOASTER_WMI_METHOD_HANDLER *PTOASTER_WMI_METHOD_HANDLER;
+
+#define TOASTER_WMI_METHOD_PASSIVE      0x00000001  // handler is pageable
+
+typedef struct _TOASTER_WMI_METHOD {
+    ULONG                       InSize;
+    ULONG                       OutSize;
+    ULONG                       Flags;
+    PTOASTER_WMI_METHOD_HANDLER Handler;
+} TOASTER_WMI_METHOD, *PTOASTER_WMI_METHOD;
+
+static
+NTSTATUS
+ToasterWmiDispatchMethod(
+    _In_reads_(MethodCount) const TOASTER_WMI_METHOD* Methods,
+    _In_    ULONG           MethodCount,
+    _In_    WDFWMIINSTANCE  WmiInstance,
+    _In_    ULONG           MethodId,
+    _In_    ULONG           InBufferSize,
+    _In_    ULONG           OutBufferSize,
+    _Inout_ PVOID           Buffer,
+    _Out_   PULONG          BufferUsed
+    );
+
+static TOASTER_WMI_METHOD_HANDLER ToasterControlMethod1;
+static TOASTER_WMI_METHOD_HANDLER ToasterControlMethod2;
+static TOASTER_WMI_METHOD_HANDLER ToasterControlMethod3;
+
+//
+// ToasterControl methods, entry n is method ID n + 1. The buffer holds the
+// input on entry and the output on return; a handler reads everything it
+// needs before it writes.
+//
+static const TOASTER_WMI_METHOD ToasterControlMethods[] = {
+    { ToasterControl1_IN_SIZE, ToasterControl1_OUT_SIZE, 0, ToasterControlMethod1 },
+    { ToasterControl2_IN_SIZE, ToasterControl2_OUT_SIZE, 0, ToasterControlMethod2 },
+    { ToasterControl3_IN_SIZE, ToasterControl3_OUT_SIZE, 0, ToasterControlMethod3 },
+};
+
+C_ASSERT(ToasterControl1 == 1);
+C_ASSERT(ToasterControl2 == 2);
+C_ASSERT(ToasterControl3 == 3);
+
+
+EVT_WDF_WMI_INSTANCE_QUERY_INSTANCE EvtWmiInstanceToasterCrispinessQueryInstance;
+EVT_WDF_WMI_INSTANCE_SET_INSTANCE   EvtWmiInstanceToasterCrispinessSetInstance;
+EVT_WDF_WMI_INSTANCE_SET_ITEM       EvtWmiInstanceToasterCrispinessSetItem;
+EVT_WDF_WMI_INSTANCE_QUERY_INSTANCE EvtWmiInstancePerfStatisticsQueryInstance;
+EVT_WDF_WMI_INSTANCE_QUERY_INSTANCE EvtWmiInstanceIdlePolicyQueryInstance;
+EVT_WDF_WMI_INSTANCE_SET_INSTANCE   EvtWmiInstanceIdlePolicySetInstance;
+EVT_WDF_WMI_INSTANCE_SET_ITEM       EvtWmiInstanceIdlePolicySetItem;
+EVT_WDF_WMI_INSTANCE_QUERY_INSTANCE EvtWmiInstancePowerStateQueryInstance;
+EVT_WDF_WMI_INSTANCE_QUERY_INSTANCE EvtWmiInstancePowerLogQueryInstance;
+EVT_WDF_WMI_INSTANCE_QUERY_INSTANCE EvtWmiInstanceInterruptModerationQueryInstance;
+EVT_WDF_WMI_INSTANCE_SET_INSTANCE   EvtWmiInstanceInterruptModerationSetInstance;
+EVT_WDF_WMI_INSTANCE_SET_ITEM       EvtWmiInstanceInterruptModerationSetItem;
+EVT_WDF_WMI_INSTANCE_QUERY_INSTANCE EvtWmiInstanceDeviceSnapshotQueryInstance;
+EVT_WDF_WMI_INSTANCE_QUERY_INSTANCE EvtWmiInstanceSlotsQueryInstance;
+EVT_WDF_WMI_INSTANCE_SET_INSTANCE   EvtWmiInstanceSlotsSetInstance;
+
 
 #define ToasterDeviceInformation_SIZE UFIELD_OFFSET(ToasterDeviceInformation, VariableData)
 
+//
+// The model name that follows the fixed part of ToasterDeviceInformation,
+// and the size of the whole block: the counted string is a USHORT length
+// followed by the string, terminator included.
+//
+#define TOASTER_WMI_MODEL_NAME          L"Aishwarya"
+
+#define ToasterDeviceInformation_BLOCK_SIZE \
+    (ToasterDeviceInformation_SIZE + sizeof(USHORT) + sizeof(TOASTER_WMI_MODEL_NAME))
+
+//
+// Size of a ToasterSlots block of _count_ slots.
+//
+#define ToasterSlots_BLOCK_SIZE(_count_) \
+    (UFIELD_OFFSET(ToasterSlots, Slots) + (_count_) * sizeof(ToasterSlot))
+
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ToasterDeviceInformation, ToasterWmiGetData)
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ToasterControl, ToasterWmiGetControlData)
 
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, ToasterWmiRegistration)
+#pragma alloc_text(PAGE, ToasterWmiCacheInstanceName)
+#pragma alloc_text(PAGE, ToasterWmiRegisterSlots)
+#pragma alloc_text(PAGE, ToasterWmiRegisterEvent)
+#pragma alloc_text(PAGE, ToasterEvtWmiEventFunctionControl)
 #pragma alloc_text(PAGE, EvtWmiInstanceStdDeviceDataQueryInstance)
 #pragma alloc_text(PAGE, EvtWmiInstanceStdDeviceDataSetInstance)
 #pragma alloc_text(PAGE, EvtWmiInstanceStdDeviceDataSetItem)
 #pragma alloc_text(PAGE, EvtWmiInstanceToasterControlQueryInstance)
-#pragma alloc_text(PAGE, EvtWmiInstanceToasterControlExecuteMethod)
 #pragma alloc_text(PAGE, EvtWmiInstanceToasterControlSetInstance)
-#pragma alloc_text(PAGE, ToasterHelperFunction1)
-#pragma alloc_text(PAGE, ToasterHelperFunction2)
-#pragma alloc_text(PAGE, ToasterHelperFunction3)
+#pragma alloc_text(PAGE, EvtWmiInstanceToasterCrispinessQueryInstance)
+#pragma alloc_text(PAGE, EvtWmiInstanceToasterCrispinessSetInstance)
+#pragma alloc_text(PAGE, EvtWmiInstanceToasterCrispinessSetItem)
+#pragma alloc_text(PAGE, EvtWmiInstancePerfStatisticsQueryInstance)
+#pragma alloc_text(PAGE, EvtWmiInstanceIdlePolicyQueryInstance)
+#pragma alloc_text(PAGE, EvtWmiInstanceIdlePolicySetInstance)
+#pragma alloc_text(PAGE, EvtWmiInstanceIdlePolicySetItem)
+#pragma alloc_text(PAGE, EvtWmiInstanceInterruptModerationQueryInstance)
+#pragma alloc_text(PAGE, EvtWmiInstanceInterruptModerationSetInstance)
+#pragma alloc_text(PAGE, EvtWmiInstanceInterruptModerationSetItem)
+#pragma alloc_text(PAGE, EvtWmiInstancePowerStateQueryInstance)
+#pragma alloc_text(PAGE, EvtWmiInstancePowerLogQueryInstance)
+#pragma alloc_text(PAGE, EvtWmiInstanceDeviceSnapshotQueryInstance)
+#pragma alloc_text(PAGE, EvtWmiInstanceSlotsQueryInstance)
+#pragma alloc_text(PAGE, EvtWmiInstanceSlotsSetInstance)
 #endif
 
 //
@@ -87,7 +218,7 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ToasterControl, ToasterWmiGetControlData)
 
 extern ULONG DebugLevel;
 
-//在ToasterEvtDeviceAdd的最后被调用
+//被ToasterStartEvtWorkItem调用，设备第一次启动以后
 NTSTATUS
 ToasterWmiRegistration(
     _In_ WDFDEVICE Device
@@ -98,6 +229,8 @@ ToasterWmiRegistration(
 Routine Description
 
     Registers with WMI as a data provider for this instance of the device.
+    Runs once, from the work item of the first start rather than from
+    EvtDeviceAdd, see Start.c.
 
 Arguments:
 
@@ -114,6 +247,7 @@ Return Value:
 {
     NTSTATUS status;
     PFDO_DATA fdoData;
+    PFDO_IO_DATA ioData;
     PToasterDeviceInformation pData;
     PToasterControl controlData;
 
@@ -126,6 +260,7 @@ Return Value:
     PAGED_CODE();
 
     fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
 
     //
     // Register the MOF resource names of any customized WMI data providers
@@ -205,31 +340,141 @@ Return Value:
     pData->Controls = 5;
     pData->DebugPrintLevel = DebugLevel;
 
+    ioData->DeviceInformationInstance = instance;
+
 	//-------------------------------------------------------------------------------
 	//
 	//-------------------------------------------------------------------------------
 
-    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &TOASTER_NOTIFY_DEVICE_ARRIVAL_EVENT);
-    providerConfig.Flags = WdfWmiProviderEventOnly;
+    //
+    // Event blocks. The instance name is the same for every event the device
+    // fires, so look it up once here rather than on every event.
+    //
+    ToasterWmiCacheInstanceName(Device);
+
+    status = ToasterWmiRegisterEvent(Device,
+                                     &TOASTER_NOTIFY_DEVICE_ARRIVAL_EVENT,
+                                     &fdoData->WmiDeviceArrivalEvent);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+	//-------------------------------------------------------------------------------
+	//
+	//-------------------------------------------------------------------------------
+
+	//
+    // Register the Toaster Control class.
+    //
+
+    //
+    // Initialize the config structures for the Provider and the Instance and
+    // define event callback functions that support a WMI client's request to
+    // access the driver's WMI data blocks.
+    //
+
+	//provider只创建1个实例的情况，需要WDF_WMI_PROVIDER_CONFIG结构来描述the WMI data provider
+    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &ToasterControl_GUID);
 
     //
     // Specify minimum expected buffer size for query and set instance requests.
-    // Since the query block size is different than the set block size, set it
-    // to zero and manually check for the buffer size for each operation.
     //
-    providerConfig.MinInstanceBufferSize = 0;
+    providerConfig.MinInstanceBufferSize = ToasterControl_SIZE;
 
+    //
+    // The WDFWMIPROVIDER handle is needed if multiple instances for the provider
+    // has to be created or if the instances have to be created sometime after
+    // the provider is created. In case below, the provider handle is not needed
+    // because only one instance is needed and can be created when the provider
+    // is created.
+    //
     WDF_WMI_INSTANCE_CONFIG_INIT_PROVIDER_CONFIG(&instanceConfig, &providerConfig);
-    instanceConfig.Register = TRUE;//registers the provider instance synchronously
+
+    //
+    // Create the Provider object as part of the Instance creation call by setting
+    // the Register value in the Instance Config to TRUE. This eliminates the
+    // need to call WdfWmiProviderRegister.
+    //
+    instanceConfig.Register = TRUE; //registers the provider instance synchronously
+
+    instanceConfig.EvtWmiInstanceQueryInstance = EvtWmiInstanceToasterControlQueryInstance;
+    instanceConfig.EvtWmiInstanceSetInstance   = EvtWmiInstanceToasterControlSetInstance;
+    instanceConfig.EvtWmiInstanceSetItem       = EvtWmiInstanceToasterControlSetItem;
+    instanceConfig.EvtWmiInstanceExecuteMethod = EvtWmiInstanceToasterControlExecuteMethod;
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&woa, ToasterControl);
 
     //
     // Create the WMI instance object for this data block.
     //
+    status = WdfWmiInstanceCreate(Device,
+                                  &instanceConfig,
+                                  &woa,
+                                  &instance);
+    if (!NT_SUCCESS(status)) {
+
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "[Toaster] Status = 0x%08x, WdfWmiInstanceCreate failed\n",
+                            status);
+        return status;
+    }
+
+	//因为WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ToasterControl, ToasterWmiGetControlData)
+    controlData = ToasterWmiGetControlData(instance);
+    controlData->ControlValue = 25;
+
+    ioData->ControlInstance = instance;
+
+	//-------------------------------------------------------------------------------
+	//
+	//-------------------------------------------------------------------------------
+
+    //
+    // Register the Toaster Crispiness class. The block has no storage of its
+    // own; queries are answered from the cache in FDO_IO_DATA (see bus.c).
+    //
+    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &ToasterCrispiness_GUID);
+    providerConfig.MinInstanceBufferSize = ToasterCrispiness_SIZE;
+
+    WDF_WMI_INSTANCE_CONFIG_INIT_PROVIDER_CONFIG(&instanceConfig, &providerConfig);
+    instanceConfig.Register = TRUE;
+
+    instanceConfig.EvtWmiInstanceQueryInstance = EvtWmiInstanceToasterCrispinessQueryInstance;
+    instanceConfig.EvtWmiInstanceSetInstance   = EvtWmiInstanceToasterCrispinessSetInstance;
+    instanceConfig.EvtWmiInstanceSetItem       = EvtWmiInstanceToasterCrispinessSetItem;
+
     status = WdfWmiInstanceCreate(Device,
                                   &instanceConfig,
                                   WDF_NO_OBJECT_ATTRIBUTES,
-                                  &fdoData->WmiDeviceArrivalEvent);
+                                  WDF_NO_HANDLE);
+    if (!NT_SUCCESS(status)) {
+
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "[Toaster] Status = 0x%08x, WdfWmiInstanceCreate failed\n",
+                            status);
+        return status;
+    }
+
+	//-------------------------------------------------------------------------------
+	//
+	//-------------------------------------------------------------------------------
+
+    //
+    // Register the Toaster Perf Statistics class. Read only; every query
+    // sums the per-processor counters in FDO_IO_DATA (see stats.c).
+    //
+    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &ToasterPerfStatistics_GUID);
+    providerConfig.MinInstanceBufferSize = ToasterPerfStatistics_SIZE;
+
+    WDF_WMI_INSTANCE_CONFIG_INIT_PROVIDER_CONFIG(&instanceConfig, &providerConfig);
+    instanceConfig.Register = TRUE;
+
+    instanceConfig.EvtWmiInstanceQueryInstance = EvtWmiInstancePerfStatisticsQueryInstance;
 
+    status = WdfWmiInstanceCreate(Device,
+                                  &instanceConfig,
+                                  WDF_NO_OBJECT_ATTRIBUTES,
+                                  WDF_NO_HANDLE);
     if (!NT_SUCCESS(status)) {
 
         WppPrintDeviceError(fdoData->WppRecorderLog,
@@ -242,54 +487,1000 @@ Return Value:
 	//
 	//-------------------------------------------------------------------------------
 
+    //
+    // Register the Toaster Idle Policy class. The policy lives in
+    // FDO_IO_DATA (see idle.c).
+    //
+    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &ToasterIdlePolicy_GUID);
+    providerConfig.MinInstanceBufferSize = ToasterIdlePolicy_SIZE;
+
+    WDF_WMI_INSTANCE_CONFIG_INIT_PROVIDER_CONFIG(&instanceConfig, &providerConfig);
+    instanceConfig.Register = TRUE;
+
+    instanceConfig.EvtWmiInstanceQueryInstance = EvtWmiInstanceIdlePolicyQueryInstance;
+    instanceConfig.EvtWmiInstanceSetInstance   = EvtWmiInstanceIdlePolicySetInstance;
+    instanceConfig.EvtWmiInstanceSetItem       = EvtWmiInstanceIdlePolicySetItem;
+
+    status = WdfWmiInstanceCreate(Device,
+                                  &instanceConfig,
+                                  WDF_NO_OBJECT_ATTRIBUTES,
+                                  WDF_NO_HANDLE);
+    if (!NT_SUCCESS(status)) {
+
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "[Toaster] Status = 0x%08x, WdfWmiInstanceCreate failed\n",
+                            status);
+        return status;
+    }
+
+	//-------------------------------------------------------------------------------
 	//
-    // Register the Toaster Control class.
+	//-------------------------------------------------------------------------------
+
+    //
+    // Register the Toaster Power State class. Read only; the save/restore
+    // counters and transition times live in FDO_IO_DATA (see state.c).
     //
+    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &ToasterPowerState_GUID);
+    providerConfig.MinInstanceBufferSize = ToasterPowerState_SIZE;
+
+    WDF_WMI_INSTANCE_CONFIG_INIT_PROVIDER_CONFIG(&instanceConfig, &providerConfig);
+    instanceConfig.Register = TRUE;
+
+    instanceConfig.EvtWmiInstanceQueryInstance = EvtWmiInstancePowerStateQueryInstance;
+
+    status = WdfWmiInstanceCreate(Device,
+                                  &instanceConfig,
+                                  WDF_NO_OBJECT_ATTRIBUTES,
+                                  WDF_NO_HANDLE);
+    if (!NT_SUCCESS(status)) {
+
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "[Toaster] Status = 0x%08x, WdfWmiInstanceCreate failed\n",
+                            status);
+        return status;
+    }
+
+	//-------------------------------------------------------------------------------
+	//
+	//-------------------------------------------------------------------------------
 
     //
-    // Initialize the config structures for the Provider and the Instance and
-    // define event callback functions that support a WMI client's request to
-    // access the driver's WMI data blocks.
+    // Register the Toaster Power Log class. Read only; the power callback
+    // history lives in FDO_IO_DATA (see power.c).
     //
+    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &ToasterPowerLog_GUID);
+    providerConfig.MinInstanceBufferSize = ToasterPowerLog_SIZE;
 
-	//provider只创建1个实例的情况，需要WDF_WMI_PROVIDER_CONFIG结构来描述the WMI data provider
-    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &ToasterControl_GUID);
+    WDF_WMI_INSTANCE_CONFIG_INIT_PROVIDER_CONFIG(&instanceConfig, &providerConfig);
+    instanceConfig.Register = TRUE;
+
+    instanceConfig.EvtWmiInstanceQueryInstance = EvtWmiInstancePowerLogQueryInstance;
+
+    status = WdfWmiInstanceCreate(Device,
+                                  &instanceConfig,
+                                  WDF_NO_OBJECT_ATTRIBUTES,
+                                  WDF_NO_HANDLE);
+    if (!NT_SUCCESS(status)) {
+
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "[Toaster] Status = 0x%08x, WdfWmiInstanceCreate failed\n",
+                            status);
+        return status;
+    }
+
+	//-------------------------------------------------------------------------------
+	//
+	//-------------------------------------------------------------------------------
 
     //
-    // Specify minimum expected buffer size for query and set instance requests.
+    // Register the Toaster Interrupt Moderation class. The settings live in
+    // FDO_IO_DATA (see interrupt.c) and can be changed on any toaster; only
+    // a hardware toaster uses them.
     //
-    providerConfig.MinInstanceBufferSize = ToasterControl_SIZE;
+    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &ToasterInterruptModeration_GUID);
+    providerConfig.MinInstanceBufferSize = ToasterInterruptModeration_SIZE;
+
+    WDF_WMI_INSTANCE_CONFIG_INIT_PROVIDER_CONFIG(&instanceConfig, &providerConfig);
+    instanceConfig.Register = TRUE;
+
+    instanceConfig.EvtWmiInstanceQueryInstance = EvtWmiInstanceInterruptModerationQueryInstance;
+    instanceConfig.EvtWmiInstanceSetInstance   = EvtWmiInstanceInterruptModerationSetInstance;
+    instanceConfig.EvtWmiInstanceSetItem       = EvtWmiInstanceInterruptModerationSetItem;
+
+    status = WdfWmiInstanceCreate(Device,
+                                  &instanceConfig,
+                                  WDF_NO_OBJECT_ATTRIBUTES,
+                                  WDF_NO_HANDLE);
+    if (!NT_SUCCESS(status)) {
+
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "[Toaster] Status = 0x%08x, WdfWmiInstanceCreate failed\n",
+                            status);
+        return status;
+    }
+
+	//-------------------------------------------------------------------------------
+	//
+	//-------------------------------------------------------------------------------
 
     //
-    // The WDFWMIPROVIDER handle is needed if multiple instances for the provider
-    // has to be created or if the instances have to be created sometime after
-    // the provider is created. In case below, the provider handle is not needed
-    // because only one instance is needed and can be created when the provider
-    // is created.
+    // Register the Toaster Device Snapshot class. Read only; it copies the
+    // storage of the blocks above, so it must be registered after them.
+    // Its size is fixed, so the framework rejects short buffers without
+    // calling the driver.
     //
+    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &ToasterDeviceSnapshot_GUID);
+    providerConfig.MinInstanceBufferSize = ToasterDeviceSnapshot_SIZE;
+
     WDF_WMI_INSTANCE_CONFIG_INIT_PROVIDER_CONFIG(&instanceConfig, &providerConfig);
+    instanceConfig.Register = TRUE;
+
+    instanceConfig.EvtWmiInstanceQueryInstance = EvtWmiInstanceDeviceSnapshotQueryInstance;
+
+    status = WdfWmiInstanceCreate(Device,
+                                  &instanceConfig,
+                                  WDF_NO_OBJECT_ATTRIBUTES,
+                                  WDF_NO_HANDLE);
+    if (!NT_SUCCESS(status)) {
+
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "[Toaster] Status = 0x%08x, WdfWmiInstanceCreate failed\n",
+                            status);
+        return status;
+    }
+
+	//-------------------------------------------------------------------------------
+	//
+	//-------------------------------------------------------------------------------
+
+    //
+    // Register the Toaster Slots class, on a multi-slot toaster only.
+    //
+    status = ToasterWmiRegisterSlots(Device);
+
+    return status;
+}
+
+//被ToasterWmiRegistration调用
+NTSTATUS
+ToasterWmiRegisterSlots(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Allocates the slot array of a multi-slot toaster and registers the
+    ToasterSlots block over it.
+
+    All slots are one instance of one block, not an instance per slot.
+    The framework creates a WDFWMIINSTANCE and a registration entry for
+    every instance, so an instance per slot would make device start grow
+    with the slot count; this way start does the same work for two slots
+    as for a thousand, and a query of all data is one copy of the array.
+
+    The slot count is read from the device's hardware key. A device whose
+    INF does not set it has no slots and no ToasterSlots block.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_DATA               fdoData;
+    PFDO_IO_DATA            ioData;
+    WDFKEY                  key;
+    WDFMEMORY               memory;
+    ULONG                   count = 0;
+    ULONG                   i;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    WDF_WMI_PROVIDER_CONFIG providerConfig;
+    WDF_WMI_INSTANCE_CONFIG instanceConfig;
+    DECLARE_CONST_UNICODE_STRING(slotCountName, TOASTER_REG_SLOT_COUNT);
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    ioData = ToasterFdoGetIoData(Device);
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+    if (NT_SUCCESS(status)) {
+        status = WdfRegistryQueryULong(key, &slotCountName, &count);
+        WdfRegistryClose(key);
+    }
+
+    if (!NT_SUCCESS(status) || count == 0) {
+        return STATUS_SUCCESS;
+    }
+
+    if (count > TOASTER_MAX_SLOTS) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "%d slots configured, only %d are served\n",
+                            count,
+                            TOASTER_MAX_SLOTS);
+        count = TOASTER_MAX_SLOTS;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfMemoryCreate(&attributes,
+                             NonPagedPoolNx,
+                             TOASTER_POOL_TAG,
+                             count * sizeof(ToasterSlot),
+                             &memory,
+                             (PVOID*) &ioData->Slots);
+    if (!NT_SUCCESS(status)) {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "WdfMemoryCreate for %d slots failed %x\n",
+                            count,
+                            status);
+        ioData->Slots = NULL;
+        return status;
+    }
+
+    for (i = 0; i < count; i++) {
+        ioData->Slots[i].SlotNumber = i;
+        ioData->Slots[i].Capacity = 2000;
+        ioData->Slots[i].ControlValue = 25;
+        ioData->Slots[i].ErrorCount = 0;
+    }
+
+    ioData->SlotCount = count;
+
+    //
+    // The block size depends only on the slot count, so the framework
+    // rejects short query and set buffers without calling the driver.
+    //
+    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, &ToasterSlots_GUID);
+    providerConfig.MinInstanceBufferSize = ToasterSlots_BLOCK_SIZE(count);
+
+    WDF_WMI_INSTANCE_CONFIG_INIT_PROVIDER_CONFIG(&instanceConfig, &providerConfig);
+    instanceConfig.Register = TRUE;
+
+    instanceConfig.EvtWmiInstanceQueryInstance = EvtWmiInstanceSlotsQueryInstance;
+    instanceConfig.EvtWmiInstanceSetInstance   = EvtWmiInstanceSlotsSetInstance;
+
+    status = WdfWmiInstanceCreate(Device,
+                                  &instanceConfig,
+                                  WDF_NO_OBJECT_ATTRIBUTES,
+                                  WDF_NO_HANDLE);
+    if (!NT_SUCCESS(status)) {
+
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "[Toaster] Status = 0x%08x, WdfWmiInstanceCreate failed\n",
+                            status);
+        return status;
+    }
+
+    WppPrintDevice(fdoData->WppRecorderLog,
+                   "Serving %d slots through one WMI instance\n",
+                   count);
+
+    return status;
+}
+
+//
+// WMI System Call back functions
+//
+
+NTSTATUS
+EvtWmiInstanceStdDeviceDataQueryInstance(
+    _In_  WDFWMIINSTANCE WmiInstance,
+    _In_  ULONG OutBufferSize,
+    _Out_writes_bytes_to_(OutBufferSize, *BufferUsed) PVOID OutBuffer,
+    _Out_ PULONG BufferUsed
+    )
+{
+    PUCHAR          pBuf;
+    ULONG           size;
+    UNICODE_STRING  string;
+    NTSTATUS        status;
+
+    PAGED_CODE();
+
+    //
+    // The terminator is part of the counted string.
+    //
+    string.Buffer = TOASTER_WMI_MODEL_NAME;
+    string.Length = sizeof(TOASTER_WMI_MODEL_NAME);
+    string.MaximumLength = sizeof(TOASTER_WMI_MODEL_NAME);
+
+    size = ToasterDeviceInformation_BLOCK_SIZE;
+
+    *BufferUsed = size;
+
+    if (OutBufferSize < size) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    pBuf = (PUCHAR) OutBuffer;
+
+    //
+    // ErrorCount is kept by the I/O paths; pick up the current total.
+    //
+    ToasterWmiGetData(WmiInstance)->ErrorCount =
+        (ULONG) ToasterStatsGetErrorCount(WdfWmiInstanceGetDevice(WmiInstance));
+
+    //
+    // Copy the structure information
+    //
+    RtlCopyMemory(pBuf,
+                  ToasterWmiGetData(WmiInstance),
+                  ToasterDeviceInformation_SIZE);
+
+    pBuf += ToasterDeviceInformation_SIZE;
+
+    //
+    // Copy the string. Put length of string ahead of string.
+    //
+    status = WDF_WMI_BUFFER_APPEND_STRING(pBuf,
+                                          size - ToasterDeviceInformation_SIZE,
+                                          &string,
+                                          &size);
+
+    return status;
+}
+
+
+NTSTATUS
+EvtWmiInstanceStdDeviceDataSetInstance(
+    _In_ WDFWMIINSTANCE WmiInstance,
+    _In_ ULONG InBufferSize,
+    _In_reads_bytes_(InBufferSize) PVOID InBuffer
+    )
+{
+    PAGED_CODE();
+
+    if (InBufferSize < ToasterDeviceInformation_SIZE) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    //
+    // We will update only writable elements.
+    //
+    DebugLevel = ToasterWmiGetData(WmiInstance)->DebugPrintLevel =
+        ((PToasterDeviceInformation)InBuffer)->DebugPrintLevel;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+EvtWmiInstanceStdDeviceDataSetItem(
+    _In_ WDFWMIINSTANCE WmiInstance,
+    _In_ ULONG DataItemId,
+    _In_ ULONG InBufferSize,
+    _In_reads_bytes_(InBufferSize) PVOID InBuffer
+    )
+{
+    PAGED_CODE();
+
+    if (DataItemId == ToasterDeviceInformation_DebugPrintLevel_ID) {
+        if (InBufferSize < sizeof(ULONG)) {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        DebugLevel = ToasterWmiGetData(WmiInstance)->DebugPrintLevel =
+            *((PULONG)InBuffer);
+
+        return STATUS_SUCCESS;
+
+    } else {
+        return STATUS_WMI_READ_ONLY;
+    }
+}
+
+NTSTATUS
+EvtWmiInstanceToasterCrispinessQueryInstance(
+    _In_  WDFWMIINSTANCE WmiInstance,
+    _In_  ULONG OutBufferSize,
+    _Out_writes_bytes_to_(OutBufferSize, *BufferUsed) PVOID OutBuffer,
+    _Out_ PULONG BufferUsed
+    )
+{
+    WDFDEVICE           device;
+    PToasterCrispiness  crispiness;
+    UCHAR               level;
+    BOOLEAN             safetyLock;
+    NTSTATUS            status;
+
+    UNREFERENCED_PARAMETER(OutBufferSize);
+
+    PAGED_CODE();
+
+    device = WdfWmiInstanceGetDevice(WmiInstance);
+
+    status = ToasterGetCrispiness(device, &level);
+    if (!NT_SUCCESS(status)) {
+        *BufferUsed = 0;
+        return status;
+    }
+
+    (VOID) ToasterGetSafetyLock(device, &safetyLock);
+
+    //
+    // The framework has already checked OutBufferSize against
+    // MinInstanceBufferSize.
+    //
+    crispiness = (PToasterCrispiness) OutBuffer;
+    crispiness->CrispinessLevel = level;
+    crispiness->SafetyLockEnabled = safetyLock;
+
+    *BufferUsed = ToasterCrispiness_SIZE;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EvtWmiInstanceToasterCrispinessSetInstance(
+    _In_ WDFWMIINSTANCE WmiInstance,
+    _In_ ULONG InBufferSize,
+    _In_reads_bytes_(InBufferSize) PVOID InBuffer
+    )
+{
+    ULONG level;
+
+    UNREFERENCED_PARAMETER(InBufferSize);
+
+    PAGED_CODE();
+
+    //
+    // We will update only writable elements.
+    //
+    level = ((PToasterCrispiness) InBuffer)->CrispinessLevel;
+    if (level > MAXUCHAR) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return ToasterSetCrispiness(WdfWmiInstanceGetDevice(WmiInstance), (UCHAR) level);
+}
+
+NTSTATUS
+EvtWmiInstanceToasterCrispinessSetItem(
+    _In_ WDFWMIINSTANCE WmiInstance,
+    _In_ ULONG DataItemId,
+    _In_ ULONG InBufferSize,
+    _In_reads_bytes_(InBufferSize) PVOID InBuffer
+    )
+{
+    ULONG level;
+
+    PAGED_CODE();
+
+    if (DataItemId != ToasterCrispiness_CrispinessLevel_ID) {
+        return STATUS_WMI_READ_ONLY;
+    }
+
+    if (InBufferSize < ToasterCrispiness_CrispinessLevel_SIZE) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    level = *((PULONG) InBuffer);
+    if (level > MAXUCHAR) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return ToasterSetCrispiness(WdfWmiInstanceGetDevice(WmiInstance), (UCHAR) level);
+}
+
+NTSTATUS
+EvtWmiInstancePerfStatisticsQueryInstance(
+    _In_  WDFWMIINSTANCE WmiInstance,
+    _In_  ULONG OutBufferSize,
+    _Out_writes_bytes_to_(OutBufferSize, *BufferUsed) PVOID OutBuffer,
+    _Out_ PULONG BufferUsed
+    )
+{
+    UNREFERENCED_PARAMETER(OutBufferSize);
+
+    PAGED_CODE();
+
+    //
+    // The framework has already checked OutBufferSize against
+    // MinInstanceBufferSize.
+    //
+    ToasterStatsQuery(WdfWmiInstanceGetDevice(WmiInstance),
+                      (PToasterPerfStatistics) OutBuffer);
+
+    *BufferUsed = ToasterPerfStatistics_SIZE;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EvtWmiInstanceIdlePolicyQueryInstance(
+    _In_  WDFWMIINSTANCE WmiInstance,
+    _In_  ULONG OutBufferSize,
+    _Out_writes_bytes_to_(OutBufferSize, *BufferUsed) PVOID OutBuffer,
+    _Out_ PULONG BufferUsed
+    )
+{
+    UNREFERENCED_PARAMETER(OutBufferSize);
+
+    PAGED_CODE();
+
+    //
+    // The framework has already checked OutBufferSize against
+    // MinInstanceBufferSize.
+    //
+    ToasterIdleQuery(WdfWmiInstanceGetDevice(WmiInstance),
+                     (PToasterIdlePolicy) OutBuffer);
+
+    *BufferUsed = ToasterIdlePolicy_SIZE;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EvtWmiInstancePowerStateQueryInstance(
+    _In_  WDFWMIINSTANCE WmiInstance,
+    _In_  ULONG OutBufferSize,
+    _Out_writes_bytes_to_(OutBufferSize, *BufferUsed) PVOID OutBuffer,
+    _Out_ PULONG BufferUsed
+    )
+{
+    UNREFERENCED_PARAMETER(OutBufferSize);
+
+    PAGED_CODE();
+
+    //
+    // The framework has already checked OutBufferSize against
+    // MinInstanceBufferSize.
+    //
+    ToasterStateQuery(WdfWmiInstanceGetDevice(WmiInstance),
+                      (PToasterPowerState) OutBuffer);
+
+    ToasterStartQuery(WdfWmiInstanceGetDevice(WmiInstance),
+                      (PToasterPowerState) OutBuffer);
+
+    *BufferUsed = ToasterPowerState_SIZE;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EvtWmiInstancePowerLogQueryInstance(
+    _In_  WDFWMIINSTANCE WmiInstance,
+    _In_  ULONG OutBufferSize,
+    _Out_writes_bytes_to_(OutBufferSize, *BufferUsed) PVOID OutBuffer,
+    _Out_ PULONG BufferUsed
+    )
+{
+    UNREFERENCED_PARAMETER(OutBufferSize);
+
+    PAGED_CODE();
+
+    //
+    // The framework has already checked OutBufferSize against
+    // MinInstanceBufferSize.
+    //
+    ToasterPowerLogQuery(WdfWmiInstanceGetDevice(WmiInstance),
+                         (PToasterPowerLog) OutBuffer);
+
+    *BufferUsed = ToasterPowerLog_SIZE;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EvtWmiInstanceInterruptModerationQueryInstance(
+    _In_  WDFWMIINSTANCE WmiInstance,
+    _In_  ULONG OutBufferSize,
+    _Out_writes_bytes_to_(OutBufferSize, *BufferUsed) PVOID OutBuffer,
+    _Out_ PULONG BufferUsed
+    )
+{
+    UNREFERENCED_PARAMETER(OutBufferSize);
+
+    PAGED_CODE();
+
+    //
+    // The framework has already checked OutBufferSize against
+    // MinInstanceBufferSize.
+    //
+    ToasterHwQueryModeration(WdfWmiInstanceGetDevice(WmiInstance),
+                             (PToasterInterruptModeration) OutBuffer);
+
+    *BufferUsed = ToasterInterruptModeration_SIZE;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EvtWmiInstanceDeviceSnapshotQueryInstance(
+    _In_  WDFWMIINSTANCE WmiInstance,
+    _In_  ULONG OutBufferSize,
+    _Out_writes_bytes_to_(OutBufferSize, *BufferUsed) PVOID OutBuffer,
+    _Out_ PULONG BufferUsed
+    )
+/*++
+
+Routine Description:
+
+    Fills in ToasterDeviceSnapshot in one pass, so that a monitoring agent
+    gets in a single round trip what otherwise takes a query per block.
+    The counters are read without stopping the I/O paths, the same as
+    ToasterPerfStatistics.
+
+--*/
+{
+    WDFDEVICE               device;
+    PFDO_IO_DATA            ioData;
+    PToasterDeviceSnapshot  snapshot;
+    PToasterDeviceInformation information;
+    UCHAR                   level;
+    BOOLEAN                 safetyLock;
+
+    UNREFERENCED_PARAMETER(OutBufferSize);
+
+    PAGED_CODE();
+
+    device = WdfWmiInstanceGetDevice(WmiInstance);
+    ioData = ToasterFdoGetIoData(device);
+
+    //
+    // The framework has already checked OutBufferSize against
+    // MinInstanceBufferSize.
+    //
+    snapshot = (PToasterDeviceSnapshot) OutBuffer;
+    RtlZeroMemory(snapshot, ToasterDeviceSnapshot_SIZE);
+
+    snapshot->Version = TOASTER_SNAPSHOT_VERSION;
+    snapshot->Size = ToasterDeviceSnapshot_SIZE;
+
+    information = ToasterWmiGetData(ioData->DeviceInformationInstance);
+
+    snapshot->ConnectorType = information->ConnectorType;
+    snapshot->Capacity = information->Capacity;
+    snapshot->ErrorCount = (ULONG) ToasterStatsGetErrorCount(device);
+    snapshot->Controls = information->Controls;
+    snapshot->DebugPrintLevel = information->DebugPrintLevel;
+
+    snapshot->ControlValue = ToasterWmiGetControlData(ioData->ControlInstance)->ControlValue;
+
+    if (NT_SUCCESS(ToasterGetCrispiness(device, &level))) {
+        (VOID) ToasterGetSafetyLock(device, &safetyLock);
+        snapshot->CrispinessLevel = level;
+        snapshot->SafetyLockEnabled = safetyLock;
+    }
+
+    ToasterStatsQueryTotals(device, snapshot);
+
+    *BufferUsed = ToasterDeviceSnapshot_SIZE;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EvtWmiInstanceSlotsQueryInstance(
+    _In_  WDFWMIINSTANCE WmiInstance,
+    _In_  ULONG OutBufferSize,
+    _Out_writes_bytes_to_(OutBufferSize, *BufferUsed) PVOID OutBuffer,
+    _Out_ PULONG BufferUsed
+    )
+{
+    PFDO_IO_DATA    ioData;
+    PToasterSlots   slots;
+
+    UNREFERENCED_PARAMETER(OutBufferSize);
+
+    PAGED_CODE();
+
+    ioData = ToasterFdoGetIoData(WdfWmiInstanceGetDevice(WmiInstance));
+
+    //
+    // The framework has already checked OutBufferSize against
+    // MinInstanceBufferSize. The array is kept in the block layout.
+    //
+    slots = (PToasterSlots) OutBuffer;
+    slots->SlotCount = ioData->SlotCount;
+
+    RtlCopyMemory(slots->Slots,
+                  ioData->Slots,
+                  ioData->SlotCount * sizeof(ToasterSlot));
+
+    *BufferUsed = ToasterSlots_BLOCK_SIZE(ioData->SlotCount);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EvtWmiInstanceSlotsSetInstance(
+    _In_ WDFWMIINSTANCE WmiInstance,
+    _In_ ULONG InBufferSize,
+    _In_reads_bytes_(InBufferSize) PVOID InBuffer
+    )
+/*++
+
+Routine Description:
+
+    Updates ControlValue of every slot. The caller sends back the whole
+    block, normally as it was queried; the slot count must match.
+
+--*/
+{
+    PFDO_IO_DATA    ioData;
+    PToasterSlots   slots;
+    ULONG           i;
+
+    UNREFERENCED_PARAMETER(InBufferSize);
+
+    PAGED_CODE();
+
+    ioData = ToasterFdoGetIoData(WdfWmiInstanceGetDevice(WmiInstance));
+    slots = (PToasterSlots) InBuffer;
+
+    if (slots->SlotCount != ioData->SlotCount) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < ioData->SlotCount; i++) {
+        ioData->Slots[i].ControlValue = slots->Slots[i].ControlValue;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EvtWmiInstanceIdlePolicySetInstance(
+    _In_ WDFWMIINSTANCE WmiInstance,
+    _In_ ULONG InBufferSize,
+    _In_reads_bytes_(InBufferSize) PVOID InBuffer
+    )
+{
+    UNREFERENCED_PARAMETER(InBufferSize);
+
+    PAGED_CODE();
+
+    //
+    // Only the writable elements are taken from InBuffer.
+    //
+    return ToasterIdleSetPolicy(WdfWmiInstanceGetDevice(WmiInstance),
+                                (PToasterIdlePolicy) InBuffer);
+}
+
+NTSTATUS
+EvtWmiInstanceIdlePolicySetItem(
+    _In_ WDFWMIINSTANCE WmiInstance,
+    _In_ ULONG DataItemId,
+    _In_ ULONG InBufferSize,
+    _In_reads_bytes_(InBufferSize) PVOID InBuffer
+    )
+{
+    WDFDEVICE           device;
+    ToasterIdlePolicy   policy;
+    PULONG              item;
+
+    PAGED_CODE();
+
+    device = WdfWmiInstanceGetDevice(WmiInstance);
+
+    ToasterIdleQuery(device, &policy);
+
+    switch (DataItemId) {
+    case ToasterIdlePolicy_Enabled_ID:
+        item = &policy.Enabled;
+        break;
+    case ToasterIdlePolicy_MinimumIdleTimeout_ID:
+        item = &policy.MinimumIdleTimeout;
+        break;
+    case ToasterIdlePolicy_MaximumIdleTimeout_ID:
+        item = &policy.MaximumIdleTimeout;
+        break;
+    case ToasterIdlePolicy_Percentile_ID:
+        item = &policy.Percentile;
+        break;
+    default:
+        return STATUS_WMI_READ_ONLY;
+    }
+
+    if (InBufferSize < sizeof(ULONG)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *item = *((PULONG) InBuffer);
+
+    return ToasterIdleSetPolicy(device, &policy);
+}
+
+NTSTATUS
+EvtWmiInstanceInterruptModerationSetInstance(
+    _In_ WDFWMIINSTANCE WmiInstance,
+    _In_ ULONG InBufferSize,
+    _In_reads_bytes_(InBufferSize) PVOID InBuffer
+    )
+{
+    UNREFERENCED_PARAMETER(InBufferSize);
+
+    PAGED_CODE();
+
+    //
+    // Only the writable elements are taken from InBuffer.
+    //
+    return ToasterHwSetModeration(WdfWmiInstanceGetDevice(WmiInstance),
+                                  (PToasterInterruptModeration) InBuffer);
+}
+
+NTSTATUS
+EvtWmiInstanceInterruptModerationSetItem(
+    _In_ WDFWMIINSTANCE WmiInstance,
+    _In_ ULONG DataItemId,
+    _In_ ULONG InBufferSize,
+    _In_reads_bytes_(InBufferSize) PVOID InBuffer
+    )
+{
+    WDFDEVICE                   device;
+    ToasterInterruptModeration  moderation;
+    PULONG                      item;
+
+    PAGED_CODE();
+
+    device = WdfWmiInstanceGetDevice(WmiInstance);
+
+    ToasterHwQueryModeration(device, &moderation);
+
+    switch (DataItemId) {
+    case ToasterInterruptModeration_CoalesceCount_ID:
+        item = &moderation.CoalesceCount;
+        break;
+    case ToasterInterruptModeration_CoalesceTimer_ID:
+        item = &moderation.CoalesceTimer;
+        break;
+    default:
+        return STATUS_WMI_READ_ONLY;
+    }
+
+    if (InBufferSize < sizeof(ULONG)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *item = *((PULONG) InBuffer);
+
+    return ToasterHwSetModeration(device, &moderation);
+}
+
+//被ToasterWmiRegistration调用
+VOID
+ToasterWmiCacheInstanceName(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Looks up the device's friendly name once and keeps it, already encoded
+    as the counted string that follows a WNODE_SINGLE_INSTANCE header, in
+    non-paged memory parented to the device.
+
+    Failure is not fatal; ToasterFireEvent will then refuse to fire.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_DATA               fdoData;
+    PTOASTER_WMI_EVENTS     events;
+    WDFMEMORY               memory;
+    UNICODE_STRING          deviceName;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    ULONG                   size;
+    ULONG                   length;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    events = &ToasterFdoGetIoData(Device)->WmiEvents;
+
+    events->ProviderId = IoWMIDeviceObjectToProviderId(
+                                WdfDeviceWdmGetDeviceObject(Device)/*返回传统的pDevice*/);
+
+    status = GetDeviceFriendlyName(Device, &memory);//函数在后面
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    RtlInitUnicodeString(&deviceName, (PWSTR) WdfMemoryGetBuffer(memory, NULL));
+
+    size = deviceName.Length + sizeof(USHORT);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfMemoryCreate(&attributes,
+                             NonPagedPoolNx,
+                             TOASTER_POOL_TAG,
+                             size,
+                             &events->InstanceNameMemory,
+                             &events->InstanceName);
+    if (NT_SUCCESS(status)) {
+        status = WDF_WMI_BUFFER_APPEND_STRING(events->InstanceName,
+                                              size,
+                                              &deviceName,
+                                              &length);
+        //
+        // Size was precomputed, this should never fail
+        //
+        ASSERT(NT_SUCCESS(status));
+
+        events->InstanceNameSize = size;
+    } else {
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "WdfMemoryCreate for the WMI instance name failed %x\n",
+                            status);
+        events->InstanceName = NULL;
+    }
+
+    //
+    // Free the memory allocated by GetDeviceFriendlyName function.
+    //
+    WdfObjectDelete(memory);//看前面，非常容易忘了这句造成内存泄漏
+}
+
+//被ToasterWmiRegistration调用
+NTSTATUS
+ToasterWmiRegisterEvent(
+    _In_      WDFDEVICE       Device,
+    _In_      LPCGUID         Guid,
+    _Out_opt_ WDFWMIINSTANCE* Instance
+    )
+/*++
+
+Routine Description:
+
+    Registers an event-only WMI block and adds it to the table that
+    ToasterFireEvent looks events up in.
+
+--*/
+{
+    NTSTATUS                status;
+    PFDO_DATA               fdoData;
+    PTOASTER_WMI_EVENTS     events;
+    PTOASTER_WMI_EVENT      event;
+    WDF_WMI_PROVIDER_CONFIG providerConfig;
+    WDF_WMI_INSTANCE_CONFIG instanceConfig;
+
+    PAGED_CODE();
+
+    fdoData = ToasterFdoGetData(Device);
+    events = &ToasterFdoGetIoData(Device)->WmiEvents;
+
+    if (events->Count == TOASTER_WMI_MAX_EVENTS) {
+        ASSERT(FALSE);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    event = &events->Events[events->Count];
+
+    WDF_WMI_PROVIDER_CONFIG_INIT(&providerConfig, Guid);
+    providerConfig.Flags = WdfWmiProviderEventOnly;
+
+    //
+    // Specify minimum expected buffer size for query and set instance requests.
+    // Since the query block size is different than the set block size, set it
+    // to zero and manually check for the buffer size for each operation.
+    //
+    providerConfig.MinInstanceBufferSize = 0;
 
     //
-    // Create the Provider object as part of the Instance creation call by setting
-    // the Register value in the Instance Config to TRUE. This eliminates the
-    // need to call WdfWmiProviderRegister.
+    // Tells us when a consumer enables or disables the event, so that
+    // nothing is built for an event nobody listens to.
     //
-    instanceConfig.Register = TRUE; //registers the provider instance synchronously
-
-    instanceConfig.EvtWmiInstanceQueryInstance = EvtWmiInstanceToasterControlQueryInstance;
-    instanceConfig.EvtWmiInstanceSetInstance   = EvtWmiInstanceToasterControlSetInstance;
-    instanceConfig.EvtWmiInstanceSetItem       = EvtWmiInstanceToasterControlSetItem;
-    instanceConfig.EvtWmiInstanceExecuteMethod = EvtWmiInstanceToasterControlExecuteMethod;
+    providerConfig.EvtWmiProviderFunctionControl = ToasterEvtWmiEventFunctionControl;
 
-    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&woa, ToasterControl);
+    WDF_WMI_INSTANCE_CONFIG_INIT_PROVIDER_CONFIG(&instanceConfig, &providerConfig);
+    instanceConfig.Register = TRUE;//registers the provider instance synchronously
 
     //
     // Create the WMI instance object for this data block.
     //
     status = WdfWmiInstanceCreate(Device,
                                   &instanceConfig,
-                                  &woa,
-                                  &instance);
+                                  WDF_NO_OBJECT_ATTRIBUTES,
+                                  &event->Instance);
+
     if (!NT_SUCCESS(status)) {
 
         WppPrintDeviceError(fdoData->WppRecorderLog,
@@ -298,274 +1489,214 @@ Return Value:
         return status;
     }
 
-	//因为WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ToasterControl, ToasterWmiGetControlData)
-    controlData = ToasterWmiGetControlData(instance);
-    controlData->ControlValue = 25;
+    event->Guid = Guid;
+    event->Enabled = FALSE;
+    events->Count++;
 
-    return status;
-}
+    if (Instance != NULL) {
+        *Instance = event->Instance;
+    }
 
-//
-// WMI System Call back functions
-//
+    return STATUS_SUCCESS;
+}
 
 NTSTATUS
-EvtWmiInstanceStdDeviceDataQueryInstance(
-    _In_  WDFWMIINSTANCE WmiInstance,
-    _In_  ULONG OutBufferSize,
-    _Out_writes_bytes_to_(OutBufferSize, *BufferUsed) PVOID OutBuffer,
-    _Out_ PULONG BufferUsed
+ToasterEvtWmiEventFunctionControl(
+    _In_ WDFWMIPROVIDER WmiProvider,
+    _In_ WDF_WMI_PROVIDER_CONTROL Control,
+    _In_ BOOLEAN Enable
     )
 {
-    PUCHAR          pBuf;
-    ULONG           size;
-    UNICODE_STRING  string;
-    NTSTATUS        status;
+    PTOASTER_WMI_EVENTS events;
+    ULONG               i;
 
     PAGED_CODE();
 
-    string.Buffer = L"Aishwarya\0\0";
-    string.Length = (USHORT) (wcslen(string.Buffer) + 1) * sizeof(WCHAR);
-    string.MaximumLength = string.Length + sizeof(UNICODE_NULL);
-
-    //
-    // A USHORT value is needed to contain the length of the buffer in the data
-    //
-    size = ToasterDeviceInformation_SIZE + string.Length + sizeof(USHORT);
-
-    *BufferUsed = size;
-
-    if (OutBufferSize < size) {
-        return STATUS_BUFFER_TOO_SMALL;
+    if (Control != WdfWmiEventControl) {
+        return STATUS_SUCCESS;
     }
 
-    pBuf = (PUCHAR) OutBuffer;
-
-    //
-    // Copy the structure information
-    //
-    RtlCopyMemory(pBuf,
-                  ToasterWmiGetData(WmiInstance),
-                  ToasterDeviceInformation_SIZE);
-
-    pBuf += ToasterDeviceInformation_SIZE;
+    events = &ToasterFdoGetIoData(WdfWmiProviderGetDevice(WmiProvider))->WmiEvents;
 
-    //
-    // Copy the string. Put length of string ahead of string.
-    //
-    status = WDF_WMI_BUFFER_APPEND_STRING(pBuf,
-                                          size - ToasterDeviceInformation_SIZE,
-                                          &string,
-                                          &size);
+    for (i = 0; i < events->Count; i++) {
+        if (WdfWmiInstanceGetProvider(events->Events[i].Instance) == WmiProvider) {
+            InterlockedExchange(&events->Events[i].Enabled, Enable);
+            break;
+        }
+    }
 
-    return status;
+    return STATUS_SUCCESS;
 }
 
-
 NTSTATUS
-EvtWmiInstanceStdDeviceDataSetInstance(
-    _In_ WDFWMIINSTANCE WmiInstance,
-    _In_ ULONG InBufferSize,
-    _In_reads_bytes_(InBufferSize) PVOID InBuffer
+ToasterFireEvent(
+    _In_ WDFDEVICE  Device,
+    _In_ LPCGUID    Guid,
+    _In_reads_bytes_opt_(PayloadLength) PVOID Payload,
+    _In_ ULONG      PayloadLength
     )
-{
-    PAGED_CODE();
+/*++
 
-    if (InBufferSize < ToasterDeviceInformation_SIZE) {
-        return STATUS_BUFFER_TOO_SMALL;
-    }
+Routine Description:
 
-    //
-    // We will update only writable elements.
-    //
-    DebugLevel = ToasterWmiGetData(WmiInstance)->DebugPrintLevel =
-        ((PToasterDeviceInformation)InBuffer)->DebugPrintLevel;
+    Fires a WMI event registered with ToasterWmiRegisterEvent. Returns
+    without doing anything if no consumer has enabled the event. Callable
+    at IRQL <= DISPATCH_LEVEL.
 
-    return STATUS_SUCCESS;
-}
+    Each event still needs its own pool allocation: IoWMIWriteEvent takes
+    ownership of the WNODE and frees it with ExFreePool, so the buffer
+    cannot come from a lookaside list we recycle. Everything else in the
+    WNODE (provider id, flags, instance name) is prepared ahead of time and
+    only copied here.
 
+Arguments:
 
-NTSTATUS
-EvtWmiInstanceStdDeviceDataSetItem(
-    _In_ WDFWMIINSTANCE WmiInstance,
-    _In_ ULONG DataItemId,
-    _In_ ULONG InBufferSize,
-    _In_reads_bytes_(InBufferSize) PVOID InBuffer
-    )
-{
-    PAGED_CODE();
+    Device - Handle to a framework device object.
 
-    if (DataItemId == ToasterDeviceInformation_DebugPrintLevel_ID) {
-        if (InBufferSize < sizeof(ULONG)) {
-            return STATUS_BUFFER_TOO_SMALL;
-        }
+    Guid - GUID of the event block.
 
-        DebugLevel = ToasterWmiGetData(WmiInstance)->DebugPrintLevel =
-            *((PULONG)InBuffer);
+    Payload, PayloadLength - event data.
 
-        return STATUS_SUCCESS;
+Return Value:
 
-    } else {
-        return STATUS_WMI_READ_ONLY;
-    }
-}
+    STATUS_SUCCESS if the event was fired or nobody was listening.
 
-//被ToasterEvtDevicePrepareHardware调用
-NTSTATUS
-ToasterFireArrivalEvent(
-    _In_ WDFDEVICE Device
-    )
+--*/
 {
-    WDFMEMORY memory;
     PWNODE_SINGLE_INSTANCE  wnode;
+    PTOASTER_WMI_EVENTS     events;
+    PTOASTER_WMI_EVENT      event = NULL;
     ULONG                   wnodeSize;
-    ULONG                   wnodeDataBlockSize;
-    ULONG                   wnodeInstanceNameSize;
+    ULONG                   dataBlockOffset;
     ULONG                   size;
-    ULONG                   length;
-    UNICODE_STRING          deviceName;
-    UNICODE_STRING          modelName;
+    ULONG                   i;
     NTSTATUS                status;
     PFDO_DATA               fdoData;
 
-    fdoData = ToasterFdoGetData(Device);
+    events = &ToasterFdoGetIoData(Device)->WmiEvents;
 
-    //
-    // *NOTE*
-    // WdfWmiFireEvent only fires single instance events at the moment so
-    // continue to use this method of firing events
-    // *NOTE*
-    //
+    for (i = 0; i < events->Count; i++) {
+        if (IsEqualGUID(events->Events[i].Guid, Guid)) {
+            event = &events->Events[i];
+            break;
+        }
+    }
+
+    if (event == NULL) {
+        return STATUS_WMI_GUID_NOT_FOUND;
+    }
 
-    RtlInitUnicodeString(&modelName, L"Sonali\0\0");
     //
-    // Get the device name.
+    // Why fire an event when nobody is interested and waste system
+    // resources?
     //
-    status = GetDeviceFriendlyName(Device, &memory);//函数在后面
-
-    if (!NT_SUCCESS(status)) {
-        return status;
+    if (ReadNoFence(&event->Enabled) == FALSE) {
+        return STATUS_SUCCESS;
     }
 
-    RtlInitUnicodeString(&deviceName, (PWSTR) WdfMemoryGetBuffer(memory, NULL));
+    if (events->InstanceName == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
 
     //
-    // Determine the amount of wnode information we need.
+    // *NOTE*
+    // WdfWmiFireEvent only fires single instance events at the moment so
+    // continue to use this method of firing events
+    // *NOTE*
     //
     wnodeSize = sizeof(WNODE_SINGLE_INSTANCE);
-    wnodeInstanceNameSize = deviceName.Length + sizeof(USHORT);
-    wnodeDataBlockSize = modelName.Length + sizeof(USHORT);
-
-    size = wnodeSize + wnodeInstanceNameSize + wnodeDataBlockSize;
+    dataBlockOffset = ALIGN_UP_BY(wnodeSize + events->InstanceNameSize, sizeof(ULONG64));
+    size = dataBlockOffset + PayloadLength;
 
     //
     // Allocate memory for the WNODE from NonPagedPoolNx
     //
     wnode = ExAllocatePoolWithTag(NonPagedPoolNx, size, TOASTER_POOL_TAG);
+    if (wnode == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    if (NULL != wnode) {
-        RtlZeroMemory(wnode, size);
-
-        wnode->WnodeHeader.BufferSize = size;
-        wnode->WnodeHeader.ProviderId =
-                            IoWMIDeviceObjectToProviderId(
-                                    WdfDeviceWdmGetDeviceObject(Device)/*返回传统的pDevice*/);
-        wnode->WnodeHeader.Version = 1;
-        KeQuerySystemTime(&wnode->WnodeHeader.TimeStamp);
-
-        RtlCopyMemory(&wnode->WnodeHeader.Guid,
-                      &TOASTER_NOTIFY_DEVICE_ARRIVAL_EVENT,
-                      sizeof(GUID));
-
-        //
-        // *NOTE*
-        // WdfWmiFireEvent only fires single instance events at the moment so
-        // continue to use this method of firing events
-        // *NOTE*
-        //
+    RtlZeroMemory(wnode, dataBlockOffset);
 
-        //
-        // Set flags to indicate that you are creating dynamic instance names.
-        // The reason we chose to do dynamic instance is becuase we can fire
-        // the events anytime. If we do static instance names, we can only
-        // fire events after WMI queries for IRP_MN_REGINFO, which happens
-        // after the device has been started. Another point to note is that if you
-        // are firing an event after the device is started, you should
-        // check whether the event is enabled, because that
-        // indicates that someone is interested in receiving the event.
-        // Why fire an event when nobody is interested and waste
-        // system resources?
-        //
+    wnode->WnodeHeader.BufferSize = size;
+    wnode->WnodeHeader.ProviderId = events->ProviderId;
+    wnode->WnodeHeader.Version = 1;
+    KeQuerySystemTime(&wnode->WnodeHeader.TimeStamp);
+    wnode->WnodeHeader.Guid = *Guid;
 
-        wnode->WnodeHeader.Flags = WNODE_FLAG_EVENT_ITEM |
-                                    WNODE_FLAG_SINGLE_INSTANCE;
+    //
+    // Set flags to indicate that you are creating dynamic instance names.
+    // The reason we chose to do dynamic instance is becuase we can fire
+    // the events anytime. If we do static instance names, we can only
+    // fire events after WMI queries for IRP_MN_REGINFO, which happens
+    // after the device has been started.
+    //
+    wnode->WnodeHeader.Flags = WNODE_FLAG_EVENT_ITEM |
+                                WNODE_FLAG_SINGLE_INSTANCE;
 
-        wnode->OffsetInstanceName = wnodeSize;
-        wnode->DataBlockOffset = wnodeSize + wnodeInstanceNameSize;
-        wnode->SizeDataBlock = wnodeDataBlockSize;
+    wnode->OffsetInstanceName = wnodeSize;
+    wnode->DataBlockOffset = dataBlockOffset;
+    wnode->SizeDataBlock = PayloadLength;
 
-        //
-        // Write the instance name
-        //
-        size -= wnodeSize;
-        status = WDF_WMI_BUFFER_APPEND_STRING(
-            WDF_PTR_ADD_OFFSET(wnode, wnode->OffsetInstanceName),
-            size,
-            &deviceName,
-            &length
-            );
+    RtlCopyMemory(WDF_PTR_ADD_OFFSET(wnode, wnode->OffsetInstanceName),
+                  events->InstanceName,
+                  events->InstanceNameSize);
 
-        //
-        // Size was precomputed, this should never fail
-        //
-        ASSERT(NT_SUCCESS(status));
+    if (PayloadLength != 0) {
+        RtlCopyMemory(WDF_PTR_ADD_OFFSET(wnode, wnode->DataBlockOffset),
+                      Payload,
+                      PayloadLength);
+    }
 
+	//------------------------------------------------------------------------
+	// delivers a given event to the user-mode WMI components for notification.
+	//------------------------------------------------------------------------
 
-        //
-        // Write the data, which is the model name as a string
-        //
-        size -= wnodeInstanceNameSize;
-        WDF_WMI_BUFFER_APPEND_STRING(
-            WDF_PTR_ADD_OFFSET(wnode,  wnode->DataBlockOffset),
-            size,
-            &modelName,
-            &length
-            );
+    // Indicate the event to WMI. WMI will take care of freeing
+    // the WMI struct back to pool.
+    //
+    status = IoWMIWriteEvent(wnode);
 
-        //
-        // Size was precomputed, this should never fail
-        //
-        ASSERT(NT_SUCCESS(status));
-		
-		//------------------------------------------------------------------------
-		// delivers a given event to the user-mode WMI components for notification.
-		//------------------------------------------------------------------------
+    if (!NT_SUCCESS(status)) {
+        fdoData = ToasterFdoGetData(Device);
+        WppPrintDeviceError(fdoData->WppRecorderLog,
+                            "IoWMIWriteEvent failed %x\n",
+                            status);
+        ExFreePool(wnode);
+    }
 
-        // Indicate the event to WMI. WMI will take care of freeing
-        // the WMI struct back to pool.
-        //
-        status = IoWMIWriteEvent(wnode);
+    return status;
+}
 
-        if (!NT_SUCCESS(status)) {
-            WppPrintDeviceError(fdoData->WppRecorderLog,
-                                "IoWMIWriteEvent failed %x\n",
-                                status);
-            ExFreePool(wnode);
-        }
-    }
-    else {
-        status = STATUS_INSUFFICIENT_RESOURCES;
-    }
+//
+// The arrival event carries the model name as a counted string.
+//
+static const struct {
+    USHORT  Length;
+    WCHAR   Name[6];
+} ToasterArrivalEventModel = {
+    sizeof(L"Sonali") - sizeof(WCHAR),
+    L"Sonali"
+};
 
+//被ToasterEvtDevicePrepareHardware调用
+NTSTATUS
+ToasterFireArrivalEvent(
+    _In_ WDFDEVICE Device
+    )
+{
     //
-    // Free the memory allocated by GetDeviceFriendlyName function.
+    // Waiters on IOCTL_TOASTER_WAIT_EVENTS hear about it too.
     //
-    WdfObjectDelete(memory);//看前面，非常容易忘了这句造成内存泄漏
+    ToasterNotify(ToasterFdoGetIoData(Device), ToasterEventArrival);
 
-    return status;
+    return ToasterFireEvent(Device,
+                            &TOASTER_NOTIFY_DEVICE_ARRIVAL_EVENT,
+                            (PVOID) &ToasterArrivalEventModel,
+                            sizeof(ToasterArrivalEventModel));
 }
 
-//上面函数的子函数
+//ToasterWmiCacheInstanceName的子函数
 //注意WdfDeviceAllocAndQueryProperty的用法
 NTSTATUS
 GetDeviceFriendlyName(
@@ -789,124 +1920,146 @@ Return Value:
 --*/
 
 {
-    NTSTATUS status = STATUS_SUCCESS;
+    //
+    // Not pageable, see TOASTER_WMI_METHOD.
+    //
+    return ToasterWmiDispatchMethod(ToasterControlMethods,
+                                    ARRAYSIZE(ToasterControlMethods),
+                                    WmiInstance,
+                                    MethodId,
+                                    InBufferSize,
+                                    OutBufferSize,
+                                    Buffer,
+                                    BufferUsed);
+}
 
-    UNREFERENCED_PARAMETER(WmiInstance);
-    PAGED_CODE();
+NTSTATUS
+ToasterWmiDispatchMethod(
+    _In_reads_(MethodCount) const TOASTER_WMI_METHOD* Methods,
+    _In_    ULONG           MethodCount,
+    _In_    WDFWMIINSTANCE  WmiInstance,
+    _In_    ULONG           MethodId,
+    _In_    ULONG           InBufferSize,
+    _In_    ULONG           OutBufferSize,
+    _Inout_ PVOID           Buffer,
+    _Out_   PULONG          BufferUsed
+    )
+/*++
 
-    switch (MethodId) {
-    case ToasterControl1:
-        {
-            PToasterControl1_IN  InBuffer  = (PToasterControl1_IN) Buffer;
-            PToasterControl1_OUT OutBuffer = (PToasterControl1_OUT)Buffer;
-
-            //
-            // Check the size of the input and output buffers.
-            //
-            if (InBufferSize < ToasterControl1_IN_SIZE) {
-                status = STATUS_INVALID_PARAMETER_MIX;
-                break;
-            }
-
-            if (OutBufferSize < ToasterControl1_OUT_SIZE) {
-                status = STATUS_BUFFER_TOO_SMALL;
-                break;
-            }
-
-            //
-            // Call the helper function for the Toaster Method 1.
-            //
-            OutBuffer->OutData = ToasterHelperFunction1(InBuffer->InData);
-
-            //
-            // Update the size of the output buffer used.
-            //
-            *BufferUsed = ToasterControl1_OUT_SIZE;
+Routine Description:
 
-        }
-        break;
+    Validates a method call against its table entry and runs it. Callable
+    at DISPATCH_LEVEL; methods marked TOASTER_WMI_METHOD_PASSIVE are
+    refused there.
 
-    case ToasterControl2:
-        {
-            PToasterControl2_IN  InBuffer  = (PToasterControl2_IN) Buffer;
-            PToasterControl2_OUT OutBuffer = (PToasterControl2_OUT)Buffer;
-
-            //
-            // Check the size of the input and output buffers.
-            //
-            if (InBufferSize < ToasterControl2_IN_SIZE) {
-                status = STATUS_INVALID_PARAMETER_MIX;
-                break;
-            }
-
-            if (OutBufferSize < ToasterControl2_OUT_SIZE) {
-                status = STATUS_BUFFER_TOO_SMALL;
-                break;
-            }
-
-            //
-            // Call the helper function for the Toaster Method 2.
-            //
-            OutBuffer->OutData = ToasterHelperFunction2(InBuffer->InData1, InBuffer->InData2);
-
-            //
-            // Update the size of the output buffer used.
-            //
-            *BufferUsed = ToasterControl2_OUT_SIZE;
+Arguments:
 
-        }
-        break;
+    Methods - the class's method table, entry n being method ID n + 1.
 
-    case ToasterControl3:
-        {
-            PToasterControl3_IN  InBuffer  = (PToasterControl3_IN) Buffer;
-            PToasterControl3_OUT OutBuffer = (PToasterControl3_OUT)Buffer;
-
-            //
-            // Check the size of the input and output buffers.
-            //
-            if (InBufferSize < ToasterControl3_IN_SIZE) {
-                status = STATUS_INVALID_PARAMETER_MIX;
-                break;
-            }
-
-            if (OutBufferSize < ToasterControl3_OUT_SIZE) {
-                status = STATUS_BUFFER_TOO_SMALL;
-                break;
-            }
-
-            //
-            // Call the helper function for the Toaster Method 3.
-            //
-            ToasterHelperFunction3(InBuffer->InData1,
-                                   InBuffer->InData2,
-                                   &(OutBuffer->OutData1),
-                                   &(OutBuffer->OutData2));
-
-            //
-            // Update the size of the output buffer used.
-            //
-            *BufferUsed = ToasterControl3_OUT_SIZE;
+    MethodCount - number of entries in Methods.
 
-        }
-        break;
+    The remaining arguments are those of EvtWmiInstanceExecuteMethod.
 
-    default:
-        status = STATUS_WMI_ITEMID_NOT_FOUND;
-        break;
+--*/
+{
+    const TOASTER_WMI_METHOD*   method;
+    NTSTATUS                    status;
+
+    *BufferUsed = 0;
+
+    //
+    // Method IDs start at 1; an ID of 0 wraps around and fails the check.
+    //
+    if (MethodId - 1 >= MethodCount) {
+        return STATUS_WMI_ITEMID_NOT_FOUND;
+    }
+
+    method = &Methods[MethodId - 1];
+
+    if (InBufferSize < method->InSize) {
+        return STATUS_INVALID_PARAMETER_MIX;
+    }
+
+    if (OutBufferSize < method->OutSize) {
+        *BufferUsed = method->OutSize;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if ((method->Flags & TOASTER_WMI_METHOD_PASSIVE) &&
+        KeGetCurrentIrql() > PASSIVE_LEVEL) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    status = method->Handler(WmiInstance, Buffer);
+    if (NT_SUCCESS(status)) {
+        *BufferUsed = method->OutSize;
     }
 
     return status;
 }
 
+NTSTATUS
+ToasterControlMethod1(
+    _In_    WDFWMIINSTANCE  WmiInstance,
+    _Inout_ PVOID           Buffer
+    )
+{
+    PToasterControl1_IN  InBuffer  = (PToasterControl1_IN) Buffer;
+    PToasterControl1_OUT OutBuffer = (PToasterControl1_OUT) Buffer;
+
+    UNREFERENCED_PARAMETER(WmiInstance);
+
+    OutBuffer->OutData = ToasterHelperFunction1(InBuffer->InData);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ToasterControlMethod2(
+    _In_    WDFWMIINSTANCE  WmiInstance,
+    _Inout_ PVOID           Buffer
+    )
+{
+    PToasterControl2_IN  InBuffer  = (PToasterControl2_IN) Buffer;
+    PToasterControl2_OUT OutBuffer = (PToasterControl2_OUT) Buffer;
+
+    UNREFERENCED_PARAMETER(WmiInstance);
+
+    OutBuffer->OutData = ToasterHelperFunction2(InBuffer->InData1, InBuffer->InData2);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ToasterControlMethod3(
+    _In_    WDFWMIINSTANCE  WmiInstance,
+    _Inout_ PVOID           Buffer
+    )
+{
+    PToasterControl3_IN  InBuffer  = (PToasterControl3_IN) Buffer;
+    PToasterControl3_OUT OutBuffer = (PToasterControl3_OUT) Buffer;
+    ULONG                inData1 = InBuffer->InData1;
+    ULONG                inData2 = InBuffer->InData2;
+
+    UNREFERENCED_PARAMETER(WmiInstance);
+
+    //
+    // The outputs overlay the inputs.
+    //
+    ToasterHelperFunction3(inData1,
+                           inData2,
+                           &(OutBuffer->OutData1),
+                           &(OutBuffer->OutData2));
+
+    return STATUS_SUCCESS;
+}
+
 
 ULONG
 ToasterHelperFunction1(
     _In_ ULONG InData
     )
 {
-    PAGED_CODE();
-
     return (InData + 1);
 }
 
@@ -917,8 +2070,6 @@ ToasterHelperFunction2(
     _In_ ULONG InData2
     )
 {
-    PAGED_CODE();
-
     return (InData1 + InData2);
 }
 
@@ -931,8 +2082,6 @@ ToasterHelperFunction3(
     _Out_ PULONG OutData2
     )
 {
-    PAGED_CODE();
-
     *OutData1 = InData1 + 1;
     *OutData2 = InData2 + 1;
 